@@ -177,7 +177,7 @@ answer_axfr_ixfr(struct nsd *nsd, struct query *q)
 			struct zone_options* zone_opt;
 			zone_opt = zone_options_find(nsd->options, q->qname);
 			if(!zone_opt ||
-			   acl_check_incoming(zone_opt->pattern->provide_xfr, q, &acl)==-1)
+			   acl_trie_check_incoming(zone_opt->pattern->provide_xfr_trie, q, &acl)==-1)
 			{
 				if (verbosity >= 2) {
 					char a[128];
@@ -10,6 +10,7 @@
 #include "config.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "buffer.h"
 
@@ -129,3 +130,24 @@ buffer_printf(buffer_type *buffer, const char *format, ...)
 	buffer->_position += written;
 	return written;
 }
+
+void
+buffer_print_string(buffer_type *buffer, const char *str)
+{
+	size_t len = strlen(str);
+	buffer_reserve(buffer, len);
+	buffer_write(buffer, str, len);
+}
+
+void
+buffer_print_u32(buffer_type *buffer, uint32_t number)
+{
+	char buf[10];
+	size_t i = sizeof(buf);
+	do {
+		buf[--i] = '0' + (number % 10);
+		number /= 10;
+	} while(number != 0);
+	buffer_reserve(buffer, sizeof(buf) - i);
+	buffer_write(buffer, buf + i, sizeof(buf) - i);
+}
@@ -97,11 +97,16 @@ static int parse_range(const char *str, long long *low, long long *high);
 %token VAR_IPV6_EDNS_SIZE
 %token VAR_STATISTICS
 %token VAR_XFRD_RELOAD_TIMEOUT
+%token VAR_XFRD_TCP_MAX_PER_MASTER
+%token VAR_XFRD_UDP_SHARE
 %token VAR_LOG_TIME_ASCII
 %token VAR_ROUND_ROBIN
 %token VAR_MINIMAL_RESPONSES
 %token VAR_CONFINE_TO_ZONE
 %token VAR_REFUSE_ANY
+%token VAR_NXDOMAIN_FLOOD_LIMIT
+%token VAR_ANSWER_COOKIE
+%token VAR_COOKIE_SECRET_FILE
 %token VAR_ZONEFILES_CHECK
 %token VAR_ZONEFILES_WRITE
 %token VAR_RRL_SIZE
@@ -110,6 +115,7 @@ static int parse_range(const char *str, long long *low, long long *high);
 %token VAR_RRL_IPV4_PREFIX_LENGTH
 %token VAR_RRL_IPV6_PREFIX_LENGTH
 %token VAR_RRL_WHITELIST_RATELIMIT
+%token VAR_RRL_COOKIE_RATELIMIT
 %token VAR_TLS_SERVICE_KEY
 %token VAR_TLS_SERVICE_PEM
 %token VAR_TLS_SERVICE_OCSP
@@ -123,6 +129,12 @@ static int parse_range(const char *str, long long *low, long long *high);
 %token VAR_DNSTAP
 %token VAR_DNSTAP_ENABLE
 %token VAR_DNSTAP_SOCKET_PATH
+%token VAR_DNSTAP_FILE_PATH
+%token VAR_DNSTAP_FILE_SIZE
+%token VAR_DNSTAP_SAMPLE_RATE
+%token VAR_DNSTAP_LOG_QTYPES
+%token VAR_DNSTAP_LOG_RCODES
+%token VAR_DNSTAP_LOG_RRL_ONLY
 %token VAR_DNSTAP_SEND_IDENTITY
 %token VAR_DNSTAP_SEND_VERSION
 %token VAR_DNSTAP_IDENTITY
@@ -140,6 +152,13 @@ static int parse_range(const char *str, long long *low, long long *high);
 %token VAR_CONTROL_KEY_FILE
 %token VAR_CONTROL_CERT_FILE
 
+/* metrics */
+%token VAR_METRICS
+%token VAR_METRICS_ENABLE
+%token VAR_METRICS_INTERFACE
+%token VAR_METRICS_PORT
+%token VAR_METRICS_PATH
+
 /* key */
 %token VAR_KEY
 %token VAR_ALGORITHM
@@ -164,6 +183,7 @@ static int parse_range(const char *str, long long *low, long long *high);
 %token VAR_MIN_RETRY_TIME
 %token VAR_MIN_EXPIRE_TIME
 %token VAR_MULTI_MASTER_CHECK
+%token VAR_DNSTAP_LOG
 %token VAR_SIZE_LIMIT_XFR
 %token VAR_ZONESTATS
 %token VAR_INCLUDE_PATTERN
@@ -187,6 +207,7 @@ block:
     server
   | dnstap
   | remote_control
+  | metrics
   | key
   | pattern
   | zone ;
@@ -347,6 +368,16 @@ server_option:
     { cfg_parser->opt->xfrdir = region_strdup(cfg_parser->opt->region, $2); }
   | VAR_XFRD_RELOAD_TIMEOUT number
     { cfg_parser->opt->xfrd_reload_timeout = (int)$2; }
+  | VAR_XFRD_TCP_MAX_PER_MASTER number
+    { cfg_parser->opt->xfrd_tcp_max_per_master = (int)$2; }
+  | VAR_XFRD_UDP_SHARE number
+    {
+      if ($2 > 0 && $2 <= XFRD_UDP_SHARE_MAX) {
+        cfg_parser->opt->xfrd_udp_share = (int)$2;
+      } else {
+        yyerror("expected a number from 1 to 4");
+      }
+    }
   | VAR_VERBOSITY number
     { cfg_parser->opt->verbosity = (int)$2; }
   | VAR_RRL_SIZE number
@@ -395,6 +426,12 @@ server_option:
     {
 #ifdef RATELIMIT
       cfg_parser->opt->rrl_whitelist_ratelimit = (size_t)$2;
+#endif
+    }
+  | VAR_RRL_COOKIE_RATELIMIT number
+    {
+#ifdef RATELIMIT
+      cfg_parser->opt->rrl_cookie_ratelimit = (size_t)$2;
 #endif
     }
   | VAR_ZONEFILES_CHECK boolean
@@ -420,6 +457,12 @@ server_option:
     { cfg_parser->opt->confine_to_zone = $2; }
   | VAR_REFUSE_ANY boolean
     { cfg_parser->opt->refuse_any = $2; }
+  | VAR_NXDOMAIN_FLOOD_LIMIT number
+    { cfg_parser->opt->nxdomain_flood_limit = (size_t)$2; }
+  | VAR_ANSWER_COOKIE boolean
+    { cfg_parser->opt->answer_cookie = $2; }
+  | VAR_COOKIE_SECRET_FILE STRING
+    { cfg_parser->opt->cookie_secret_file = region_strdup(cfg_parser->opt->region, $2); }
   | VAR_TLS_SERVICE_KEY STRING
     { cfg_parser->opt->tls_service_key = region_strdup(cfg_parser->opt->region, $2); }
   | VAR_TLS_SERVICE_OCSP STRING
@@ -563,6 +606,10 @@ dnstap_option:
     { cfg_parser->opt->dnstap_enable = $2; }
   | VAR_DNSTAP_SOCKET_PATH STRING
     { cfg_parser->opt->dnstap_socket_path = region_strdup(cfg_parser->opt->region, $2); }
+  | VAR_DNSTAP_FILE_PATH STRING
+    { cfg_parser->opt->dnstap_file_path = region_strdup(cfg_parser->opt->region, $2); }
+  | VAR_DNSTAP_FILE_SIZE number
+    { cfg_parser->opt->dnstap_file_size = (size_t)$2; }
   | VAR_DNSTAP_SEND_IDENTITY boolean
     { cfg_parser->opt->dnstap_send_identity = $2; }
   | VAR_DNSTAP_SEND_VERSION boolean
@@ -575,6 +622,14 @@ dnstap_option:
     { cfg_parser->opt->dnstap_log_auth_query_messages = $2; }
   | VAR_DNSTAP_LOG_AUTH_RESPONSE_MESSAGES boolean
     { cfg_parser->opt->dnstap_log_auth_response_messages = $2; }
+  | VAR_DNSTAP_SAMPLE_RATE number
+    { cfg_parser->opt->dnstap_sample_rate = (int)$2; }
+  | VAR_DNSTAP_LOG_QTYPES STRING
+    { cfg_parser->opt->dnstap_log_qtypes = region_strdup(cfg_parser->opt->region, $2); }
+  | VAR_DNSTAP_LOG_RCODES STRING
+    { cfg_parser->opt->dnstap_log_rcodes = region_strdup(cfg_parser->opt->region, $2); }
+  | VAR_DNSTAP_LOG_RRL_ONLY boolean
+    { cfg_parser->opt->dnstap_log_rrl_only = $2; }
   ;
 
 remote_control:
@@ -614,6 +669,43 @@ remote_control_option:
     { cfg_parser->opt->control_cert_file = region_strdup(cfg_parser->opt->region, $2); }
   ;
 
+metrics:
+    VAR_METRICS metrics_block ;
+
+metrics_block:
+    metrics_block metrics_option | ;
+
+metrics_option:
+    VAR_METRICS_ENABLE boolean
+    { cfg_parser->opt->metrics_enable = $2; }
+  | VAR_METRICS_INTERFACE ip_address
+    {
+      struct ip_address_option *ip = cfg_parser->opt->metrics_interface;
+      if(ip == NULL) {
+        cfg_parser->opt->metrics_interface = $2;
+      } else {
+        while(ip->next != NULL) { ip = ip->next; }
+        ip->next = $2;
+      }
+    }
+  | VAR_METRICS_PORT number
+    {
+      if($2 == 0) {
+        yyerror("metrics port number expected");
+      } else {
+        cfg_parser->opt->metrics_port = (int)$2;
+      }
+    }
+  | VAR_METRICS_PATH STRING
+    {
+      if($2[0] != '/') {
+        yyerror("metrics path must start with a /");
+      } else {
+        cfg_parser->opt->metrics_path = region_strdup(cfg_parser->opt->region, $2);
+      }
+    }
+  ;
+
 key:
     VAR_KEY
       {
@@ -835,6 +927,11 @@ pattern_or_zone_option:
       cfg_parser->pattern->allow_axfr_fallback = $2;
       cfg_parser->pattern->allow_axfr_fallback_is_default = 0;
     }
+  | VAR_DNSTAP_LOG boolean
+    {
+      cfg_parser->pattern->dnstap_log = $2;
+      cfg_parser->pattern->dnstap_log_is_default = 0;
+    }
   | VAR_NOTIFY_RETRY number
     {
       cfg_parser->pattern->notify_retry = $2;
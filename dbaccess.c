@@ -166,6 +166,8 @@ read_rrset(udb_base* udb, namedb_type* db, zone_type* zone,
 	}
 	udb_ptr_unlink(&urr, udb);
 	domain_add_rrset(domain, rrset);
+	if(rrset_rrtype(rrset) == TYPE_DNAME)
+		zone->has_dname = 1;
 	if(domain == zone->apex)
 		apex_rrset_checks(db, rrset, domain);
 }
@@ -190,7 +192,11 @@ static void read_node_elem(udb_base* udb, namedb_type* db,
 		read_rrset(udb, db, zone, domain, &urrset);
 		udb_ptr_set_rptr(&urrset, udb, &RRSET(&urrset)->next);
 
-		if(++udb_rrsets % ZONEC_PCT_COUNT == 0 && time(NULL) > udb_time + ZONEC_PCT_TIME) {
+		/* big zones are streamed, the read part of the mmap does
+		 * not stay in memory next to the zone */
+		if(++udb_rrsets % ZONEC_RELEASE_COUNT == 0)
+			udb_base_release(udb);
+		if(udb_rrsets % ZONEC_PCT_COUNT == 0 && time(NULL) > udb_time + ZONEC_PCT_TIME) {
 			udb_time = time(NULL);
 			VERBOSITY(1, (LOG_INFO, "read %s %d %%",
 				zone->opts->name,
@@ -274,8 +280,13 @@ namedb_zone_create(namedb_type* db, const dname_type* dname,
 	zone->mtime.tv_sec = 0;
 	zone->mtime.tv_nsec = 0;
 	zone->zonestatid = 0;
+	zone->nx_count = 0;
+	zone->nx_time = 0;
+	zone->nx_flood = 0;
 	zone->is_secure = 0;
 	zone->is_changed = 0;
+	zone->is_journaled = 0;
+	zone->has_dname = 0;
 	zone->is_ok = 1;
 	return zone;
 }
@@ -520,6 +531,7 @@ namedb_read_zonefile(struct nsd* nsd, struct zone* zone, udb_base* taskudb,
 {
 	struct timespec mtime;
 	int nonexist = 0;
+	int journaled = 0;
 	unsigned int errors;
 	const char* fname;
 	if(!nsd->db || !zone || !zone->opts || !zone->opts->pattern->zonefile)
@@ -576,6 +588,18 @@ namedb_read_zonefile(struct nsd* nsd, struct zone* zone, udb_base* taskudb,
 #endif
 	delete_zone_rrs(nsd->db, zone);
 	errors = zonec_read(zone->opts->name, fname, zone);
+	/* apply the IXFRs that were journaled after the zonefile was
+	 * written, if that fails the zonefile is read again by itself */
+	if(errors == 0 && (journaled = diff_journal_replay(nsd, zone, fname,
+		&mtime)) == -1) {
+#ifdef NSEC3
+		nsec3_clear_precompile(nsd->db, zone);
+		zone->nsec3_param = NULL;
+#endif
+		delete_zone_rrs(nsd->db, zone);
+		errors = zonec_read(zone->opts->name, fname, zone);
+		journaled = 0;
+	}
 	if(errors > 0) {
 		log_msg(LOG_ERR, "zone %s file %s read with %u errors",
 			zone->opts->name, fname, errors);
@@ -618,7 +642,8 @@ namedb_read_zonefile(struct nsd* nsd, struct zone* zone, udb_base* taskudb,
 		VERBOSITY(1, (LOG_INFO, "zone %s read with success",
 			zone->opts->name));
 		zone->is_ok = 1;
-		zone->is_changed = 0;
+		zone->is_changed = (journaled > 0);
+		zone->is_journaled = (journaled > 0);
 		/* store zone into udb */
 		if(nsd->db->udb) {
 			if(!write_zone_to_udb(nsd->db->udb, zone, &mtime,
@@ -23,9 +23,12 @@
 #include "udbzone.h"
 #include "options.h"
 #include "nsd.h"
+#include "difffile.h"
 
 /* pathname directory separator character */
 #define PATHSEP '/'
+/* stdio buffer size for writing zonefiles */
+#define ZONEFILE_WRITE_BUFSIZE 262144
 
 /** add an rdata (uncompressed) to the destination */
 static size_t
@@ -134,8 +137,12 @@ write_zone(udb_base* udb, udb_ptr* z, zone_type* zone)
 					return 0;
 			}
 		}
+		/* the written part of the mmap does not stay in memory
+		 * next to the zone, for big zones */
+		if(++c % ZONEC_RELEASE_COUNT == 0)
+			udb_base_release(udb);
 		/* only check every ... domains, and print pct */
-		if(++c % ZONEC_PCT_COUNT == 0 && time(NULL) > t + ZONEC_PCT_TIME) {
+		if(c % ZONEC_PCT_COUNT == 0 && time(NULL) > t + ZONEC_PCT_TIME) {
 			t = time(NULL);
 			VERBOSITY(1, (LOG_INFO, "write %s %d %%",
 				zone->opts->name, (int)(c*((unsigned long)100)/n)));
@@ -167,7 +174,7 @@ write_zone_to_udb(udb_base* udb, zone_type* zone, struct timespec* mtime,
 	/* set mtime */
 	ZONE(&z)->mtime = (uint64_t)mtime->tv_sec;
 	ZONE(&z)->mtime_nsec = (uint64_t)mtime->tv_nsec;
-	ZONE(&z)->is_changed = 0;
+	ZONE(&z)->is_changed = zone->is_changed;
 	udb_zone_set_log_str(udb, &z, NULL);
 	udb_zone_set_file_str(udb, &z, file_str);
 	/* write zone */
@@ -180,7 +187,7 @@ write_zone_to_udb(udb_base* udb, zone_type* zone, struct timespec* mtime,
 	return 1;
 }
 
-static int
+int
 print_rrs(FILE* out, struct zone* zone)
 {
 	rrset_type *rrset;
@@ -249,12 +256,18 @@ static int
 write_to_zonefile(zone_type* zone, const char* filename, const char* logs)
 {
 	time_t now = time(0);
+	struct timeval start, end;
+	off_t size;
 	FILE *out = fopen(filename, "w");
 	if(!out) {
 		log_msg(LOG_ERR, "cannot write zone %s file %s: %s",
 			zone->opts->name, filename, strerror(errno));
 		return 0;
 	}
+	/* write the RRs in large blocks */
+	(void)setvbuf(out, NULL, _IOFBF, ZONEFILE_WRITE_BUFSIZE);
+	if(gettimeofday(&start, NULL) != 0)
+		memset(&start, 0, sizeof(start));
 	if(!print_header(zone, out, &now, logs)) {
 		fclose(out);
 		log_msg(LOG_ERR, "There was an error printing "
@@ -265,11 +278,21 @@ write_to_zonefile(zone_type* zone, const char* filename, const char* logs)
 		fclose(out);
 		return 0;
 	}
+	size = ftello(out);
 	if(fclose(out) != 0) {
 		log_msg(LOG_ERR, "cannot write zone %s to file %s: fclose: %s",
 			zone->opts->name, filename, strerror(errno));
 		return 0;
 	}
+	if(verbosity >= 2 && start.tv_sec != 0 &&
+		gettimeofday(&end, NULL) == 0) {
+		double elapsed = (double)(end.tv_sec - start.tv_sec) +
+			(double)(end.tv_usec - start.tv_usec) / 1000000.0;
+		VERBOSITY(2, (LOG_INFO, "zone %s written, %lld bytes in %g "
+			"seconds, %g MB/s", zone->opts->name, (long long)size,
+			elapsed, (elapsed > 0 ? (double)size / elapsed /
+			1000000.0 : 0.0)));
+	}
 	return 1;
 }
 
@@ -327,7 +350,7 @@ create_path_components(const char* path, int* notexist)
 }
 
 void
-namedb_write_zonefile(struct nsd* nsd, struct zone_options* zopt)
+namedb_write_zonefile(struct nsd* nsd, struct zone_options* zopt, int force)
 {
 	const char* zfile;
 	int notexist = 0;
@@ -348,6 +371,16 @@ namedb_write_zonefile(struct nsd* nsd, struct zone_options* zopt)
 		return;
 	}
 
+	/* the changes in the journal do not need a write, until the
+	 * journal is large compared to the zonefile, or the write is
+	 * asked for with nsd-control write */
+	if(!force && !notexist && zone->is_changed && zone->is_journaled &&
+		!diff_journal_full(zfile)) {
+		VERBOSITY(3, (LOG_INFO, "zone %s changes are in the journal "
+			"of %s", zone->opts->name, zfile));
+		return;
+	}
+
 	/* if not changed, do not write. */
 	if(notexist || zone->is_changed) {
 		char logs[4096];
@@ -387,6 +420,12 @@ namedb_write_zonefile(struct nsd* nsd, struct zone_options* zopt)
 			return;
 		}
 		zone->is_changed = 0;
+		/* the journal is in the zonefile now */
+		zone->is_journaled = 0;
+		diff_journal_name(bakfile, sizeof(bakfile), zfile);
+		if(unlink(bakfile) == -1 && errno != ENOENT)
+			log_msg(LOG_ERR, "could not remove journal %s: %s",
+				bakfile, strerror(errno));
 		/* fetch the mtime of the just created zonefile so we
 		 * do not waste effort reading it back in */
 		if(!file_get_mtime(zfile, &mtime, &notexist)) {
@@ -413,10 +452,11 @@ namedb_write_zonefile(struct nsd* nsd, struct zone_options* zopt)
 }
 
 void
-namedb_write_zonefiles(struct nsd* nsd, struct nsd_options* options)
+namedb_write_zonefiles(struct nsd* nsd, struct nsd_options* options,
+	int force)
 {
 	struct zone_options* zo;
 	RBTREE_FOR(zo, struct zone_options*, options->zone_options) {
-		namedb_write_zonefile(nsd, zo);
+		namedb_write_zonefile(nsd, zo, force);
 	}
 }
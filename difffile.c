@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include "difffile.h"
 #include "xfrd-disk.h"
 #include "util.h"
@@ -23,6 +24,15 @@
 #include "nsec3.h"
 #include "nsd.h"
 #include "rrl.h"
+#include "lookup3.h"
+
+/* stdio buffer size for reading xfr files in the reload */
+#define XFR_FILE_BUFSIZE 65536
+/* the journal entries are hashed in blocks of this size */
+#define DIFF_JOURNAL_BLOCK 4096
+/* the start of a journal file */
+#define DIFF_JOURNAL_MAGIC "NSDJNL01"
+#define DIFF_JOURNAL_MAGIC_LEN 8
 
 static int
 write_64(FILE *out, uint64_t val)
@@ -776,6 +786,8 @@ add_RR(namedb_type* db, const dname_type* dname,
 		rrset->rrs = 0;
 		rrset->rr_count = 0;
 		domain_add_rrset(domain, rrset);
+		if(type == TYPE_DNAME)
+			zone->has_dname = 1;
 #ifdef NSEC3
 		rrset_added = 1;
 #endif
@@ -957,6 +969,10 @@ delete_zone_rrs(namedb_type* db, zone_type* zone)
 		region_log_stats(db->region);
 #endif
 
+	/* the flag is not cleared when single DNAMEs are deleted, only
+	 * here when the zone is empty */
+	zone->has_dname = 0;
+
 	assert(zone->soa_rrset == 0);
 	/* keep zone->soa_nx_rrset alloced: it is reused */
 	assert(zone->ns_rrset == 0);
@@ -969,12 +985,10 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 	struct nsd_options* opt, uint32_t seq_nr, uint32_t seq_total,
 	int* is_axfr, int* delete_mode, int* rr_count,
 	udb_ptr* udbz, struct zone** zone_res, const char* patname, int* bytes,
-	int* softfail)
+	int* softfail, buffer_type* packet, region_type* region)
 {
 	uint32_t msglen, checklen, pkttype;
 	int qcount, ancount, counter;
-	buffer_type* packet;
-	region_type* region;
 	int i;
 	uint16_t rrlen;
 	const dname_type *dname_zone, *dname;
@@ -1001,21 +1015,13 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 		return 0;
 	}
 
-	region = region_create(xalloc, free);
-	if(!region) {
-		log_msg(LOG_ERR, "out of memory");
-		return 0;
-	}
-	packet = buffer_create(region, QIOBUFSZ);
-	if(msglen > QIOBUFSZ) {
+	if(msglen > buffer_capacity(packet)) {
 		log_msg(LOG_ERR, "msg too long");
-		region_destroy(region);
 		return 0;
 	}
 	buffer_clear(packet);
 	if(fread(buffer_begin(packet), msglen, 1, in) != 1) {
 		log_msg(LOG_ERR, "short fread: %s", strerror(errno));
-		region_destroy(region);
 		return 0;
 	}
 	buffer_set_limit(packet, msglen);
@@ -1028,14 +1034,21 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 	}
 	*bytes += msglen;
 
-	dname_zone = dname_parse(region, zone);
-	zone_db = find_or_create_zone(db, dname_zone, opt, zone, patname);
-	if(!zone_db) {
-		log_msg(LOG_ERR, "could not create zone %s %s", zone, patname);
-		region_destroy(region);
-		return 0;
+	/* the zone is looked up (or created) for the first part only */
+	if(*zone_res) {
+		zone_db = *zone_res;
+		dname_zone = domain_dname(zone_db->apex);
+	} else {
+		dname_zone = dname_parse(region, zone);
+		zone_db = find_or_create_zone(db, dname_zone, opt, zone,
+			patname);
+		if(!zone_db) {
+			log_msg(LOG_ERR, "could not create zone %s %s", zone,
+				patname);
+			return 0;
+		}
+		*zone_res = zone_db;
 	}
-	*zone_res = zone_db;
 
 	/* only answer section is really used, question, additional and
 	   authority section RRs are skipped */
@@ -1045,7 +1058,6 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 	/* qcount should be 0 or 1 really, ancount limited by 64k packet */
 	if(qcount > 64 || ancount > 65530) {
 		log_msg(LOG_ERR, "RR count impossibly high");
-		region_destroy(region);
 		return 0;
 	}
 
@@ -1053,7 +1065,6 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 	for(i=0; i<qcount; ++i)
 		if(!packet_skip_rr(packet, 1)) {
 			log_msg(LOG_ERR, "bad RR in question section");
-			region_destroy(region);
 			return 0;
 		}
 
@@ -1066,7 +1077,6 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 		dname = dname_make_from_packet(region, packet, 1, 1);
 		if(!dname) {
 			log_msg(LOG_ERR, "could not parse dname");
-			region_destroy(region);
 			return 0;
 		}
 		if(dname_compare(dname_zone, dname) != 0) {
@@ -1074,18 +1084,15 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 				dname_to_string(dname,0));
 			log_msg(LOG_ERR, "zone dname is %s",
 				dname_to_string(dname_zone,0));
-			region_destroy(region);
 			return 0;
 		}
 		if(!buffer_available(packet, 10)) {
 			log_msg(LOG_ERR, "bad SOA RR");
-			region_destroy(region);
 			return 0;
 		}
 		if(buffer_read_u16(packet) != TYPE_SOA ||
 			buffer_read_u16(packet) != CLASS_IN) {
 			log_msg(LOG_ERR, "first RR not SOA IN");
-			region_destroy(region);
 			return 0;
 		}
 		buffer_skip(packet, sizeof(uint32_t)); /* ttl */
@@ -1093,14 +1100,12 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 			!packet_skip_dname(packet) /* skip prim_ns */ ||
 			!packet_skip_dname(packet) /* skip email */) {
 			log_msg(LOG_ERR, "bad SOA RR");
-			region_destroy(region);
 			return 0;
 		}
 		if(buffer_read_u32(packet) != serialno) {
 			buffer_skip(packet, -4);
 			log_msg(LOG_ERR, "SOA serial %u different from commit %u",
 				(unsigned)buffer_read_u32(packet), (unsigned)serialno);
-			region_destroy(region);
 			return 0;
 		}
 		buffer_skip(packet, sizeof(uint32_t)*4);
@@ -1120,12 +1125,10 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 
 		if(!(dname=dname_make_from_packet(region, packet, 1,1))) {
 			log_msg(LOG_ERR, "bad xfr RR dname %d", *rr_count);
-			region_destroy(region);
 			return 0;
 		}
 		if(!buffer_available(packet, 10)) {
 			log_msg(LOG_ERR, "bad xfr RR format %d", *rr_count);
-			region_destroy(region);
 			return 0;
 		}
 		type = buffer_read_u16(packet);
@@ -1135,7 +1138,6 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 		if(!buffer_available(packet, rrlen)) {
 			log_msg(LOG_ERR, "bad xfr RR rdata %d, len %d have %d",
 				*rr_count, rrlen, (int)buffer_remaining(packet));
-			region_destroy(region);
 			return 0;
 		}
 		DEBUG(DEBUG_XFRD,2, (LOG_INFO, "diff: %s parsed count %d, ax %d, delmode %d",
@@ -1165,7 +1167,6 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 				buffer_remaining(packet) < sizeof(uint32_t)*5)
 			{
 				log_msg(LOG_ERR, "bad xfr SOA RR formerr.");
-				region_destroy(region);
 				return 0;
 			}
 			thisserial = buffer_read_u32(packet);
@@ -1188,7 +1189,6 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 				zone_db, TYPE_SOA)) {
 				log_msg(LOG_ERR, "%s SOA serial %u is not "
 					"in memory, skip IXFR", zone, serialno);
-				region_destroy(region);
 				/* break out and stop the IXFR, ignore it */
 				return 2;
 			}
@@ -1219,7 +1219,6 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 			}
 			if(!delete_RR(db, dname, type, klass, packet,
 				rrlen, zone_db, region, udbz, softfail)) {
-				region_destroy(region);
 				return 0;
 			}
 		}
@@ -1228,12 +1227,10 @@ apply_ixfr(namedb_type* db, FILE *in, const char* zone, uint32_t serialno,
 			/* add this rr */
 			if(!add_RR(db, dname, type, klass, ttl, packet,
 				rrlen, zone_db, udbz, softfail)) {
-				region_destroy(region);
 				return 0;
 			}
 		}
 	}
-	region_destroy(region);
 	return 1;
 }
 
@@ -1262,10 +1259,14 @@ check_for_bad_serial(namedb_type* db, const char* zone_str, uint32_t old_serial)
 	return 0;
 }
 
+static int diff_journal_append(struct nsd* nsd, zone_type* zone, FILE* in);
+
+/* apply the transfer in the file, if replay it is from the journal, and
+ * the zone keeps the zonefile as its source */
 static int
 apply_ixfr_for_zone(nsd_type* nsd, zone_type* zonedb, FILE* in,
 	struct nsd_options* opt, udb_base* taskudb, udb_ptr* last_task,
-	uint32_t xfrfilenr)
+	uint32_t xfrfilenr, int replay)
 {
 	char zone_buf[3072];
 	char log_buf[5120];
@@ -1277,7 +1278,13 @@ apply_ixfr_for_zone(nsd_type* nsd, zone_type* zonedb, FILE* in,
 	uint8_t committed;
 	uint32_t i;
 	int num_bytes = 0;
+	int was_changed = zonedb->is_changed;
+	struct timeval apply_start;
+	region_type* region, *bufregion;
+	buffer_type* packet;
 	assert(zonedb);
+	if(gettimeofday(&apply_start, NULL) != 0)
+		memset(&apply_start, 0, sizeof(apply_start));
 
 	/* read zone name and serial */
 	if(!diff_read_32(in, &type)) {
@@ -1356,6 +1363,11 @@ apply_ixfr_for_zone(nsd_type* nsd, zone_type* zonedb, FILE* in,
 			/* set the udb dirty until we are finished applying changes */
 			udb_base_set_userflags(nsd->db->udb, 1);
 		}
+		/* the packet buffer is reused for all the parts, and the
+		 * scratch region is emptied after every part */
+		bufregion = region_create(xalloc, free);
+		region = region_create(xalloc, free);
+		packet = buffer_create(bufregion, QIOBUFSZ);
 		/* read and apply all of the parts */
 		for(i=0; i<num_parts; i++) {
 			int ret;
@@ -1363,10 +1375,17 @@ apply_ixfr_for_zone(nsd_type* nsd, zone_type* zonedb, FILE* in,
 			ret = apply_ixfr(nsd->db, in, zone_buf, new_serial, opt,
 				i, num_parts, &is_axfr, &delete_mode,
 				&rr_count, (nsd->db->udb?&z:NULL), &zonedb,
-				patname_buf, &num_bytes, &softfail);
+				patname_buf, &num_bytes, &softfail, packet,
+				region);
+			region_free_all(region);
 			assert(zonedb);
 			if(ret == 0) {
 				log_msg(LOG_ERR, "bad ixfr packet part %d in diff file for %s", (int)i, zone_buf);
+				if(replay) {
+					region_destroy(region);
+					region_destroy(bufregion);
+					return 0;
+				}
 				xfrd_unlink_xfrfile(nsd, xfrfilenr);
 				/* the udb is still dirty, it is bad */
 				exit(1);
@@ -1374,6 +1393,8 @@ apply_ixfr_for_zone(nsd_type* nsd, zone_type* zonedb, FILE* in,
 				break;
 			}
 		}
+		region_destroy(region);
+		region_destroy(bufregion);
 		if(nsd->db->udb)
 			udb_base_set_userflags(nsd->db->udb, 0);
 		/* read the final log_str: but do not fail on it */
@@ -1383,7 +1404,8 @@ apply_ixfr_for_zone(nsd_type* nsd, zone_type* zonedb, FILE* in,
 			snprintf(log_buf, sizeof(log_buf), "error reading log");
 		}
 #ifdef NSEC3
-		if(zonedb) prehash_zone(nsd->db, zonedb);
+		/* on replay the zone is prehashed after the read */
+		if(zonedb && !replay) prehash_zone(nsd->db, zonedb);
 #endif /* NSEC3 */
 		zonedb->is_changed = 1;
 		if(nsd->db->udb) {
@@ -1394,7 +1416,7 @@ apply_ixfr_for_zone(nsd_type* nsd, zone_type* zonedb, FILE* in,
 			udb_zone_set_log_str(nsd->db->udb, &z, log_buf);
 			udb_zone_set_file_str(nsd->db->udb, &z, NULL);
 			udb_ptr_unlink(&z, nsd->db->udb);
-		} else {
+		} else if(!replay) {
 			zonedb->mtime.tv_sec = time_end_0;
 			zonedb->mtime.tv_nsec = time_end_1*1000;
 			if(zonedb->logstr)
@@ -1406,6 +1428,12 @@ apply_ixfr_for_zone(nsd_type* nsd, zone_type* zonedb, FILE* in,
 					strlen(zonedb->filename)+1);
 			zonedb->filename = NULL;
 		}
+		/* the IXFR is appended to the journal of the zonefile, if
+		 * the earlier changes are in there too */
+		if(!replay)
+			zonedb->is_journaled = opt->zonefiles_write && !is_axfr
+				&& (!was_changed || zonedb->is_journaled) &&
+				diff_journal_append(nsd, zonedb, in);
 		if(softfail && taskudb && !is_axfr) {
 			log_msg(LOG_ERR, "Failed to apply IXFR cleanly "
 				"(deletes nonexistent RRs, adds existing RRs). "
@@ -1418,12 +1446,24 @@ apply_ixfr_for_zone(nsd_type* nsd, zone_type* zonedb, FILE* in,
 				task_new_soainfo(taskudb, last_task, zonedb, 0);
 		}
 
-		if(1 <= verbosity) {
+		if(replay) {
+			VERBOSITY(2, (LOG_INFO, "zone %s applied %s from journal",
+				zone_buf, log_buf));
+		} else if(1 <= verbosity) {
 			double elapsed = (double)(time_end_0 - time_start_0)+
 				(double)((double)time_end_1
 				-(double)time_start_1) / 1000000.0;
-			VERBOSITY(1, (LOG_INFO, "zone %s %s of %d bytes in %g seconds",
-				zone_buf, log_buf, num_bytes, elapsed));
+			double applied = 0.0;
+			struct timeval apply_end;
+			if(apply_start.tv_sec != 0 &&
+				gettimeofday(&apply_end, NULL) == 0)
+				applied = (double)(apply_end.tv_sec -
+					apply_start.tv_sec) + (double)(
+					apply_end.tv_usec - apply_start.tv_usec)
+					/ 1000000.0;
+			VERBOSITY(1, (LOG_INFO, "zone %s %s of %d bytes in %g "
+				"seconds, applied in %g seconds",
+				zone_buf, log_buf, num_bytes, elapsed, applied));
 		}
 	}
 	else {
@@ -1432,6 +1472,187 @@ apply_ixfr_for_zone(nsd_type* nsd, zone_type* zonedb, FILE* in,
 	return 1;
 }
 
+void
+diff_journal_name(char* buf, size_t len, const char* zfile)
+{
+	snprintf(buf, len, "%s.jnl", zfile);
+}
+
+/* hash len bytes from the file, and copy them to out if not NULL */
+static int
+diff_journal_copy(FILE* in, FILE* out, uint32_t len, uint32_t* check)
+{
+	uint8_t buf[DIFF_JOURNAL_BLOCK];
+	size_t n;
+	while(len > 0) {
+		n = (len < sizeof(buf))?len:sizeof(buf);
+		if(fread(buf, n, 1, in) != 1)
+			return 0;
+		*check = hashlittle(buf, n, *check);
+		if(out && !write_data(out, buf, n))
+			return 0;
+		len -= n;
+	}
+	return 1;
+}
+
+/* append the xfr file to the journal of the zonefile, true if done */
+static int
+diff_journal_append(struct nsd* nsd, zone_type* zone, FILE* in)
+{
+	char jfile[4096];
+	const char* zfile;
+	struct timespec mtime;
+	int notexist = 0;
+	uint32_t check = 0;
+	off_t len, pos;
+	FILE* out;
+	if(!zone->opts || !zone->opts->pattern->zonefile)
+		return 0;
+	zfile = config_make_zonefile(zone->opts, nsd);
+	/* without a zonefile, the next write creates it */
+	if(!file_get_mtime(zfile, &mtime, &notexist))
+		return 0;
+	if(fseeko(in, 0, SEEK_END) == -1 || (len = ftello(in)) == -1 ||
+		len > (off_t)0xffffffff || fseeko(in, 0, SEEK_SET) == -1 ||
+		!diff_journal_copy(in, NULL, (uint32_t)len, &check) ||
+		fseeko(in, 0, SEEK_SET) == -1) {
+		log_msg(LOG_ERR, "could not read transfer for journal of %s",
+			zone->opts->name);
+		return 0;
+	}
+	diff_journal_name(jfile, sizeof(jfile), zfile);
+	out = fopen(jfile, "a");
+	if(!out) {
+		log_msg(LOG_ERR, "could not open journal %s: %s", jfile,
+			strerror(errno));
+		return 0;
+	}
+	if(fseeko(out, 0, SEEK_END) == -1 || (pos = ftello(out)) == -1) {
+		log_msg(LOG_ERR, "could not seek journal %s: %s", jfile,
+			strerror(errno));
+		fclose(out);
+		return 0;
+	}
+	/* a new journal starts with the mtime of the zonefile it is for */
+	if((pos == 0 && (!write_data(out, DIFF_JOURNAL_MAGIC,
+		DIFF_JOURNAL_MAGIC_LEN) ||
+		!write_64(out, (uint64_t)mtime.tv_sec) ||
+		!write_64(out, (uint64_t)mtime.tv_nsec))) ||
+		!write_32(out, (uint32_t)len) ||
+		!write_32(out, check) ||
+		!diff_journal_copy(in, out, (uint32_t)len, &check)) {
+		log_msg(LOG_ERR, "could not write journal %s: %s", jfile,
+			strerror(errno));
+		fclose(out);
+		return 0;
+	}
+	if(fclose(out) != 0) {
+		log_msg(LOG_ERR, "could not write journal %s: %s", jfile,
+			strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+int
+diff_journal_full(const char* zfile)
+{
+	char jfile[4096];
+	struct stat zst, jst;
+	diff_journal_name(jfile, sizeof(jfile), zfile);
+	if(stat(zfile, &zst) != 0 || stat(jfile, &jst) != 0)
+		return 1;
+	return jst.st_size * DIFF_JOURNAL_RATIO > zst.st_size;
+}
+
+int
+diff_journal_replay(struct nsd* nsd, zone_type* zone, const char* zfile,
+	struct timespec* mtime)
+{
+	char jfile[4096];
+	char magic[DIFF_JOURNAL_MAGIC_LEN];
+	uint64_t sec, nsec;
+	uint32_t len, check, c;
+	off_t start, pos;
+	udb_base* udb;
+	int num = 0, ret;
+	FILE* in;
+	diff_journal_name(jfile, sizeof(jfile), zfile);
+	in = fopen(jfile, "r");
+	if(!in) {
+		if(errno != ENOENT)
+			log_msg(LOG_ERR, "could not open journal %s: %s",
+				jfile, strerror(errno));
+		return 0;
+	}
+	(void)setvbuf(in, NULL, _IOFBF, XFR_FILE_BUFSIZE);
+	/* the journal belongs to the zonefile if it has the same mtime */
+	if(fread(magic, sizeof(magic), 1, in) != 1 ||
+		memcmp(magic, DIFF_JOURNAL_MAGIC, sizeof(magic)) != 0 ||
+		!diff_read_64(in, &sec) || !diff_read_64(in, &nsec) ||
+		sec != (uint64_t)mtime->tv_sec ||
+		nsec != (uint64_t)mtime->tv_nsec) {
+		VERBOSITY(2, (LOG_INFO, "journal %s is not for zonefile %s, "
+			"%s", jfile, zfile, nsd->journal_readonly?"skipped":
+			"removed"));
+		fclose(in);
+		if(!nsd->journal_readonly)
+			(void)unlink(jfile);
+		return 0;
+	}
+	/* the zone is stored in the udb after the journal is applied */
+	udb = nsd->db->udb;
+	nsd->db->udb = NULL;
+	while((start = ftello(in)) != -1 && diff_read_32(in, &len) &&
+		diff_read_32(in, &check)) {
+		c = 0;
+		if((pos = ftello(in)) == -1 ||
+			!diff_journal_copy(in, NULL, len, &c) || c != check ||
+			fseeko(in, pos, SEEK_SET) == -1) {
+			/* written partly when nsd stopped, later IXFRs are
+			 * appended after the good entries */
+			if(nsd->journal_readonly) {
+				log_msg(LOG_WARNING, "journal %s has a bad "
+					"entry, the rest is skipped", jfile);
+				break;
+			}
+			log_msg(LOG_WARNING, "journal %s has a bad entry, "
+				"it is truncated", jfile);
+			if(truncate(jfile, start) != 0)
+				num = -1;
+			break;
+		}
+		zone->is_changed = 0;
+		ret = apply_ixfr_for_zone(nsd, zone, in, nsd->options, NULL,
+			NULL, 0, 1);
+		if(!ret || fseeko(in, pos+len, SEEK_SET) == -1) {
+			num = -1;
+			break;
+		}
+		if(zone->is_changed)
+			num++;
+	}
+	nsd->db->udb = udb;
+	fclose(in);
+	if(num == -1) {
+		log_msg(LOG_ERR, "journal %s could not be applied, %s",
+			jfile, nsd->journal_readonly?"skipped":"removed");
+		if(!nsd->journal_readonly)
+			(void)unlink(jfile);
+	} else if(num == 0) {
+		/* the serials do not follow the zonefile */
+		if(!nsd->journal_readonly)
+			(void)unlink(jfile);
+	} else {
+		VERBOSITY(1, (LOG_INFO, "zone %s applied %d transfers from "
+			"journal", zone->opts->name, num));
+	}
+	zone->is_changed = (num > 0);
+	zone->is_journaled = (num > 0);
+	return num;
+}
+
 struct udb_base* task_file_create(const char* file)
 {
         return udb_base_create_new(file, &namedb_walkfunc, NULL);
@@ -1593,7 +1814,7 @@ void task_new_check_zonefiles(udb_base* udb, udb_ptr* last,
 }
 
 void task_new_write_zonefiles(udb_base* udb, udb_ptr* last,
-	const dname_type* zone)
+	const dname_type* zone, int force)
 {
 	udb_ptr e;
 	DEBUG(DEBUG_IPC,1, (LOG_INFO, "add task writezonefiles"));
@@ -1604,6 +1825,7 @@ void task_new_write_zonefiles(udb_base* udb, udb_ptr* last,
 	}
 	TASKLIST(&e)->task_type = task_write_zonefiles;
 	TASKLIST(&e)->yesno = (zone!=NULL);
+	TASKLIST(&e)->newserial = (force!=0);
 	udb_ptr_unlink(&e, udb);
 }
 
@@ -1623,7 +1845,7 @@ void task_new_set_verbosity(udb_base* udb, udb_ptr* last, int v)
 
 #ifdef BIND8_STATS
 void* task_new_stat_info(udb_base* udb, udb_ptr* last, struct nsdst* stat,
-	size_t child_count)
+	size_t child_count, int stat_block)
 {
 	void* p;
 	udb_ptr e;
@@ -1634,6 +1856,8 @@ void* task_new_stat_info(udb_base* udb, udb_ptr* last, struct nsdst* stat,
 		return NULL;
 	}
 	TASKLIST(&e)->task_type = task_stat_info;
+	/* the stat_map block of the new children */
+	TASKLIST(&e)->yesno = (uint64_t)stat_block;
 	p = TASKLIST(&e)->zname;
 	memcpy(p, stat, sizeof(*stat));
 	udb_ptr_unlink(&e, udb);
@@ -1867,9 +2091,10 @@ task_process_writezones(struct nsd* nsd, struct task_list_d* task)
 		struct zone_options* zo = zone_options_find(nsd->options,
 			task->zname);
 		if(zo)
-			namedb_write_zonefile(nsd, zo);
+			namedb_write_zonefile(nsd, zo, (int)task->newserial);
 	} else {
-		namedb_write_zonefiles(nsd, nsd->options);
+		namedb_write_zonefiles(nsd, nsd->options,
+			(int)task->newserial);
 	}
 }
 
@@ -2030,9 +2255,11 @@ task_process_apply_xfr(struct nsd* nsd, udb_base* udb, udb_ptr *last_task,
 		xfrd_unlink_xfrfile(nsd, TASKLIST(task)->yesno);
 		return;
 	}
+	/* read the packets in larger blocks, with fewer read calls */
+	(void)setvbuf(df, NULL, _IOFBF, XFR_FILE_BUFSIZE);
 	/* read and apply zone transfer */
 	if(!apply_ixfr_for_zone(nsd, zone, df, nsd->options, udb,
-		last_task, TASKLIST(task)->yesno)) {
+		last_task, TASKLIST(task)->yesno, 0)) {
 		/* there is no reply to xfrd failed-update,
 		 * because xfrd has a scan for apply-failures. */
 	}
@@ -40,6 +40,26 @@ int diff_read_32(FILE *in, uint32_t* result);
 int diff_read_8(FILE *in, uint8_t* result);
 int diff_read_str(FILE* in, char* buf, size_t len);
 
+/*
+ * The journal of a zonefile holds the IXFRs that were applied after the
+ * zonefile was written.  The zonefile is written again when the journal
+ * is larger than the zonefile size divided by this ratio.
+ */
+#define DIFF_JOURNAL_RATIO 2
+/* make the filename of the journal of the zonefile */
+void diff_journal_name(char* buf, size_t len, const char* zfile);
+/* true if the zonefile should be written because of its journal size */
+int diff_journal_full(const char* zfile);
+/*
+ * Apply the journal to the zone that was just read from the zonefile,
+ * with that mtime.  A journal that is not for the zonefile is removed.
+ * Returns the number of IXFRs applied, or -1 if that failed, then the
+ * journal is removed and the zonefile has to be read again.  With
+ * nsd->journal_readonly the journal file is not truncated or removed.
+ */
+int diff_journal_replay(struct nsd* nsd, zone_type* zone, const char* zfile,
+	struct timespec* mtime);
+
 /* delete the RRs for a zone from memory */
 void delete_zone_rrs(namedb_type* db, zone_type* zone);
 /* delete an RR */
@@ -95,6 +115,8 @@ struct task_list_d {
 	/** soainfo: zonename dname, soaRR wireform */
 	/** expire: zonename, boolyesno */
 	/** apply_xfr: zonename, serials, yesno is filenamecounter */
+	/** write_zonefiles: zonename if yesno, newserial is 1 to also
+	 * write the zones that have their changes in the journal */
 	uint32_t oldserial, newserial;
 	/** general variable.  for some used to see if zname is present. */
 	uint64_t yesno;
@@ -110,11 +132,11 @@ void task_new_soainfo(udb_base* udb, udb_ptr* last, struct zone* z, int gone);
 void task_new_expire(udb_base* udb, udb_ptr* last,
 	const struct dname* z, int expired);
 void* task_new_stat_info(udb_base* udb, udb_ptr* last, struct nsdst* stat,
-	size_t child_count);
+	size_t child_count, int stat_block);
 void task_new_check_zonefiles(udb_base* udb, udb_ptr* last,
 	const dname_type* zone);
 void task_new_write_zonefiles(udb_base* udb, udb_ptr* last,
-	const dname_type* zone);
+	const dname_type* zone, int force);
 void task_new_set_verbosity(udb_base* udb, udb_ptr* last, int v);
 void task_new_add_zone(udb_base* udb, udb_ptr* last, const char* zone,
 	const char* pattern, unsigned zonestatid);
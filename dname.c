@@ -22,21 +22,24 @@
 #include "dname.h"
 #include "query.h"
 
-const dname_type *
-dname_make(region_type *region, const uint8_t *name, int normalize)
+/*
+ * Find the label offsets and the size of wire format NAME, returns 0
+ * if it is not a valid uncompressed name.
+ */
+static int
+dname_scan(const uint8_t *name, uint8_t *label_offsets,
+	   uint8_t *label_count_ret, size_t *name_size_ret)
 {
 	size_t name_size = 0;
-	uint8_t label_offsets[MAXDOMAINLEN];
 	uint8_t label_count = 0;
 	const uint8_t *label = name;
-	dname_type *result;
 	ssize_t i;
 
 	assert(name);
 
 	while (1) {
 		if (label_is_pointer(label))
-			return NULL;
+			return 0;
 
 		label_offsets[label_count] = (uint8_t) (label - name);
 		++label_count;
@@ -49,7 +52,7 @@ dname_make(region_type *region, const uint8_t *name, int normalize)
 	}
 
 	if (name_size > MAXDOMAINLEN)
-		return NULL;
+		return 0;
 
 	assert(label_count <= MAXDOMAINLEN / 2 + 1);
 
@@ -60,10 +63,22 @@ dname_make(region_type *region, const uint8_t *name, int normalize)
 		label_offsets[label_count - i - 1] = tmp;
 	}
 
-	result = (dname_type *) region_alloc(
-		region,
-		(sizeof(dname_type)
-		 + (((size_t)label_count) + ((size_t)name_size)) * sizeof(uint8_t)));
+	*label_count_ret = label_count;
+	*name_size_ret = name_size;
+	return 1;
+}
+
+/*
+ * Fill RESULT, that has space for the label offsets and name, with
+ * the scanned NAME.
+ */
+static void
+dname_fill(dname_type *result, const uint8_t *name, int normalize,
+	   const uint8_t *label_offsets, uint8_t label_count,
+	   size_t name_size)
+{
+	ssize_t i;
+
 	result->name_size = name_size;
 	result->label_count = label_count;
 	memcpy((uint8_t *) dname_label_offsets(result),
@@ -85,9 +100,43 @@ dname_make(region_type *region, const uint8_t *name, int normalize)
 		       name,
 		       name_size * sizeof(uint8_t));
 	}
+}
+
+const dname_type *
+dname_make(region_type *region, const uint8_t *name, int normalize)
+{
+	size_t name_size;
+	uint8_t label_offsets[MAXDOMAINLEN];
+	uint8_t label_count;
+	dname_type *result;
+
+	if (!dname_scan(name, label_offsets, &label_count, &name_size))
+		return NULL;
+
+	result = (dname_type *) region_alloc(
+		region,
+		(sizeof(dname_type)
+		 + (((size_t)label_count) + ((size_t)name_size)) * sizeof(uint8_t)));
+	dname_fill(result, name, normalize, label_offsets, label_count,
+		   name_size);
 	return result;
 }
 
+const dname_type *
+dname_make_buffered(struct dname_buffer *buffer, const uint8_t *name,
+		    int normalize)
+{
+	size_t name_size;
+	uint8_t label_offsets[MAXDOMAINLEN];
+	uint8_t label_count;
+
+	if (!dname_scan(name, label_offsets, &label_count, &name_size))
+		return NULL;
+	dname_fill(&buffer->dname, name, normalize, label_offsets,
+		   label_count, name_size);
+	return &buffer->dname;
+}
+
 
 const dname_type *
 dname_make_from_packet(region_type *region, buffer_type *packet,
@@ -99,6 +148,17 @@ dname_make_from_packet(region_type *region, buffer_type *packet,
 	return dname_make(region, buf, normalize);
 }
 
+const dname_type *
+dname_make_from_packet_buffered(struct dname_buffer *buffer,
+				buffer_type *packet, int allow_pointers,
+				int normalize)
+{
+	uint8_t buf[MAXDOMAINLEN + 1];
+	if(!dname_make_wire_from_packet(buf, packet, allow_pointers))
+		return 0;
+	return dname_make_buffered(buffer, buf, normalize);
+}
+
 int
 dname_make_wire_from_packet(uint8_t *buf, buffer_type *packet,
                        int allow_pointers)
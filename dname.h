@@ -14,6 +14,7 @@
 #include <stdio.h>
 
 #include "buffer.h"
+#include "dns.h"
 #include "region-allocator.h"
 
 #if defined(NAMEDB_UPPERCASE) || defined(USE_NAMEDB_UPPERCASE)
@@ -57,6 +58,24 @@ struct dname
 const dname_type *dname_make(region_type *region, const uint8_t *name,
 			     int normalize);
 
+/*
+ * Storage for a domain name of the maximum size, so that a name can be
+ * made without allocation.
+ */
+struct dname_buffer
+{
+	struct dname dname;
+	/* the label offsets and the name */
+	uint8_t storage[MAXDOMAINLEN / 2 + 1 + MAXDOMAINLEN + 1];
+};
+
+/*
+ * Construct a domain name like dname_make, in BUFFER.  Returns a pointer
+ * to the name in BUFFER, or NULL on failure.
+ */
+const dname_type *dname_make_buffered(struct dname_buffer *buffer,
+				      const uint8_t *name, int normalize);
+
 /*
  * Construct a new domain name based on wire format dname stored at
  * PACKET's current position.  Compression pointers are followed.  The
@@ -68,6 +87,14 @@ const dname_type *dname_make_from_packet(region_type *region,
 					 int allow_pointers,
 					 int normalize);
 
+/*
+ * Like dname_make_from_packet, but the name is made in BUFFER.
+ */
+const dname_type *dname_make_from_packet_buffered(struct dname_buffer *buffer,
+						  buffer_type *packet,
+						  int allow_pointers,
+						  int normalize);
+
 /*
  * parse wireformat from packet (following pointers) into the
  * given buffer. Returns length in buffer or 0 on error.
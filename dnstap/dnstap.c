@@ -38,86 +38,465 @@
 
 #include "config.h"
 #include <string.h>
+#include <assert.h>
 #include <sys/time.h>
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include "util.h"
 #include "options.h"
 
-#include <fstrm.h>
-#include <protobuf-c/protobuf-c.h>
-
 #include "dnstap/dnstap.h"
-#include "dnstap/dnstap.pb-c.h"
 
 #define DNSTAP_CONTENT_TYPE		"protobuf:dnstap.Dnstap"
-#define DNSTAP_INITIAL_BUF_SIZE		256
 
-struct dt_msg {
-	void		*buf;
-	size_t		len_buf;
-	Dnstap__Dnstap	d;
-	Dnstap__Message	m;
-};
+/* frame streams control frame types and fields */
+#define FSTRM_CONTROL_ACCEPT		0x01
+#define FSTRM_CONTROL_START		0x02
+#define FSTRM_CONTROL_STOP		0x03
+#define FSTRM_CONTROL_READY		0x04
+#define FSTRM_CONTROL_FINISH		0x05
+#define FSTRM_CONTROL_FIELD_CONTENT_TYPE	0x01
+/* max length of a control frame that we read */
+#define FSTRM_CONTROL_FRAME_MAX		DNSTAP_CONTROL_FRAME_MAX
+/* seconds to wait for the reply of the socket reader, when the socket
+ * is closed */
+#define FSTRM_HANDSHAKE_TIMEOUT		5
+
+/* protobuf field numbers, see dnstap.proto */
+#define DNSTAP_FIELD_IDENTITY		1
+#define DNSTAP_FIELD_VERSION		2
+#define DNSTAP_FIELD_MESSAGE		14
+#define DNSTAP_FIELD_TYPE		15
+#define DNSTAP_TYPE_MESSAGE		1
+#define MESSAGE_FIELD_TYPE		1
+#define MESSAGE_FIELD_SOCKET_FAMILY	2
+#define MESSAGE_FIELD_SOCKET_PROTOCOL	3
+#define MESSAGE_FIELD_QUERY_ADDRESS	4
+#define MESSAGE_FIELD_QUERY_PORT	6
+#define MESSAGE_FIELD_QUERY_TIME_SEC	8
+#define MESSAGE_FIELD_QUERY_TIME_NSEC	9
+#define MESSAGE_FIELD_QUERY_MESSAGE	10
+#define MESSAGE_FIELD_QUERY_ZONE	11
+#define MESSAGE_FIELD_RESPONSE_TIME_SEC	12
+#define MESSAGE_FIELD_RESPONSE_TIME_NSEC	13
+#define MESSAGE_FIELD_RESPONSE_MESSAGE	14
+#define MESSAGE_TYPE_AUTH_QUERY		1
+#define MESSAGE_TYPE_AUTH_RESPONSE	2
+#define SOCKET_FAMILY_INET		1
+#define SOCKET_FAMILY_INET6		2
+#define SOCKET_PROTOCOL_UDP		1
+#define SOCKET_PROTOCOL_TCP		2
+
+/* protobuf wire types */
+#define PB_WIRE_VARINT			0
+#define PB_WIRE_LENGTH			2
+#define PB_WIRE_FIXED32			5
+/* room for the length of the message field, the message is smaller than
+ * 2**21 bytes, because the DNS message is smaller than 65536 bytes */
+#define PB_MESSAGE_LEN_ROOM		3
+/* room for the fields of a message, other than the DNS message, the
+ * address and the zone name */
+#define PB_MESSAGE_FIELDS_ROOM		64
+
+/* write varint at p, return the position after it */
+static uint8_t*
+pb_varint(uint8_t* p, uint64_t v)
+{
+	while(v >= 0x80) {
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+static uint8_t*
+pb_field_varint(uint8_t* p, unsigned field, uint64_t v)
+{
+	p = pb_varint(p, (field<<3) | PB_WIRE_VARINT);
+	return pb_varint(p, v);
+}
+
+static uint8_t*
+pb_field_fixed32(uint8_t* p, unsigned field, uint32_t v)
+{
+	p = pb_varint(p, (field<<3) | PB_WIRE_FIXED32);
+	/* fixed32 is little endian */
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v>>8);
+	p[2] = (uint8_t)(v>>16);
+	p[3] = (uint8_t)(v>>24);
+	return p+4;
+}
 
+static uint8_t*
+pb_field_bytes(uint8_t* p, unsigned field, const void* data, size_t len)
+{
+	p = pb_varint(p, (field<<3) | PB_WIRE_LENGTH);
+	p = pb_varint(p, len);
+	memcpy(p, data, len);
+	return p+len;
+}
+
+/* number of bytes in the varint encoding of v */
+static size_t
+pb_varint_len(uint64_t v)
+{
+	size_t n = 1;
+	while(v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+/* write a frame streams control frame, with the content type field if
+ * it is not the stop or finish frame.  returns its length. */
+static size_t
+fstrm_control_frame(uint8_t* buf, uint32_t type)
+{
+	uint32_t len = 4;
+	write_uint32(buf, 0); /* escape, zero length data frame */
+	write_uint32(buf+8, type);
+	if(type != FSTRM_CONTROL_STOP && type != FSTRM_CONTROL_FINISH) {
+		write_uint32(buf+12, FSTRM_CONTROL_FIELD_CONTENT_TYPE);
+		write_uint32(buf+16, sizeof(DNSTAP_CONTENT_TYPE)-1);
+		memcpy(buf+20, DNSTAP_CONTENT_TYPE,
+			sizeof(DNSTAP_CONTENT_TYPE)-1);
+		len += 8 + sizeof(DNSTAP_CONTENT_TYPE)-1;
+	}
+	write_uint32(buf+4, len);
+	return 8 + len;
+}
+
+/* write all of the data, and wait at most DNSTAP_CLOSE_TIMEOUT seconds
+ * for a nonblocking socket that does not take it, returns false on
+ * failure or timeout */
 static int
-dt_pack(const Dnstap__Dnstap *d, void **buf, size_t *sz)
+dt_write_all(int fd, const uint8_t* data, size_t len)
 {
-	ProtobufCBufferSimple sbuf;
-
-	memset(&sbuf, 0, sizeof(sbuf));
-	sbuf.base.append = protobuf_c_buffer_simple_append;
-	sbuf.len = 0;
-	sbuf.alloced = DNSTAP_INITIAL_BUF_SIZE;
-	sbuf.data = malloc(sbuf.alloced);
-	if (sbuf.data == NULL)
-		return 0;
-	sbuf.must_free_data = 1;
+	time_t end = time(NULL) + DNSTAP_CLOSE_TIMEOUT, now;
+	size_t total = 0;
+	ssize_t r;
+	while(total < len) {
+		r = write(fd, data+total, len-total);
+		if(r == -1) {
+			struct pollfd p;
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN
+#ifdef EWOULDBLOCK
+				&& errno != EWOULDBLOCK
+#endif
+				)
+				return 0;
+			now = time(NULL);
+			if(now >= end) {
+				errno = ETIMEDOUT;
+				return 0;
+			}
+			p.fd = fd;
+			p.events = POLLOUT;
+			p.revents = 0;
+			(void)poll(&p, 1, (int)(end-now)*1000);
+			continue;
+		}
+		total += r;
+	}
+	return 1;
+}
 
-	*sz = dnstap__dnstap__pack_to_buffer(d, (ProtobufCBuffer *) &sbuf);
-	if (sbuf.data == NULL)
+/* parse the control frame in buf, of len bytes, returns its type, 0 if
+ * it is not complete yet, or -1 if it is malformed. */
+static int64_t
+dt_parse_control(const uint8_t* buf, size_t len)
+{
+	uint32_t want;
+	if(len < 8)
 		return 0;
-	*buf = sbuf.data;
+	if(read_uint32(buf) != 0)
+		return -1; /* not a control frame */
+	want = 8 + read_uint32(buf+4);
+	if(want < 12 || want > FSTRM_CONTROL_FRAME_MAX)
+		return -1;
+	if(len < want)
+		return 0;
+	return (int64_t)read_uint32(buf+8);
+}
 
-	return 1;
+/* read a control frame from the blocking socket, returns its type, or 0
+ * on failure. */
+static uint32_t
+dt_read_control(int fd)
+{
+	uint8_t buf[FSTRM_CONTROL_FRAME_MAX];
+	size_t total = 0;
+	int64_t type;
+	ssize_t r;
+	while((type = dt_parse_control(buf, total)) == 0) {
+		/* read no more than the frame, the rest is not ours */
+		size_t want = total < 8 ? 8 : 8 + read_uint32(buf+4);
+		r = read(fd, buf+total, want-total);
+		if(r == -1 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return 0;
+		total += r;
+	}
+	return type < 0 ? 0 : (uint32_t)type;
+}
+
+/* the socket is not connected, close it, it is tried again later */
+static void
+dt_connect_failed(struct dt_env* env, const char* reason)
+{
+	log_msg(LOG_ERR, "dnstap socket %s: %s", env->socket_path, reason);
+	close(env->fd);
+	env->fd = -1;
+	env->connecting = 0;
 }
 
+/* the connect is done, send the ready frame and wait for accept */
 static void
-dt_send(const struct dt_env *env, void *buf, size_t len_buf)
+dt_connect_send_ready(struct dt_env* env)
 {
-	fstrm_res res;
-	if (!buf)
+	uint8_t frame[FSTRM_CONTROL_FRAME_MAX];
+	size_t len = fstrm_control_frame(frame, FSTRM_CONTROL_READY);
+	ssize_t r;
+	/* the small frame fits in the empty socket buffer */
+	while((r = write(env->fd, frame, len)) == -1 && errno == EINTR)
+		;
+	if(r != (ssize_t)len) {
+		dt_connect_failed(env, "could not send the ready frame");
 		return;
-	res = fstrm_iothr_submit(env->iothr, env->ioq, buf, len_buf,
-				 fstrm_free_wrapper, NULL);
-	if (res != fstrm_res_success)
-		free(buf);
+	}
+	env->connecting = DT_CONNECT_WANT_READ;
+	env->handshake_len = 0;
+}
+
+/* the accept frame has arrived, send start, and the stream is open */
+static void
+dt_connect_send_start(struct dt_env* env)
+{
+	uint8_t frame[FSTRM_CONTROL_FRAME_MAX];
+	size_t len = fstrm_control_frame(frame, FSTRM_CONTROL_START);
+	struct timeval tv;
+	ssize_t r;
+	while((r = write(env->fd, frame, len)) == -1 && errno == EINTR)
+		;
+	if(r != (ssize_t)len) {
+		dt_connect_failed(env, "could not send the start frame");
+		return;
+	}
+	/* for the wait for the finish frame when the socket is closed */
+	tv.tv_sec = FSTRM_HANDSHAKE_TIMEOUT;
+	tv.tv_usec = 0;
+	if(setsockopt(env->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))
+		== -1)
+		log_msg(LOG_ERR, "dnstap socket: setsockopt(SO_RCVTIMEO): %s",
+			strerror(errno));
+	env->connecting = 0;
+	VERBOSITY(1, (LOG_INFO, "connected to dnstap socket %s",
+		env->socket_path));
+}
+
+void
+dt_connect_continue(struct dt_env* env)
+{
+	if(env->connecting == DT_CONNECT_WANT_WRITE) {
+		int error = 0;
+		socklen_t len = (socklen_t)sizeof(error);
+		if(getsockopt(env->fd, SOL_SOCKET, SO_ERROR, &error, &len)
+			== -1)
+			error = errno;
+		if(error == EINPROGRESS || error == EINTR || error == EAGAIN)
+			return; /* wait more */
+		if(error != 0) {
+			dt_connect_failed(env, strerror(error));
+			return;
+		}
+		dt_connect_send_ready(env);
+	} else if(env->connecting == DT_CONNECT_WANT_READ) {
+		int64_t type;
+		ssize_t r;
+		size_t want = env->handshake_len < 8 ? 8 :
+			8 + read_uint32(env->handshake+4);
+		if(want > sizeof(env->handshake)) {
+			dt_connect_failed(env, "malformed handshake reply");
+			return;
+		}
+		r = read(env->fd, env->handshake + env->handshake_len,
+			want - env->handshake_len);
+		if(r == -1 && (errno == EINTR || errno == EAGAIN
+#ifdef EWOULDBLOCK
+			|| errno == EWOULDBLOCK
+#endif
+			))
+			return; /* wait more */
+		if(r <= 0) {
+			dt_connect_failed(env, r==0?"closed by the reader":
+				strerror(errno));
+			return;
+		}
+		env->handshake_len += r;
+		type = dt_parse_control(env->handshake, env->handshake_len);
+		if(type == 0)
+			return; /* wait for the rest */
+		if(type != FSTRM_CONTROL_ACCEPT) {
+			dt_connect_failed(env, "frame streams handshake "
+				"failed");
+			return;
+		}
+		dt_connect_send_start(env);
+	}
+}
+
+void
+dt_connect_timeout(struct dt_env* env)
+{
+	if(env->connecting)
+		dt_connect_failed(env, "no reply from the reader, timeout");
+}
+
+/* start to connect to the dnstap socket, the connect and the frame
+ * streams handshake are continued by dt_connect_continue when the socket
+ * is ready.  returns the fd or -1 on failure. */
+static int
+dt_open_socket(struct dt_env* env)
+{
+	struct sockaddr_un addr;
+	const char* path = env->socket_path;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		log_msg(LOG_ERR, "dnstap-socket-path too long: %s", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	if((env->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		log_msg(LOG_ERR, "dnstap socket: %s", strerror(errno));
+		return -1;
+	}
+	if(fcntl(env->fd, F_SETFL, O_NONBLOCK) == -1) {
+		log_msg(LOG_ERR, "fcntl failed: %s", strerror(errno));
+		close(env->fd);
+		env->fd = -1;
+		return -1;
+	}
+	if(connect(env->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		if(errno == EINPROGRESS || errno == EINTR) {
+			env->connecting = DT_CONNECT_WANT_WRITE;
+			return env->fd;
+		}
+		log_msg(LOG_ERR, "could not connect to dnstap socket %s: %s",
+			path, strerror(errno));
+		close(env->fd);
+		env->fd = -1;
+		return -1;
+	}
+	dt_connect_send_ready(env);
+	return env->fd;
+}
+
+/* move the file away, to the name with the time of rotation appended */
+static void
+dt_rotate_file(const char* path)
+{
+	char name[1024];
+	struct stat st;
+	time_t now = time(NULL);
+	int i;
+	for(i=0; i<100; i++) {
+		if(i == 0)
+			snprintf(name, sizeof(name), "%s.%lld", path,
+				(long long)now);
+		else	snprintf(name, sizeof(name), "%s.%lld.%d", path,
+				(long long)now, i);
+		if(stat(name, &st) == -1 && errno == ENOENT)
+			break;
+	}
+	if(rename(path, name) == -1) {
+		log_msg(LOG_ERR, "could not rename %s to %s: %s", path, name,
+			strerror(errno));
+		return;
+	}
+	VERBOSITY(2, (LOG_INFO, "dnstap file rotated to %s", name));
 }
 
+/* open the dnstap file for writing, the file that is already there is
+ * rotated, so that every file is a complete frame stream.
+ * returns the fd or -1 on failure. */
+static int
+dt_open_file(struct dt_env* env)
+{
+	uint8_t frame[FSTRM_CONTROL_FRAME_MAX];
+	struct stat st;
+	size_t len;
+	int fd;
+	if(stat(env->file_path, &st) == 0 && st.st_size > 0)
+		dt_rotate_file(env->file_path);
+	fd = open(env->file_path, O_WRONLY|O_CREAT|O_TRUNC, 0640);
+	if(fd == -1) {
+		log_msg(LOG_ERR, "could not open dnstap file %s: %s",
+			env->file_path, strerror(errno));
+		return -1;
+	}
+	len = fstrm_control_frame(frame, FSTRM_CONTROL_START);
+	if(!dt_write_all(fd, frame, len)) {
+		log_msg(LOG_ERR, "could not write dnstap file %s: %s",
+			env->file_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	env->file_written = len;
+	VERBOSITY(1, (LOG_INFO, "writing dnstap to file %s", env->file_path));
+	return fd;
+}
+
+/* open the socket or file */
+static int
+dt_open(struct dt_env* env)
+{
+	env->open_time = time(NULL);
+	if(env->file_path)
+		env->fd = dt_open_file(env);
+	else	env->fd = dt_open_socket(env);
+	return env->fd != -1;
+}
+
+/* stop the frame stream, and close the socket or file */
 static void
-dt_msg_init(const struct dt_env *env,
-	    struct dt_msg *dm,
-	    Dnstap__Message__Type mtype)
+dt_close(struct dt_env* env)
 {
-	memset(dm, 0, sizeof(*dm));
-	dm->d.base.descriptor = &dnstap__dnstap__descriptor;
-	dm->m.base.descriptor = &dnstap__message__descriptor;
-	dm->d.type = DNSTAP__DNSTAP__TYPE__MESSAGE;
-	dm->d.message = &dm->m;
-	dm->m.type = mtype;
-	if (env->identity != NULL) {
-		dm->d.identity.data = (uint8_t *) env->identity;
-		dm->d.identity.len = (size_t) env->len_identity;
-		dm->d.has_identity = 1;
-	}
-	if (env->version != NULL) {
-		dm->d.version.data = (uint8_t *) env->version;
-		dm->d.version.len = (size_t) env->len_version;
-		dm->d.has_version = 1;
+	uint8_t frame[FSTRM_CONTROL_FRAME_MAX];
+	if(env->fd == -1)
+		return;
+	if(env->connecting) {
+		/* the stream was not started */
+		close(env->fd);
+		env->fd = -1;
+		env->connecting = 0;
+		return;
+	}
+	if(dt_write_all(env->fd, frame, fstrm_control_frame(frame,
+		FSTRM_CONTROL_STOP)) && !env->file_path) {
+		/* wait for the finish reply, SO_RCVTIMEO limits the wait */
+		int fl = fcntl(env->fd, F_GETFL);
+		if(fl != -1)
+			(void)fcntl(env->fd, F_SETFL, fl&~O_NONBLOCK);
+		if(dt_read_control(env->fd) != FSTRM_CONTROL_FINISH)
+			VERBOSITY(2, (LOG_INFO, "dnstap socket: no finish "
+				"frame from reader"));
 	}
+	close(env->fd);
+	env->fd = -1;
 }
 
 /* check that the socket file can be opened and exists, print error if not */
@@ -133,56 +512,34 @@ check_socket_file(const char* socket_path)
 }
 
 struct dt_env *
-dt_create(const char *socket_path, unsigned num_workers)
+dt_create(const char *socket_path, const char *file_path, uint64_t file_size)
 {
-#ifndef NDEBUG
-	fstrm_res res;
-#endif
 	struct dt_env *env;
-	struct fstrm_iothr_options *fopt;
-	struct fstrm_unix_writer_options *fuwopt;
-	struct fstrm_writer *fw;
-	struct fstrm_writer_options *fwopt;
 
-	VERBOSITY(1, (LOG_INFO, "attempting to connect to dnstap socket %s",
-		socket_path));
-	assert(socket_path != NULL);
-	assert(num_workers > 0);
-	check_socket_file(socket_path);
+	assert(socket_path != NULL || file_path != NULL);
+	if(file_path == NULL) {
+		VERBOSITY(1, (LOG_INFO, "attempting to connect to dnstap "
+			"socket %s", socket_path));
+		check_socket_file(socket_path);
+	}
 
 	env = (struct dt_env *) calloc(1, sizeof(struct dt_env));
 	if (!env)
 		return NULL;
-
-	fwopt = fstrm_writer_options_init();
-#ifndef NDEBUG
-	res = 
-#else
-	(void)
-#endif
-	    fstrm_writer_options_add_content_type(fwopt,
-		DNSTAP_CONTENT_TYPE, sizeof(DNSTAP_CONTENT_TYPE) - 1);
-	assert(res == fstrm_res_success);
-
-	fuwopt = fstrm_unix_writer_options_init();
-	fstrm_unix_writer_options_set_socket_path(fuwopt, socket_path);
-
-	fw = fstrm_unix_writer_init(fuwopt, fwopt);
-	assert(fw != NULL);
-
-	fopt = fstrm_iothr_options_init();
-	fstrm_iothr_options_set_num_input_queues(fopt, num_workers);
-	env->iothr = fstrm_iothr_init(fopt, &fw);
-	if (env->iothr == NULL) {
-		log_msg(LOG_ERR, "dt_create: fstrm_iothr_init() failed");
-		fstrm_writer_destroy(&fw);
+	env->fd = -1;
+	env->file_size = file_size;
+	if(file_path)
+		env->file_path = strdup(file_path);
+	else	env->socket_path = strdup(socket_path);
+	env->buf = (uint8_t*)malloc(DNSTAP_OUTPUT_BUFFER_SIZE);
+	if(!env->buf || (!env->file_path && !env->socket_path)) {
+		log_msg(LOG_ERR, "dt_create: out of memory");
+		free(env->buf);
+		free(env->file_path);
+		free(env->socket_path);
 		free(env);
-		env = NULL;
+		return NULL;
 	}
-	fstrm_iothr_options_destroy(&fopt);
-	fstrm_unix_writer_options_destroy(&fuwopt);
-	fstrm_writer_options_destroy(&fwopt);
-
 	return env;
 }
 
@@ -227,6 +584,25 @@ dt_apply_version(struct dt_env *env, struct nsd_options *cfg)
 		env->version));
 }
 
+/* encode the identity and version fields, they are the same for every
+ * frame */
+static void
+dt_apply_prefix(struct dt_env *env)
+{
+	uint8_t* p;
+	free(env->prefix);
+	env->prefix = (uint8_t*)xalloc(env->len_identity + env->len_version
+		+ 32);
+	p = env->prefix;
+	if(env->identity)
+		p = pb_field_bytes(p, DNSTAP_FIELD_IDENTITY, env->identity,
+			env->len_identity);
+	if(env->version)
+		p = pb_field_bytes(p, DNSTAP_FIELD_VERSION, env->version,
+			env->len_version);
+	env->len_prefix = (size_t)(p - env->prefix);
+}
+
 void
 dt_apply_cfg(struct dt_env *env, struct nsd_options *cfg)
 {
@@ -235,6 +611,7 @@ dt_apply_cfg(struct dt_env *env, struct nsd_options *cfg)
 
 	dt_apply_identity(env, cfg);
 	dt_apply_version(env, cfg);
+	dt_apply_prefix(env);
 	if ((env->log_auth_query_messages = (unsigned int)
 	     cfg->dnstap_log_auth_query_messages))
 	{
@@ -250,10 +627,7 @@ dt_apply_cfg(struct dt_env *env, struct nsd_options *cfg)
 int
 dt_init(struct dt_env *env)
 {
-	env->ioq = fstrm_iothr_get_input_queue(env->iothr);
-	if (env->ioq == NULL)
-		return 0;
-	return 1;
+	return dt_open(env);
 }
 
 void
@@ -262,90 +636,185 @@ dt_delete(struct dt_env *env)
 	if (!env)
 		return;
 	VERBOSITY(1, (LOG_INFO, "closing dnstap socket"));
-	fstrm_iothr_destroy(&env->iothr);
+	if(env->fd != -1 && env->connecting) {
+		dt_close(env);
+	} else if(env->fd != -1) {
+		/* a reader that does not take the frames delays the exit
+		 * by at most DNSTAP_CLOSE_TIMEOUT */
+		if(!dt_write_all(env->fd, env->buf, env->len_buf)) {
+			log_msg(LOG_ERR, "dnstap: write failed: %s, %u bytes "
+				"of frames lost", strerror(errno),
+				(unsigned)env->len_buf);
+			/* the stop frame cannot follow a partial frame */
+			close(env->fd);
+			env->fd = -1;
+		} else	dt_close(env);
+		env->len_buf = 0;
+	}
+	if(env->dropped)
+		log_msg(LOG_INFO, "dnstap: %u frames dropped because the output "
+			"was too slow", (unsigned)env->dropped);
 	free(env->identity);
 	free(env->version);
+	free(env->prefix);
+	free(env->socket_path);
+	free(env->file_path);
+	free(env->buf);
 	free(env);
 }
 
-static void
-dt_fill_timeval(const struct timeval *tv,
-		uint64_t *time_sec, protobuf_c_boolean *has_time_sec,
-		uint32_t *time_nsec, protobuf_c_boolean *has_time_nsec)
-{
-#ifndef S_SPLINT_S
-	*time_sec = tv->tv_sec;
-	*time_nsec = tv->tv_usec * 1000;
-#endif
-	*has_time_sec = 1;
-	*has_time_nsec = 1;
-}
-
-static void
-dt_fill_buffer(uint8_t* pkt, size_t pktlen, ProtobufCBinaryData *p, protobuf_c_boolean *has)
+void
+dt_flush(struct dt_env *env)
 {
-	p->len = pktlen;
-	p->data = pkt;
-	*has = 1;
+	size_t total = 0;
+	ssize_t r;
+	if(env->fd == -1) {
+		if(time(NULL) < env->open_time + DNSTAP_REOPEN_INTERVAL ||
+			!dt_open(env))
+			return;
+	}
+	if(env->connecting) {
+		/* the frames wait until the handshake is done */
+		if(time(NULL) >= env->open_time + DNSTAP_CONNECT_TIMEOUT)
+			dt_connect_timeout(env);
+		return;
+	}
+	while(total < env->len_buf) {
+		r = write(env->fd, env->buf+total, env->len_buf-total);
+		if(r == -1) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN)
+				break; /* write the remainder later */
+			log_msg(LOG_ERR, "dnstap: write to %s failed: %s",
+				env->file_path?env->file_path:env->socket_path,
+				strerror(errno));
+			close(env->fd);
+			env->fd = -1;
+			/* a partly written frame cannot be continued on
+			 * the next connection, drop the buffer */
+			total = env->len_buf;
+			break;
+		}
+		total += r;
+	}
+	if(total != 0 && total < env->len_buf)
+		memmove(env->buf, env->buf+total, env->len_buf-total);
+	env->len_buf -= total;
+	if(env->file_path) {
+		env->file_written += total;
+		if(env->fd != -1 && env->file_size != 0 &&
+			env->len_buf == 0 &&
+			env->file_written >= env->file_size) {
+			dt_close(env);
+			(void)dt_open(env);
+		}
+	}
 }
 
+/* put a frame with the message in the output buffer */
 static void
-dt_msg_fill_net(struct dt_msg *dm,
+dt_msg_frame(struct dt_env *env, uint32_t mtype,
 #ifdef INET6
-		struct sockaddr_storage *ss,
+	struct sockaddr_storage* ss,
 #else
-		struct sockaddr_in *ss,
+	struct sockaddr_in* ss,
 #endif
-		int is_tcp,
-		ProtobufCBinaryData *addr, protobuf_c_boolean *has_addr,
-		uint32_t *port, protobuf_c_boolean *has_port)
+	int is_tcp, uint8_t* zone, size_t zonelen, uint8_t* pkt, size_t pktlen)
 {
+	uint8_t *frame, *msg, *p;
+	size_t msglen, lenlen;
+	struct timeval tv;
+
+	if(DNSTAP_OUTPUT_BUFFER_SIZE - env->len_buf < 4 + env->len_prefix +
+		PB_MESSAGE_FIELDS_ROOM + 16 + zonelen + pktlen) {
+		/* make room, and if the output is blocked, drop the frame */
+		dt_flush(env);
+		if(DNSTAP_OUTPUT_BUFFER_SIZE - env->len_buf < 4 +
+			env->len_prefix + PB_MESSAGE_FIELDS_ROOM + 16 +
+			zonelen + pktlen) {
+			env->dropped++;
+			return;
+		}
+	}
+	gettimeofday(&tv, NULL);
+
+	/* the frame length goes at the start */
+	frame = env->buf + env->len_buf;
+	p = frame + 4;
+	memcpy(p, env->prefix, env->len_prefix);
+	p += env->len_prefix;
+	p = pb_varint(p, (DNSTAP_FIELD_MESSAGE<<3) | PB_WIRE_LENGTH);
+	/* the length of the message goes here, when it is known */
+	msg = p + PB_MESSAGE_LEN_ROOM;
+	p = pb_field_varint(msg, MESSAGE_FIELD_TYPE, mtype);
+
+	/* socket_family, socket_protocol, query_address, query_port */
 #ifdef INET6
-	assert(ss->ss_family == AF_INET6 || ss->ss_family == AF_INET);
 	if (ss->ss_family == AF_INET6) {
 		struct sockaddr_in6 *s = (struct sockaddr_in6 *) ss;
-
-		/* socket_family */
-		dm->m.socket_family = DNSTAP__SOCKET_FAMILY__INET6;
-		dm->m.has_socket_family = 1;
-
-		/* addr: query_address or response_address */
-		addr->data = s->sin6_addr.s6_addr;
-		addr->len = 16; /* IPv6 */
-		*has_addr = 1;
-
-		/* port: query_port or response_port */
-		*port = ntohs(s->sin6_port);
-		*has_port = 1;
+		p = pb_field_varint(p, MESSAGE_FIELD_SOCKET_FAMILY,
+			SOCKET_FAMILY_INET6);
+		p = pb_field_varint(p, MESSAGE_FIELD_SOCKET_PROTOCOL,
+			is_tcp?SOCKET_PROTOCOL_TCP:SOCKET_PROTOCOL_UDP);
+		p = pb_field_bytes(p, MESSAGE_FIELD_QUERY_ADDRESS,
+			s->sin6_addr.s6_addr, 16);
+		p = pb_field_varint(p, MESSAGE_FIELD_QUERY_PORT,
+			ntohs(s->sin6_port));
 	} else if (ss->ss_family == AF_INET) {
 #else
 	if (ss->sin_family == AF_INET) {
 #endif /* INET6 */
 		struct sockaddr_in *s = (struct sockaddr_in *) ss;
-
-		/* socket_family */
-		dm->m.socket_family = DNSTAP__SOCKET_FAMILY__INET;
-		dm->m.has_socket_family = 1;
-
-		/* addr: query_address or response_address */
-		addr->data = (uint8_t *) &s->sin_addr.s_addr;
-		addr->len = 4; /* IPv4 */
-		*has_addr = 1;
-
-		/* port: query_port or response_port */
-		*port = ntohs(s->sin_port);
-		*has_port = 1;
+		p = pb_field_varint(p, MESSAGE_FIELD_SOCKET_FAMILY,
+			SOCKET_FAMILY_INET);
+		p = pb_field_varint(p, MESSAGE_FIELD_SOCKET_PROTOCOL,
+			is_tcp?SOCKET_PROTOCOL_TCP:SOCKET_PROTOCOL_UDP);
+		p = pb_field_bytes(p, MESSAGE_FIELD_QUERY_ADDRESS,
+			&s->sin_addr.s_addr, 4);
+		p = pb_field_varint(p, MESSAGE_FIELD_QUERY_PORT,
+			ntohs(s->sin_port));
+	} else {
+		p = pb_field_varint(p, MESSAGE_FIELD_SOCKET_PROTOCOL,
+			is_tcp?SOCKET_PROTOCOL_TCP:SOCKET_PROTOCOL_UDP);
 	}
 
-	if (!is_tcp) {
-		/* socket_protocol */
-		dm->m.socket_protocol = DNSTAP__SOCKET_PROTOCOL__UDP;
-		dm->m.has_socket_protocol = 1;
+	/* the fields are in order of field number, like protobuf-c packs
+	 * them */
+	if(mtype == MESSAGE_TYPE_AUTH_QUERY) {
+		p = pb_field_varint(p, MESSAGE_FIELD_QUERY_TIME_SEC,
+			(uint64_t)tv.tv_sec);
+		p = pb_field_fixed32(p, MESSAGE_FIELD_QUERY_TIME_NSEC,
+			(uint32_t)tv.tv_usec * 1000);
+		p = pb_field_bytes(p, MESSAGE_FIELD_QUERY_MESSAGE, pkt, pktlen);
+		if(zone)
+			p = pb_field_bytes(p, MESSAGE_FIELD_QUERY_ZONE, zone,
+				zonelen);
 	} else {
-		/* socket_protocol */
-		dm->m.socket_protocol = DNSTAP__SOCKET_PROTOCOL__TCP;
-		dm->m.has_socket_protocol = 1;
+		if(zone)
+			p = pb_field_bytes(p, MESSAGE_FIELD_QUERY_ZONE, zone,
+				zonelen);
+		p = pb_field_varint(p, MESSAGE_FIELD_RESPONSE_TIME_SEC,
+			(uint64_t)tv.tv_sec);
+		p = pb_field_fixed32(p, MESSAGE_FIELD_RESPONSE_TIME_NSEC,
+			(uint32_t)tv.tv_usec * 1000);
+		p = pb_field_bytes(p, MESSAGE_FIELD_RESPONSE_MESSAGE, pkt,
+			pktlen);
+	}
+
+	/* fill in the message length, and move the message up against it
+	 * if the length is shorter than the room for it */
+	msglen = (size_t)(p - msg);
+	lenlen = pb_varint_len(msglen);
+	(void)pb_varint(msg - PB_MESSAGE_LEN_ROOM, msglen);
+	if(lenlen < PB_MESSAGE_LEN_ROOM) {
+		memmove(msg - PB_MESSAGE_LEN_ROOM + lenlen, msg, msglen);
+		p -= PB_MESSAGE_LEN_ROOM - lenlen;
 	}
+	p = pb_field_varint(p, DNSTAP_FIELD_TYPE, DNSTAP_TYPE_MESSAGE);
+
+	write_uint32(frame, (uint32_t)(p - frame - 4));
+	env->len_buf += (size_t)(p - frame);
 }
 
 void
@@ -357,36 +826,8 @@ dt_msg_send_auth_query(struct dt_env *env,
 #endif
 	int is_tcp, uint8_t* zone, size_t zonelen, uint8_t* pkt, size_t pktlen)
 {
-	struct dt_msg dm;
-	struct timeval qtime;
-
-	gettimeofday(&qtime, NULL);
-
-	/* type */
-	dt_msg_init(env, &dm, DNSTAP__MESSAGE__TYPE__AUTH_QUERY);
-
-	if(zone) {
-		/* query_zone */
-		dm.m.query_zone.data = zone;
-		dm.m.query_zone.len = zonelen;
-		dm.m.has_query_zone = 1;
-	}
-
-	/* query_time */
-	dt_fill_timeval(&qtime,
-			&dm.m.query_time_sec, &dm.m.has_query_time_sec,
-			&dm.m.query_time_nsec, &dm.m.has_query_time_nsec);
-
-	/* query_message */
-	dt_fill_buffer(pkt, pktlen, &dm.m.query_message, &dm.m.has_query_message);
-
-	/* socket_family, socket_protocol, query_address, query_port */
-	dt_msg_fill_net(&dm, addr, is_tcp,
-			&dm.m.query_address, &dm.m.has_query_address,
-			&dm.m.query_port, &dm.m.has_query_port);
-
-	if (dt_pack(&dm.d, &dm.buf, &dm.len_buf))
-		dt_send(env, dm.buf, dm.len_buf);
+	dt_msg_frame(env, MESSAGE_TYPE_AUTH_QUERY, addr, is_tcp, zone,
+		zonelen, pkt, pktlen);
 }
 
 void
@@ -398,36 +839,8 @@ dt_msg_send_auth_response(struct dt_env *env,
 #endif
 	int is_tcp, uint8_t* zone, size_t zonelen, uint8_t* pkt, size_t pktlen)
 {
-	struct dt_msg dm;
-	struct timeval rtime;
-
-	gettimeofday(&rtime, NULL);
-
-	/* type */
-	dt_msg_init(env, &dm, DNSTAP__MESSAGE__TYPE__AUTH_RESPONSE);
-
-	if(zone) {
-		/* query_zone */
-		dm.m.query_zone.data = zone;
-		dm.m.query_zone.len = zonelen;
-		dm.m.has_query_zone = 1;
-	}
-
-	/* response_time */
-	dt_fill_timeval(&rtime,
-			&dm.m.response_time_sec, &dm.m.has_response_time_sec,
-			&dm.m.response_time_nsec, &dm.m.has_response_time_nsec);
-
-	/* response_message */
-	dt_fill_buffer(pkt, pktlen, &dm.m.response_message, &dm.m.has_response_message);
-
-	/* socket_family, socket_protocol, query_address, query_port */
-	dt_msg_fill_net(&dm, addr, is_tcp,
-			&dm.m.query_address, &dm.m.has_query_address,
-			&dm.m.query_port, &dm.m.has_query_port);
-
-	if (dt_pack(&dm.d, &dm.buf, &dm.len_buf))
-		dt_send(env, dm.buf, dm.len_buf);
+	dt_msg_frame(env, MESSAGE_TYPE_AUTH_RESPONSE, addr, is_tcp, zone,
+		zonelen, pkt, pktlen);
 }
 
 #endif /* USE_DNSTAP */
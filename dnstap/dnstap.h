@@ -40,16 +40,22 @@
 #ifdef USE_DNSTAP
 
 struct nsd_options;
-struct fstrm_io;
-struct fstrm_queue;
 
-struct dt_env {
-	/** dnstap I/O thread */
-	struct fstrm_iothr *iothr;
-
-	/** dnstap I/O thread input queue */
-	struct fstrm_iothr_queue *ioq;
+/** size of the output buffer with frames for the dnstap socket or file */
+#define DNSTAP_OUTPUT_BUFFER_SIZE (1024*1024)
+/** seconds between attempts to reconnect to the dnstap socket */
+#define DNSTAP_REOPEN_INTERVAL 5
+/** seconds for the connect and the handshake with the socket reader */
+#define DNSTAP_CONNECT_TIMEOUT 5
+/** seconds that the close waits for the socket to take the frames */
+#define DNSTAP_CLOSE_TIMEOUT 2
+/** max length of a frame streams control frame that is read */
+#define DNSTAP_CONTROL_FRAME_MAX 512
+/** dnstap socket is connecting, and waits to write, or to read the reply */
+#define DT_CONNECT_WANT_WRITE 1
+#define DT_CONNECT_WANT_READ 2
 
+struct dt_env {
 	/** dnstap "identity" field, NULL if disabled */
 	char *identity;
 
@@ -66,21 +72,53 @@ struct dt_env {
 	unsigned log_auth_query_messages : 1;
 	/** whether to log Message/AUTH_RESPONSE */
 	unsigned log_auth_response_messages : 1;
+
+	/** path of the dnstap socket, NULL when writing to a file */
+	char *socket_path;
+	/** path of the dnstap file, NULL when writing to the socket */
+	char *file_path;
+	/** rotate the file when it has grown to this size, 0 for never */
+	uint64_t file_size;
+	/** number of bytes written to the current file */
+	uint64_t file_written;
+	/** the socket or file descriptor, -1 if not open */
+	int fd;
+	/** time of the last attempt to open the output */
+	time_t open_time;
+	/** the socket is connecting, DT_CONNECT_WANT_WRITE or _READ, or 0 */
+	int connecting;
+	/** the part of the handshake reply that is read */
+	uint8_t handshake[DNSTAP_CONTROL_FRAME_MAX];
+	/** length of the handshake reply that is read */
+	size_t handshake_len;
+
+	/** the encoded identity and version fields, they start every frame */
+	uint8_t *prefix;
+	/** length of the prefix */
+	size_t len_prefix;
+
+	/** the frames that wait to be written, flushed in one write */
+	uint8_t *buf;
+	/** number of bytes in buf */
+	size_t len_buf;
+	/** number of frames dropped because the output could not keep up */
+	size_t dropped;
 };
 
 /**
  * Create dnstap environment object. Afterwards, call dt_apply_cfg() to fill in
- * the config variables and dt_init() to fill in the per-worker state. Each
- * worker needs a copy of this object but with its own I/O queue (the fq field
- * of the structure) to ensure lock-free access to its own per-worker circular
- * queue.  Duplicate the environment object if more than one worker needs to
- * share access to the dnstap I/O socket.
- * @param socket_path: path to dnstap logging socket, must be non-NULL.
- * @param num_workers: number of worker threads, must be > 0.
+ * the config variables and dt_init() to open the output.  The messages are
+ * encoded into frames in the output buffer, and written to the dnstap socket
+ * or file in one write when dt_flush() is called.
+ * @param socket_path: path to dnstap logging socket, or NULL.
+ * @param file_path: path to dnstap log file, or NULL.  One of the paths must
+ *	be non-NULL, the file is used if both are given.
+ * @param file_size: size in bytes after which the file is rotated, 0 to
+ *	never rotate it.
  * @return dt_env object, NULL on failure.
  */
 struct dt_env *
-dt_create(const char *socket_path, unsigned num_workers);
+dt_create(const char *socket_path, const char *file_path, uint64_t file_size);
 
 /**
  * Apply config settings.
@@ -91,7 +129,8 @@ void
 dt_apply_cfg(struct dt_env *env, struct nsd_options *cfg);
 
 /**
- * Initialize per-worker state in dnstap environment object.
+ * Open the dnstap socket or file of the dnstap environment object.  If that
+ * fails, it is attempted again by dt_flush().
  * @param env: dnstap environment object to initialize, created with dt_create().
  * @return: true on success, false on failure.
  */
@@ -99,14 +138,42 @@ int
 dt_init(struct dt_env *env);
 
 /**
- * Delete dnstap environment object. Closes dnstap I/O socket and deletes all
- * per-worker I/O queues.
+ * Continue the connect and frame streams handshake of the dnstap socket,
+ * when env->connecting says the socket is ready to write or read.  If it
+ * fails the socket is closed and tried again later by dt_flush().
+ * @param env: dnstap environment object.
+ */
+void
+dt_connect_continue(struct dt_env *env);
+
+/**
+ * The connect or handshake of the dnstap socket took too long, close it,
+ * it is tried again later by dt_flush().
+ * @param env: dnstap environment object.
+ */
+void
+dt_connect_timeout(struct dt_env *env);
+
+/**
+ * Delete dnstap environment object. Flushes the output buffer, and stops
+ * and closes the dnstap socket or file.
  */
 void
 dt_delete(struct dt_env *env);
 
 /**
- * Create and send a new dnstap "Message" event of type AUTH_QUERY.
+ * Write the frames in the output buffer to the dnstap socket or file.  It
+ * does not block on the socket, what cannot be written is kept for later.
+ * Reopens the output if it was closed, and rotates the file if it is large.
+ * A socket is connected without blocking, see env->connecting.
+ * @param env: dnstap environment object.
+ */
+void
+dt_flush(struct dt_env *env);
+
+/**
+ * Create a new dnstap "Message" event of type AUTH_QUERY, and put it in the
+ * output buffer.  It is dropped if the buffer is full.
  * @param env: dnstap environment object.
  * @param addr: address/port of client.
  * @param is_tcp: true for tcp, false for udp.
@@ -125,7 +192,8 @@ dt_msg_send_auth_query(struct dt_env *env,
 	int is_tcp, uint8_t* zone, size_t zonelen, uint8_t* pkt, size_t pktlen);
 
 /**
- * Create and send a new dnstap "Message" event of type AUTH_RESPONSE.
+ * Create a new dnstap "Message" event of type AUTH_RESPONSE, and put it in
+ * the output buffer.  It is dropped if the buffer is full.
  * @param env: dnstap environment object.
  * @param addr: address/port of client.
  * @param is_tcp: true for tcp, false for udp.
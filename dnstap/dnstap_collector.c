@@ -10,9 +10,20 @@
 #include "config.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS   MAP_ANON
+#endif
+#endif /* HAVE_MMAP */
 #ifndef USE_MINI_EVENT
 #  ifdef HAVE_EVENT_H
 #    include <event.h>
@@ -32,6 +43,122 @@
 #include "buffer.h"
 #include "namedb.h"
 #include "options.h"
+#include "query.h"
+
+/* full memory barrier between the worker and collector that share a ring,
+ * it orders the message data against the head and tail positions */
+#if defined(__GNUC__) || defined(__clang__)
+#define dt_ring_barrier() __sync_synchronize()
+#define dt_ring_cas(p, o, n) __sync_bool_compare_and_swap(p, o, n)
+#else
+#define dt_ring_barrier() /* the volatile positions have to do */
+#define dt_ring_cas(p, o, n) (*(p) = (n), 1)
+#endif
+
+/* map the shared memory rings, before the fork of the collector and the
+ * workers, so they are shared between those processes */
+static void
+dt_collector_map_rings(struct dt_collector* dt_col)
+{
+#ifdef HAVE_MMAP
+	int i;
+	dt_col->rings = (struct dt_ring**)xalloc_array_zero(dt_col->count*DT_RINGS_PER_WORKER,
+		sizeof(struct dt_ring*));
+	for(i=0; i<dt_col->count*DT_RINGS_PER_WORKER; i++) {
+		void* p = mmap(NULL, sizeof(struct dt_ring),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED) {
+			log_msg(LOG_ERR, "dnstap collector: mmap failed: %s, "
+				"using pipes", strerror(errno));
+			while(i > 0) {
+				i--;
+				munmap(dt_col->rings[i], sizeof(struct dt_ring));
+			}
+			free(dt_col->rings);
+			dt_col->rings = NULL;
+			return;
+		}
+		dt_col->rings[i] = (struct dt_ring*)p;
+		/* the positions start at zero, anonymous maps are zeroed */
+	}
+#else
+	dt_col->rings = NULL;
+#endif /* HAVE_MMAP */
+}
+
+/* names of the rcodes for the dnstap-log-rcodes option */
+static const char* dt_rcode_names[] = {"NOERROR", "FORMERR", "SERVFAIL",
+	"NXDOMAIN", "NOTIMP", "REFUSED", "YXDOMAIN", "YXRRSET", "NXRRSET",
+	"NOTAUTH", "NOTZONE"};
+
+/* parse the rcode name or number, returns -1 if it is not known */
+static int
+dt_parse_rcode(const char* str)
+{
+	size_t i;
+	char* end;
+	long rc;
+	for(i=0; i<sizeof(dt_rcode_names)/sizeof(dt_rcode_names[0]); i++) {
+		if(strcasecmp(str, dt_rcode_names[i]) == 0)
+			return (int)i;
+	}
+	if(!isdigit((unsigned char)str[0]))
+		return -1;
+	/* the whole string is the number, "5x" is not rcode 5 */
+	rc = strtol(str, &end, 10);
+	if(*end != 0 || rc > 15)
+		return -1;
+	return (int)rc;
+}
+
+/* setup the filters that the workers use, from the config */
+static void
+dt_collector_setup_filters(struct dt_collector* dt_col, struct nsd* nsd)
+{
+	char buf[1024], *tok, *next;
+	dt_col->sample_rate = (nsd->options->dnstap_sample_rate > 1)?
+		(uint32_t)nsd->options->dnstap_sample_rate:0;
+	dt_col->sample_left = 1;
+	dt_col->rrl_only = nsd->options->dnstap_log_rrl_only;
+	if(nsd->options->dnstap_log_qtypes &&
+		nsd->options->dnstap_log_qtypes[0]) {
+		dt_col->qtypes = (uint8_t*)region_alloc_zero(dt_col->region,
+			65536/8);
+		strlcpy(buf, nsd->options->dnstap_log_qtypes, sizeof(buf));
+		for(tok = buf; tok && *tok; tok = next) {
+			uint16_t t;
+			next = strchr(tok, ' ');
+			if(next)
+				*next++ = 0;
+			if(*tok == 0)
+				continue;
+			if((t = rrtype_from_string(tok)) == 0) {
+				log_msg(LOG_ERR, "dnstap-log-qtypes: unknown "
+					"type %s", tok);
+				continue;
+			}
+			dt_col->qtypes[t>>3] |= (1<<(t&7));
+		}
+	}
+	if(nsd->options->dnstap_log_rcodes &&
+		nsd->options->dnstap_log_rcodes[0]) {
+		strlcpy(buf, nsd->options->dnstap_log_rcodes, sizeof(buf));
+		for(tok = buf; tok && *tok; tok = next) {
+			int rc;
+			next = strchr(tok, ' ');
+			if(next)
+				*next++ = 0;
+			if(*tok == 0)
+				continue;
+			if((rc = dt_parse_rcode(tok)) == -1) {
+				log_msg(LOG_ERR, "dnstap-log-rcodes: unknown "
+					"rcode %s", tok);
+				continue;
+			}
+			dt_col->rcodes |= ((uint32_t)1<<rc);
+		}
+	}
+}
 
 struct dt_collector* dt_collector_create(struct nsd* nsd)
 {
@@ -73,6 +200,8 @@ struct dt_collector* dt_collector_create(struct nsd* nsd)
 		nsd->dt_collector_fd_recv[i] = fd[0];
 		nsd->dt_collector_fd_send[i] = fd[1];
 	}
+	dt_collector_map_rings(dt_col);
+	dt_collector_setup_filters(dt_col, nsd);
 
 	/* open socketpair */
 	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
@@ -94,6 +223,15 @@ struct dt_collector* dt_collector_create(struct nsd* nsd)
 void dt_collector_destroy(struct dt_collector* dt_col, struct nsd* nsd)
 {
 	if(!dt_col) return;
+#ifdef HAVE_MMAP
+	if(dt_col->rings) {
+		int i;
+		for(i=0; i<dt_col->count*DT_RINGS_PER_WORKER; i++)
+			munmap(dt_col->rings[i], sizeof(struct dt_ring));
+		free(dt_col->rings);
+		dt_col->rings = NULL;
+	}
+#endif
 	free(nsd->dt_collector_fd_recv);
 	nsd->dt_collector_fd_recv = NULL;
 	free(nsd->dt_collector_fd_send);
@@ -137,6 +275,106 @@ dt_handle_cmd_from_nsd(int ATTR_UNUSED(fd), short event, void* arg)
 	}
 }
 
+/* add the flush timer */
+static void
+dt_flush_timer_add(struct dt_collector* dt_col)
+{
+	struct timeval tv;
+	tv.tv_sec = DT_COLLECTOR_FLUSH_INTERVAL;
+	tv.tv_usec = 0;
+	if(event_add(dt_col->flush_event, &tv) != 0)
+		log_msg(LOG_ERR, "dnstap collector: event_add failed");
+}
+
+static void dt_handle_output(int fd, short event, void* arg);
+
+/* what the dnstap socket waits for, the connect and handshake, or to take
+ * the frames that are left, 0 for nothing */
+static int
+dt_collector_output_want(struct dt_env* env)
+{
+	if(!env || env->fd == -1)
+		return 0;
+	if(env->connecting)
+		return env->connecting;
+	/* a file takes all the frames, a socket can be full */
+	if(!env->file_path && env->len_buf != 0)
+		return DT_OUTPUT_WANT_FLUSH;
+	return 0;
+}
+
+/* wait for the dnstap socket if it is connecting, or if it has not taken
+ * all the frames, so that the connect, the handshake and the output do not
+ * block the collector */
+static void
+dt_collector_watch_output(struct dt_collector* dt_col)
+{
+	struct dt_env* env = dt_col->dt_env;
+	int want = dt_collector_output_want(env);
+	struct timeval tv;
+	if(dt_col->output_want && (want != dt_col->output_want ||
+		env->fd != dt_col->output_fd)) {
+		event_del(dt_col->output_event);
+		dt_col->output_want = 0;
+	}
+	if(!want || dt_col->output_want)
+		return;
+	event_set(dt_col->output_event, env->fd,
+		want==DT_CONNECT_WANT_READ?EV_READ:EV_WRITE,
+		dt_handle_output, dt_col);
+	if(event_base_set(dt_col->event_base, dt_col->output_event) != 0)
+		log_msg(LOG_ERR, "dnstap collector: event_base_set failed");
+	tv.tv_sec = DNSTAP_CONNECT_TIMEOUT;
+	tv.tv_usec = 0;
+	/* the flush timer retries the output, there is no timeout for it */
+	if(event_add(dt_col->output_event,
+		want==DT_OUTPUT_WANT_FLUSH?NULL:&tv) != 0) {
+		log_msg(LOG_ERR, "dnstap collector: event_add failed");
+		return;
+	}
+	dt_col->output_want = want;
+	dt_col->output_fd = env->fd;
+}
+
+/* write the output buffer, and watch the dnstap socket */
+static void
+dt_collector_flush(struct dt_collector* dt_col)
+{
+	if(dt_col->dt_env)
+		dt_flush(dt_col->dt_env);
+	dt_collector_watch_output(dt_col);
+}
+
+/* the dnstap socket that is connecting can continue, or timed out, or it
+ * can take the frames that are left */
+static void
+dt_handle_output(int ATTR_UNUSED(fd), short event, void* arg)
+{
+	struct dt_collector* dt_col = (struct dt_collector*)arg;
+	int want = dt_col->output_want;
+	dt_col->output_want = 0;
+	if(!dt_col->dt_env)
+		return;
+	if(want != DT_OUTPUT_WANT_FLUSH) {
+		if((event&EV_TIMEOUT))
+			dt_connect_timeout(dt_col->dt_env);
+		else	dt_connect_continue(dt_col->dt_env);
+	}
+	/* write the frames that waited */
+	dt_collector_flush(dt_col);
+}
+
+/* timer to write what is left in the output buffer, and to reopen the
+ * output if it was closed */
+static void
+dt_handle_flush_timer(int ATTR_UNUSED(fd), short ATTR_UNUSED(event),
+	void* arg)
+{
+	struct dt_collector* dt_col = (struct dt_collector*)arg;
+	dt_collector_flush(dt_col);
+	dt_flush_timer_add(dt_col);
+}
+
 /* read data from fd into buffer, true when message is complete */
 static int read_into_buffer(int fd, struct buffer* buf)
 {
@@ -235,11 +473,121 @@ dt_submit_content(struct dt_env* dt_env, struct buffer* buf)
 	}
 }
 
+/* copy len bytes at ring position pos to dest */
+static void
+dt_ring_copy_out(struct dt_ring* ring, uint32_t pos, uint8_t* dest,
+	size_t len)
+{
+	size_t off = pos & (DT_RING_SIZE-1);
+	size_t part = DT_RING_SIZE - off;
+	if(part > len)
+		part = len;
+	memcpy(dest, ring->data+off, part);
+	if(part < len)
+		memcpy(dest+part, ring->data, len-part);
+}
+
+/* read the next message from the ring into the buffer, true if a message
+ * was read.  The buffer is flipped, like read_into_buffer does. */
+static int
+dt_ring_read(struct dt_ring* ring, struct buffer* buf)
+{
+	uint32_t tail = ring->tail;
+	uint32_t head = ring->head;
+	uint32_t msglen;
+	dt_ring_barrier();
+	if(head - tail < 4)
+		return 0;
+	buffer_clear(buf);
+	dt_ring_copy_out(ring, tail, buffer_begin(buf), 4);
+	msglen = buffer_read_u32_at(buf, 0);
+	if(msglen > head - tail - 4 || msglen + 4 > buffer_capacity(buf)) {
+		/* the worker only publishes whole messages, skip the
+		 * contents, it is not usable */
+		log_msg(LOG_ERR, "dnstap collector: bad message in ring, "
+			"dropped %u bytes", (unsigned)(head - tail));
+		dt_ring_barrier();
+		ring->tail = head;
+		return 0;
+	}
+	dt_ring_copy_out(ring, tail+4, buffer_at(buf, 4), msglen);
+	buffer_set_position(buf, 4+msglen);
+	buffer_flip(buf);
+	/* the data is copied out, before the space is given back */
+	dt_ring_barrier();
+	ring->tail = tail + 4 + msglen;
+	return 1;
+}
+
+/* drain the messages from the rings of a worker, in one batch */
+static void
+dt_drain_rings(struct dt_collector_input* dt_input)
+{
+	struct dt_collector* dt_col = dt_input->dt_collector;
+	struct dt_ring* ring[DT_RINGS_PER_WORKER];
+	int num = 0, j, empty;
+	for(j=0; j<DT_RINGS_PER_WORKER; j++)
+		ring[j] = dt_col->rings[j*dt_col->count + dt_input->num];
+	while(1) {
+		int got = 0;
+		for(j=0; j<DT_RINGS_PER_WORKER; j++) {
+			while(num < DT_RING_MAX_DRAIN &&
+				dt_ring_read(ring[j], dt_input->buffer)) {
+				got = 1;
+				num++;
+				if(dt_col->dt_env)
+					dt_submit_content(dt_col->dt_env,
+						dt_input->buffer);
+			}
+		}
+		if(num >= DT_RING_MAX_DRAIN) {
+			/* service the other events, and continue with this
+			 * one after that, the byte wakes us up again */
+			uint8_t b = 0;
+			if(write(dt_input->wake_fd, &b, 1) == -1 &&
+				errno != EAGAIN && errno != EINTR)
+				log_msg(LOG_ERR, "dnstap collector: write "
+					"failed: %s", strerror(errno));
+			break;
+		}
+		if(got)
+			continue;
+		/* the rings are empty, ask the worker to wake us up, and check
+		 * again for messages that were put in before it saw that */
+		for(j=0; j<DT_RINGS_PER_WORKER; j++)
+			ring[j]->sleeping = 1;
+		dt_ring_barrier();
+		empty = 1;
+		for(j=0; j<DT_RINGS_PER_WORKER; j++)
+			if(ring[j]->head != ring[j]->tail)
+				empty = 0;
+		if(empty)
+			break;
+		for(j=0; j<DT_RINGS_PER_WORKER; j++)
+			ring[j]->sleeping = 0;
+	}
+	VERBOSITY(4, (LOG_INFO, "dnstap collector: drained %d msgs from "
+		"worker %d", num, dt_input->num));
+	/* write the batch */
+	dt_collector_flush(dt_col);
+}
+
 /* handle input from worker for dnstap */
 void
 dt_handle_input(int fd, short event, void* arg)
 {
 	struct dt_collector_input* dt_input = (struct dt_collector_input*)arg;
+	if((event&EV_READ) != 0 && dt_input->dt_collector->rings) {
+		/* the pipe is only used to wake us up, read the bytes that
+		 * the worker wrote to it, and then drain the rings */
+		uint8_t wake[512];
+		if(read(fd, wake, sizeof(wake)) == -1 && errno != EAGAIN &&
+			errno != EINTR)
+			log_msg(LOG_ERR, "dnstap collector: read failed: %s",
+				strerror(errno));
+		dt_drain_rings(dt_input);
+		return;
+	}
 	if((event&EV_READ) != 0) {
 		/* read */
 		if(!read_into_buffer(fd, dt_input->buffer))
@@ -251,6 +599,7 @@ dt_handle_input(int fd, short event, void* arg)
 		if(dt_input->dt_collector->dt_env) {
 			dt_submit_content(dt_input->dt_collector->dt_env,
 				dt_input->buffer);
+			dt_collector_flush(dt_input->dt_collector);
 		}
 		
 		/* clear buffer for next message */
@@ -261,7 +610,6 @@ dt_handle_input(int fd, short event, void* arg)
 /* init dnstap */
 static void dt_init_dnstap(struct dt_collector* dt_col, struct nsd* nsd)
 {
-	int num_workers = 1;
 #ifdef HAVE_CHROOT
 	if(nsd->chrootdir && nsd->chrootdir[0]) {
 		int l = strlen(nsd->chrootdir)-1; /* ends in trailing slash */
@@ -270,9 +618,20 @@ static void dt_init_dnstap(struct dt_collector* dt_col, struct nsd* nsd)
 			strncmp(nsd->options->dnstap_socket_path,
 				nsd->chrootdir, l) == 0)
 			nsd->options->dnstap_socket_path += l;
+		if (nsd->options->dnstap_file_path &&
+			nsd->options->dnstap_file_path[0] == '/' &&
+			strncmp(nsd->options->dnstap_file_path,
+				nsd->chrootdir, l) == 0)
+			nsd->options->dnstap_file_path += l;
 	}
 #endif
-	dt_col->dt_env = dt_create(nsd->options->dnstap_socket_path, num_workers);
+	if(nsd->options->dnstap_file_path &&
+		nsd->options->dnstap_file_path[0])
+		dt_col->dt_env = dt_create(NULL,
+			nsd->options->dnstap_file_path,
+			(uint64_t)nsd->options->dnstap_file_size);
+	else	dt_col->dt_env = dt_create(nsd->options->dnstap_socket_path,
+			NULL, 0);
 	if(!dt_col->dt_env) {
 		log_msg(LOG_ERR, "could not create dnstap env");
 		return;
@@ -285,8 +644,11 @@ static void dt_init_dnstap(struct dt_collector* dt_col, struct nsd* nsd)
 static void dt_collector_cleanup(struct dt_collector* dt_col, struct nsd* nsd)
 {
 	int i;
+	if(dt_col->output_want)
+		event_del(dt_col->output_event);
 	dt_delete(dt_col->dt_env);
 	event_del(dt_col->cmd_event);
+	event_del(dt_col->flush_event);
 	for(i=0; i<dt_col->count; i++) {
 		event_del(dt_col->inputs[i].event);
 	}
@@ -294,6 +656,8 @@ static void dt_collector_cleanup(struct dt_collector* dt_col, struct nsd* nsd)
 	event_base_free(dt_col->event_base);
 #ifdef MEMCLEAN
 	free(dt_col->cmd_event);
+	free(dt_col->flush_event);
+	free(dt_col->output_event);
 	if(dt_col->inputs) {
 		for(i=0; i<dt_col->count; i++) {
 			free(dt_col->inputs[i].event);
@@ -323,12 +687,27 @@ static void dt_attach_events(struct dt_collector* dt_col, struct nsd* nsd)
 		log_msg(LOG_ERR, "dnstap collector: event_base_set failed");
 	if(event_add(dt_col->cmd_event, NULL) != 0)
 		log_msg(LOG_ERR, "dnstap collector: event_add failed");
+
+	/* add flush timer */
+	dt_col->flush_event = (struct event*)xalloc_zero(
+		sizeof(*dt_col->flush_event));
+	event_set(dt_col->flush_event, -1, 0, dt_handle_flush_timer, dt_col);
+	if(event_base_set(dt_col->event_base, dt_col->flush_event) != 0)
+		log_msg(LOG_ERR, "dnstap collector: event_base_set failed");
+	dt_flush_timer_add(dt_col);
+
+	/* the output event is set when the dnstap socket connects, or is full */
+	dt_col->output_event = (struct event*)xalloc_zero(
+		sizeof(*dt_col->output_event));
+	dt_collector_watch_output(dt_col);
 	
 	/* add worker input handlers */
 	dt_col->inputs = xalloc_array_zero(dt_col->count,
 		sizeof(*dt_col->inputs));
 	for(i=0; i<dt_col->count; i++) {
 		dt_col->inputs[i].dt_collector = dt_col;
+		dt_col->inputs[i].num = i;
+		dt_col->inputs[i].wake_fd = nsd->dt_collector_fd_send[i];
 		dt_col->inputs[i].event = (struct event*)xalloc_zero(
 			sizeof(struct event));
 		event_set(dt_col->inputs[i].event,
@@ -396,6 +775,82 @@ void dt_collector_start(struct dt_collector* dt_col, struct nsd* nsd)
 	}
 }
 
+struct dt_ring* dt_collector_claim_ring(struct dt_collector* dt_col, int num)
+{
+	int j;
+	for(j=0; j<DT_RINGS_PER_WORKER; j++) {
+		struct dt_ring* ring = dt_col->rings[j*dt_col->count + num];
+		pid_t owner = ring->owner;
+		/* a zombie, or a reused pid, keeps the ring in use, and
+		 * that only wastes it until the next try */
+		if(owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH))
+			continue;
+		/* the other new worker of this number, after another
+		 * reload, can try to claim it at the same time */
+		if(dt_ring_cas(&ring->owner, owner, getpid()))
+			return ring;
+	}
+	return NULL;
+}
+
+/* get the qtype from the question of the query packet, -1 if it cannot
+ * be read.  The query is not parsed yet. */
+static int
+dt_packet_qtype(struct buffer* packet)
+{
+	size_t pos = QHEADERSZ;
+	size_t limit = buffer_limit(packet);
+	uint8_t* d = buffer_begin(packet);
+	if(limit < QHEADERSZ || QDCOUNT(packet) != 1)
+		return -1;
+	/* skip the qname labels */
+	while(pos < limit && d[pos] != 0) {
+		if((d[pos]&0xc0))
+			return -1; /* no compression in the query name */
+		pos += d[pos]+1;
+	}
+	if(pos+3 > limit)
+		return -1;
+	return (int)read_uint16(d+pos+1);
+}
+
+int dt_collector_select_query(struct nsd* nsd, struct query* q)
+{
+	struct dt_collector* dt_col = nsd->dt_collector;
+	q->dnstap_log = 0;
+	q->dnstap_rrl = 0;
+	if(!dt_col)
+		return 0;
+	if(dt_col->qtypes) {
+		int t = dt_packet_qtype(q->packet);
+		if(t == -1 || !(dt_col->qtypes[t>>3] & (1<<(t&7))))
+			return 0;
+	}
+	if(dt_col->sample_rate) {
+		/* one in sample_rate of the queries that pass the filter */
+		if(--dt_col->sample_left != 0)
+			return 0;
+		dt_col->sample_left = dt_col->sample_rate;
+	}
+	q->dnstap_log = 1;
+	return 1;
+}
+
+int dt_collector_select_response(struct nsd* nsd, struct query* q)
+{
+	struct dt_collector* dt_col = nsd->dt_collector;
+	if(!q->dnstap_log)
+		return 0;
+	if(q->zone && q->zone->opts && !q->zone->opts->pattern->dnstap_log)
+		return 0;
+	if(dt_col->rcodes && !(dt_col->rcodes & ((uint32_t)1<<RCODE(
+		q->packet))))
+		return 0;
+	if(dt_col->rrl_only && !q->dnstap_rrl)
+		return 0;
+	return 1;
+}
+
 /* put data for sending to the collector process into the buffer */
 static int
 prep_send_data(struct buffer* buf, uint8_t is_response,
@@ -435,8 +890,9 @@ prep_send_data(struct buffer* buf, uint8_t is_response,
 	return 1;
 }
 
-/* attempt to write buffer to socket, if it blocks do not write it. */
-static void attempt_to_write(int s, uint8_t* data, size_t len)
+/* attempt to write buffer to socket, if it blocks do not write it.
+ * returns false if the message is dropped. */
+static int attempt_to_write(int s, uint8_t* data, size_t len)
 {
 	size_t total = 0;
 	ssize_t r;
@@ -447,14 +903,14 @@ static void attempt_to_write(int s, uint8_t* data, size_t len)
 				/* on first write part, check if pipe is full,
 				 * if the nonblocking fd blocks, then drop
 				 * the message */
-				return;
+				return 0;
 			}
 			if(errno != EAGAIN && errno != EINTR) {
 				/* some sort of error, print it and drop it */
 				log_msg(LOG_ERR,
 					"dnstap collector: write failed: %s",
 					strerror(errno));
-				return;
+				return 0;
 			}
 			/* continue and write this again */
 			/* for EINTR, we have to do this,
@@ -466,6 +922,76 @@ static void attempt_to_write(int s, uint8_t* data, size_t len)
 		}
 		total += r;
 	}
+	return 1;
+}
+
+/* put the message in the ring of this worker.  returns false if the ring
+ * is full and the message is dropped. */
+static int
+dt_ring_write(struct dt_ring* ring, int wake_fd, uint8_t* data, size_t len)
+{
+	uint32_t head = ring->head;
+	size_t off, part;
+	dt_ring_barrier();
+	if(len > DT_RING_SIZE - (head - ring->tail))
+		return 0;
+	off = head & (DT_RING_SIZE-1);
+	part = DT_RING_SIZE - off;
+	if(part > len)
+		part = len;
+	memcpy(ring->data+off, data, part);
+	if(part < len)
+		memcpy(ring->data, data+part, len-part);
+	/* publish the message after its data is in place */
+	dt_ring_barrier();
+	ring->head = head + len;
+	dt_ring_barrier();
+	if(ring->sleeping) {
+		/* the collector has drained the ring, wake it up */
+		uint8_t b = 0;
+		ring->sleeping = 0;
+		if(write(wake_fd, &b, 1) == -1 && errno != EAGAIN &&
+			errno != EINTR)
+			log_msg(LOG_ERR, "dnstap collector: write failed: %s",
+				strerror(errno));
+	}
+	return 1;
+}
+
+/* send the message in the send buffer to the collector */
+static void
+dt_collector_send(struct nsd* nsd)
+{
+	struct dt_collector* dt_col = nsd->dt_collector;
+	int num = nsd->this_child->child_num;
+	int sent;
+	if(dt_col->rings) {
+		if(!dt_col->ring && time(NULL) >= dt_col->ring_retry) {
+			dt_col->ring = dt_collector_claim_ring(dt_col, num);
+			if(!dt_col->ring && dt_col->ring_retry == 0)
+				log_msg(LOG_WARNING, "dnstap: the workers of "
+					"earlier reloads use the rings of "
+					"worker %d, messages are dropped "
+					"until they exit", num);
+			dt_col->ring_retry = time(NULL) + DT_RING_RETRY;
+		}
+		if(!dt_col->ring) {
+			STATUP(nsd, dnstap_dropped);
+			return;
+		}
+		sent = dt_ring_write(dt_col->ring,
+			nsd->dt_collector_fd_send[num],
+			buffer_begin(dt_col->send_buffer),
+			buffer_remaining(dt_col->send_buffer));
+	} else {
+		/* attempt to send data; do not block */
+		sent = attempt_to_write(nsd->dt_collector_fd_send[num],
+			buffer_begin(dt_col->send_buffer),
+			buffer_remaining(dt_col->send_buffer));
+	}
+	if(!sent) {
+		STATUP(nsd, dnstap_dropped);
+	}
 }
 
 void dt_collector_submit_auth_query(struct nsd* nsd,
@@ -485,10 +1011,7 @@ void dt_collector_submit_auth_query(struct nsd* nsd,
 		is_tcp, packet, NULL))
 		return; /* probably did not fit in buffer */
 
-	/* attempt to send data; do not block */
-	attempt_to_write(nsd->dt_collector_fd_send[nsd->this_child->child_num],
-		buffer_begin(nsd->dt_collector->send_buffer),
-		buffer_remaining(nsd->dt_collector->send_buffer));
+	dt_collector_send(nsd);
 }
 
 void dt_collector_submit_auth_response(struct nsd* nsd,
@@ -509,8 +1032,5 @@ void dt_collector_submit_auth_response(struct nsd* nsd,
 		is_tcp, packet, zone))
 		return; /* probably did not fit in buffer */
 
-	/* attempt to send data; do not block */
-	attempt_to_write(nsd->dt_collector_fd_send[nsd->this_child->child_num],
-		buffer_begin(nsd->dt_collector->send_buffer),
-		buffer_remaining(nsd->dt_collector->send_buffer));
+	dt_collector_send(nsd);
 }
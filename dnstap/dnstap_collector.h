@@ -17,6 +17,25 @@ struct dt_collector_input;
 struct zone;
 struct buffer;
 struct region;
+struct dt_ring;
+struct query;
+
+/* size in bytes of the shared memory ring per worker, a power of two */
+#define DT_RING_SIZE (512*1024)
+/* number of rings per worker, the new workers, the ones that quit after a
+ * reload and those of the reload before that can all be alive */
+#define DT_RINGS_PER_WORKER 3
+/* seconds between attempts of a worker without a ring to claim one */
+#define DT_RING_RETRY 1
+/* max number of messages the collector drains from the rings of one
+ * worker, before it returns to the event loop */
+#define DT_RING_MAX_DRAIN 4096
+/* seconds between flushes of the dnstap output, for the frames that could
+ * not be written right away */
+#define DT_COLLECTOR_FLUSH_INTERVAL 1
+/* the dnstap socket is connected, and the frames wait until it can be
+ * written to, next to DT_CONNECT_WANT_WRITE and _READ */
+#define DT_OUTPUT_WANT_FLUSH 3
 
 /* information for the dnstap collector process. It collects information
  * for dnstap from the worker processes.  And writes them to the dnstap
@@ -37,12 +56,65 @@ struct dt_collector {
 	struct event_base* event_base;
 	/* in the collector process, the cmd handle event */
 	struct event* cmd_event;
+	/* in the collector process, the timer to flush the output */
+	struct event* flush_event;
+	/* in the collector process, the event for the dnstap socket, for
+	 * its connect, or for the frames that it did not take, it is added
+	 * when output_want is nonzero */
+	struct event* output_event;
+	/* what the output event waits for, DT_CONNECT_WANT_* or
+	 * DT_OUTPUT_WANT_FLUSH, and its fd */
+	int output_want, output_fd;
 	/* in the collector process, array size count of input per worker */
 	struct dt_collector_input* inputs;
 	/* region for buffers */
 	struct region* region;
 	/* buffer for sending data to the collector */
 	struct buffer* send_buffer;
+	/* shared memory rings, DT_RINGS_PER_WORKER per worker.  A worker
+	 * writes to a ring that no other live process writes to, so the old
+	 * and new workers that coexist after reloads do not write to the
+	 * same ring.  Ring j of worker i is rings[j*count + i].  NULL if
+	 * the rings could not be mapped, messages then go over the pipes. */
+	struct dt_ring** rings;
+	/* in a worker, the ring that it claimed, NULL if it has none yet */
+	struct dt_ring* ring;
+	/* in a worker without a ring, when to try to claim one again */
+	time_t ring_retry;
+
+	/* the filters, the workers use them before they submit messages */
+	/* log one in sample_rate queries, 0 or 1 logs all of them */
+	uint32_t sample_rate;
+	/* number of queries until the next one that is logged */
+	uint32_t sample_left;
+	/* bitmap of the qtypes to log, NULL logs all qtypes */
+	uint8_t* qtypes;
+	/* bitmask of the rcodes to log responses for, 0 logs all */
+	uint32_t rcodes;
+	/* log only the responses that the ratelimit acted on */
+	int rrl_only;
+};
+
+/* single producer, single consumer ring in shared memory.  The worker
+ * appends messages at head, the collector removes them at tail.  The
+ * positions are free running counters, the offset in data is the position
+ * modulo DT_RING_SIZE.  The messages have the same format as the ones that
+ * are sent over the pipes. */
+struct dt_ring {
+	/* write position, only changed by the worker */
+	volatile uint32_t head;
+	/* the pid of the worker that writes to the ring, 0 if none.  A ring
+	 * is claimed by another worker after this process has exited */
+	volatile pid_t owner;
+	uint8_t pad_head[56];
+	/* read position, only changed by the collector */
+	volatile uint32_t tail;
+	/* set by the collector when it waits for more messages, the worker
+	 * then writes a byte to the pipe to wake it up */
+	volatile uint32_t sleeping;
+	uint8_t pad_tail[56];
+	/* the message data */
+	uint8_t data[DT_RING_SIZE];
 };
 
 /* information per worker to get input from that worker. */
@@ -53,6 +125,10 @@ struct dt_collector_input {
 	struct event* event;
 	/* buffer to store the datagrams while they are read in */
 	struct buffer* buffer;
+	/* the worker number for this input */
+	int num;
+	/* write end of the pipe, to wake up the collector itself */
+	int wake_fd;
 };
 
 /* create dt_collector process structure and dt_env */
@@ -63,10 +139,24 @@ void dt_collector_destroy(struct dt_collector* dt_col, struct nsd* nsd);
 void dt_collector_close(struct dt_collector* dt_col, struct nsd* nsd);
 /* start the collector process */
 void dt_collector_start(struct dt_collector* dt_col, struct nsd* nsd);
+/* claim a ring of worker num that no live process writes to, or NULL if
+ * the old workers still use all of them.  for unit test */
+struct dt_ring* dt_collector_claim_ring(struct dt_collector* dt_col, int num);
+
+/* select the query for dnstap logging before it is processed, by qtype and
+ * sampling.  Stores the choice in the query, for the response.
+ * returns true if the query is to be logged. */
+int dt_collector_select_query(struct nsd* nsd, struct query* q);
+
+/* select the response for dnstap logging, after the query is answered, by
+ * the choice for the query, and by zone, rcode and ratelimit.
+ * returns true if the response is to be logged. */
+int dt_collector_select_response(struct nsd* nsd, struct query* q);
 
-/* submit auth query from worker.  It attempts to send it to the collector,
- * if the nonblocking fails, then it silently skips it.  So it does not block
- * on the log.
+/* submit auth query from worker.  It puts it in the ring for the collector,
+ * or attempts to send it over the pipe, if the ring is full or the nonblocking
+ * write fails, then it skips it and counts it as dropped.  So it does not
+ * block on the log.
  */
 void dt_collector_submit_auth_query(struct nsd* nsd,
 #ifdef INET6
@@ -76,9 +166,10 @@ void dt_collector_submit_auth_query(struct nsd* nsd,
 #endif
 	socklen_t addrlen, int is_tcp, struct buffer* packet);
 
-/* submit auth response from worker.  It attempts to send it to the collector,
- * if the nonblocking fails, then it silently skips it.  So it does not block
- * on the log.
+/* submit auth response from worker.  It puts it in the ring for the
+ * collector, or attempts to send it over the pipe, if the ring is full or the
+ * nonblocking write fails, then it skips it and counts it as dropped.  So it
+ * does not block on the log.
  */
 void dt_collector_submit_auth_response(struct nsd* nsd,
 #ifdef INET6
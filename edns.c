@@ -11,11 +11,15 @@
 #include "config.h"
 
 #include <string.h>
+#include <time.h>
 
 #include "dns.h"
 #include "edns.h"
 #include "nsd.h"
 #include "query.h"
+#include "options.h"
+#include "siphash.h"
+#include "util.h"
 
 void
 edns_init_data(edns_data_type *data, uint16_t max_length)
@@ -58,6 +62,8 @@ edns_init_record(edns_record_type *edns)
 	edns->opt_reserved_space = 0;
 	edns->dnssec_ok = 0;
 	edns->nsid = 0;
+	edns->cookie_status = COOKIE_NOT_PRESENT;
+	edns->cookie_len = 0;
 }
 
 /** handle a single edns option in the query */
@@ -65,7 +71,6 @@ static int
 edns_handle_option(uint16_t optcode, uint16_t optlen, buffer_type* packet,
 	edns_record_type* edns, struct query* query, nsd_type* nsd)
 {
-	(void) query; /* in case edns options need the query structure */
 	/* handle opt code and read the optlen bytes from the packet */
 	switch(optcode) {
 	case NSID_CODE:
@@ -81,6 +86,27 @@ edns_handle_option(uint16_t optcode, uint16_t optlen, buffer_type* packet,
 			buffer_skip(packet, optlen);
 		}
 		break;
+	case COOKIE_CODE:
+		/* answer cookies? and only the first COOKIE option */
+		if(!nsd->options->answer_cookie ||
+			edns->cookie_status != COOKIE_NOT_PRESENT) {
+			buffer_skip(packet, optlen);
+			break;
+		}
+		/* a client cookie, optionally with a server cookie of
+		 * 8 to 32 bytes, other lengths are a FORMERR */
+		if(optlen != COOKIE_CLIENT_LEN && (optlen < COOKIE_CLIENT_LEN+8
+			|| optlen > COOKIE_MAX_LEN))
+			return 0;
+		buffer_read(packet, edns->cookie, optlen);
+		edns->cookie_len = optlen;
+		if(optlen == COOKIE_CLIENT_LEN)
+			edns->cookie_status = COOKIE_UNVERIFIED;
+		else	cookie_verify(query, nsd, (uint32_t)time(NULL));
+		/* in the reply the client cookie and a new server cookie */
+		edns->opt_reserved_space += OPT_HDR + COOKIE_CLIENT_LEN +
+			COOKIE_SERVER_LEN;
+		break;
 	default:
 		buffer_skip(packet, optlen);
 		break;
@@ -158,3 +184,76 @@ edns_reserved_space(edns_record_type *edns)
 	/* MIEK; when a pkt is too large?? */
 	return edns->status == EDNS_NOT_PRESENT ? 0 : (OPT_LEN + OPT_RDATA + edns->opt_reserved_space);
 }
+
+/** the siphash of the server cookie, over the client cookie, version,
+ * reserved and timestamp fields (the first 16 bytes in the cookie data),
+ * and the client address */
+static void
+cookie_hash(query_type *q, const uint8_t *secret,
+	uint8_t hash[SIPHASH_OUT_SIZE])
+{
+	uint8_t in[COOKIE_CLIENT_LEN + 8 + 16];
+	size_t len = COOKIE_CLIENT_LEN + 8;
+
+	memcpy(in, q->edns.cookie, len);
+#ifdef INET6
+	if(q->addr.ss_family == AF_INET6) {
+		memcpy(in+len, &((struct sockaddr_in6*)&q->addr)->sin6_addr, 16);
+		len += 16;
+	} else {
+		memcpy(in+len, &((struct sockaddr_in*)&q->addr)->sin_addr, 4);
+		len += 4;
+	}
+#else
+	memcpy(in+len, &q->addr.sin_addr, 4);
+	len += 4;
+#endif
+	siphash24(secret, in, len, hash);
+}
+
+void
+cookie_verify(query_type *q, nsd_type *nsd, uint32_t now)
+{
+	uint8_t hash[SIPHASH_OUT_SIZE];
+	const uint8_t *server = q->edns.cookie + COOKIE_CLIENT_LEN;
+	uint32_t stamp;
+	uint8_t diff;
+	size_t i, j;
+
+	q->edns.cookie_status = COOKIE_INVALID;
+	/* version 1 of the server cookie, that we create, is 16 bytes */
+	if(q->edns.cookie_len != COOKIE_CLIENT_LEN + COOKIE_SERVER_LEN ||
+		server[0] != 1)
+		return;
+	/* in serial arithmetic, not older than an hour and not more than
+	 * five minutes in the future (RFC 9018 section 4.3) */
+	stamp = read_uint32(server + 4);
+	if((int32_t)(now - stamp) > 3600 || (int32_t)(stamp - now) > 300)
+		return;
+	for(i = 0; i < nsd->cookie_secrets_count; i++) {
+		cookie_hash(q, nsd->cookie_secrets[i], hash);
+		/* compare without an early exit on the first different byte */
+		diff = 0;
+		for(j = 0; j < SIPHASH_OUT_SIZE; j++)
+			diff |= hash[j] ^ server[8+j];
+		if(diff == 0) {
+			q->edns.cookie_status = COOKIE_VALID;
+			return;
+		}
+	}
+}
+
+void
+cookie_create(query_type *q, nsd_type *nsd, uint32_t now)
+{
+	uint8_t *server = q->edns.cookie + COOKIE_CLIENT_LEN;
+
+	/* version 1, reserved zero bytes, timestamp */
+	server[0] = 1;
+	server[1] = 0;
+	server[2] = 0;
+	server[3] = 0;
+	write_uint32(server + 4, now);
+	cookie_hash(q, nsd->cookie_secrets[0], server + 8);
+	q->edns.cookie_len = COOKIE_CLIENT_LEN + COOKIE_SERVER_LEN;
+}
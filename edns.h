@@ -18,6 +18,11 @@ struct query;
 #define OPT_RDATA 2                     /* holds the rdata length comes after OPT_LEN */
 #define OPT_HDR 4U                      /* NSID opt header length */
 #define NSID_CODE       3               /* nsid option code */
+#define COOKIE_CODE     10              /* COOKIE option code */
+#define COOKIE_CLIENT_LEN 8U            /* length of the client cookie */
+#define COOKIE_SERVER_LEN 16U           /* length of our server cookie */
+#define COOKIE_MAX_LEN  40U             /* client plus largest server cookie */
+#define COOKIE_SECRET_SIZE 16           /* siphash key for the server cookie */
 #define DNSSEC_OK_MASK  0x8000U         /* do bit mask */
 
 struct edns_data
@@ -39,6 +44,15 @@ enum edns_status
 };
 typedef enum edns_status edns_status_type;
 
+enum cookie_status
+{
+	COOKIE_NOT_PRESENT,
+	COOKIE_UNVERIFIED,	/* client cookie, no (usable) server cookie */
+	COOKIE_VALID,		/* server cookie made by us, still fresh */
+	COOKIE_INVALID		/* server cookie did not verify */
+};
+typedef enum cookie_status cookie_status_type;
+
 struct edns_record
 {
 	edns_status_type status;
@@ -47,6 +61,9 @@ struct edns_record
 	size_t		 opt_reserved_space;
 	int              dnssec_ok;
 	int              nsid;
+	cookie_status_type cookie_status;
+	size_t           cookie_len;
+	uint8_t          cookie[COOKIE_MAX_LEN];
 };
 typedef struct edns_record edns_record_type;
 
@@ -63,4 +80,18 @@ size_t edns_reserved_space(edns_record_type *data);
 
 void edns_init_nsid(edns_data_type *data, uint16_t nsid_len);
 
+/*
+ * Verify the server cookie part of the COOKIE option in the query, with
+ * the secrets of nsd, and set cookie_status.  The server cookie is the
+ * interoperable format of RFC 9018: version, reserved, timestamp and a
+ * SipHash-2-4 over the client cookie, those fields and the client address.
+ */
+void cookie_verify(struct query *q, struct nsd *nsd, uint32_t now);
+
+/*
+ * Create a new server cookie for the query, with the active secret,
+ * and put it after the client cookie in the COOKIE option data.
+ */
+void cookie_create(struct query *q, struct nsd *nsd, uint32_t now);
+
 #endif /* _EDNS_H_ */
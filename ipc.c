@@ -284,9 +284,15 @@ stats_add(struct nsdst* total, struct nsdst* s)
 	total->ednserr += s->ednserr;
 	total->raxfr += s->raxfr;
 	total->nona += s->nona;
+	total->dnstap_dropped += s->dnstap_dropped;
+	for(i=0; i<sizeof(total->latency)/sizeof(stc_type); i++)
+		total->latency[i] += s->latency[i];
+	total->latency_usec += s->latency_usec;
 
 	total->db_disk = s->db_disk;
 	total->db_mem = s->db_mem;
+	total->db_compact_usec = s->db_compact_usec;
+	total->db_compact_moved = s->db_compact_moved;
 }
 
 /** subtract stats from total */
@@ -317,6 +323,10 @@ stats_subtract(struct nsdst* total, struct nsdst* s)
 	total->ednserr -= s->ednserr;
 	total->raxfr -= s->raxfr;
 	total->nona -= s->nona;
+	total->dnstap_dropped -= s->dnstap_dropped;
+	for(i=0; i<sizeof(total->latency)/sizeof(stc_type); i++)
+		total->latency[i] -= s->latency[i];
+	total->latency_usec -= s->latency_usec;
 }
 
 #define FINAL_STATS_TIMEOUT 10 /* seconds */
@@ -0,0 +1,876 @@
+/*
+ * metrics.c -- the statistics over http, in the OpenMetrics text format.
+ *
+ * Copyright (c) 2019, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ * The metrics are served by xfrd, from the counters that the serving
+ * children copy to the stat_map every second, and from the totals of
+ * the children that have exited.  A scrape does not talk to the children
+ * and does not cause a reload, unlike nsd-control stats.  The totals are
+ * not cleared by nsd-control stats, the counters only go up.
+ */
+
+#include "config.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#ifdef HAVE_NETDB_H
+#  include <netdb.h>
+#endif
+#ifdef HAVE_SYS_UN_H
+#  include <sys/un.h>
+#endif
+#ifndef USE_MINI_EVENT
+#  ifdef HAVE_EVENT_H
+#    include <event.h>
+#  else
+#    include <event2/event.h>
+#    include "event2/event_struct.h"
+#    include "event2/event_compat.h"
+#  endif
+#else
+#  include "mini_event.h"
+#endif
+#include "metrics.h"
+#include "remote.h"
+#include "util.h"
+#include "buffer.h"
+#include "region-allocator.h"
+#include "xfrd.h"
+#include "nsd.h"
+#include "options.h"
+#include "ipc.h"
+
+#ifdef BIND8_STATS
+/** the content type of the OpenMetrics text format */
+#define METRICS_CONTENT_TYPE "application/openmetrics-text; " \
+	"version=1.0.0; charset=utf-8"
+
+/** a listening socket */
+struct metrics_accept {
+	struct metrics_accept* next;
+	int event_added;
+	struct event c;
+	char* ident;
+	struct daemon_metrics* m;
+};
+
+/** a http connection */
+struct metrics_conn {
+	/** the next item in list */
+	struct metrics_conn* next, *prev;
+	/** if the event was added to the event_base */
+	int event_added;
+	/** the event, for reading the request and writing the answer */
+	struct event c;
+	/** timeout for the connection */
+	struct timeval tval;
+	/** the metrics this is part of */
+	struct daemon_metrics* m;
+	/** the request, nul terminated */
+	char req[METRICS_REQUEST_SIZE];
+	size_t req_len;
+	/** the answer header, and the body, with the bytes sent */
+	char hdr[256];
+	size_t hdr_len, sent;
+	region_type* region;
+	buffer_type* body;
+};
+
+/** the metrics service */
+struct daemon_metrics {
+	/** the xfrd that serves the metrics */
+	struct xfrd_state* xfrd;
+	/** the listening sockets */
+	struct metrics_accept* accept_list;
+	/** the http connections, double linked, malloced */
+	struct metrics_conn* busy_list;
+	/** number of connections */
+	int active;
+	/** the metrics path */
+	char* path;
+	/** time the service was started */
+	struct timeval boot_time;
+	/** the totals of the children that have exited */
+	struct nsdst total;
+};
+
+static void metrics_accept_callback(int fd, short event, void* arg);
+static void metrics_conn_callback(int fd, short event, void* arg);
+
+/** open a listening socket for the address, returns -1 on failure, and
+ * sets noproto if the address family is not supported */
+static int
+metrics_open_sock(const char* ip, int nr, int* noproto)
+{
+	struct addrinfo hints, *res;
+	char port[15];
+	int s, r, on = 1;
+	*noproto = 0;
+	if(ip[0] == '/') {
+#ifdef HAVE_SYS_UN_H
+		struct sockaddr_un usock;
+		memset(&usock, 0, sizeof(usock));
+#ifdef HAVE_STRUCT_SOCKADDR_UN_SUN_LEN
+		usock.sun_len = (unsigned)sizeof(usock);
+#endif
+		usock.sun_family = AF_LOCAL;
+		(void)strlcpy(usock.sun_path, ip, sizeof(usock.sun_path));
+		if((s = socket(AF_LOCAL, SOCK_STREAM, 0)) == -1) {
+			log_msg(LOG_ERR, "metrics: cannot create local socket "
+				"%s: %s", ip, strerror(errno));
+			return -1;
+		}
+		if(unlink(ip) == -1 && errno != ENOENT) {
+			log_msg(LOG_ERR, "metrics: cannot remove old local "
+				"socket %s: %s", ip, strerror(errno));
+			close(s);
+			return -1;
+		}
+		if(bind(s, (struct sockaddr*)&usock,
+			(socklen_t)sizeof(usock)) == -1) {
+			log_msg(LOG_ERR, "metrics: cannot bind local socket "
+				"%s: %s", ip, strerror(errno));
+			close(s);
+			return -1;
+		}
+#ifdef HAVE_CHOWN
+		if(nsd.username && nsd.username[0] && nsd.uid != (uid_t)-1 &&
+			chown(ip, nsd.uid, nsd.gid) == -1)
+			VERBOSITY(2, (LOG_INFO, "cannot chown %u.%u %s: %s",
+				(unsigned)nsd.uid, (unsigned)nsd.gid, ip,
+				strerror(errno)));
+		if(chmod(ip, (mode_t)(S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP))
+			== -1)
+			VERBOSITY(3, (LOG_INFO, "cannot chmod metrics socket "
+				"%s: %s", ip, strerror(errno)));
+#endif
+#else
+		log_msg(LOG_ERR, "metrics: local sockets are not supported");
+		*noproto = 1;
+		return -1;
+#endif /* HAVE_SYS_UN_H */
+	} else {
+		snprintf(port, sizeof(port), "%d", nr);
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+		if((r = getaddrinfo(ip, port, &hints, &res)) != 0 || !res) {
+			log_msg(LOG_ERR, "metrics interface %s:%s getaddrinfo: "
+				"%s", ip, port, gai_strerror(r));
+			return -1;
+		}
+		if((s = socket(res->ai_family, res->ai_socktype, 0)) == -1) {
+			if(res->ai_family == AF_INET6 && errno == EAFNOSUPPORT)
+				*noproto = 1;
+			else	log_msg(LOG_ERR, "metrics: cannot create a "
+					"socket: %s", strerror(errno));
+			freeaddrinfo(res);
+			return -1;
+		}
+#ifdef SO_REUSEADDR
+		if(setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on,
+			(socklen_t)sizeof(on)) < 0)
+			log_msg(LOG_ERR, "setsockopt(..., SO_REUSEADDR, ...) "
+				"failed: %s", strerror(errno));
+#endif
+#if defined(INET6) && defined(IPV6_V6ONLY)
+		if(res->ai_family == AF_INET6 && setsockopt(s, IPPROTO_IPV6,
+			IPV6_V6ONLY, &on, (socklen_t)sizeof(on)) < 0)
+			log_msg(LOG_ERR, "setsockopt(..., IPV6_V6ONLY, ...) "
+				"failed: %s", strerror(errno));
+#endif
+		(void)on;
+		if(bind(s, (struct sockaddr*)res->ai_addr, res->ai_addrlen)
+			!= 0) {
+			log_msg(LOG_ERR, "metrics: cannot bind %s port %d: %s",
+				ip, nr, strerror(errno));
+			freeaddrinfo(res);
+			close(s);
+			return -1;
+		}
+		freeaddrinfo(res);
+	}
+	if(fcntl(s, F_SETFL, O_NONBLOCK) == -1)
+		log_msg(LOG_ERR, "metrics: cannot fcntl: %s", strerror(errno));
+	if(listen(s, TCP_BACKLOG_REMOTE) == -1) {
+		log_msg(LOG_ERR, "metrics: cannot listen: %s", strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/** add a listening socket, returns false on failure */
+static int
+metrics_add_open(struct daemon_metrics* m, const char* ip, int nr,
+	int noproto_is_err)
+{
+	struct metrics_accept* a;
+	int noproto = 0;
+	int fd = metrics_open_sock(ip, nr, &noproto);
+	if(fd == -1 && noproto) {
+		if(!noproto_is_err)
+			return 1; /* success, but do nothing */
+		log_msg(LOG_ERR, "cannot open metrics interface %s %d: "
+			"protocol not supported", ip, nr);
+		return 0;
+	}
+	if(fd == -1) {
+		log_msg(LOG_ERR, "cannot open metrics interface %s %d", ip, nr);
+		return 0;
+	}
+	a = (struct metrics_accept*)xalloc_zero(sizeof(*a));
+	a->m = m;
+	a->ident = xstrdup(ip);
+	a->c.ev_fd = fd;
+	a->next = m->accept_list;
+	m->accept_list = a;
+	return 1;
+}
+
+struct daemon_metrics*
+daemon_metrics_create(struct nsd_options* cfg)
+{
+	struct daemon_metrics* m = (struct daemon_metrics*)xalloc_zero(
+		sizeof(*m));
+	assert(cfg->metrics_enable);
+	m->path = xstrdup(cfg->metrics_path);
+	if(cfg->metrics_interface) {
+		struct ip_address_option* p;
+		for(p = cfg->metrics_interface; p; p = p->next) {
+			if(!metrics_add_open(m, p->address, cfg->metrics_port,
+				1)) {
+				daemon_metrics_delete(m);
+				return NULL;
+			}
+		}
+	} else {
+		if((cfg->do_ip6 && !metrics_add_open(m, "::1",
+			cfg->metrics_port, 0)) || (cfg->do_ip4 &&
+			!metrics_add_open(m, "127.0.0.1", cfg->metrics_port,
+			1))) {
+			daemon_metrics_delete(m);
+			return NULL;
+		}
+	}
+	if(gettimeofday(&m->boot_time, NULL) == -1)
+		log_msg(LOG_ERR, "gettimeofday: %s", strerror(errno));
+	return m;
+}
+
+/** delete a connection */
+static void
+metrics_conn_delete(struct daemon_metrics* m, struct metrics_conn* c)
+{
+	if(c->prev) c->prev->next = c->next;
+	else	m->busy_list = c->next;
+	if(c->next) c->next->prev = c->prev;
+	m->active--;
+	if(c->event_added)
+		event_del(&c->c);
+	close(c->c.ev_fd);
+	if(c->region)
+		region_destroy(c->region);
+	free(c);
+}
+
+void
+daemon_metrics_close(struct daemon_metrics* m)
+{
+	struct metrics_accept* a, *na;
+	if(!m) return;
+	a = m->accept_list;
+	while(a) {
+		na = a->next;
+		if(a->event_added)
+			event_del(&a->c);
+		close(a->c.ev_fd);
+		free(a->ident);
+		free(a);
+		a = na;
+	}
+	m->accept_list = NULL;
+	while(m->busy_list)
+		metrics_conn_delete(m, m->busy_list);
+}
+
+void
+daemon_metrics_delete(struct daemon_metrics* m)
+{
+	if(!m) return;
+	daemon_metrics_close(m);
+	free(m->path);
+	free(m);
+}
+
+void
+daemon_metrics_attach(struct daemon_metrics* m, struct xfrd_state* xfrd)
+{
+	struct metrics_accept* a;
+	int fd;
+	if(!m) return;
+	m->xfrd = xfrd;
+	for(a = m->accept_list; a; a = a->next) {
+		fd = a->c.ev_fd;
+		memset(&a->c, 0, sizeof(a->c));
+		event_set(&a->c, fd, EV_PERSIST|EV_READ,
+			metrics_accept_callback, a);
+		if(event_base_set(xfrd->event_base, &a->c) != 0)
+			log_msg(LOG_ERR, "metrics: cannot set event_base");
+		if(event_add(&a->c, NULL) != 0)
+			log_msg(LOG_ERR, "metrics: cannot add event");
+		a->event_added = 1;
+	}
+}
+
+void
+daemon_metrics_stat_info(struct daemon_metrics* m, struct nsdst* st,
+	int stat_block)
+{
+	struct nsd* nsd;
+	if(!m || !m->xfrd) return;
+	nsd = m->xfrd->nsd;
+	stats_add(&m->total, st);
+	/* the old children have exited, and their counts are in the total */
+	if(nsd->stat_map)
+		memset(&nsd->stat_map[(stat_block?0:1)*nsd->child_count], 0,
+			sizeof(struct nsdst)*nsd->child_count);
+}
+
+static void
+metrics_accept_callback(int fd, short event, void* arg)
+{
+	struct metrics_accept* a = (struct metrics_accept*)arg;
+	struct daemon_metrics* m = a->m;
+#ifdef INET6
+	struct sockaddr_storage addr;
+#else
+	struct sockaddr_in addr;
+#endif
+	socklen_t addrlen = sizeof(addr);
+	struct metrics_conn* c;
+	int newfd;
+	if(!(event & EV_READ))
+		return;
+	newfd = accept(fd, (struct sockaddr*)&addr, &addrlen);
+	if(newfd == -1) {
+		if(errno != EINTR && errno != EWOULDBLOCK
+#ifdef ECONNABORTED
+			&& errno != ECONNABORTED
+#endif
+#ifdef EPROTO
+			&& errno != EPROTO
+#endif
+			)
+			log_msg(LOG_ERR, "metrics: accept failed: %s",
+				strerror(errno));
+		return;
+	}
+	if(m->active >= METRICS_MAX_ACTIVE) {
+		VERBOSITY(2, (LOG_INFO, "drop incoming metrics connection: "
+			"too many connections"));
+		close(newfd);
+		return;
+	}
+	if(fcntl(newfd, F_SETFL, O_NONBLOCK) == -1) {
+		log_msg(LOG_ERR, "metrics: fcntl failed: %s", strerror(errno));
+		close(newfd);
+		return;
+	}
+	c = (struct metrics_conn*)calloc(1, sizeof(*c));
+	if(!c) {
+		log_msg(LOG_ERR, "metrics: out of memory");
+		close(newfd);
+		return;
+	}
+	c->m = m;
+	c->tval.tv_sec = METRICS_TCP_TIMEOUT;
+	c->tval.tv_usec = 0;
+	event_set(&c->c, newfd, EV_PERSIST|EV_TIMEOUT|EV_READ,
+		metrics_conn_callback, c);
+	if(event_base_set(m->xfrd->event_base, &c->c) != 0 ||
+		event_add(&c->c, &c->tval) != 0) {
+		log_msg(LOG_ERR, "metrics: cannot add event");
+		close(newfd);
+		free(c);
+		return;
+	}
+	c->event_added = 1;
+	c->next = m->busy_list;
+	if(c->next) c->next->prev = c;
+	m->busy_list = c;
+	m->active++;
+}
+
+int
+metrics_http_status(const char* req, const char* path, int* head)
+{
+	const char* target;
+	size_t len, plen = strlen(path);
+	*head = 0;
+	if(strncmp(req, "GET ", 4) == 0) {
+		target = req+4;
+	} else if(strncmp(req, "HEAD ", 5) == 0) {
+		target = req+5;
+		*head = 1;
+	} else {
+		/* the method has to be a token followed by a space */
+		len = strcspn(req, " \r\n");
+		if(len == 0 || req[len] != ' ')
+			return 400;
+		return 405;
+	}
+	len = strcspn(target, " \r\n");
+	if(target[len] != ' ' || strncmp(target+len+1, "HTTP/1.", 7) != 0)
+		return 400;
+	/* the query string is ignored */
+	if(len < plen || strncmp(target, path, plen) != 0 ||
+		(len > plen && target[plen] != '?'))
+		return 404;
+	return 200;
+}
+
+/** the families of the statistics, printed for every block */
+static const char* metrics_opcode[] = {"QUERY", "IQUERY", "STATUS", "OTHER3",
+	"NOTIFY", "UPDATE"};
+static const char* metrics_rcode[] = {"NOERROR", "FORMERR", "SERVFAIL",
+	"NXDOMAIN", "NOTIMP", "REFUSED", "YXDOMAIN", "YXRRSET", "NXRRSET",
+	"NOTAUTH", "NOTZONE", "RCODE11", "RCODE12", "RCODE13", "RCODE14",
+	"RCODE15", "BADVERS"};
+
+/** print the type and help lines of a family */
+static void
+metrics_family(buffer_type* buf, const char* prefix, const char* name,
+	const char* type, const char* help)
+{
+	buffer_printf(buf, "# TYPE %s_%s %s\n# HELP %s_%s %s\n", prefix, name,
+		type, prefix, name, help);
+}
+
+/** print a counter family without labels of its own, the counter is at
+ * offset in the struct nsdst */
+static void
+metrics_counter(buffer_type* buf, const char* prefix, const char* name,
+	const char* help, size_t num, char** labels, struct nsdst** st,
+	size_t offset)
+{
+	size_t i;
+	metrics_family(buf, prefix, name, "counter", help);
+	for(i=0; i<num; i++) {
+		size_t l = strlen(labels[i]);
+		/* the labels have a trailing comma */
+		buffer_printf(buf, "%s_%s_total%s%.*s%s %lu\n", prefix, name,
+			(l?"{":""), (int)(l?l-1:0), labels[i], (l?"}":""),
+			(unsigned long)*(stc_type*)((char*)st[i] + offset));
+	}
+}
+
+void
+metrics_print_blocks(buffer_type* buf, const char* prefix, size_t num,
+	char** labels, struct nsdst** st, int zone)
+{
+	size_t i, j;
+	const char* tr[] = {"udp", "udp6", "tcp", "tcp6", "tls", "tls6"};
+
+	metrics_family(buf, prefix, "queries", "counter",
+		"Number of queries received.");
+	for(i=0; i<num; i++) {
+		stc_type v[6];
+		v[0] = st[i]->qudp; v[1] = st[i]->qudp6;
+		v[2] = st[i]->ctcp; v[3] = st[i]->ctcp6;
+		v[4] = st[i]->ctls; v[5] = st[i]->ctls6;
+		for(j=0; j<6; j++)
+			buffer_printf(buf, "%s_queries_total{%stransport=\"%s\"}"
+				" %lu\n", prefix, labels[i], tr[j],
+				(unsigned long)v[j]);
+	}
+
+	metrics_family(buf, prefix, "queries_by_type", "counter",
+		"Number of queries by query type.");
+	for(i=0; i<num; i++) {
+		for(j=0; j<=256; j++) {
+			const char* s = (j==256?"other":rrtype_to_string(j));
+			/* the types without a name only when they are used */
+			if(st[i]->qtype[j] == 0 && (j==256 ||
+				strncmp(s, "TYPE", 4) == 0))
+				continue;
+			buffer_printf(buf, "%s_queries_by_type_total{%stype="
+				"\"%s\"} %lu\n", prefix, labels[i], s,
+				(unsigned long)st[i]->qtype[j]);
+		}
+	}
+
+	metrics_family(buf, prefix, "queries_by_class", "counter",
+		"Number of queries by query class.");
+	for(i=0; i<num; i++) {
+		for(j=0; j<4; j++) {
+			if(st[i]->qclass[j] == 0 && j != CLASS_IN)
+				continue;
+			buffer_printf(buf, "%s_queries_by_class_total{%sclass="
+				"\"%s\"} %lu\n", prefix, labels[i],
+				rrclass_to_string(j),
+				(unsigned long)st[i]->qclass[j]);
+		}
+	}
+
+	metrics_family(buf, prefix, "queries_by_opcode", "counter",
+		"Number of queries by opcode.");
+	for(i=0; i<num; i++) {
+		for(j=0; j<6; j++) {
+			if(st[i]->opcode[j] == 0 && j != OPCODE_QUERY)
+				continue;
+			buffer_printf(buf, "%s_queries_by_opcode_total{%sopcode="
+				"\"%s\"} %lu\n", prefix, labels[i],
+				metrics_opcode[j],
+				(unsigned long)st[i]->opcode[j]);
+		}
+	}
+
+	metrics_family(buf, prefix, "answers_by_rcode", "counter",
+		"Number of answers by rcode.");
+	for(i=0; i<num; i++) {
+		for(j=0; j<17; j++) {
+			/* NSD does not use the larger rcodes */
+			if(st[i]->rcode[j] == 0 && j > RCODE_YXDOMAIN)
+				continue;
+			buffer_printf(buf, "%s_answers_by_rcode_total{%srcode="
+				"\"%s\"} %lu\n", prefix, labels[i],
+				metrics_rcode[j],
+				(unsigned long)st[i]->rcode[j]);
+		}
+	}
+
+	metrics_counter(buf, prefix, "edns", "Number of queries with EDNS.",
+		num, labels, st, offsetof(struct nsdst, edns));
+	metrics_counter(buf, prefix, "edns_errors", "Number of queries with "
+		"an EDNS error.", num, labels, st,
+		offsetof(struct nsdst, ednserr));
+	metrics_counter(buf, prefix, "answers_without_aa", "Number of "
+		"NOERROR answers without the AA flag.", num, labels, st,
+		offsetof(struct nsdst, nona));
+	metrics_counter(buf, prefix, "axfr_requests", "Number of AXFR "
+		"requests served.", num, labels, st,
+		offsetof(struct nsdst, raxfr));
+	metrics_counter(buf, prefix, "truncated", "Number of answers with "
+		"the TC flag.", num, labels, st,
+		offsetof(struct nsdst, truncated));
+	metrics_counter(buf, prefix, "dropped", "Number of queries that "
+		"were dropped.", num, labels, st,
+		offsetof(struct nsdst, dropped));
+	if(zone)
+		return;
+	metrics_counter(buf, prefix, "receive_errors", "Number of receive "
+		"errors.", num, labels, st, offsetof(struct nsdst, rxerr));
+	metrics_counter(buf, prefix, "transmit_errors", "Number of transmit "
+		"errors.", num, labels, st, offsetof(struct nsdst, txerr));
+#ifdef USE_DNSTAP
+	metrics_counter(buf, prefix, "dnstap_dropped", "Number of dnstap "
+		"messages dropped.", num, labels, st,
+		offsetof(struct nsdst, dnstap_dropped));
+#endif
+
+	metrics_family(buf, prefix, "answer_latency_seconds", "histogram",
+		"Time from the receipt of the query to the answer sent.");
+	for(i=0; i<num; i++) {
+		stc_type sum = 0;
+		for(j=0; j<NSD_LATENCY_BUCKETS; j++) {
+			sum += st[i]->latency[j];
+			if(j == NSD_LATENCY_BUCKETS-1)
+				buffer_printf(buf, "%s_answer_latency_seconds_"
+					"bucket{%sle=\"+Inf\"} %lu\n", prefix,
+					labels[i], (unsigned long)sum);
+			else	buffer_printf(buf, "%s_answer_latency_seconds_"
+					"bucket{%sle=\"%u.%6.6u\"} %lu\n",
+					prefix, labels[i],
+					nsd_latency_bound[j]/1000000,
+					nsd_latency_bound[j]%1000000,
+					(unsigned long)sum);
+		}
+		buffer_printf(buf, "%s_answer_latency_seconds_count%s%.*s%s "
+			"%lu\n", prefix, (labels[i][0]?"{":""),
+			(int)(labels[i][0]?strlen(labels[i])-1:0), labels[i],
+			(labels[i][0]?"}":""), (unsigned long)sum);
+		buffer_printf(buf, "%s_answer_latency_seconds_sum%s%.*s%s "
+			"%lu.%6.6lu\n", prefix, (labels[i][0]?"{":""),
+			(int)(labels[i][0]?strlen(labels[i])-1:0), labels[i],
+			(labels[i][0]?"}":""),
+			(unsigned long)(st[i]->latency_usec/1000000),
+			(unsigned long)(st[i]->latency_usec%1000000));
+	}
+}
+
+/** print a gauge without labels */
+static void
+metrics_gauge(buffer_type* buf, const char* name, const char* help,
+	const char* value)
+{
+	metrics_family(buf, "nsd", name, "gauge", help);
+	buffer_printf(buf, "nsd_%s %s\n", name, value);
+}
+
+#ifdef USE_ZONE_STATS
+/** print the zone name as a label, escaped */
+static char*
+metrics_zone_label(region_type* region, const char* name)
+{
+	size_t i, len = strlen(name);
+	char* s = (char*)region_alloc(region, len*2 + 10);
+	char* p = s;
+	memcpy(p, "zone=\"", 6);
+	p += 6;
+	for(i=0; i<len; i++) {
+		if(name[i] == '"' || name[i] == '\\') {
+			*p++ = '\\';
+			*p++ = name[i];
+		} else if(name[i] == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+		} else	*p++ = name[i];
+	}
+	memcpy(p, "\",", 3);
+	return s;
+}
+
+/** print the per zone statistics, from the zonestat arrays */
+static void
+metrics_print_zones(buffer_type* buf, region_type* region,
+	struct xfrd_state* xfrd)
+{
+	struct nsd* nsd = xfrd->nsd;
+	struct zonestatname* n;
+	size_t num = 0, max = nsd->options->zonestatnames->count;
+	char** labels;
+	struct nsdst** st;
+	if(max == 0)
+		return;
+	labels = (char**)region_alloc_array(region, max, sizeof(char*));
+	st = (struct nsdst**)region_alloc_array(region, max,
+		sizeof(struct nsdst*));
+	RBTREE_FOR(n, struct zonestatname*, nsd->options->zonestatnames) {
+		char* name = (char*)n->node.key;
+		if(num >= max)
+			break;
+		/* allocated, but the reload has not yet sized the arrays */
+		if(n->id >= xfrd->zonestat_safe || !name || !name[0])
+			continue;
+		labels[num] = metrics_zone_label(region, name);
+		st[num] = (struct nsdst*)region_alloc_zero(region,
+			sizeof(struct nsdst));
+		zonestat_add(st[num], &nsd->zonestat[0][n->id],
+			nsd->zonestatrare[0]);
+		zonestat_add(st[num], &nsd->zonestat[1][n->id],
+			nsd->zonestatrare[1]);
+		num++;
+	}
+	metrics_print_blocks(buf, "nsd_zone", num, labels, st, 1);
+	metrics_family(buf, "nsd", "zone_lost", "counter", "Per zone counts "
+		"that did not fit in the table of rare counters.");
+	buffer_printf(buf, "nsd_zone_lost_total %lu\n",
+		(unsigned long)zonestat_lost(nsd));
+}
+#endif /* USE_ZONE_STATS */
+
+/** print all the metrics, with the # EOF at the end */
+static void
+metrics_print(buffer_type* buf, region_type* region,
+	struct daemon_metrics* m)
+{
+	struct xfrd_state* xfrd = m->xfrd;
+	struct nsd* nsd = xfrd->nsd;
+	struct nsdst total;
+	struct nsdst* st = &total;
+	char* nolabel = "";
+	struct timeval now, uptime;
+	char v[64];
+	size_t i;
+
+	/* the exited children, and the published counts of the running
+	 * ones, in both blocks during a reload */
+	memcpy(&total, &m->total, sizeof(total));
+	if(nsd->stat_map) {
+		for(i=0; i<2*nsd->child_count; i++)
+			stats_add(&total, &nsd->stat_map[i]);
+	}
+	metrics_print_blocks(buf, "nsd", 1, &nolabel, &st, 0);
+#ifdef USE_ZONE_STATS
+	metrics_print_zones(buf, region, xfrd);
+#else
+	(void)region;
+#endif
+
+	if(gettimeofday(&now, NULL) == -1)
+		now = m->boot_time;
+	uptime.tv_sec = now.tv_sec - m->boot_time.tv_sec;
+	uptime.tv_usec = now.tv_usec - m->boot_time.tv_usec;
+	if(uptime.tv_usec < 0) {
+		uptime.tv_sec--;
+		uptime.tv_usec += 1000000;
+	}
+	snprintf(v, sizeof(v), "%lu.%6.6lu", (unsigned long)uptime.tv_sec,
+		(unsigned long)uptime.tv_usec);
+	metrics_gauge(buf, "uptime_seconds", "Time since the start.", v);
+	metrics_family(buf, "nsd", "zones", "gauge", "Number of zones.");
+	buffer_printf(buf, "nsd_zones{type=\"master\"} %lu\n",
+		(unsigned long)(xfrd->notify_zones->count -
+		xfrd->zones->count));
+	buffer_printf(buf, "nsd_zones{type=\"slave\"} %lu\n",
+		(unsigned long)xfrd->zones->count);
+	/* the sizes are from the last reload */
+	snprintf(v, sizeof(v), "%llu", (unsigned long long)m->total.db_disk);
+	metrics_gauge(buf, "db_disk_bytes", "Size of the database file, at "
+		"the last reload.", v);
+	snprintf(v, sizeof(v), "%llu", (unsigned long long)m->total.db_mem);
+	metrics_gauge(buf, "db_mem_bytes", "Memory used by the database, at "
+		"the last reload.", v);
+	snprintf(v, sizeof(v), "%llu",
+		(unsigned long long)region_get_mem(xfrd->region));
+	metrics_gauge(buf, "xfrd_mem_bytes", "Memory used by xfrd.", v);
+	snprintf(v, sizeof(v), "%llu", (unsigned long long)region_get_mem(
+		nsd->options->region));
+	metrics_gauge(buf, "config_mem_bytes", "Memory used by the config.",
+		v);
+	buffer_printf(buf, "# EOF\n");
+}
+
+/** make the answer for the request */
+static void
+metrics_answer(struct metrics_conn* c)
+{
+	int head = 0;
+	int status = metrics_http_status(c->req, c->m->path, &head);
+	const char* reason = "OK";
+	c->region = region_create(xalloc, free);
+	c->body = buffer_create(c->region, 16384);
+	if(status == 200) {
+		metrics_print(c->body, c->region, c->m);
+	} else {
+		if(status == 400) reason = "Bad Request";
+		else if(status == 404) reason = "Not Found";
+		else if(status == 405) reason = "Method Not Allowed";
+		buffer_printf(c->body, "%s\n", reason);
+	}
+	buffer_flip(c->body);
+	c->hdr_len = (size_t)snprintf(c->hdr, sizeof(c->hdr),
+		"HTTP/1.0 %d %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %lu\r\n"
+		"Connection: close\r\n"
+		"\r\n", status, reason, (status == 200 ?
+		METRICS_CONTENT_TYPE : "text/plain"),
+		(unsigned long)buffer_limit(c->body));
+	if(c->hdr_len >= sizeof(c->hdr))
+		c->hdr_len = sizeof(c->hdr)-1;
+	if(head)
+		buffer_set_limit(c->body, 0);
+	VERBOSITY(3, (LOG_INFO, "metrics request, status %d", status));
+}
+
+/** read the request, returns false if the connection is done */
+static int
+metrics_read(struct metrics_conn* c, int fd)
+{
+	ssize_t r = read(fd, c->req + c->req_len,
+		sizeof(c->req) - 1 - c->req_len);
+	if(r == -1) {
+		if(errno == EINTR || errno == EAGAIN
+#ifdef EWOULDBLOCK
+			|| errno == EWOULDBLOCK
+#endif
+			)
+			return 1;
+		VERBOSITY(2, (LOG_INFO, "metrics: read: %s", strerror(errno)));
+		return 0;
+	}
+	if(r == 0)
+		return 0;
+	c->req_len += r;
+	c->req[c->req_len] = 0;
+	/* the request is done at the empty line after the header, the
+	 * request line is enough if the buffer is full */
+	if(!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n") &&
+		c->req_len < sizeof(c->req) - 1)
+		return 1;
+	metrics_answer(c);
+	/* write the answer */
+	event_del(&c->c);
+	memset(&c->c, 0, sizeof(c->c));
+	event_set(&c->c, fd, EV_PERSIST|EV_TIMEOUT|EV_WRITE,
+		metrics_conn_callback, c);
+	if(event_base_set(c->m->xfrd->event_base, &c->c) != 0 ||
+		event_add(&c->c, &c->tval) != 0) {
+		log_msg(LOG_ERR, "metrics: cannot add event");
+		c->event_added = 0;
+		return 0;
+	}
+	return 1;
+}
+
+/** write the answer, returns false if the connection is done */
+static int
+metrics_write(struct metrics_conn* c, int fd)
+{
+	ssize_t r;
+	if(c->sent < c->hdr_len)
+		r = write(fd, c->hdr + c->sent, c->hdr_len - c->sent);
+	else	r = write(fd, buffer_at(c->body, c->sent - c->hdr_len),
+			buffer_limit(c->body) - (c->sent - c->hdr_len));
+	if(r == -1) {
+		if(errno == EINTR || errno == EAGAIN
+#ifdef EWOULDBLOCK
+			|| errno == EWOULDBLOCK
+#endif
+			)
+			return 1;
+		VERBOSITY(2, (LOG_INFO, "metrics: write: %s", strerror(errno)));
+		return 0;
+	}
+	c->sent += r;
+	return (c->sent < c->hdr_len + buffer_limit(c->body));
+}
+
+static void
+metrics_conn_callback(int fd, short event, void* arg)
+{
+	struct metrics_conn* c = (struct metrics_conn*)arg;
+	if((event&EV_TIMEOUT)) {
+		VERBOSITY(2, (LOG_INFO, "metrics connection timed out"));
+		metrics_conn_delete(c->m, c);
+		return;
+	}
+	if(!c->body) {
+		if((event&EV_READ) && !metrics_read(c, fd))
+			metrics_conn_delete(c->m, c);
+		return;
+	}
+	if((event&EV_WRITE) && !metrics_write(c, fd))
+		metrics_conn_delete(c->m, c);
+}
+
+#else /* BIND8_STATS */
+
+struct daemon_metrics*
+daemon_metrics_create(struct nsd_options* cfg)
+{
+	(void)cfg;
+	log_msg(LOG_ERR, "metrics need the statistics, that are not "
+		"enabled at compile time");
+	return NULL;
+}
+
+void daemon_metrics_close(struct daemon_metrics* m) { (void)m; }
+void daemon_metrics_delete(struct daemon_metrics* m) { (void)m; }
+void daemon_metrics_attach(struct daemon_metrics* m,
+	struct xfrd_state* xfrd) { (void)m; (void)xfrd; }
+#endif /* BIND8_STATS */
@@ -0,0 +1,77 @@
+/*
+ * metrics.h -- the statistics over http, in the OpenMetrics text format.
+ *
+ * Copyright (c) 2019, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+
+#ifndef DAEMON_METRICS_H
+#define DAEMON_METRICS_H
+struct xfrd_state;
+struct nsd_options;
+struct nsdst;
+struct buffer;
+
+/* private, defined in metrics.c */
+struct daemon_metrics;
+
+/* number of seconds timeout on a metrics http connection */
+#define METRICS_TCP_TIMEOUT 10
+/* max number of metrics http connections at the same time */
+#define METRICS_MAX_ACTIVE 10
+/* size of the buffer for the http request */
+#define METRICS_REQUEST_SIZE 2048
+
+/**
+ * Create the metrics service, and open the ports, before the fork of
+ * xfrd and the drop of privileges.
+ * @param cfg: config with the metrics options.
+ * @return new state or NULL on failure.
+ */
+struct daemon_metrics* daemon_metrics_create(struct nsd_options* cfg);
+
+/** close the listening sockets and connections */
+void daemon_metrics_close(struct daemon_metrics* m);
+
+/** delete the metrics service, and close it */
+void daemon_metrics_delete(struct daemon_metrics* m);
+
+/** listen with the xfrd event base */
+void daemon_metrics_attach(struct daemon_metrics* m, struct xfrd_state* xfrd);
+
+/**
+ * The final statistics of the children that were stopped by the reload
+ * are added to the totals, and the block of the stat_map that they used
+ * is zeroed.
+ * @param m: the metrics, NULL if disabled.
+ * @param st: the statistics from the stat_info task.
+ * @param stat_block: the stat_map block of the new children.
+ */
+void daemon_metrics_stat_info(struct daemon_metrics* m, struct nsdst* st,
+	int stat_block);
+
+/**
+ * Print the OpenMetrics families of the statistics blocks.
+ * @param buf: appended to.
+ * @param prefix: name prefix of the metrics, like "nsd" or "nsd_zone".
+ * @param num: number of blocks.
+ * @param labels: labels for every block, like "zone=\"example.com\",",
+ *	with a trailing comma, or "".
+ * @param st: the statistics blocks.
+ * @param zone: if true, the counters that zones do not have are left out.
+ */
+void metrics_print_blocks(struct buffer* buf, const char* prefix, size_t num,
+	char** labels, struct nsdst** st, int zone);
+
+/**
+ * Check the http request.
+ * @param req: the request, nul terminated.
+ * @param path: the configured metrics path.
+ * @param head: set true if the method is HEAD.
+ * @return the http status code for the answer, 200 if OK.
+ */
+int metrics_http_status(const char* req, const char* path, int* head);
+
+#endif /* DAEMON_METRICS_H */
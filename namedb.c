@@ -596,6 +596,8 @@ domain_type *
 find_dname_above(domain_type* domain, zone_type* zone)
 {
 	domain_type* d = domain->parent;
+	if(!zone->has_dname)
+		return NULL;
 	while(d && d != zone->apex) {
 		if(domain_find_rrset(d, zone, TYPE_DNAME))
 			return d;
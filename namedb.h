@@ -141,9 +141,14 @@ struct zone
 	char*        logstr; /* set for zone xfer, the log string */
 	struct timespec mtime; /* time of last modification */
 	unsigned     zonestatid; /* array index for zone stats */
+	uint32_t     nx_count; /* NXDOMAINs in this second, per server process */
+	uint32_t     nx_time; /* the second nx_count is for */
 	unsigned     is_secure : 1; /* zone uses DNSSEC */
 	unsigned     is_ok : 1; /* zone has not expired. */
 	unsigned     is_changed : 1; /* zone was changed by AXFR */
+	unsigned     is_journaled : 1; /* the changes are in the zone journal */
+	unsigned     has_dname : 1; /* zone has DNAMEs, lookups look for them */
+	unsigned     nx_flood : 1; /* over the NXDOMAIN flood limit */
 } ATTR_PACKED;
 
 /* a RR in DNS */
@@ -392,8 +397,14 @@ void apex_rrset_checks(struct namedb* db, rrset_type* rrset,
 zone_type* namedb_zone_create(namedb_type* db, const dname_type* dname,
         struct zone_options* zopt);
 void namedb_zone_delete(namedb_type* db, zone_type* zone);
-void namedb_write_zonefile(struct nsd* nsd, struct zone_options* zopt);
-void namedb_write_zonefiles(struct nsd* nsd, struct nsd_options* options);
+/* print the RRs of the zone in zonefile format, returns 0 on failure */
+int print_rrs(FILE* out, struct zone* zone);
+/* write the changed zones to their zonefiles, with force also the zones
+ * whose changes are in the journal */
+void namedb_write_zonefile(struct nsd* nsd, struct zone_options* zopt,
+	int force);
+void namedb_write_zonefiles(struct nsd* nsd, struct nsd_options* options,
+	int force);
 int create_dirs(const char* path);
 int file_get_mtime(const char* file, struct timespec* mtime, int* nonexist);
 void allocate_domain_nsec3(domain_table_type *table, domain_type *result);
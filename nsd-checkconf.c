@@ -323,6 +323,7 @@ config_print_zone(nsd_options_type* opt, const char* k, int s, const char *o,
 		ZONE_GET_RRL(rrl_whitelist, o, zone->pattern);
 #endif
 		ZONE_GET_BIN(multi_master_check, o, zone->pattern);
+		ZONE_GET_BIN(dnstap_log, o, zone->pattern);
 		printf("Zone option not handled: %s %s\n", z, o);
 		exit(1);
 	} else if(pat) {
@@ -355,6 +356,7 @@ config_print_zone(nsd_options_type* opt, const char* k, int s, const char *o,
 		ZONE_GET_RRL(rrl_whitelist, o, p);
 #endif
 		ZONE_GET_BIN(multi_master_check, o, p);
+		ZONE_GET_BIN(dnstap_log, o, p);
 		printf("Pattern option not handled: %s %s\n", pat, o);
 		exit(1);
 	} else {
@@ -376,6 +378,7 @@ config_print_zone(nsd_options_type* opt, const char* k, int s, const char *o,
 		SERV_GET_BIN(minimal_responses, o);
 		SERV_GET_BIN(confine_to_zone, o);
 		SERV_GET_BIN(refuse_any, o);
+		SERV_GET_BIN(answer_cookie, o);
 		SERV_GET_BIN(tcp_reject_overflow, o);
 		SERV_GET_BIN(log_only_syslog, o);
 		/* str */
@@ -391,6 +394,7 @@ config_print_zone(nsd_options_type* opt, const char* k, int s, const char *o,
 		SERV_GET_PATH(final, xfrdfile, o);
 		SERV_GET_PATH(final, xfrdir, o);
 		SERV_GET_PATH(final, zonelistfile, o);
+		SERV_GET_PATH(final, cookie_secret_file, o);
 		SERV_GET_STR(port, o);
 		SERV_GET_STR(tls_service_key, o);
 		SERV_GET_STR(tls_service_ocsp, o);
@@ -399,6 +403,7 @@ config_print_zone(nsd_options_type* opt, const char* k, int s, const char *o,
 		/* int */
 		SERV_GET_INT(server_count, o);
 		SERV_GET_INT(tcp_count, o);
+		SERV_GET_INT(nxdomain_flood_limit, o);
 		SERV_GET_INT(tcp_query_count, o);
 		SERV_GET_INT(tcp_timeout, o);
 		SERV_GET_INT(tcp_mss, o);
@@ -407,6 +412,8 @@ config_print_zone(nsd_options_type* opt, const char* k, int s, const char *o,
 		SERV_GET_INT(ipv6_edns_size, o);
 		SERV_GET_INT(statistics, o);
 		SERV_GET_INT(xfrd_reload_timeout, o);
+		SERV_GET_INT(xfrd_tcp_max_per_master, o);
+		SERV_GET_INT(xfrd_udp_share, o);
 		SERV_GET_INT(verbosity, o);
 		SERV_GET_INT(send_buffer_size, o);
 		SERV_GET_INT(receive_buffer_size, o);
@@ -417,16 +424,23 @@ config_print_zone(nsd_options_type* opt, const char* k, int s, const char *o,
 		SERV_GET_INT(rrl_ipv4_prefix_length, o);
 		SERV_GET_INT(rrl_ipv6_prefix_length, o);
 		SERV_GET_INT(rrl_whitelist_ratelimit, o);
+		SERV_GET_INT(rrl_cookie_ratelimit, o);
 #endif
 #ifdef USE_DNSTAP
 		SERV_GET_BIN(dnstap_enable, o);
 		SERV_GET_STR(dnstap_socket_path, o);
+		SERV_GET_STR(dnstap_file_path, o);
+		SERV_GET_INT(dnstap_file_size, o);
 		SERV_GET_BIN(dnstap_send_identity, o);
 		SERV_GET_BIN(dnstap_send_version, o);
 		SERV_GET_STR(dnstap_identity, o);
 		SERV_GET_STR(dnstap_version, o);
 		SERV_GET_BIN(dnstap_log_auth_query_messages, o);
 		SERV_GET_BIN(dnstap_log_auth_response_messages, o);
+		SERV_GET_INT(dnstap_sample_rate, o);
+		SERV_GET_STR(dnstap_log_qtypes, o);
+		SERV_GET_STR(dnstap_log_rcodes, o);
+		SERV_GET_BIN(dnstap_log_rrl_only, o);
 #endif
 		SERV_GET_INT(zonefiles_write, o);
 		/* remote control */
@@ -437,6 +451,11 @@ config_print_zone(nsd_options_type* opt, const char* k, int s, const char *o,
 		SERV_GET_STR(server_cert_file, o);
 		SERV_GET_STR(control_key_file, o);
 		SERV_GET_STR(control_cert_file, o);
+		/* metrics */
+		SERV_GET_BIN(metrics_enable, o);
+		SERV_GET_IP(metrics_interface, metrics_interface, o);
+		SERV_GET_INT(metrics_port, o);
+		SERV_GET_STR(metrics_path, o);
 
 		if(strcasecmp(o, "zones") == 0) {
 			zone_options_type* zone;
@@ -477,6 +496,8 @@ static void print_zone_content_elems(pattern_options_type* pat)
 	if(!pat->allow_axfr_fallback_is_default)
 		printf("\tallow-axfr-fallback: %s\n",
 			pat->allow_axfr_fallback?"yes":"no");
+	if(!pat->dnstap_log_is_default)
+		printf("\tdnstap-log: %s\n", pat->dnstap_log?"yes":"no");
 	if(!pat->max_refresh_time_is_default)
 		printf("\tmax-refresh-time: %d\n", pat->max_refresh_time);
 	if(!pat->min_refresh_time_is_default)
@@ -561,12 +582,20 @@ config_test_print_server(nsd_options_type* opt)
 	print_string_var("zonelistfile:", opt->zonelistfile);
 	print_string_var("xfrdir:", opt->xfrdir);
 	printf("\txfrd-reload-timeout: %d\n", opt->xfrd_reload_timeout);
+	printf("\txfrd-tcp-max-per-master: %d\n",
+		opt->xfrd_tcp_max_per_master);
+	printf("\txfrd-udp-share: %d\n", opt->xfrd_udp_share);
 	printf("\tlog-time-ascii: %s\n", opt->log_time_ascii?"yes":"no");
 	printf("\tround-robin: %s\n", opt->round_robin?"yes":"no");
 	printf("\tminimal-responses: %s\n", opt->minimal_responses?"yes":"no");
 	printf("\tconfine-to-zone: %s\n",
 		opt->confine_to_zone ? "yes" : "no");
 	printf("\trefuse-any: %s\n", opt->refuse_any?"yes":"no");
+	printf("\tnxdomain-flood-limit: %d\n", (int)opt->nxdomain_flood_limit);
+	printf("\tanswer-cookie: %s\n", opt->answer_cookie?"yes":"no");
+	if(opt->cookie_secret_file)
+		print_string_var("cookie-secret-file:",
+			opt->cookie_secret_file);
 	printf("\tverbosity: %d\n", opt->verbosity);
 	for(ip = opt->ip_addresses; ip; ip=ip->next)
 	{
@@ -596,6 +625,7 @@ config_test_print_server(nsd_options_type* opt)
 	printf("\trrl-ipv4-prefix-length: %d\n", (int)opt->rrl_ipv4_prefix_length);
 	printf("\trrl-ipv6-prefix-length: %d\n", (int)opt->rrl_ipv6_prefix_length);
 	printf("\trrl-whitelist-ratelimit: %d\n", (int)opt->rrl_whitelist_ratelimit);
+	printf("\trrl-cookie-ratelimit: %d\n", (int)opt->rrl_cookie_ratelimit);
 #endif
 	printf("\tzonefiles-check: %s\n", opt->zonefiles_check?"yes":"no");
 	printf("\tzonefiles-write: %d\n", opt->zonefiles_write);
@@ -608,12 +638,18 @@ config_test_print_server(nsd_options_type* opt)
 	printf("\ndnstap:\n");
 	printf("\tdnstap-enable: %s\n", opt->dnstap_enable?"yes":"no");
 	print_string_var("dnstap-socket-path:", opt->dnstap_socket_path);
+	print_string_var("dnstap-file-path:", opt->dnstap_file_path);
+	printf("\tdnstap-file-size: %llu\n", (unsigned long long)opt->dnstap_file_size);
 	printf("\tdnstap-send-identity: %s\n", opt->dnstap_send_identity?"yes":"no");
 	printf("\tdnstap-send-version: %s\n", opt->dnstap_send_version?"yes":"no");
 	print_string_var("dnstap-identity:", opt->dnstap_identity);
 	print_string_var("dnstap-version:", opt->dnstap_version);
 	printf("\tdnstap-log-auth-query-messages: %s\n", opt->dnstap_log_auth_query_messages?"yes":"no");
 	printf("\tdnstap-log-auth-response-messages: %s\n", opt->dnstap_log_auth_response_messages?"yes":"no");
+	printf("\tdnstap-sample-rate: %d\n", opt->dnstap_sample_rate);
+	print_string_var("dnstap-log-qtypes:", opt->dnstap_log_qtypes);
+	print_string_var("dnstap-log-rcodes:", opt->dnstap_log_rcodes);
+	printf("\tdnstap-log-rrl-only: %s\n", opt->dnstap_log_rrl_only?"yes":"no");
 #endif
 
 	printf("\nremote-control:\n");
@@ -626,6 +662,13 @@ config_test_print_server(nsd_options_type* opt)
 	print_string_var("control-key-file:", opt->control_key_file);
 	print_string_var("control-cert-file:", opt->control_cert_file);
 
+	printf("\nmetrics:\n");
+	printf("\tmetrics-enable: %s\n", opt->metrics_enable?"yes":"no");
+	for(ip = opt->metrics_interface; ip; ip=ip->next)
+		print_string_var("metrics-interface:", ip->address);
+	printf("\tmetrics-port: %d\n", opt->metrics_port);
+	print_string_var("metrics-path:", opt->metrics_path);
+
 	RBTREE_FOR(key, key_options_type*, opt->keys)
 	{
 		printf("\nkey:\n");
@@ -753,6 +796,12 @@ additional_checks(nsd_options_type* opt, const char* filename)
 				filename, opt->xfrdir, opt->chroot);
 			errors ++;
                 }
+		if (opt->cookie_secret_file &&
+			!file_inside_chroot(opt->cookie_secret_file, opt->chroot)) {
+			fprintf(stderr, "%s: cookie-secret-file %s is not relative to chroot %s.\n",
+				filename, opt->cookie_secret_file, opt->chroot);
+			errors ++;
+		}
 	}
 
 	if (atoi(opt->port) <= 0) {
@@ -31,13 +31,14 @@ struct nsd nsd;
 static void
 usage (void)
 {
-	fprintf(stderr, "Usage: nsd-checkzone <zone name> <zone file>\n");
+	fprintf(stderr, "Usage: nsd-checkzone [-p] <zone name> <zone file>\n");
+	fprintf(stderr, "\t-p\tprint the zone if it is ok.\n");
 	fprintf(stderr, "Version %s. Report bugs to <%s>.\n",
 		PACKAGE_VERSION, PACKAGE_BUGREPORT);
 }
 
 static void
-check_zone(struct nsd* nsd, const char* name, const char* fname)
+check_zone(struct nsd* nsd, const char* name, const char* fname, int print)
 {
 	const dname_type* dname;
 	zone_options_type* zo;
@@ -67,7 +68,15 @@ check_zone(struct nsd* nsd, const char* name, const char* fname)
 #endif
 		exit(1);
 	}
-	printf("zone %s is ok\n", name);
+	if(print) {
+		/* the zone in the format that the zonefiles are written in */
+		(void)setvbuf(stdout, NULL, _IOFBF, 262144);
+		if(!print_rrs(stdout, zone) || fflush(stdout) != 0) {
+			error("could not print zone %s", name);
+		}
+	} else {
+		printf("zone %s is ok\n", name);
+	}
 	namedb_close(nsd->db);
 }
 
@@ -95,17 +104,21 @@ main(int argc, char *argv[])
 {
 	/* Scratch variables... */
 	int c;
+	int print = 0;
 	struct nsd nsd;
 	memset(&nsd, 0, sizeof(nsd));
 
 	log_init("nsd-checkzone");
 
 	/* Parse the command line... */
-	while ((c = getopt(argc, argv, "h")) != -1) {
+	while ((c = getopt(argc, argv, "hp")) != -1) {
 		switch (c) {
 		case 'h':
 			usage();
 			exit(0);
+		case 'p':
+			print = 1;
+			break;
 		case '?':
 		default:
 			usage();
@@ -128,7 +141,7 @@ main(int argc, char *argv[])
 	if (verbosity == 0)
 		verbosity = nsd.options->verbosity;
 
-	check_zone(&nsd, argv[0], argv[1]);
+	check_zone(&nsd, argv[0], argv[1], print);
 	region_destroy(nsd.options->region);
 	/* yylex_destroy(); but, not available in all versions of flex */
 
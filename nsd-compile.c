@@ -0,0 +1,232 @@
+/*
+ * nsd-compile.c -- nsd-compile(8)
+ *
+ * Copyright (c) 2019, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "nsd.h"
+#include "tsig.h"
+#include "options.h"
+#include "namedb.h"
+#include "udb.h"
+#include "util.h"
+
+struct nsd nsd;
+
+/*
+ * Print the help text.
+ *
+ */
+static void
+usage (void)
+{
+	fprintf(stderr, "Usage: nsd-compile [-c configfile] [-o dbfile]\n\n");
+	fprintf(stderr, "Reads the zonefiles of the zones in the config and "
+		"writes them into the\n");
+	fprintf(stderr, "database, that nsd can load without parsing the "
+		"zonefiles.\n");
+	fprintf(stderr, "-c configfile\tconfig file to use, default %s\n",
+		CONFIGFILE);
+	fprintf(stderr, "-o dbfile\tdatabase to write, default the database "
+		"from the config\n");
+	fprintf(stderr, "Version %s. Report bugs to <%s>.\n",
+		PACKAGE_VERSION, PACKAGE_BUGREPORT);
+}
+
+/* read the zonefile into the db, returns false if the zone has no data */
+static int
+compile_zone(struct nsd* nsd, struct zone_options* zo)
+{
+	const dname_type* dname = (const dname_type*)zo->node.key;
+	zone_type* zone;
+
+	if(!zo->pattern->zonefile || !zo->pattern->zonefile[0]) {
+		VERBOSITY(1, (LOG_INFO, "zone %s has no zonefile, skipped",
+			zo->name));
+		return 1;
+	}
+	zone = namedb_zone_create(nsd->db, dname, zo);
+	namedb_read_zonefile(nsd, zone, NULL, NULL);
+	if(!zone->soa_rrset) {
+		log_msg(LOG_ERR, "zone %s: no data from zonefile %s",
+			zo->name, config_make_zonefile(zo, nsd));
+		return 0;
+	}
+	return 1;
+}
+
+/* compile all the zones into the dbfile, returns false on failure */
+static int
+compile_db(struct nsd* nsd, const char* dbfile)
+{
+	struct zone_options* zo;
+	char tmpfile[1024];
+	size_t count = 0, errors = 0;
+
+	/* build into a new file, so that a running nsd never sees
+	 * a partial database and a failed compile keeps the old one */
+	if(snprintf(tmpfile, sizeof(tmpfile), "%s.compile-%u", dbfile,
+		(unsigned)getpid()) >= (int)sizeof(tmpfile)) {
+		log_msg(LOG_ERR, "database filename too long: %s", dbfile);
+		return 0;
+	}
+	unlink(tmpfile);
+	nsd->db = namedb_open(tmpfile, nsd->options);
+	if(!nsd->db || !nsd->db->udb) {
+		log_msg(LOG_ERR, "cannot create %s: %s", tmpfile,
+			strerror(errno));
+		return 0;
+	}
+
+	RBTREE_FOR(zo, struct zone_options*, nsd->options->zone_options) {
+		if(!compile_zone(nsd, zo))
+			errors++;
+		else	count++;
+	}
+	if(errors > 0) {
+		log_msg(LOG_ERR, "%u zones failed, %s is not changed",
+			(unsigned)errors, dbfile);
+		namedb_close(nsd->db);
+		nsd->db = NULL;
+		unlink(tmpfile);
+		return 0;
+	}
+
+	/* namedb_close syncs the file to disk */
+	namedb_close(nsd->db);
+	nsd->db = NULL;
+	if(rename(tmpfile, dbfile) != 0) {
+		log_msg(LOG_ERR, "rename %s to %s failed: %s", tmpfile,
+			dbfile, strerror(errno));
+		unlink(tmpfile);
+		return 0;
+	}
+	printf("%u zones compiled into %s\n", (unsigned)count, dbfile);
+	return 1;
+}
+
+/* dummy functions to link */
+struct nsd;
+int writepid(struct nsd * ATTR_UNUSED(nsd))
+{
+	        return 0;
+}
+void unlinkpid(const char * ATTR_UNUSED(file))
+{
+}
+void bind8_stats(struct nsd * ATTR_UNUSED(nsd))
+{
+}
+
+void sig_handler(int ATTR_UNUSED(sig))
+{
+}
+
+extern char *optarg;
+extern int optind;
+
+int
+main(int argc, char *argv[])
+{
+	/* Scratch variables... */
+	int c;
+	const char *configfile = CONFIGFILE;
+	const char *dbfile = NULL;
+	memset(&nsd, 0, sizeof(nsd));
+
+	log_init("nsd-compile");
+	/* the journals belong to the zonefiles of the running nsd */
+	nsd.journal_readonly = 1;
+
+	/* Parse the command line... */
+	while ((c = getopt(argc, argv, "c:ho:"
+		)) != -1) {
+		switch (c) {
+		case 'c':
+			configfile = optarg;
+			break;
+		case 'o':
+			dbfile = optarg;
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		case '?':
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	argc -= optind;
+
+	/* Commandline parse error */
+	if (argc != 0) {
+		usage();
+		exit(1);
+	}
+
+	/* Read options */
+	nsd.options = nsd_options_create(region_create_custom(xalloc, free,
+		DEFAULT_CHUNK_SIZE, DEFAULT_LARGE_OBJECT_SIZE,
+		DEFAULT_INITIAL_CLEANUP_SIZE, 1));
+	tsig_init(nsd.options->region);
+	if(!parse_options_file(nsd.options, configfile, NULL, NULL)) {
+		error("could not read config: %s\n", configfile);
+	}
+	if(!parse_zone_list_file(nsd.options)) {
+		error("could not read zonelist file %s\n",
+			nsd.options->zonelistfile);
+	}
+	if (verbosity == 0)
+		verbosity = nsd.options->verbosity;
+	if(dbfile && dbfile[0] != '/') {
+		/* relative to the current directory, not to the zonesdir */
+		static char path[1024];
+		if(!getcwd(path, sizeof(path)))
+			error("getcwd: %s", strerror(errno));
+		if(strlcat(path, "/", sizeof(path)) >= sizeof(path) ||
+			strlcat(path, dbfile, sizeof(path)) >= sizeof(path))
+			error("database filename too long: %s", dbfile);
+		dbfile = path;
+	}
+	if(!dbfile)
+		dbfile = nsd.options->database;
+	if(!dbfile || !dbfile[0]) {
+		error("no database to write, the config has database: \"\", "
+			"use -o dbfile");
+	}
+#ifndef HAVE_MMAP
+	error("no mmap(), nsd cannot use a database on this system");
+#endif
+
+#ifdef HAVE_CHROOT
+	if(nsd.chrootdir == 0) nsd.chrootdir = nsd.options->chroot;
+#ifdef CHROOTDIR
+	/* if still no chrootdir, fallback to default */
+	if(nsd.chrootdir == 0) nsd.chrootdir = CHROOTDIR;
+#endif /* CHROOTDIR */
+#endif /* HAVE_CHROOT */
+	if(nsd.options->zonesdir && nsd.options->zonesdir[0]) {
+		if(chdir(nsd.options->zonesdir)) {
+			error("cannot chdir to '%s': %s",
+				nsd.options->zonesdir, strerror(errno));
+		}
+		DEBUG(DEBUG_IPC,1, (LOG_INFO, "changed directory to %s",
+			nsd.options->zonesdir));
+	}
+
+	if(!compile_db(&nsd, dbfile))
+		exit(1);
+	exit(0);
+}
@@ -89,11 +89,15 @@ usage()
 	printf("  status			display status of server\n");
 	printf("  stats				print statistics\n");
 	printf("  stats_noreset			peek at statistics\n");
+	printf("  zonestats			print statistics per zone\n");
+	printf("  zonestats_noreset		peek at statistics per zone\n");
+	printf("  top [<number>]		print the most queried names, clients and zones\n");
+	printf("  top_noreset [<number>]	peek at the most queried names, clients, zones\n");
 	printf("  addzone <name> <pattern>	add a new zone\n");
 	printf("  delzone <name>		remove a zone\n");
 	printf("  changezone <name> <pattern>	change zone to use pattern\n");
-	printf("  addzones			add zone list on stdin {name space pattern newline}\n");
-	printf("  delzones			remove zone list on stdin {name newline}\n");
+	printf("  addzones [<file>]		add zone list on stdin or in file {name space pattern newline}\n");
+	printf("  delzones [<file>]		remove zone list on stdin or in file {name newline}\n");
 	printf("  write [<zone>]		write changed zonefiles to disk\n");
 	printf("  notify [<zone>]		send NOTIFY messages to slave servers\n");
 	printf("  transfer [<zone>]		try to update slave zones to newer serial\n");
@@ -373,9 +377,16 @@ static void
 send_file(SSL* ssl, int fd, FILE* in, char* buf, size_t sz)
 {
 	char e[] = {0x04, 0x0a};
-	while(fgets(buf, (int)sz, in)) {
-		remote_write(ssl, fd, buf, strlen(buf));
+	size_t r;
+	char last = '\n';
+	/* in blocks, not per line, for bulk input */
+	while((r = fread(buf, 1, sz, in)) > 0) {
+		remote_write(ssl, fd, buf, r);
+		last = buf[r-1];
 	}
+	/* the end-of-file marker has to be on a line of its own */
+	if(last != '\n')
+		remote_write(ssl, fd, "\n", 1);
 	/* send end-of-file marker */
 	remote_write(ssl, fd, e, sizeof(e));
 }
@@ -390,6 +401,18 @@ go_cmd(SSL* ssl, int fd, int argc, char* argv[])
 	int was_error = 0, first_line = 1;
 	int i;
 	char buf[1024];
+	char zbuf[16384];
+	FILE* in = NULL;
+	/* the zone list is read from stdin or from the file argument */
+	if(argc >= 1 && (strcmp(argv[0], "addzones") == 0 ||
+		strcmp(argv[0], "delzones") == 0)) {
+		if(argc > 2)
+			error("too many arguments for %s", argv[0]);
+		if(argc == 2 && !(in = fopen(argv[1], "r")))
+			error("could not open %s: %s", argv[1],
+				strerror(errno));
+		argc = 1;
+	}
 	snprintf(pre, sizeof(pre), "NSDCT%d ", NSD_CONTROL_VERSION);
 	remote_write(ssl, fd, pre, strlen(pre));
 	for(i=0; i<argc; i++) {
@@ -401,7 +424,9 @@ go_cmd(SSL* ssl, int fd, int argc, char* argv[])
 	/* send contents to server */
 	if(argc == 1 && (strcmp(argv[0], "addzones") == 0 ||
 		strcmp(argv[0], "delzones") == 0)) {
-		send_file(ssl, fd, stdin, buf, sizeof(buf));
+		send_file(ssl, fd, (in?in:stdin), zbuf, sizeof(zbuf));
+		if(in)
+			fclose(in);
 	}
 
 	while(1) {
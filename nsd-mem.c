@@ -24,6 +24,7 @@
 #include "udb.h"
 #include "udbzone.h"
 #include "util.h"
+#include "zonec.h"
 
 struct nsd nsd;
 
@@ -34,7 +35,9 @@ struct nsd nsd;
 static void
 usage (void)
 {
-	fprintf(stderr, "Usage: nsd-mem [-c configfile]\n");
+	fprintf(stderr, "Usage: nsd-mem [-s] [-c configfile]\n");
+	fprintf(stderr, "-s\testimate from a scan of the zonefiles, without "
+		"loading the zones\n");
 	fprintf(stderr, "Version %s. Report bugs to <%s>.\n",
 		PACKAGE_VERSION, PACKAGE_BUGREPORT);
 }
@@ -193,6 +196,8 @@ check_zone_mem(const char* tf, const char* df, struct zone_options* zo,
 	/* init*/
 	memset(&zmem, 0, sizeof(zmem));
 	memset(&nsd, 0, sizeof(nsd));
+	/* the journals belong to the zonefiles of the running nsd */
+	nsd.journal_readonly = 1;
 	nsd.db = db = namedb_open(df, opt);
 	if(!db) error("cannot open %s: %s", df, strerror(errno));
 	zone = namedb_zone_create(db, dname, zo);
@@ -218,8 +223,136 @@ check_zone_mem(const char* tf, const char* df, struct zone_options* zo,
 	add_mem(totmem, &zmem);
 }
 
+/* size of an allocation in the region, with the alignment */
+#define EST_ALIGN(x) (((x) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+/* the radix tree nodes and lookup arrays per domain name, measured for
+ * zones with hosts and with delegations, in memory and in the nsd.db */
+#define EST_RADIX_RAM 112
+#define EST_RADIX_DISK 336
+/* max number of rrset types remembered for the owner name */
+#define EST_MAX_TYPES 64
+
+/* zone estimate, from the RRs of the zonefile */
+struct zone_est {
+	/* the memory use */
+	struct zone_mem mem;
+	/* previous owner name and the types of rrsets it has */
+	domain_type* owner;
+	uint16_t types[EST_MAX_TYPES];
+	size_t num_types;
+	/* if the zone has NSEC3 */
+	int nsec3;
+};
+
+/* add an RR to the estimate */
+static void
+estimate_rr(void* arg, rr_type* rr, size_t new_domains, int new_owner)
+{
+	struct zone_est* est = (struct zone_est*)arg;
+	const dname_type* dname = domain_dname(rr->owner);
+	size_t i, wirelen = 0;
+
+	/* the new names in the domain table */
+	est->mem.domaincount += new_domains;
+	est->mem.data += new_domains * (EST_ALIGN(sizeof(domain_type)) +
+		EST_ALIGN(sizeof(dname_type) + dname->label_count +
+		dname->name_size) + EST_RADIX_RAM);
+	/* the owner can reuse the memory of a released name, so the
+	 * rrset types are also forgotten for a new owner name */
+	if(est->owner != rr->owner || new_owner) {
+		est->owner = rr->owner;
+		est->num_types = 0;
+	}
+	if(new_owner) {
+		/* the nsd.db only stores the names that have data */
+		est->mem.udb_data += sizeof(struct domain_d) +
+			dname->name_size;
+		est->mem.udb_overhead += udb_alloc_space_needed(
+			sizeof(struct domain_d) + dname->name_size) -
+			(sizeof(struct domain_d) + dname->name_size) +
+			EST_RADIX_DISK;
+	}
+	for(i=0; i<est->num_types; i++)
+		if(est->types[i] == rr->type)
+			break;
+	if(i == est->num_types) {
+		if(est->num_types < EST_MAX_TYPES)
+			est->types[est->num_types++] = rr->type;
+		est->mem.data += EST_ALIGN(sizeof(rrset_type));
+		est->mem.udb_data += sizeof(struct rrset_d);
+		est->mem.udb_overhead += udb_alloc_space_needed(
+			sizeof(struct rrset_d)) - sizeof(struct rrset_d);
+	}
+
+	/* the RR and its rdata */
+	est->mem.data += EST_ALIGN(sizeof(rr_type)) +
+		EST_ALIGN(rr->rdata_count * sizeof(rdata_atom_type));
+	for(i=0; i<rr->rdata_count; i++) {
+		if(rdata_atom_is_domain(rr->type, i)) {
+			wirelen += domain_dname(rdata_atom_domain(
+				rr->rdatas[i]))->name_size;
+		} else {
+			wirelen += rdata_atom_size(rr->rdatas[i]);
+			est->mem.data += EST_ALIGN(sizeof(uint16_t) +
+				rdata_atom_size(rr->rdatas[i]));
+		}
+	}
+	est->mem.udb_data += sizeof(struct rr_d) + wirelen;
+	est->mem.udb_overhead += udb_alloc_space_needed(sizeof(struct rr_d) +
+		wirelen) - (sizeof(struct rr_d) + wirelen);
+#ifdef NSEC3
+	if(rr->type == TYPE_NSEC3PARAM)
+		est->nsec3 = 1;
+#endif
+}
+
+static void
+estimate_zone_mem(struct zone_options* zo, struct nsd_options* opt,
+	struct tot_mem* totmem)
+{
+	struct nsd nsd;
+	struct namedb* db;
+	const dname_type* dname = (const dname_type*)zo->node.key;
+	zone_type* zone;
+	struct zone_est est;
+	unsigned int errors;
+
+	printf("zone %s\n", zo->name);
+	if(!zo->pattern->zonefile || !zo->pattern->zonefile[0]) {
+		printf("no zonefile\n");
+		return;
+	}
+
+	/* only the domain table, the zone is not stored */
+	memset(&est, 0, sizeof(est));
+	memset(&nsd, 0, sizeof(nsd));
+	nsd.options = opt;
+	nsd.db = db = namedb_open("", opt);
+	if(!db) error("cannot create namedb");
+	zone = namedb_zone_create(db, dname, zo);
+	errors = zonec_count(zo->name, config_make_zonefile(zo, &nsd), zone,
+		&estimate_rr, &est);
+	if(errors > 0)
+		printf("zonefile has %u errors\n", errors);
+#ifdef NSEC3
+	/* the precompiled hashes for every name */
+	if(est.nsec3)
+		est.mem.data += est.mem.domaincount * (EST_ALIGN(
+			sizeof(struct nsec3_domain_data)) + EST_ALIGN(
+			sizeof(nsec3_hash_wc_node_type)));
+#endif
+	if(opt->database == NULL || opt->database[0] == 0) {
+		est.mem.udb_data = 0;
+		est.mem.udb_overhead = 0;
+	}
+
+	print_zone_mem(&est.mem);
+	namedb_close(db);
+	add_mem(totmem, &est.mem);
+}
+
 static void
-check_mem(struct nsd_options* opt)
+check_mem(struct nsd_options* opt, int estimate)
 {
 	struct tot_mem totmem;
 	struct zone_options* zo;
@@ -233,7 +366,9 @@ check_mem(struct nsd_options* opt)
 
 	/* read all zones and account memory */
 	RBTREE_FOR(zo, struct zone_options*, opt->zone_options) {
-		check_zone_mem(tf, df, zo, opt, &totmem);
+		if(estimate)
+			estimate_zone_mem(zo, opt, &totmem);
+		else	check_zone_mem(tf, df, zo, opt, &totmem);
 	}
 
 	/* calculate more total statistics */
@@ -275,6 +410,7 @@ main(int argc, char *argv[])
 {
 	/* Scratch variables... */
 	int c;
+	int estimate = 0;
 	struct nsd nsd;
 	const char *configfile = CONFIGFILE;
 	memset(&nsd, 0, sizeof(nsd));
@@ -282,12 +418,15 @@ main(int argc, char *argv[])
 	log_init("nsd-mem");
 
 	/* Parse the command line... */
-	while ((c = getopt(argc, argv, "c:h"
+	while ((c = getopt(argc, argv, "c:hs"
 		)) != -1) {
 		switch (c) {
 		case 'c':
 			configfile = optarg;
 			break;
+		case 's':
+			estimate = 1;
+			break;
 		case 'h':
 			usage();
 			exit(0);
@@ -348,7 +487,7 @@ main(int argc, char *argv[])
 	}
 #endif /* HAVE_CHROOT */
 
-	check_mem(nsd.options);
+	check_mem(nsd.options, estimate);
 
 	exit(0);
 }
@@ -47,7 +47,10 @@
 #include "options.h"
 #include "tsig.h"
 #include "remote.h"
+#include "metrics.h"
 #include "xfrd-disk.h"
+#include "rrl.h"
+#include "topn.h"
 #ifdef USE_DNSTAP
 #include "dnstap/dnstap_collector.h"
 #endif
@@ -1438,6 +1441,10 @@ main(int argc, char *argv[])
 		} else if (!file_inside_chroot(nsd.options->xfrdir, nsd.chrootdir)) {
 			error("xfrdir %s is not relative to %s: chroot not possible",
 				nsd.options->xfrdir, nsd.chrootdir);
+		} else if (nsd.options->cookie_secret_file &&
+			!file_inside_chroot(nsd.options->cookie_secret_file, nsd.chrootdir)) {
+			error("cookie-secret-file %s is not relative to %s: chroot not possible",
+				nsd.options->cookie_secret_file, nsd.chrootdir);
 		}
 	}
 
@@ -1531,6 +1538,11 @@ main(int argc, char *argv[])
 			error("could not set up tls SSL_CTX");
 	}
 #endif /* HAVE_SSL */
+	if(nsd.options->metrics_enable) {
+		/* open the ports while superuser and outside chroot */
+		if(!(nsd.metrics = daemon_metrics_create(nsd.options)))
+			error("could not perform metrics setup");
+	}
 
 	/* Unless we're debugging, fork... */
 	if (!nsd.debug) {
@@ -1607,6 +1619,9 @@ main(int argc, char *argv[])
 			nsd.options->zonelistfile += l;
 		if (nsd.options->xfrdir[0] == '/')
 			nsd.options->xfrdir += l;
+		if (nsd.options->cookie_secret_file &&
+			nsd.options->cookie_secret_file[0] == '/')
+			nsd.options->cookie_secret_file += l;
 
 		/* strip chroot from pathnames of "include:" statements
 		 * on subsequent repattern commands */
@@ -1686,6 +1701,17 @@ main(int argc, char *argv[])
 	options_zonestatnames_create(nsd.options);
 	server_zonestat_alloc(&nsd);
 #endif /* USE_ZONE_STATS */
+	/* before xfrd is forked, it reads the tables for the remote control */
+#ifdef RATELIMIT
+	topn_mmap_init(nsd.child_count, nsd.options->rrl_ipv4_prefix_length,
+		nsd.options->rrl_ipv6_prefix_length);
+#else
+	topn_mmap_init(nsd.child_count, RRL_IPV4_PREFIX_LENGTH,
+		RRL_IPV6_PREFIX_LENGTH);
+#endif /* RATELIMIT */
+#ifdef BIND8_STATS
+	server_stat_map_alloc(&nsd);
+#endif
 #ifdef USE_DNSTAP
 	if(nsd.options->dnstap_enable) {
 		nsd.dt_collector = dt_collector_create(&nsd);
@@ -30,6 +30,7 @@ struct netio_handler;
 struct nsd_options;
 struct udb_base;
 struct daemon_remote;
+struct daemon_metrics;
 #ifdef USE_DNSTAP
 struct dt_collector;
 #endif
@@ -92,6 +93,11 @@ typedef	unsigned long stc_type;
 
 #define	LASTELEM(arr)	(sizeof(arr) / sizeof(arr[0]) - 1)
 
+/* number of buckets of the latency histogram, the last has no bound */
+#define NSD_LATENCY_BUCKETS 11
+/* the upper bounds of the latency buckets, in microseconds */
+extern const unsigned nsd_latency_bound[NSD_LATENCY_BUCKETS-1];
+
 #define	STATUP(nsd, stc) nsd->st.stc++
 /* #define	STATUP2(nsd, stc, i)  ((i) <= (LASTELEM(nsd->st.stc) - 1)) ? nsd->st.stc[(i)]++ : \
 				nsd->st.stc[LASTELEM(nsd->st.stc)]++ */
@@ -105,14 +111,67 @@ typedef	unsigned long stc_type;
 #endif /* BIND8_STATS */
 
 #ifdef USE_ZONE_STATS
+/* the counters of struct nsdzst start with the plain counters, that
+ * ZTATUP increments by name, the commonly used array elements follow */
+enum zonestat_plain {
+	zst_qudp = 0, zst_qudp6, zst_ctcp, zst_ctcp6, zst_ctls, zst_ctls6,
+	zst_nona, zst_dropped, zst_truncated, zst_edns, zst_ednserr,
+	zst_raxfr, ZONESTAT_PLAIN_NUM
+};
+/* number of counters in struct nsdzst, ZONESTAT_PLAIN_NUM of them plain */
+#define ZONESTAT_COUNTER_NUM 39
+/* the elements of the qtype, qclass, rcode and opcode arrays in struct
+ * nsdst are numbered like this, out of range values use the last element */
+#define ZST_qtype(i) ((i) < 256 ? (unsigned)(i) : 256)
+#define ZST_qclass(i) (257 + ((i) < 3 ? (unsigned)(i) : 3))
+#define ZST_rcode(i) (261 + ((i) < 16 ? (unsigned)(i) : 16))
+#define ZST_opcode(i) (278 + ((i) < 5 ? (unsigned)(i) : 5))
+#define ZONESTAT_ARRAY_NUM 284
+/* size of the table with the rare counters, entries of 16 bytes */
+#define ZONESTAT_RARE_NUM (1<<20)
+
+/* The statistics for one zonestat name, in the mmapped arrays.  The
+ * array elements that do not have a counter here are in the rare table. */
+struct nsdzst {
+	stc_type counter[ZONESTAT_COUNTER_NUM];
+	/* index+1 of the first rare counter of this zone, or 0 */
+	uint32_t rare;
+	uint32_t unused;
+};
+
+/* a rare counter, in the list of rare counters for its zone */
+struct zonestat_rare_entry {
+	stc_type count;
+	/* index+1 of the next entry of the zone, or 0 */
+	uint32_t next;
+	/* the ZST_ array element number */
+	uint16_t id;
+	uint16_t unused;
+};
+
+/* Table of the rare counters, shared by the processes.  Entries are
+ * taken from it atomically and not removed, if it is full the counts
+ * are added to lost. */
+struct zonestat_rare {
+	uint32_t used;
+	stc_type lost;
+	struct zonestat_rare_entry entry[ZONESTAT_RARE_NUM];
+};
+
+/* the counter number for the ZST_ array element, or 0 if it is rare */
+extern uint8_t zonestat_slot[ZONESTAT_ARRAY_NUM];
+
 /* increment zone statistic, checks if zone-nonNULL and zone array bounds */
 #define ZTATUP(nsd, zone, stc) ( \
 	(zone && zone->zonestatid < nsd->zonestatsizenow) ? \
-		nsd->zonestatnow[zone->zonestatid].stc++ \
+		nsd->zonestatnow[zone->zonestatid].counter[zst_##stc]++ \
 		: 0)
 #define	ZTATUP2(nsd, zone, stc, i) ( \
 	(zone && zone->zonestatid < nsd->zonestatsizenow) ? \
-		(nsd->zonestatnow[zone->zonestatid].stc[(i) <= (LASTELEM(nsd->zonestatnow[zone->zonestatid].stc) - 1) ? i : LASTELEM(nsd->zonestatnow[zone->zonestatid].stc)]++ ) \
+		(zonestat_slot[ZST_##stc(i)] ? \
+		nsd->zonestatnow[zone->zonestatid].counter[zonestat_slot[ZST_##stc(i)]]++ : \
+		(stc_type)zonestat_rare_inc(nsd->zonestatrarenow, \
+		&nsd->zonestatnow[zone->zonestatid], ZST_##stc(i))) \
 		: 0)
 #else /* USE_ZONE_STATS */
 #define	ZTATUP(nsd, zone, stc) /* Nothing */
@@ -226,6 +285,8 @@ struct	nsd
 	region_type* server_region;
 	struct netio_handler* xfrd_listener;
 	struct daemon_remote* rc;
+	/* the metrics http service, in xfrd */
+	struct daemon_metrics* metrics;
 
 	/* Configuration */
 	const char		*dbfile;
@@ -240,6 +301,14 @@ struct	nsd
 	uint16_t		nsid_len;
 	unsigned char		*nsid;
 	uint8_t 		file_rotation_ok;
+	/* zone journals are applied but not changed, for nsd-compile */
+	uint8_t			journal_readonly;
+
+	/* DNS cookie secrets, the first is used to create server cookies,
+	 * the second (staging or previous) is accepted for verification.
+	 * Set up before the fork, so all children share them. */
+	uint8_t			cookie_secrets[2][COOKIE_SECRET_SIZE];
+	size_t			cookie_secrets_count;
 
 #ifdef HAVE_CPUSET_T
 	int			use_cpu_affinity;
@@ -286,11 +355,19 @@ struct	nsd
 		/* Dropped, truncated, queries for nonconfigured zone, tx errors */
 		stc_type dropped, truncated, wrongzone, txerr, rxerr;
 		stc_type edns, ednserr, raxfr, nona;
+		/* dnstap messages dropped, because the collector lagged */
+		stc_type dnstap_dropped;
+		/* histogram of the time to answer, and the total in usec */
+		stc_type latency[NSD_LATENCY_BUCKETS], latency_usec;
 		uint64_t db_disk, db_mem;
+		/* time (usec) and bytes moved by database compaction */
+		uint64_t db_compact_usec, db_compact_moved;
 	} st;
 	/* per zone stats, each an array per zone-stat-idx, stats per zone is
 	 * add of [0][zoneidx] and [1][zoneidx]. */
-	struct nsdst* zonestat[2];
+	struct nsdzst* zonestat[2];
+	/* the rare counters for the zonestat arrays, shared anonymous mmap */
+	struct zonestat_rare* zonestatrare[2];
 	/* fd for zonestat mapping (otherwise mmaps cannot be shared between
 	 * processes and resized) */
 	int zonestatfd[2];
@@ -299,13 +376,22 @@ struct	nsd
 	/* size of the mmapped zone stat array (number of array entries) */
 	size_t zonestatsize[2], zonestatdesired, zonestatsizenow;
 	/* current zonestat array to use */
-	struct nsdst* zonestatnow;
+	struct nsdzst* zonestatnow;
+	struct zonestat_rare* zonestatrarenow;
+	/* copies of st of the serving children, that they publish every
+	 * second for the metrics, NULL if not enabled.  A shared anonymous
+	 * mmap of two blocks of child_count, after a reload the new
+	 * children use the other block, like the zonestat arrays */
+	struct nsdst* stat_map;
+	/* the block of stat_map that the children use, 0 or 1 */
+	int stat_block;
 #endif /* BIND8_STATS */
 #ifdef USE_DNSTAP
 	/* the dnstap collector process info */
 	struct dt_collector* dt_collector;
 	/* the pipes from server processes to the dt_collector,
-	 * arrays of size child_count.  Kept open for (re-)forks. */
+	 * arrays of size child_count.  Kept open for (re-)forks.  With the
+	 * shared memory rings, they are only used to wake up the collector */
 	int *dt_collector_fd_send, *dt_collector_fd_recv;
 #endif /* USE_DNSTAP */
 	/* ratelimit for errors, time value */
@@ -351,6 +437,26 @@ void server_zonestat_alloc(struct nsd* nsd);
 /* remap the mmaps for zonestat isx, to bytesize sz.  Caller has to set
  * the zonestatsize */
 void zonestat_remap(struct nsd* nsd, int idx, size_t sz);
+#ifdef USE_ZONE_STATS
+/* setup the zonestat_slot table */
+void zonestat_slot_init(void);
+/* increment the rare counter id, of the zone z, in the table */
+int zonestat_rare_inc(struct zonestat_rare* rare, struct nsdzst* z,
+	unsigned id);
+/* the stat counter for the nsdzst counter number */
+stc_type* zonestat_counter(struct nsdst* st, unsigned c);
+/* the stat counter for the ZST_ array element */
+stc_type* zonestat_array_counter(struct nsdst* st, unsigned id);
+/* add the counters of z, and its rare counters, to st */
+void zonestat_add(struct nsdst* st, struct nsdzst* z,
+	struct zonestat_rare* rare);
+/* the counts that did not fit in the rare tables, since the start */
+stc_type zonestat_lost(struct nsd* nsd);
+#endif
+#ifdef BIND8_STATS
+/* allocate the shared copies of the child statistics, for the metrics */
+void server_stat_map_alloc(struct nsd* nsd);
+#endif
 /* allocate and init xfrd variables */
 void server_prepare_xfrd(struct nsd *nsd);
 /* start xfrdaemon (again) */
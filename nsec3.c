@@ -18,6 +18,7 @@
 #include "answer.h"
 #include "udbzone.h"
 #include "options.h"
+#include "lookup3.h"
 
 #define NSEC3_RDATA_BITMAP 5
 
@@ -124,6 +125,71 @@ nsec3_hash_and_store(zone_type* zone, const dname_type* dname, uint8_t* store)
 		dname_name(dname), dname->name_size, nsec3_iterations);
 }
 
+/*
+ * Cache of the hashes of names at query time, so that names that are
+ * queried often are not hashed again for the nonexist proof.  It is per
+ * server process, and the processes are restarted when zones reload, so
+ * the zone pointer with the name is the key.
+ */
+struct nsec3_cache_entry {
+	zone_type* zone;
+	uint32_t used; /* for least recently used */
+	uint8_t hash[NSEC3_HASH_LEN];
+	uint8_t name_size;
+	uint8_t name[MAXDOMAINLEN];
+};
+static struct nsec3_cache_entry* nsec3_cache = NULL;
+static uint32_t nsec3_cache_used = 0;
+
+int
+nsec3_hash_cache_set(zone_type* zone, const dname_type* dname)
+{
+	return (int)(hashlittle(dname_name(dname), dname->name_size,
+		(uint32_t)(size_t)zone) % NSEC3_CACHE_SETS);
+}
+
+void
+nsec3_hash_cache_clear(void)
+{
+	free(nsec3_cache);
+	nsec3_cache = NULL;
+	nsec3_cache_used = 0;
+}
+
+void
+nsec3_hash_and_store_cached(zone_type* zone, const dname_type* dname,
+	uint8_t* store)
+{
+	struct nsec3_cache_entry* set, *e;
+	int i;
+
+	if(!nsec3_cache)
+		nsec3_cache = (struct nsec3_cache_entry*)xalloc_array_zero(
+			NSEC3_CACHE_SETS*NSEC3_CACHE_WAYS,
+			sizeof(struct nsec3_cache_entry));
+	set = &nsec3_cache[nsec3_hash_cache_set(zone, dname) *
+		NSEC3_CACHE_WAYS];
+	e = &set[0];
+	for(i=0; i<NSEC3_CACHE_WAYS; i++) {
+		if(set[i].zone == zone && set[i].name_size == dname->name_size
+			&& memcmp(set[i].name, dname_name(dname),
+			dname->name_size) == 0) {
+			set[i].used = ++nsec3_cache_used;
+			memmove(store, set[i].hash, NSEC3_HASH_LEN);
+			return;
+		}
+		if(set[i].used < e->used)
+			e = &set[i];
+	}
+	nsec3_hash_and_store(zone, dname, store);
+	/* replace the least recently used entry of the set */
+	e->zone = zone;
+	e->used = ++nsec3_cache_used;
+	memmove(e->hash, store, NSEC3_HASH_LEN);
+	e->name_size = (uint8_t)dname->name_size;
+	memmove(e->name, dname_name(dname), dname->name_size);
+}
+
 #define STORE_HASH(x,y) memmove(domain->nsec3->x,y,NSEC3_HASH_LEN); domain->nsec3->have_##x =1;
 
 /** find hash or create it and store it */
@@ -944,7 +1010,7 @@ nsec3_add_nonexist_proof(struct query* query, struct answer* answer,
 	to_prove = dname_partial_copy(query->region, qname,
 		dname_label_match_count(qname, domain_dname(encloser))+1);
 	/* generate proof that one label below closest encloser does not exist */
-	nsec3_hash_and_store(query->zone, to_prove, hash);
+	nsec3_hash_and_store_cached(query->zone, to_prove, hash);
 	if(nsec3_find_cover(query->zone, hash, sizeof(hash), &cover))
 	{
 		/* exact match, hash collision */
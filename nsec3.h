@@ -76,6 +76,18 @@ int domain_has_only_NSEC3(struct domain* domain, struct zone* zone);
 /* get hashed bytes */
 void nsec3_hash_and_store(struct zone* zone, const struct dname* dname,
 	uint8_t* store);
+/* the query name hash cache, sets of ways, a set is least recently used */
+#define NSEC3_CACHE_SETS 256
+#define NSEC3_CACHE_WAYS 4
+/* get hashed bytes of a query name, from the cache or hashed and stored
+ * in the cache.  The zone is the key with the name, its NSEC3PARAM is
+ * not expected to change in the server process */
+void nsec3_hash_and_store_cached(struct zone* zone, const struct dname* dname,
+	uint8_t* store);
+/* the set of the cache for the name, for unit test */
+int nsec3_hash_cache_set(struct zone* zone, const struct dname* dname);
+/* empty the cache, for unit test */
+void nsec3_hash_cache_clear(void);
 /* see if NSEC3 record uses the params in use for the zone */
 int nsec3_rr_uses_params(struct rr* rr, struct zone* zone);
 /* number of NSEC3s that are in the zone chain */
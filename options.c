@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <unistd.h>
 #include "options.h"
 #include "query.h"
 #include "tsig.h"
@@ -73,6 +74,9 @@ nsd_options_create(region_type* region)
 	opt->minimal_responses = 0; /* also packet.h::minimal_responses */
 	opt->confine_to_zone = 0;
 	opt->refuse_any = 0;
+	opt->nxdomain_flood_limit = 0;
+	opt->answer_cookie = 0;
+	opt->cookie_secret_file = NULL;
 	opt->server_count = 1;
 	opt->cpu_affinity = NULL;
 	opt->service_cpu_affinity = NULL;
@@ -100,6 +104,7 @@ nsd_options_create(region_type* region)
 	opt->rrl_slip = RRL_SLIP;
 	opt->rrl_ipv4_prefix_length = RRL_IPV4_PREFIX_LENGTH;
 	opt->rrl_ipv6_prefix_length = RRL_IPV6_PREFIX_LENGTH;
+	opt->rrl_cookie_ratelimit = RRL_COOKIE_LIMIT/2;
 #  ifdef RATELIMIT_DEFAULT_OFF
 	opt->rrl_ratelimit = 0;
 	opt->rrl_whitelist_ratelimit = 0;
@@ -111,18 +116,26 @@ nsd_options_create(region_type* region)
 #ifdef USE_DNSTAP
 	opt->dnstap_enable = 0;
 	opt->dnstap_socket_path = DNSTAP_SOCKET_PATH;
+	opt->dnstap_file_path = NULL;
+	opt->dnstap_file_size = 0;
 	opt->dnstap_send_identity = 0;
 	opt->dnstap_send_version = 0;
 	opt->dnstap_identity = NULL;
 	opt->dnstap_version = NULL;
 	opt->dnstap_log_auth_query_messages = 0;
 	opt->dnstap_log_auth_response_messages = 0;
+	opt->dnstap_sample_rate = 0;
+	opt->dnstap_log_qtypes = NULL;
+	opt->dnstap_log_rcodes = NULL;
+	opt->dnstap_log_rrl_only = 0;
 #endif
 	opt->zonefiles_check = 1;
 	if(opt->database == NULL || opt->database[0] == 0)
 		opt->zonefiles_write = ZONEFILES_WRITE_INTERVAL;
 	else	opt->zonefiles_write = 0;
 	opt->xfrd_reload_timeout = 1;
+	opt->xfrd_tcp_max_per_master = 0;
+	opt->xfrd_udp_share = 1;
 	opt->tls_service_key = NULL;
 	opt->tls_service_ocsp = NULL;
 	opt->tls_service_pem = NULL;
@@ -134,6 +147,10 @@ nsd_options_create(region_type* region)
 	opt->server_cert_file = CONFIGDIR"/nsd_server.pem";
 	opt->control_key_file = CONFIGDIR"/nsd_control.key";
 	opt->control_cert_file = CONFIGDIR"/nsd_control.pem";
+	opt->metrics_enable = 0;
+	opt->metrics_interface = NULL;
+	opt->metrics_port = NSD_METRICS_PORT;
+	opt->metrics_path = "/metrics";
 	return opt;
 }
 
@@ -258,6 +275,7 @@ parse_options_file(struct nsd_options* opt, const char* file,
 				c_error("key %s in pattern %s could not be found",
 					acl->key_name, pat->pname);
 		}
+		pattern_acl_tries_setup(opt->region, pat);
 	}
 
 	if(cfg_parser->errors > 0)
@@ -449,6 +467,17 @@ zone_options_delete(struct nsd_options* opt, struct zone_options* zone)
 	region_recycle(opt->region, zone, sizeof(*zone));
 }
 
+/* flush the zonelist, unless it is changed in a batch */
+static void
+zone_list_flush(struct nsd_options* opt)
+{
+	if(opt->zonelist_batch)
+		return;
+	if(fflush(opt->zonelist) != 0) {
+		log_msg(LOG_ERR, "fflush %s: %s", opt->zonelistfile, strerror(errno));
+	}
+}
+
 /* add a new zone to the zonelist */
 struct zone_options*
 zone_list_add(struct nsd_options* opt, const char* zname, const char* pname)
@@ -503,9 +532,9 @@ zone_list_add(struct nsd_options* opt, const char* zname, const char* pname)
 		opt->zonelist_off = ftello(opt->zonelist);
 		if(opt->zonelist_off == -1)
 			log_msg(LOG_ERR, "ftello(%s): %s", opt->zonelistfile, strerror(errno));
-		if(fflush(opt->zonelist) != 0) {
-			log_msg(LOG_ERR, "fflush %s: %s", opt->zonelistfile, strerror(errno));
-		}
+		if(opt->zonelist_batch)
+			opt->zonelist_batch = 2;
+		zone_list_flush(opt);
 		return zone;
 	}
 	b = (struct zonelist_bucket*)rbtree_search(opt->zonefree,
@@ -513,7 +542,9 @@ zone_list_add(struct nsd_options* opt, const char* zname, const char* pname)
 	if(!b || b->list == NULL) {
 		/* no empty place, append to file */
 		zone->off = opt->zonelist_off;
-		if(fseeko(opt->zonelist, zone->off, SEEK_SET) == -1) {
+		/* in a batch, the file is at the end after the last append */
+		if(opt->zonelist_batch != 2 &&
+			fseeko(opt->zonelist, zone->off, SEEK_SET) == -1) {
 			log_msg(LOG_ERR, "fseeko(%s): %s", opt->zonelistfile, strerror(errno));
 			log_msg(LOG_ERR, "zone %s could not be added", zname);
 			zone_options_delete(opt, zone);
@@ -531,14 +562,16 @@ zone_list_add(struct nsd_options* opt, const char* zname, const char* pname)
 			return NULL;
 		}
 		opt->zonelist_off += linesize;
-		if(fflush(opt->zonelist) != 0) {
-			log_msg(LOG_ERR, "fflush %s: %s", opt->zonelistfile, strerror(errno));
-		}
+		if(opt->zonelist_batch)
+			opt->zonelist_batch = 2;
+		zone_list_flush(opt);
 		return zone;
 	}
 	/* reuse empty spot */
 	e = b->list;
 	zone->off = e->off;
+	if(opt->zonelist_batch)
+		opt->zonelist_batch = 1;
 	if(fseeko(opt->zonelist, zone->off, SEEK_SET) == -1) {
 		log_msg(LOG_ERR, "fseeko(%s): %s", opt->zonelistfile, strerror(errno));
 		log_msg(LOG_ERR, "zone %s could not be added", zname);
@@ -556,9 +589,7 @@ zone_list_add(struct nsd_options* opt, const char* zname, const char* pname)
 		zone_options_delete(opt, zone);
 		return NULL;
 	}
-	if(fflush(opt->zonelist) != 0) {
-		log_msg(LOG_ERR, "fflush %s: %s", opt->zonelistfile, strerror(errno));
-	}
+	zone_list_flush(opt);
 
 	/* snip off and recycle element */
 	b->list = e->next;
@@ -576,6 +607,8 @@ void
 zone_list_del(struct nsd_options* opt, struct zone_options* zone)
 {
 	/* put its space onto the free entry */
+	if(opt->zonelist_batch)
+		opt->zonelist_batch = 1;
 	if(fseeko(opt->zonelist, zone->off, SEEK_SET) == -1) {
 		log_msg(LOG_ERR, "fseeko(%s): %s", opt->zonelistfile, strerror(errno));
 		return;
@@ -587,12 +620,11 @@ zone_list_del(struct nsd_options* opt, struct zone_options* zone)
 	zone_options_delete(opt, zone);
 
 	/* see if we need to compact: it is going to halve the zonelist */
-	if(opt->zonefree_number > opt->zone_options->count) {
+	if(opt->zonefree_number > opt->zone_options->count &&
+		!opt->zonelist_batch) {
 		zone_list_compact(opt);
 	} else {
-		if(fflush(opt->zonelist) != 0) {
-			log_msg(LOG_ERR, "fflush %s: %s", opt->zonelistfile, strerror(errno));
-		}
+		zone_list_flush(opt);
 	}
 }
 /* postorder delete of zonelist free space tree */
@@ -694,6 +726,24 @@ zone_list_compact(struct nsd_options* opt)
 	opt->zonelist_off = off;
 }
 
+/* end a batch of zonelist changes */
+void
+zone_list_sync(struct nsd_options* opt)
+{
+	opt->zonelist_batch = 0;
+	if(!opt->zonelist)
+		return;
+	if(opt->zonefree_number > opt->zone_options->count)
+		zone_list_compact(opt);
+	if(fflush(opt->zonelist) != 0) {
+		log_msg(LOG_ERR, "fflush %s: %s", opt->zonelistfile, strerror(errno));
+	}
+	/* once for the entire batch */
+	if(fsync(fileno(opt->zonelist)) != 0) {
+		log_msg(LOG_ERR, "fsync %s: %s", opt->zonelistfile, strerror(errno));
+	}
+}
+
 /* close zonelist file */
 void
 zone_list_close(struct nsd_options* opt)
@@ -829,6 +879,9 @@ pattern_options_create(region_type* region)
 	p->notify = 0;
 	p->provide_xfr = 0;
 	p->outgoing_interface = 0;
+	p->allow_notify_trie = NULL;
+	p->request_xfr_trie = NULL;
+	p->provide_xfr_trie = NULL;
 	p->notify_retry = 5;
 	p->notify_retry_is_default = 1;
 	p->allow_axfr_fallback = 1;
@@ -849,6 +902,8 @@ pattern_options_create(region_type* region)
 	p->rrl_whitelist = 0;
 #endif
 	p->multi_master_check = 0;
+	p->dnstap_log = 1;
+	p->dnstap_log_is_default = 1;
 	return p;
 }
 
@@ -898,6 +953,9 @@ pattern_options_remove(struct nsd_options* opt, const char* name)
 	acl_list_delete(opt->region, p->notify);
 	acl_list_delete(opt->region, p->provide_xfr);
 	acl_list_delete(opt->region, p->outgoing_interface);
+	acl_trie_delete(opt->region, p->allow_notify_trie);
+	acl_trie_delete(opt->region, p->request_xfr_trie);
+	acl_trie_delete(opt->region, p->provide_xfr_trie);
 
 	region_recycle(opt->region, p, sizeof(struct pattern_options));
 }
@@ -942,14 +1000,17 @@ copy_acl_list(struct nsd_options* opt, struct acl_options* a)
 	return blist;
 }
 
-static void
+/* returns true if the acl list was changed */
+static int
 copy_changed_acl(struct nsd_options* opt, struct acl_options** orig,
 	struct acl_options* anew)
 {
 	if(!acl_list_equal(*orig, anew)) {
 		acl_list_delete(opt->region, *orig);
 		*orig = copy_acl_list(opt, anew);
+		return 1;
 	}
+	return 0;
 }
 
 static void
@@ -982,6 +1043,8 @@ copy_pat_fixed(region_type* region, struct pattern_options* orig,
 	orig->rrl_whitelist = p->rrl_whitelist;
 #endif
 	orig->multi_master_check = p->multi_master_check;
+	orig->dnstap_log = p->dnstap_log;
+	orig->dnstap_log_is_default = p->dnstap_log_is_default;
 }
 
 void
@@ -999,6 +1062,7 @@ pattern_options_add_modify(struct nsd_options* opt, struct pattern_options* p)
 		orig->provide_xfr = copy_acl_list(opt, p->provide_xfr);
 		orig->outgoing_interface = copy_acl_list(opt,
 			p->outgoing_interface);
+		pattern_acl_tries_setup(opt->region, orig);
 		nsd_options_insert_pattern(opt, orig);
 	} else {
 		/* modify in place so pointers stay valid (and copy
@@ -1010,11 +1074,26 @@ pattern_options_add_modify(struct nsd_options* opt, struct pattern_options* p)
 			region_recycle(opt->region, (char*)orig->zonestats,
 				strlen(orig->zonestats)+1);
 		copy_pat_fixed(opt->region, orig, p);
-		copy_changed_acl(opt, &orig->allow_notify, p->allow_notify);
-		copy_changed_acl(opt, &orig->request_xfr, p->request_xfr);
-		copy_changed_acl(opt, &orig->notify, p->notify);
-		copy_changed_acl(opt, &orig->provide_xfr, p->provide_xfr);
-		copy_changed_acl(opt, &orig->outgoing_interface,
+		if(copy_changed_acl(opt, &orig->allow_notify,
+			p->allow_notify)) {
+			acl_trie_delete(opt->region, orig->allow_notify_trie);
+			orig->allow_notify_trie = acl_trie_create(opt->region,
+				orig->allow_notify);
+		}
+		if(copy_changed_acl(opt, &orig->request_xfr,
+			p->request_xfr)) {
+			acl_trie_delete(opt->region, orig->request_xfr_trie);
+			orig->request_xfr_trie = acl_trie_create(opt->region,
+				orig->request_xfr);
+		}
+		(void)copy_changed_acl(opt, &orig->notify, p->notify);
+		if(copy_changed_acl(opt, &orig->provide_xfr,
+			p->provide_xfr)) {
+			acl_trie_delete(opt->region, orig->provide_xfr_trie);
+			orig->provide_xfr_trie = acl_trie_create(opt->region,
+				orig->provide_xfr);
+		}
+		(void)copy_changed_acl(opt, &orig->outgoing_interface,
 			p->outgoing_interface);
 	}
 }
@@ -1071,6 +1150,9 @@ pattern_options_equal(struct pattern_options* p, struct pattern_options* q)
 	if(p->rrl_whitelist != q->rrl_whitelist) return 0;
 #endif
 	if(!booleq(p->multi_master_check,q->multi_master_check)) return 0;
+	if(!booleq(p->dnstap_log, q->dnstap_log)) return 0;
+	if(!booleq(p->dnstap_log_is_default, q->dnstap_log_is_default))
+		return 0;
 	if(p->size_limit_xfr != q->size_limit_xfr) return 0;
 	return 1;
 }
@@ -1234,6 +1316,8 @@ pattern_options_marshal(struct buffer* b, struct pattern_options* p)
 	marshal_u32(b, p->min_expire_time);
 	marshal_u8(b, p->min_expire_time_expr);
 	marshal_u8(b, p->multi_master_check);
+	marshal_u8(b, p->dnstap_log);
+	marshal_u8(b, p->dnstap_log_is_default);
 }
 
 struct pattern_options*
@@ -1268,6 +1352,8 @@ pattern_options_unmarshal(region_type* r, struct buffer* b)
 	p->min_expire_time = unmarshal_u32(b);
 	p->min_expire_time_expr = unmarshal_u8(b);
 	p->multi_master_check = unmarshal_u8(b);
+	p->dnstap_log = unmarshal_u8(b);
+	p->dnstap_log_is_default = unmarshal_u8(b);
 	return p;
 }
 
@@ -1302,6 +1388,7 @@ key_options_desetup(region_type* region, struct key_options* key)
 	if(!key->tsig_key)
 		return;
 	/* name stays the same */
+	tsig_key_delete_state(key->tsig_key);
 	if(key->tsig_key->data) {
 		/* wipe secret! */
 		memset(key->tsig_key->data, 0xdd, key->tsig_key->size);
@@ -1332,6 +1419,9 @@ key_options_setup(region_type* region, struct key_options* key)
 		}
 		key->tsig_key->size = 0;
 		key->tsig_key->data = NULL;
+		key->tsig_key->state_algorithm = NULL;
+		key->tsig_key->state = NULL;
+		key->tsig_key->state_serial = 0;
 	}
 	size = b64_pton(key->secret, data, sizeof(data));
 	if(size == -1) {
@@ -1342,6 +1432,9 @@ key_options_setup(region_type* region, struct key_options* key)
 	}
 	key->tsig_key->size = size;
 	key->tsig_key->data = (uint8_t *)region_alloc_init(region, data, size);
+	/* precompute the HMAC key schedule, once, not for every message */
+	tsig_key_create_state(key->tsig_key,
+		tsig_get_algorithm_by_name(key->algorithm));
 }
 
 void
@@ -1443,6 +1536,349 @@ acl_check_incoming(struct acl_options* acl, struct query* q,
 	return found_match;
 }
 
+/*
+ * The acl lists are compiled into a binary trie on the address bits, one
+ * for IPv4 and one for IPv6.  Every acl element is stored, as an entry
+ * with its number in the list, at the node(s) for its prefix(es).  A
+ * lookup walks down the trie along the address, and checks the port and
+ * key of the entries that it meets, that is at most one node per bit.
+ * The trie is path compressed, every node has the full prefix, so that
+ * there are at most two nodes per prefix.
+ */
+#define ACL_TRIE_ADDRLEN 16 /* bytes, for IPv6 */
+
+/* acl element in the trie, at the node of the prefix */
+struct acl_trie_entry {
+	/* next entry at the same node */
+	struct acl_trie_entry* next;
+	struct acl_options* acl;
+	/* number of the element in the acl list */
+	int number;
+};
+
+struct acl_trie_node {
+	struct acl_trie_node* child[2];
+	/* the entries with exactly this prefix */
+	struct acl_trie_entry* entries;
+	/* the prefix, the bits after prefixlen are zero */
+	uint8_t addr[ACL_TRIE_ADDRLEN];
+	uint8_t prefixlen;
+};
+
+struct acl_trie {
+	/* the root nodes, with prefixlen 0 */
+	struct acl_trie_node* root4;
+	struct acl_trie_node* root6;
+	/* elements with a mask that is not a prefix, checked one by one */
+	struct acl_trie_entry* other;
+};
+
+/* bit number i of the address, from the top */
+#define ACL_TRIE_BIT(a, i) (((a)[(i)/8] >> (7 - (i)%8)) & 1)
+
+/* see if the first len bits of a and b are the same */
+static int
+acl_trie_prefix_match(const uint8_t* a, const uint8_t* b, int len)
+{
+	int bytes = len/8, bits = len%8;
+	if(memcmp(a, b, bytes) != 0)
+		return 0;
+	if(bits) {
+		uint8_t mask = (uint8_t)(0xff << (8-bits));
+		if(((a[bytes]^b[bytes])&mask) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+static struct acl_trie_node*
+acl_trie_node_create(region_type* region, const uint8_t* addr, int prefixlen)
+{
+	struct acl_trie_node* n = (struct acl_trie_node*)region_alloc_zero(
+		region, sizeof(*n));
+	int bytes = prefixlen/8, bits = prefixlen%8;
+	memcpy(n->addr, addr, bytes);
+	if(bits)
+		n->addr[bytes] = addr[bytes] & (uint8_t)(0xff << (8-bits));
+	n->prefixlen = (uint8_t)prefixlen;
+	return n;
+}
+
+static void
+acl_trie_entry_add(region_type* region, struct acl_trie_entry** list,
+	struct acl_options* acl, int number)
+{
+	struct acl_trie_entry* e = (struct acl_trie_entry*)region_alloc(
+		region, sizeof(*e));
+	e->acl = acl;
+	e->number = number;
+	/* keep the list in acl order, the elements are added in order */
+	while(*list)
+		list = &(*list)->next;
+	e->next = NULL;
+	*list = e;
+}
+
+/* add the acl element at the prefix */
+static void
+acl_trie_insert(region_type* region, struct acl_trie_node* node,
+	const uint8_t* addr, int prefixlen, struct acl_options* acl,
+	int number)
+{
+	/* the prefix of node is a prefix of addr */
+	while(node->prefixlen != prefixlen) {
+		int bit = ACL_TRIE_BIT(addr, node->prefixlen);
+		struct acl_trie_node* child = node->child[bit], *mid;
+		int common;
+		if(!child) {
+			child = acl_trie_node_create(region, addr, prefixlen);
+			node->child[bit] = child;
+			node = child;
+			break;
+		}
+		/* the bits that the child and addr have in common */
+		common = node->prefixlen + 1;
+		while(common < child->prefixlen && common < prefixlen &&
+			ACL_TRIE_BIT(addr, common) ==
+			ACL_TRIE_BIT(child->addr, common))
+			common++;
+		if(common == child->prefixlen) {
+			node = child;
+			continue;
+		}
+		/* split the edge to the child */
+		mid = acl_trie_node_create(region, addr, common);
+		mid->child[ACL_TRIE_BIT(child->addr, common)] = child;
+		node->child[bit] = mid;
+		node = mid;
+	}
+	acl_trie_entry_add(region, &node->entries, acl, number);
+}
+
+/* is the mask a prefix, returns the prefix length or -1 */
+static int
+acl_trie_mask_prefixlen(const uint8_t* mask, int bytes)
+{
+	int i, len = 0;
+	for(i=0; i<bytes*8; i++) {
+		if(!ACL_TRIE_BIT(mask, i))
+			break;
+		len++;
+	}
+	for(; i<bytes*8; i++) {
+		if(ACL_TRIE_BIT(mask, i))
+			return -1;
+	}
+	return len;
+}
+
+/* add the range min..max, both inclusive, as prefixes.  The addresses
+ * are numbers in network byte order. */
+static void
+acl_trie_insert_range(region_type* region, struct acl_trie_node* root,
+	const uint8_t* min, const uint8_t* max, int bytes,
+	struct acl_options* acl, int number)
+{
+	uint8_t cur[ACL_TRIE_ADDRLEN], last[ACL_TRIE_ADDRLEN];
+	int nbits = bytes*8, k, i;
+	memcpy(cur, min, bytes);
+	while(memcmp(cur, max, bytes) <= 0) {
+		/* the largest block of 2^k addresses at cur, that is
+		 * aligned and ends before max */
+		k = 0;
+		memcpy(last, cur, bytes);
+		while(k < nbits && !ACL_TRIE_BIT(cur, nbits-1-k)) {
+			last[(nbits-1-k)/8] |= (uint8_t)(1<<(k%8));
+			if(memcmp(last, max, bytes) > 0) {
+				last[(nbits-1-k)/8] &= (uint8_t)~(1<<(k%8));
+				break;
+			}
+			k++;
+		}
+		acl_trie_insert(region, root, cur, nbits-k, acl, number);
+		/* cur = last + 1 */
+		memcpy(cur, last, bytes);
+		for(i=bytes-1; i>=0; i--) {
+			if(++cur[i] != 0)
+				break;
+		}
+		if(i < 0)
+			break; /* wrapped around, the range ended at the top */
+	}
+}
+
+struct acl_trie*
+acl_trie_create(region_type* region, struct acl_options* acl)
+{
+	struct acl_trie* trie;
+	int number = 0;
+	if(!acl)
+		return NULL;
+	trie = (struct acl_trie*)region_alloc_zero(region, sizeof(*trie));
+	trie->root4 = acl_trie_node_create(region, (uint8_t*)"", 0);
+	trie->root6 = acl_trie_node_create(region, (uint8_t*)"", 0);
+	for(; acl; acl = acl->next, number++) {
+		struct acl_trie_node* root = trie->root4;
+		int bytes = (int)sizeof(struct in_addr), len;
+		uint8_t* addr = (uint8_t*)&acl->addr.addr;
+		uint8_t* mask = (uint8_t*)&acl->range_mask.addr;
+		if(acl->is_ipv6) {
+#ifdef INET6
+			root = trie->root6;
+			bytes = (int)sizeof(struct in6_addr);
+			addr = (uint8_t*)&acl->addr.addr6;
+			mask = (uint8_t*)&acl->range_mask.addr6;
+#else
+			continue; /* no inet6, no match */
+#endif
+		}
+		switch(acl->rangetype) {
+		case acl_range_mask:
+		case acl_range_subnet:
+			len = acl_trie_mask_prefixlen(mask, bytes);
+			if(len == -1)
+				acl_trie_entry_add(region, &trie->other, acl,
+					number);
+			else	acl_trie_insert(region, root, addr, len, acl,
+					number);
+			break;
+		case acl_range_minmax:
+			acl_trie_insert_range(region, root, addr, mask, bytes,
+				acl, number);
+			break;
+		case acl_range_single:
+		default:
+			acl_trie_insert(region, root, addr, bytes*8, acl,
+				number);
+			break;
+		}
+	}
+	return trie;
+}
+
+static void
+acl_trie_entries_delete(region_type* region, struct acl_trie_entry* e)
+{
+	struct acl_trie_entry* n;
+	while(e) {
+		n = e->next;
+		region_recycle(region, e, sizeof(*e));
+		e = n;
+	}
+}
+
+static void
+acl_trie_node_delete(region_type* region, struct acl_trie_node* n)
+{
+	if(!n)
+		return;
+	acl_trie_node_delete(region, n->child[0]);
+	acl_trie_node_delete(region, n->child[1]);
+	acl_trie_entries_delete(region, n->entries);
+	region_recycle(region, n, sizeof(*n));
+}
+
+void
+acl_trie_delete(region_type* region, struct acl_trie* trie)
+{
+	if(!trie)
+		return;
+	acl_trie_node_delete(region, trie->root4);
+	acl_trie_node_delete(region, trie->root6);
+	acl_trie_entries_delete(region, trie->other);
+	region_recycle(region, trie, sizeof(*trie));
+}
+
+/* check the entry, whose address matches, for the query.  Keeps the
+ * first match and the first blocked match, in acl order */
+static void
+acl_trie_check_entry(struct acl_trie_entry* e, struct query* q,
+	struct acl_trie_entry** match, struct acl_trie_entry** blocked)
+{
+	if(*match && e->number > (*match)->number && !e->acl->blocked)
+		return; /* cannot change the result */
+	if(!acl_key_matches(e->acl, q))
+		return;
+	if(!*match || e->number < (*match)->number)
+		*match = e;
+	if(e->acl->blocked && (!*blocked || e->number < (*blocked)->number))
+		*blocked = e;
+}
+
+int
+acl_trie_check_incoming(struct acl_trie* trie, struct query* q,
+	struct acl_options** reason)
+{
+	struct acl_trie_node* node;
+	struct acl_trie_entry* e, *match = NULL, *blocked = NULL;
+	const uint8_t* addr;
+	unsigned int port;
+	int nbits;
+
+	if(reason)
+		*reason = NULL;
+	if(!trie)
+		return -1;
+#ifdef INET6
+	if(((struct sockaddr_storage*)&q->addr)->ss_family == AF_INET6) {
+		struct sockaddr_in6* sa = (struct sockaddr_in6*)&q->addr;
+		node = trie->root6;
+		addr = (const uint8_t*)&sa->sin6_addr;
+		port = ntohs(sa->sin6_port);
+		nbits = 128;
+	} else
+#endif
+	{
+		struct sockaddr_in* sa = (struct sockaddr_in*)&q->addr;
+		if(sa->sin_family != AF_INET)
+			return -1;
+		node = trie->root4;
+		addr = (const uint8_t*)&sa->sin_addr;
+		port = ntohs(sa->sin_port);
+		nbits = 32;
+	}
+
+	/* the root matches every address */
+	while(node) {
+		for(e = node->entries; e; e = e->next) {
+			if(e->acl->port == 0 || e->acl->port == port)
+				acl_trie_check_entry(e, q, &match, &blocked);
+		}
+		if(node->prefixlen >= nbits)
+			break;
+		node = node->child[ACL_TRIE_BIT(addr, node->prefixlen)];
+		if(node && !acl_trie_prefix_match(node->addr, addr,
+			node->prefixlen))
+			break;
+	}
+	for(e = trie->other; e; e = e->next) {
+		if(acl_addr_matches(e->acl, q))
+			acl_trie_check_entry(e, q, &match, &blocked);
+	}
+
+	if(blocked) {
+		if(reason)
+			*reason = blocked->acl;
+		return -1;
+	}
+	if(!match)
+		return -1;
+	if(reason)
+		*reason = match->acl;
+	return match->number;
+}
+
+void
+pattern_acl_tries_setup(region_type* region, struct pattern_options* p)
+{
+	acl_trie_delete(region, p->allow_notify_trie);
+	acl_trie_delete(region, p->request_xfr_trie);
+	acl_trie_delete(region, p->provide_xfr_trie);
+	p->allow_notify_trie = acl_trie_create(region, p->allow_notify);
+	p->request_xfr_trie = acl_trie_create(region, p->request_xfr);
+	p->provide_xfr_trie = acl_trie_create(region, p->provide_xfr);
+}
+
 #ifdef INET6
 int
 acl_addr_matches_ipv6host(struct acl_options* acl, struct sockaddr_storage* addr_storage, unsigned int port)
@@ -2053,6 +2489,10 @@ config_apply_pattern(struct pattern_options *dest, const char* name)
 	copy_and_append_acls(&dest->outgoing_interface, pat->outgoing_interface);
 	if(pat->multi_master_check)
 		dest->multi_master_check = pat->multi_master_check;
+	if(!pat->dnstap_log_is_default) {
+		dest->dnstap_log = pat->dnstap_log;
+		dest->dnstap_log_is_default = 0;
+	}
 }
 
 void
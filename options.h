@@ -19,6 +19,7 @@ struct dname;
 struct tsig_key;
 struct buffer;
 struct nsd;
+struct acl_trie;
 
 typedef struct nsd_options nsd_options_type;
 typedef struct pattern_options pattern_options_type;
@@ -50,6 +51,10 @@ struct nsd_options {
 	FILE* zonelist;
 	/* last offset in file (or 0 if none) */
 	off_t zonelist_off;
+	/* if nonzero, zonelist changes are not flushed (and the file is not
+	 * compacted) until zone_list_sync, 2 if the file position is at
+	 * zonelist_off */
+	int zonelist_batch;
 
 	/* tree of zonestat names and their id values, entries are struct
 	 * zonestatname with malloced key=stringname. The number of items
@@ -102,13 +107,23 @@ struct nsd_options {
 	const char* zonelistfile;
 	const char* nsid;
 	int xfrd_reload_timeout;
+	int xfrd_tcp_max_per_master;
+	/** IXFR queries that are sent from one UDP socket, at most
+	 * XFRD_UDP_SHARE_MAX */
+	int xfrd_udp_share;
 	int zonefiles_check;
 	int zonefiles_write;
 	int log_time_ascii;
 	int round_robin;
 	int minimal_responses;
 	int refuse_any;
+	/** NXDOMAINs per second for a zone that make it a flood, 0 is off */
+	size_t nxdomain_flood_limit;
 	int reuseport;
+	/** answer DNS cookies (RFC 7873) */
+	int answer_cookie;
+	/** file with the cookie secrets, if NULL a random one is used */
+	const char* cookie_secret_file;
 
 	/* private key file for TLS */
 	char* tls_service_key;
@@ -134,6 +149,15 @@ struct nsd_options {
 	/** certificate file for nsd-control */
 	char* control_cert_file;
 
+	/** metrics section. enable toggle. */
+	int metrics_enable;
+	/** the interfaces the metrics should listen on */
+	struct ip_address_option* metrics_interface;
+	/** port number for the metrics http service */
+	int metrics_port;
+	/** the http path that the metrics are served on */
+	char* metrics_path;
+
 #ifdef RATELIMIT
 	/** number of buckets in rrl hashtable */
 	size_t rrl_size;
@@ -146,11 +170,17 @@ struct nsd_options {
 	size_t rrl_ipv6_prefix_length;
 	/** max qps for whitelisted queries, 0 is nolimit */
 	size_t rrl_whitelist_ratelimit;
+	/** max qps for queries with a valid server cookie, 0 is nolimit */
+	size_t rrl_cookie_ratelimit;
 #endif
 	/** if dnstap is enabled */
 	int dnstap_enable;
 	/** dnstap socket path */
 	char* dnstap_socket_path;
+	/** dnstap file path, if set the file is written instead of socket */
+	char* dnstap_file_path;
+	/** size in bytes after which the dnstap file is rotated, 0 never */
+	size_t dnstap_file_size;
 	/** true to send "identity" via dnstap */
 	int dnstap_send_identity;
 	/** true to send "version" via dnstap */
@@ -163,6 +193,14 @@ struct nsd_options {
 	int dnstap_log_auth_query_messages;
 	/** true to log dnstap AUTH_RESPONSE message events */
 	int dnstap_log_auth_response_messages;
+	/** log one in this many queries with dnstap, 0 or 1 logs all */
+	int dnstap_sample_rate;
+	/** qtypes of queries to log with dnstap, NULL logs all */
+	char* dnstap_log_qtypes;
+	/** rcodes of responses to log with dnstap, NULL logs all */
+	char* dnstap_log_rcodes;
+	/** true to log only responses that the ratelimit acted on */
+	int dnstap_log_rrl_only;
 
 	region_type* region;
 };
@@ -215,6 +253,11 @@ struct pattern_options {
 	struct acl_options* notify;
 	struct acl_options* provide_xfr;
 	struct acl_options* outgoing_interface;
+	/* the allow_notify, request_xfr and provide_xfr lists, compiled
+	 * for the checks of incoming queries */
+	struct acl_trie* allow_notify_trie;
+	struct acl_trie* request_xfr_trie;
+	struct acl_trie* provide_xfr_trie;
 	const char* zonestats;
 #ifdef RATELIMIT
 	uint16_t rrl_whitelist; /* bitmap with rrl types */
@@ -241,6 +284,8 @@ struct pattern_options {
 	uint8_t min_expire_time_expr;
 	uint64_t size_limit_xfr;
 	uint8_t multi_master_check;
+	uint8_t dnstap_log;
+	uint8_t dnstap_log_is_default;
 } ATTR_PACKED;
 
 #define PATTERN_IMPLICIT_MARKER "_implicit_"
@@ -330,6 +375,8 @@ struct zonelist_bucket {
 
 /* default zonefile write interval if database is "", in seconds */
 #define ZONEFILES_WRITE_INTERVAL 3600
+/* the most SOA and IXFR queries that xfrd sends from one UDP socket */
+#define XFRD_UDP_SHARE_MAX 4
 
 struct zonestatname {
 	rbnode_type node; /* key is malloced string with cooked zonestat name */
@@ -402,6 +449,9 @@ struct zone_options* zone_list_zone_insert(struct nsd_options* opt,
 	const char* nm, const char* patnm, int linesize, off_t off);
 void zone_list_del(struct nsd_options* opt, struct zone_options* zone);
 void zone_list_compact(struct nsd_options* opt);
+/* end a batch of zone_list_add and zone_list_del, compact the zonelist if
+ * needed and flush and fsync it */
+void zone_list_sync(struct nsd_options* opt);
 void zone_list_close(struct nsd_options* opt);
 
 /* create zonestat name tree , for initially created zones */
@@ -426,6 +476,16 @@ void key_options_tsig_add(struct nsd_options* opt);
 /* the reason why (the acl) is returned too (or NULL) */
 int acl_check_incoming(struct acl_options* acl, struct query* q,
 	struct acl_options** reason);
+/* compile the acl list into a prefix trie, NULL if the list is empty.
+ * The trie points to the acl elements, it is rebuilt when they change */
+struct acl_trie* acl_trie_create(region_type* region,
+	struct acl_options* acl);
+void acl_trie_delete(region_type* region, struct acl_trie* trie);
+/* check like acl_check_incoming, with the trie made of the acl list */
+int acl_trie_check_incoming(struct acl_trie* trie, struct query* q,
+	struct acl_options** reason);
+/* (re)build the acl tries of the pattern */
+void pattern_acl_tries_setup(region_type* region, struct pattern_options* p);
 int acl_addr_matches_host(struct acl_options* acl, struct acl_options* host);
 int acl_addr_matches(struct acl_options* acl, struct query* q);
 int acl_key_matches(struct acl_options* acl, struct query* q);
@@ -450,6 +510,7 @@ const char* config_make_zonefile(struct zone_options* zone, struct nsd* nsd);
 
 #define ZONEC_PCT_TIME 5 /* seconds, then it starts to print pcts */
 #define ZONEC_PCT_COUNT 100000 /* elements before pct check is done */
+#define ZONEC_RELEASE_COUNT 1000000 /* elements before the udb mmap is released */
 
 /* parsing helpers */
 void c_error(const char* msg, ...) ATTR_FORMAT(printf, 1,2);
@@ -9,11 +9,13 @@
 
 #include "config.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "packet.h"
 #include "query.h"
 #include "rdata.h"
+#include "util.h"
 
 int round_robin = 0;
 int minimal_responses = 0;
@@ -107,6 +109,150 @@ packet_encode_rr(query_type *q, domain_type *owner, rr_type *rr, uint32_t ttl)
 	}
 }
 
+/*
+ * Pre-encoded rrsets, for the authority section of NXDOMAIN answers in
+ * a zone that gets an NXDOMAIN flood (a random subdomain attack).  The
+ * wire format is kept when the rrset is encoded normally, and copied into
+ * the next answers.  Its compression pointers point to the zone apex in
+ * the query name, or inside the rrset itself, and are adjusted for the
+ * new packet.  Only SOA, NSEC and NSEC3 rrsets are kept, with their
+ * RRSIGs, the other names in their rdata are not compressed.  The cache
+ * is per server process, and those are restarted when zones reload.
+ */
+#define WIRE_CACHE_SIZE 1024	/* slots, a power of 2 */
+#define WIRE_CACHE_PTRS 16	/* compression pointers in an rrset */
+#define WIRE_PTR_SELF 0x4000	/* the pointer is inside the rrset */
+
+struct rrset_wire {
+	rrset_type* rrset;
+	domain_type* owner;
+	uint8_t* data;
+	uint16_t len;
+	uint16_t added; /* number of RRs */
+	uint8_t dnssec_ok;
+	uint8_t ptr_count;
+	uint16_t ptr_pos[WIRE_CACHE_PTRS];
+	/* offset from the apex, or WIRE_PTR_SELF|offset in the data */
+	uint16_t ptr_target[WIRE_CACHE_PTRS];
+};
+static struct rrset_wire* wire_cache = NULL;
+
+static struct rrset_wire*
+wire_cache_slot(rrset_type* rrset, int dnssec_ok)
+{
+	if(!wire_cache)
+		wire_cache = (struct rrset_wire*)xalloc_array_zero(
+			WIRE_CACHE_SIZE, sizeof(struct rrset_wire));
+	return &wire_cache[((((size_t)rrset)>>4)*2 + (dnssec_ok?1:0)) &
+		(WIRE_CACHE_SIZE-1)];
+}
+
+/* note the compression pointer in a name, false if it cannot be moved */
+static int
+wire_cache_dname(struct rrset_wire* w, const uint8_t* p, size_t len,
+	size_t* pos, size_t mark, uint16_t apex, size_t apex_end)
+{
+	while(*pos < len) {
+		uint8_t lab = p[*pos];
+		if(lab == 0) {
+			(*pos)++;
+			return 1;
+		} else if((lab&0xc0) == 0xc0) {
+			uint16_t target;
+			if(*pos+2 > len || w->ptr_count >= WIRE_CACHE_PTRS)
+				return 0;
+			target = read_uint16(p+*pos)&0x3fff;
+			if(target >= mark && target < mark+len)
+				target = (target-mark)|WIRE_PTR_SELF;
+			else if(target >= apex && target < apex_end)
+				target -= apex;
+			else	return 0;
+			w->ptr_pos[w->ptr_count] = *pos;
+			w->ptr_target[w->ptr_count++] = target;
+			*pos += 2;
+			return 1;
+		} else if((lab&0xc0) != 0) {
+			return 0;
+		}
+		*pos += lab+1;
+	}
+	return 0;
+}
+
+/* keep the rrset that was encoded at mark, if it can be copied */
+static void
+wire_cache_store(query_type* q, domain_type* owner, rrset_type* rrset,
+	size_t mark, uint16_t added)
+{
+	struct rrset_wire w, *slot;
+	const uint8_t* p = buffer_at(q->packet, mark);
+	size_t len = buffer_position(q->packet) - mark, pos = 0, rdata;
+	uint16_t apex = query_get_dname_offset(q, rrset->zone->apex);
+	uint16_t i, type;
+
+	if(apex == 0)
+		return;
+	w.ptr_count = 0;
+	for(i=0; i<added; i++) {
+		if(!wire_cache_dname(&w, p, len, &pos, mark, apex, apex +
+			domain_dname(rrset->zone->apex)->name_size) ||
+			pos+10 > len)
+			return;
+		type = read_uint16(p+pos);
+		rdata = pos + 10;
+		pos = rdata + read_uint16(p+pos+8);
+		if(type == TYPE_SOA && (!wire_cache_dname(&w, p, pos, &rdata,
+			mark, apex, apex + domain_dname(rrset->zone->apex)->
+			name_size) || !wire_cache_dname(&w, p, pos, &rdata,
+			mark, apex, apex + domain_dname(rrset->zone->apex)->
+			name_size)))
+			return;
+	}
+	if(pos != len)
+		return;
+
+	slot = wire_cache_slot(rrset, q->edns.dnssec_ok);
+	free(slot->data);
+	*slot = w;
+	slot->rrset = rrset;
+	slot->owner = owner;
+	slot->data = (uint8_t*)xalloc(len);
+	memcpy(slot->data, p, len);
+	slot->len = (uint16_t)len;
+	slot->added = added;
+	slot->dnssec_ok = (q->edns.dnssec_ok?1:0);
+}
+
+/* copy the pre-encoded rrset into the packet, false if not possible */
+static int
+wire_cache_write(query_type* q, domain_type* owner, rrset_type* rrset,
+	uint16_t* added)
+{
+	struct rrset_wire* w = wire_cache_slot(rrset, q->edns.dnssec_ok);
+	size_t mark = buffer_position(q->packet);
+	uint16_t apex, target;
+	uint8_t i;
+
+	if(w->rrset != rrset || w->owner != owner ||
+		w->dnssec_ok != (q->edns.dnssec_ok?1:0))
+		return 0;
+	apex = query_get_dname_offset(q, rrset->zone->apex);
+	if(apex == 0 || mark + w->len > q->maxlen - q->reserved_space ||
+		mark + w->len > MAX_COMPRESSION_OFFSET)
+		return 0;
+	buffer_write(q->packet, w->data, w->len);
+	for(i=0; i<w->ptr_count; i++) {
+		target = w->ptr_target[i];
+		if((target&WIRE_PTR_SELF))
+			target = mark + (target&~WIRE_PTR_SELF);
+		else	target += apex;
+		buffer_write_u16_at(q->packet, mark + w->ptr_pos[i],
+			0xc000 | target);
+	}
+	*added = w->added;
+	return 1;
+}
+
 int
 packet_encode_rrset(query_type *query,
 		    domain_type *owner,
@@ -138,9 +284,18 @@ packet_encode_rrset(query_type *query,
 		query->qtype != TYPE_AXFR && query->qtype != TYPE_IXFR);
 	uint16_t start;
 	rrset_type *rrsig;
+	int wire_cached;
 
 	assert(rrset->rr_count > 0);
 
+	/* in an NXDOMAIN flood, copy the negative answer proof */
+	wire_cached = (query->nx_flood && section == AUTHORITY_SECTION &&
+		(rrset_rrtype(rrset) == TYPE_SOA ||
+		rrset_rrtype(rrset) == TYPE_NSEC ||
+		rrset_rrtype(rrset) == TYPE_NSEC3));
+	if(wire_cached && wire_cache_write(query, owner, rrset, &added))
+		return added;
+
 	truncation_mark = buffer_position(query->packet);
 
 	if(do_robin && rrset->rr_count)
@@ -208,6 +363,8 @@ packet_encode_rrset(query_type *query,
 		added = 0;
 	}
 
+	if(wire_cached && all_added && added)
+		wire_cache_store(query, owner, rrset, truncation_mark, added);
 	return added;
 }
 
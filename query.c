@@ -234,6 +234,7 @@ query_reset(query_type *q, size_t maxlen, int is_tcp)
 	q->zone = NULL;
 	q->opcode = 0;
 	q->cname_count = 0;
+	q->nx_flood = 0;
 	q->delegation_domain = NULL;
 	q->delegation_rrset = NULL;
 	q->compressed_dname_count = 0;
@@ -435,8 +436,8 @@ answer_notify(struct nsd* nsd, struct query *query)
 		return query_error(query, rc);
 
 	/* check if it passes acl */
-	if((acl_num = acl_check_incoming(zone_opt->pattern->allow_notify, query,
-		&why)) != -1)
+	if((acl_num = acl_trie_check_incoming(
+		zone_opt->pattern->allow_notify_trie, query, &why)) != -1)
 	{
 		sig_atomic_t mode = NSD_PASS_TO_XFRD;
 		int s = nsd->this_child->parent_fd;
@@ -446,8 +447,8 @@ answer_notify(struct nsd* nsd, struct query *query)
 		size_t pos;
 
 		/* Find priority candidate for request XFR. -1 if no match */
-		acl_num_xfr = acl_check_incoming(
-			zone_opt->pattern->request_xfr, query, NULL);
+		acl_num_xfr = acl_trie_check_incoming(
+			zone_opt->pattern->request_xfr_trie, query, NULL);
 
 		acl_xfr = htonl(acl_num_xfr);
 
@@ -770,6 +771,10 @@ query_synthesize_cname(struct query* q, struct answer* answer, const dname_type*
 	/* add temporary domains for from_name and to_name and all
 	   their (not allocated yet) parents */
 	/* any domains below src are not_existing (because of DNAME at src) */
+	/* only answers that expand a DNAME get here; the temp domains are
+	   a static array and the names and the CNAME are carved from
+	   q->region, that query_reset frees in one go, so this costs no
+	   malloc per query */
 	int i;
 	domain_type* cname_domain;
 	domain_type* cname_dest;
@@ -945,6 +950,39 @@ answer_nxdomain(query_type *query, answer_type *answer)
 	answer_soa(query, answer);
 }
 
+/*
+ * Count the NXDOMAIN answers of the zone per second.  Over the
+ * nxdomain-flood-limit the zone is flooded with random subdomains, and
+ * the authority section of the answers is copied from pre-encoded
+ * rrsets, until a second is under the limit again.
+ */
+static void
+count_nxdomain(struct nsd *nsd, struct query *q)
+{
+	zone_type *zone = q->zone;
+	uint32_t now = (uint32_t)time(NULL);
+
+	if (zone->nx_time != now) {
+		unsigned flood = (zone->nx_count > nsd->options->
+			nxdomain_flood_limit && zone->nx_time+1 == now);
+		if (zone->nx_flood && !flood) {
+			VERBOSITY(2, (LOG_INFO, "zone %s NXDOMAIN flood ended",
+				zone->opts->name));
+		}
+		zone->nx_flood = flood;
+		zone->nx_time = now;
+		zone->nx_count = 0;
+	}
+	if (++zone->nx_count > nsd->options->nxdomain_flood_limit &&
+		!zone->nx_flood) {
+		VERBOSITY(2, (LOG_INFO, "zone %s NXDOMAIN flood, over %u "
+			"per second, using cached answers", zone->opts->name,
+			(unsigned)nsd->options->nxdomain_flood_limit));
+		zone->nx_flood = 1;
+	}
+	q->nx_flood = zone->nx_flood;
+}
+
 
 /*
  * Answer domain information (or SOA if we do not have an RRset for
@@ -1093,7 +1131,8 @@ answer_authoritative(struct nsd   *nsd,
 
 	if (exact) {
 		match = closest_match;
-	} else if ((rrset=domain_find_rrset(closest_encloser, q->zone, TYPE_DNAME))) {
+	} else if (q->zone->has_dname &&
+		(rrset=domain_find_rrset(closest_encloser, q->zone, TYPE_DNAME))) {
 		/* process DNAME */
 		const dname_type* name = qname;
 		domain_type *dest = rdata_atom_domain(rrset->rrs[0].rdatas[0]);
@@ -1234,6 +1273,8 @@ answer_authoritative(struct nsd   *nsd,
 	if (match) {
 		answer_domain(nsd, q, answer, match, original);
 	} else {
+		if (nsd->options->nxdomain_flood_limit && q->cname_count == 0)
+			count_nxdomain(nsd, q);
 		answer_nxdomain(q, answer);
 	}
 }
@@ -1600,6 +1641,16 @@ query_add_optional(query_type *q, nsd_type *nsd)
 				/* nsid payload */
 				buffer_write(q->packet, nsd->nsid, nsd->nsid_len);
 			}
+			if(q->edns.cookie_status != COOKIE_NOT_PRESENT) {
+				/* cookie opt header */
+				buffer_write_u16(q->packet, COOKIE_CODE);
+				buffer_write_u16(q->packet, COOKIE_CLIENT_LEN +
+					COOKIE_SERVER_LEN);
+				/* the client cookie and a new server cookie */
+				cookie_create(q, nsd, (uint32_t)time(NULL));
+				buffer_write(q->packet, q->edns.cookie,
+					COOKIE_CLIENT_LEN + COOKIE_SERVER_LEN);
+			}
 		}
 		ARCOUNT_SET(q->packet, ARCOUNT(q->packet) + 1);
 		STATUP(nsd, edns);
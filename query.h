@@ -94,6 +94,10 @@ struct query {
 	 */
 	int cname_count;
 
+	/* NXDOMAIN in a zone that has a flood of them, the authority
+	 * section is copied from pre-encoded rrsets */
+	int nx_flood;
+
 	/* Used for dname compression.  */
 	uint16_t     compressed_dname_count;
 	domain_type **compressed_dnames;
@@ -121,6 +125,12 @@ struct query {
 	/* if we encountered a wildcard, its domain */
 	domain_type *wildcard_domain;
 #endif
+#ifdef USE_DNSTAP
+	/* if the query is selected for dnstap, by sampling and qtype */
+	uint8_t dnstap_log;
+	/* if the ratelimit acted on the query, for the dnstap filter */
+	uint8_t dnstap_rrl;
+#endif
 };
 
 
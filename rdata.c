@@ -70,14 +70,28 @@ typedef int (*rdata_to_string_type)(buffer_type *output,
 				    rdata_atom_type rdata,
 				    rr_type *rr);
 
+static const char hexdigits[] = {
+	'0', '1', '2', '3', '4', '5', '6', '7',
+	'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+};
+
+/* write a character of a text, escaped as \DDD, return the next position */
+static char*
+escape_ddd(char* p, uint8_t ch)
+{
+	*p++ = '\\';
+	*p++ = '0' + ch / 100;
+	*p++ = '0' + (ch / 10) % 10;
+	*p++ = '0' + ch % 10;
+	return p;
+}
+
 static int
 rdata_dname_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
-	buffer_printf(output,
-		      "%s",
-		      dname_to_string(domain_dname(rdata_atom_domain(rdata)),
-				      NULL));
+	buffer_print_string(output,
+		dname_to_string(domain_dname(rdata_atom_domain(rdata)), NULL));
 	return 1;
 }
 
@@ -89,23 +103,28 @@ rdata_dns_name_to_string(buffer_type *output, rdata_atom_type rdata,
 	size_t offset = 0;
 	uint8_t length = data[offset];
 	size_t i;
+	char* p;
 
+	/* every octet is at most 4 characters, with a dot per label */
+	buffer_reserve(output, rdata_atom_size(rdata) * 4 + 1);
+	p = (char*)buffer_current(output);
 	while (length > 0)
 	{
 		if (offset) /* concat label */
-			buffer_printf(output, ".");
+			*p++ = '.';
 
 		for (i = 1; i <= length; ++i) {
 			uint8_t ch = data[i+offset];
 
 			if (ch=='.' || ch==';' || ch=='(' || ch==')' || ch=='\\') {
-				buffer_printf(output, "\\%c", (char) ch);
+				*p++ = '\\';
+				*p++ = (char) ch;
 			} else if (!isgraph((unsigned char) ch)) {
-				buffer_printf(output, "\\%03u", (unsigned int) ch);
+				p = escape_ddd(p, ch);
 			} else if (isprint((unsigned char) ch)) {
-				buffer_printf(output, "%c", (char) ch);
+				*p++ = (char) ch;
 			} else {
-				buffer_printf(output, "\\%03u", (unsigned int) ch);
+				p = escape_ddd(p, ch);
 			}
 		}
 		/* next label */
@@ -114,31 +133,42 @@ rdata_dns_name_to_string(buffer_type *output, rdata_atom_type rdata,
 	}
 
 	/* root label */
-	buffer_printf(output, ".");
+	*p++ = '.';
+	buffer_skip(output, p - (char*)buffer_current(output));
 	return 1;
 }
 
-static int
-rdata_text_to_string(buffer_type *output, rdata_atom_type rdata,
-	rr_type* ATTR_UNUSED(rr))
+/* print the characters of a text, escaped, between quotes */
+static void
+text_to_string(buffer_type *output, const uint8_t *data, size_t length)
 {
-	const uint8_t *data = rdata_atom_data(rdata);
-	uint8_t length = data[0];
 	size_t i;
+	char* p;
 
-	buffer_printf(output, "\"");
-	for (i = 1; i <= length; ++i) {
+	buffer_reserve(output, length * 4 + 2);
+	p = (char*)buffer_current(output);
+	*p++ = '"';
+	for (i = 0; i < length; ++i) {
 		char ch = (char) data[i];
 		if (isprint((unsigned char)ch)) {
 			if (ch == '"' || ch == '\\') {
-				buffer_printf(output, "\\");
+				*p++ = '\\';
 			}
-			buffer_printf(output, "%c", ch);
+			*p++ = ch;
 		} else {
-			buffer_printf(output, "\\%03u", (unsigned) data[i]);
+			p = escape_ddd(p, data[i]);
 		}
 	}
-	buffer_printf(output, "\"");
+	*p++ = '"';
+	buffer_skip(output, p - (char*)buffer_current(output));
+}
+
+static int
+rdata_text_to_string(buffer_type *output, rdata_atom_type rdata,
+	rr_type* ATTR_UNUSED(rr))
+{
+	const uint8_t *data = rdata_atom_data(rdata);
+	text_to_string(output, data+1, data[0]);
 	return 1;
 }
 
@@ -149,23 +179,12 @@ rdata_texts_to_string(buffer_type *output, rdata_atom_type rdata,
 	uint16_t pos = 0;
 	const uint8_t *data = rdata_atom_data(rdata);
 	uint16_t length = rdata_atom_size(rdata);
-	size_t i;
 
 	while (pos < length && pos + data[pos] < length) {
-		buffer_printf(output, "\"");
-		for (i = 1; i <= data[pos]; ++i) {
-			char ch = (char) data[pos + i];
-			if (isprint((unsigned char)ch)) {
-				if (ch == '"' || ch == '\\') {
-					buffer_printf(output, "\\");
-				}
-				buffer_printf(output, "%c", ch);
-			} else {
-				buffer_printf(output, "\\%03u", (unsigned) data[pos+i]);
-			}
-		}
+		text_to_string(output, data+pos+1, data[pos]);
 		pos += data[pos]+1;
-		buffer_printf(output, pos < length?"\" ":"\"");
+		if (pos < length)
+			buffer_print_string(output, " ");
 	}
 	return 1;
 }
@@ -174,23 +193,7 @@ static int
 rdata_long_text_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
-	const uint8_t *data = rdata_atom_data(rdata);
-	uint16_t length = rdata_atom_size(rdata);
-	size_t i;
-
-	buffer_printf(output, "\"");
-	for (i = 0; i < length; ++i) {
-		char ch = (char) data[i];
-		if (isprint((unsigned char)ch)) {
-			if (ch == '"' || ch == '\\') {
-				buffer_printf(output, "\\");
-			}
-			buffer_printf(output, "%c", ch);
-		} else {
-			buffer_printf(output, "\\%03u", (unsigned) data[i]);
-		}
-	}
-	buffer_printf(output, "\"");
+	text_to_string(output, rdata_atom_data(rdata), rdata_atom_size(rdata));
 	return 1;
 }
 
@@ -215,7 +218,7 @@ rdata_byte_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
 	uint8_t data = *rdata_atom_data(rdata);
-	buffer_printf(output, "%lu", (unsigned long) data);
+	buffer_print_u32(output, data);
 	return 1;
 }
 
@@ -224,7 +227,7 @@ rdata_short_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
 	uint16_t data = read_uint16(rdata_atom_data(rdata));
-	buffer_printf(output, "%lu", (unsigned long) data);
+	buffer_print_u32(output, data);
 	return 1;
 }
 
@@ -233,7 +236,7 @@ rdata_long_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
 	uint32_t data = read_uint32(rdata_atom_data(rdata));
-	buffer_printf(output, "%lu", (unsigned long) data);
+	buffer_print_u32(output, data);
 	return 1;
 }
 
@@ -241,13 +244,15 @@ static int
 rdata_a_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
-	int result = 0;
-	char str[200];
-	if (inet_ntop(AF_INET, rdata_atom_data(rdata), str, sizeof(str))) {
-		buffer_printf(output, "%s", str);
-		result = 1;
-	}
-	return result;
+	const uint8_t* data = rdata_atom_data(rdata);
+	buffer_print_u32(output, data[0]);
+	buffer_print_string(output, ".");
+	buffer_print_u32(output, data[1]);
+	buffer_print_string(output, ".");
+	buffer_print_u32(output, data[2]);
+	buffer_print_string(output, ".");
+	buffer_print_u32(output, data[3]);
+	return 1;
 }
 
 static int
@@ -257,7 +262,7 @@ rdata_aaaa_to_string(buffer_type *output, rdata_atom_type rdata,
 	int result = 0;
 	char str[200];
 	if (inet_ntop(AF_INET6, rdata_atom_data(rdata), str, sizeof(str))) {
-		buffer_printf(output, "%s", str);
+		buffer_print_string(output, str);
 		result = 1;
 	}
 	return result;
@@ -318,7 +323,7 @@ rdata_rrtype_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
 	uint16_t type = read_uint16(rdata_atom_data(rdata));
-	buffer_printf(output, "%s", rrtype_to_string(type));
+	buffer_print_string(output, rrtype_to_string(type));
 	return 1;
 }
 
@@ -327,7 +332,7 @@ rdata_algorithm_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
 	uint8_t id = *rdata_atom_data(rdata);
-	buffer_printf(output, "%u", (unsigned) id);
+	buffer_print_u32(output, id);
 	return 1;
 }
 
@@ -351,7 +356,7 @@ rdata_period_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
 	uint32_t period = read_uint32(rdata_atom_data(rdata));
-	buffer_printf(output, "%lu", (unsigned long) period);
+	buffer_print_u32(output, period);
 	return 1;
 }
 
@@ -359,31 +364,75 @@ static int
 rdata_time_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
-	int result = 0;
-	time_t time = (time_t) read_uint32(rdata_atom_data(rdata));
-	struct tm *tm = gmtime(&time);
-	char buf[15];
-	if (strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", tm)) {
-		buffer_printf(output, "%s", buf);
-		result = 1;
+	uint32_t t = read_uint32(rdata_atom_data(rdata));
+	uint32_t days = t / 86400, secs = t % 86400;
+	/* the date from the days since 1970, in eras of 400 years that
+	 * start on the first of march, no gmtime call for every RRSIG */
+	uint32_t z = days + 719468;
+	uint32_t era = z / 146097;
+	uint32_t doe = z - era * 146097;
+	uint32_t yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+	uint32_t doy = doe - (365*yoe + yoe/4 - yoe/100);
+	uint32_t mp = (5*doy + 2) / 153;
+	uint32_t day = doy - (153*mp + 2)/5 + 1;
+	uint32_t month = (mp < 10) ? mp + 3 : mp - 9;
+	uint32_t year = yoe + era * 400 + (month <= 2);
+	uint32_t v[7];
+	char buf[14];
+	int i;
+	v[0] = year / 100;
+	v[1] = year % 100;
+	v[2] = month;
+	v[3] = day;
+	v[4] = secs / 3600;
+	v[5] = (secs / 60) % 60;
+	v[6] = secs % 60;
+	/* YYYYMMDDHHmmSS */
+	for (i = 0; i < 7; i++) {
+		buf[i*2] = '0' + v[i] / 10;
+		buf[i*2+1] = '0' + v[i] % 10;
 	}
-	return result;
+	buffer_reserve(output, sizeof(buf));
+	buffer_write(output, buf, sizeof(buf));
+	return 1;
 }
 
 static int
 rdata_base32_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
+	static const char b32[] = "0123456789abcdefghijklmnopqrstuv";
 	int length;
 	size_t size = rdata_atom_size(rdata);
+	const uint8_t* data = rdata_atom_data(rdata)+1;
+	char* p;
 	if(size == 0) {
 		buffer_write(output, "-", 1);
 		return 1;
 	}
 	size -= 1; /* remove length byte from count */
 	buffer_reserve(output, size * 2 + 1);
-	length = b32_ntop(rdata_atom_data(rdata)+1, size,
-			  (char *) buffer_current(output), size * 2);
+	/* whole groups of five octets, like the NSEC3 hashes */
+	p = (char*)buffer_current(output);
+	for (; size >= 5; size -= 5, data += 5) {
+		uint64_t v = ((uint64_t)data[0]<<32) | ((uint64_t)data[1]<<24) |
+			((uint64_t)data[2]<<16) | ((uint64_t)data[3]<<8) |
+			(uint64_t)data[4];
+		p[0] = b32[(v>>35)&0x1f];
+		p[1] = b32[(v>>30)&0x1f];
+		p[2] = b32[(v>>25)&0x1f];
+		p[3] = b32[(v>>20)&0x1f];
+		p[4] = b32[(v>>15)&0x1f];
+		p[5] = b32[(v>>10)&0x1f];
+		p[6] = b32[(v>>5)&0x1f];
+		p[7] = b32[v&0x1f];
+		p += 8;
+	}
+	buffer_skip(output, p - (char*)buffer_current(output));
+	if (size == 0)
+		return 1;
+	length = b32_ntop(data, size, (char *) buffer_current(output),
+		buffer_remaining(output));
 	if (length > 0) {
 		buffer_skip(output, length);
 	}
@@ -394,37 +443,56 @@ static int
 rdata_base64_to_string(buffer_type *output, rdata_atom_type rdata,
 	rr_type* ATTR_UNUSED(rr))
 {
-	int length;
+	static const char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 	size_t size = rdata_atom_size(rdata);
+	const uint8_t* data = rdata_atom_data(rdata);
+	char* p;
 	if(size == 0) {
 		/* single zero represents empty buffer */
 		buffer_write(output, "0", 1);
 		return 1;
 	}
-	buffer_reserve(output, size * 2 + 1);
-	length = b64_ntop(rdata_atom_data(rdata), size,
-			  (char *) buffer_current(output), size * 2);
-	if (length > 0) {
-		buffer_skip(output, length);
+	buffer_reserve(output, size * 2 + 4);
+	p = (char*)buffer_current(output);
+	/* whole groups of three octets, without branches */
+	for (; size >= 3; size -= 3, data += 3) {
+		uint32_t v = ((uint32_t)data[0]<<16) | ((uint32_t)data[1]<<8) |
+			(uint32_t)data[2];
+		p[0] = b64[v>>18];
+		p[1] = b64[(v>>12)&0x3f];
+		p[2] = b64[(v>>6)&0x3f];
+		p[3] = b64[v&0x3f];
+		p += 4;
 	}
-	return length != -1;
+	/* the last one or two octets, with padding */
+	if (size != 0) {
+		uint32_t v = ((uint32_t)data[0]<<16) |
+			(size == 2 ? ((uint32_t)data[1]<<8) : 0);
+		p[0] = b64[v>>18];
+		p[1] = b64[(v>>12)&0x3f];
+		p[2] = (size == 2) ? b64[(v>>6)&0x3f] : '=';
+		p[3] = '=';
+		p += 4;
+	}
+	buffer_skip(output, p - (char*)buffer_current(output));
+	return 1;
 }
 
 static void
 hex_to_string(buffer_type *output, const uint8_t *data, size_t size)
 {
-	static const char hexdigits[] = {
-		'0', '1', '2', '3', '4', '5', '6', '7',
-		'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
-	};
 	size_t i;
+	char* p;
 
 	buffer_reserve(output, size * 2);
+	p = (char*)buffer_current(output);
 	for (i = 0; i < size; ++i) {
 		uint8_t octet = *data++;
-		buffer_write_u8(output, hexdigits[octet >> 4]);
-		buffer_write_u8(output, hexdigits[octet & 0x0f]);
+		*p++ = hexdigits[octet >> 4];
+		*p++ = hexdigits[octet & 0x0f];
 	}
+	buffer_skip(output, size * 2);
 }
 
 static int
@@ -911,11 +979,11 @@ print_rdata(buffer_type *output, rrtype_descriptor_type *descriptor,
 
 	for (i = 0; i < record->rdata_count; ++i) {
 		if (i == 0) {
-			buffer_printf(output, "\t");
+			buffer_print_string(output, "\t");
 		} else if (descriptor->type == TYPE_SOA && i == 2) {
-			buffer_printf(output, " (\n\t\t");
+			buffer_print_string(output, " (\n\t\t");
 		} else {
-			buffer_printf(output, " ");
+			buffer_print_string(output, " ");
 		}
 		if (!rdata_atom_to_string(
 			    output,
@@ -927,7 +995,7 @@ print_rdata(buffer_type *output, rrtype_descriptor_type *descriptor,
 		}
 	}
 	if (descriptor->type == TYPE_SOA) {
-		buffer_printf(output, " )");
+		buffer_print_string(output, " )");
 	}
 
 	return 1;
@@ -78,6 +78,7 @@
 #include "options.h"
 #include "difffile.h"
 #include "ipc.h"
+#include "topn.h"
 
 #ifdef HAVE_SYS_TYPES_H
 #  include <sys/types.h>
@@ -94,6 +95,8 @@
 
 /** number of seconds timeout on incoming remote control handshake */
 #define REMOTE_CONTROL_TCP_TIMEOUT 120
+/** number of zones printed by the zonestats command per event */
+#define ZONESTATS_BATCH 64
 
 /** repattern to master or slave */
 #define REPAT_SLAVE  1
@@ -129,6 +132,11 @@ struct rc_state {
 	/** stats list indicator (0 is not part of stats list, 1 is stats,
 	 * 2 is stats_noreset. */
 	int in_stats_list;
+	/** zonestats indicator (0 is not printing zonestats, 1 is
+	 * zonestats, 2 is zonestats_noreset) */
+	int in_zonestats;
+	/** the zonestat name to continue after, NULL at the start */
+	char* zonestats_last;
 };
 
 /**
@@ -162,6 +170,8 @@ struct daemon_remote {
 	struct rc_state* stats_list;
 	/** last time stats was reported */
 	struct timeval stats_time, boot_time;
+	/** last time the top counters were cleared */
+	struct timeval top_time;
 	/** the SSL context for creating new SSL streams */
 	SSL_CTX* ctx;
 };
@@ -231,7 +241,6 @@ log_crypto_err(const char* str)
 	}
 }
 
-#ifdef BIND8_STATS
 /** subtract timers and the values do not overflow or become negative */
 static void
 timeval_subtract(struct timeval* d, const struct timeval* end, 
@@ -247,7 +256,6 @@ timeval_subtract(struct timeval* d, const struct timeval* end,
 	d->tv_usec = end_usec - start->tv_usec;
 #endif
 }
-#endif /* BIND8_STATS */
 
 static int
 remote_setup_ctx(struct daemon_remote* rc, struct nsd_options* cfg)
@@ -296,6 +304,7 @@ daemon_remote_create(struct nsd_options* cfg)
 	if(gettimeofday(&rc->boot_time, NULL) == -1)
 		log_msg(LOG_ERR, "gettimeofday: %s", strerror(errno));
 	rc->stats_time = rc->boot_time;
+	rc->top_time = rc->boot_time;
 
 	return rc;
 }
@@ -719,6 +728,7 @@ clean_point(struct daemon_remote* rc, struct rc_state* s)
 		SSL_free(s->ssl);
 	}
 	close(s->c.ev_fd);
+	free(s->zonestats_last);
 	free(s);
 }
 
@@ -819,6 +829,38 @@ ssl_read_line(RES* res, char* buf, size_t max)
 	return 0;
 }
 
+/** read a block of input, returns the number of bytes, 0 on end of file
+ * and -1 on failure */
+static ssize_t
+ssl_read_buf(RES* res, char* buf, size_t max)
+{
+	int r;
+	ssize_t rr;
+	if(!res)
+		return -1;
+	if(res->ssl) {
+		ERR_clear_error();
+		if((r=SSL_read(res->ssl, buf, (int)max)) <= 0) {
+			if(SSL_get_error(res->ssl, r) == SSL_ERROR_ZERO_RETURN)
+				return 0;
+			log_crypto_err("could not SSL_read");
+			return -1;
+		}
+		return r;
+	}
+	while(1) {
+		rr = read(res->fd, buf, max);
+		if(rr < 0) {
+			if(errno == EINTR || errno == EAGAIN)
+				continue;
+			log_msg(LOG_ERR, "could not read: %s",
+				strerror(errno));
+			return -1;
+		}
+		return rr;
+	}
+}
+
 /** skip whitespace, return new pointer into string */
 static char*
 skipwhite(char* str)
@@ -903,8 +945,9 @@ do_write(RES* ssl, xfrd_state_type* xfrd, char* arg)
 	struct zone_options* zo;
 	if(!get_zone_arg(ssl, xfrd, arg, &zo))
 		return;
+	/* also the zones that have their changes in the journal */
 	task_new_write_zonefiles(xfrd->nsd->task[xfrd->nsd->mytask],
-		xfrd->last_task, zo?(const dname_type*)zo->node.key:NULL);
+		xfrd->last_task, zo?(const dname_type*)zo->node.key:NULL, 1);
 	xfrd_set_reload_now(xfrd);
 	send_ok(ssl);
 }
@@ -966,7 +1009,7 @@ force_transfer_zone(xfrd_zone_type* zone)
 	/* if in TCP transaction, stop it immediately. */
 	if(zone->tcp_conn != -1)
 		xfrd_tcp_release(xfrd->tcp_set, zone);
-	else if(zone->zone_handler.ev_fd != -1)
+	else if(zone->udp_sock)
 		xfrd_udp_release(zone);
 	/* pretend we not longer have it and force any
 	 * zone to be downloaded (even same serial, w AXFR) */
@@ -1066,7 +1109,7 @@ print_zonestatus(RES* ssl, xfrd_state_type* xfrd, struct zone_options* zo)
 		if(!print_soa_status(ssl, "notified-serial", &xz->soa_notified,
 			xz->soa_notified_acquired))
 			return 0;
-	} else if(xz->event_added) {
+	} else if(xz->timer_slot != -1) {
 		if(!ssl_printf(ssl, "\twait: \"%lu sec between attempts\"\n",
 			(unsigned long)xz->timeout.tv_sec))
 			return 0;
@@ -1076,7 +1119,7 @@ print_zonestatus(RES* ssl, xfrd_state_type* xfrd, struct zone_options* zo)
 	if(xz->udp_waiting) {
 		if(!ssl_printf(ssl, "	transfer: \"waiting-for-UDP-fd\"\n"))
 			return 0;
-	} else if(xz->zone_handler.ev_fd != -1 && xz->tcp_conn == -1) {
+	} else if(xz->udp_sock && xz->tcp_conn == -1) {
 		if(!ssl_printf(ssl, "	transfer: \"sent UDP to %s\"\n",
 			xz->master->ip_address_spec))
 			return 0;
@@ -1086,6 +1129,13 @@ print_zonestatus(RES* ssl, xfrd_state_type* xfrd, struct zone_options* zo)
 	if(xz->tcp_waiting) {
 		if(!ssl_printf(ssl, "	transfer: \"waiting-for-TCP-fd\"\n"))
 			return 0;
+		if(!ssl_printf(ssl, "\ttcp-queue: \"waited %lld sec, %d "
+			"waiting and %d active for %s\"\n",
+			(long long)(xfrd_time() - xz->tcp_waiting_since),
+			(int)xz->tcp_master->waiting->count,
+			xz->tcp_master->num_active,
+			xz->master->ip_address_spec))
+			return 0;
 	} else if(xz->tcp_conn != -1) {
 		if(!ssl_printf(ssl, "	transfer: \"TCP connected to %s\"\n",
 			xz->master->ip_address_spec))
@@ -1132,6 +1182,52 @@ do_verbosity(RES* ssl, char* str)
 	send_ok(ssl);
 }
 
+/** do the top command, print the most queried names, client netblocks
+ * and zones, merged from the counters of the server processes */
+static void
+do_top(RES* ssl, struct daemon_remote* rc, char* arg, int clear)
+{
+	struct topn_result* r;
+	struct timeval now, elapsed;
+	char buf[MAXDOMAINLEN*5+3];
+	size_t num, i;
+	int max = 10, t;
+	if(*arg) {
+		max = atoi(arg);
+		if(max <= 0 || max > 1000) {
+			(void)ssl_printf(ssl, "error in top number syntax: %s\n",
+				arg);
+			return;
+		}
+	}
+	if(gettimeofday(&now, NULL) == -1)
+		log_msg(LOG_ERR, "gettimeofday: %s", strerror(errno));
+	timeval_subtract(&elapsed, &now, &rc->top_time);
+	if(!ssl_printf(ssl, "time.elapsed=%lu.%6.6lu\n",
+		(unsigned long)elapsed.tv_sec, (unsigned long)elapsed.tv_usec))
+		return;
+	r = (struct topn_result*)xmallocarray((size_t)max, sizeof(*r));
+	for(t=0; t<TOPN_TYPES; t++) {
+		num = topn_report((enum topn_type)t, r, (size_t)max);
+		for(i=0; i<num; i++) {
+			if(!topn_key2str((enum topn_type)t, &r[i], buf,
+				sizeof(buf)))
+				continue;
+			if(!ssl_printf(ssl, "top.%s.%d=%s %lu\n",
+				topn_type2str((enum topn_type)t), (int)i+1,
+				buf, (unsigned long)r[i].count)) {
+				free(r);
+				return;
+			}
+		}
+	}
+	free(r);
+	if(clear) {
+		topn_clear();
+		rc->top_time = now;
+	}
+}
+
 /** find second argument, modifies string */
 static int
 find_arg2(RES* ssl, char* arg, char** arg2)
@@ -1214,6 +1310,91 @@ do_stats(struct daemon_remote* rc, int peek, struct rc_state* rs)
 #endif /* BIND8_STATS */
 }
 
+#ifdef USE_ZONE_STATS
+static int zonestat_print_zone(RES* ssl, xfrd_state_type* xfrd,
+	struct zonestatname* n, int clear);
+static void zonestat_print_lost(RES* ssl, xfrd_state_type* xfrd);
+
+/** print the next batch of zonestats, the connection stays open and
+ * this is called again until all the zones are printed */
+static void
+remote_zonestats_callback(int fd, short event, void* arg)
+{
+	RES res;
+	struct rc_state* s = (struct rc_state*)arg;
+	struct daemon_remote* rc = s->rc;
+	rbtree_type* tree = rc->xfrd->nsd->options->zonestatnames;
+	rbnode_type* node;
+	int i;
+	if( (event&EV_TIMEOUT) ) {
+		log_msg(LOG_ERR, "remote control timed out");
+		clean_point(rc, s);
+		return;
+	}
+	res.ssl = s->ssl;
+	res.fd = fd;
+	/* continue after the last printed name, the tree may have
+	 * changed in between */
+	node = NULL;
+	if(s->zonestats_last)
+		(void)rbtree_find_less_equal(tree, s->zonestats_last, &node);
+	if(node == NULL)
+		node = rbtree_first(tree);
+	else	node = rbtree_next(node);
+	for(i=0; i<ZONESTATS_BATCH && node != RBTREE_NULL; i++) {
+		if(!zonestat_print_zone(&res, rc->xfrd,
+			(struct zonestatname*)node, (s->in_zonestats == 1))) {
+			clean_point(rc, s);
+			return;
+		}
+		if(i == ZONESTATS_BATCH-1) {
+			free(s->zonestats_last);
+			s->zonestats_last = strdup((char*)node->key);
+			if(!s->zonestats_last) {
+				log_msg(LOG_ERR, "out of memory");
+				clean_point(rc, s);
+				return;
+			}
+		}
+		node = rbtree_next(node);
+	}
+	if(node == RBTREE_NULL) {
+		zonestat_print_lost(&res, rc->xfrd);
+		VERBOSITY(3, (LOG_INFO, "remote control zonestats printed"));
+		clean_point(rc, s);
+	}
+}
+#endif /* USE_ZONE_STATS */
+
+/** do the zonestats command, the statistics per zone are printed in
+ * batches, with other events handled in between */
+static void
+do_zonestats(RES* ssl, int peek, struct rc_state* rs)
+{
+#ifdef USE_ZONE_STATS
+	rs->in_zonestats = (peek?2:1);
+	rs->zonestats_last = NULL;
+	if(rs->event_added)
+		event_del(&rs->c);
+	memset(&rs->c, 0, sizeof(rs->c));
+	event_set(&rs->c, rs->fd, EV_PERSIST|EV_TIMEOUT|EV_WRITE,
+		remote_zonestats_callback, rs);
+	if(event_base_set(xfrd->event_base, &rs->c) != 0)
+		log_msg(LOG_ERR, "remote zonestats: cannot set event_base");
+	if(event_add(&rs->c, &rs->tval) != 0) {
+		log_msg(LOG_ERR, "remote zonestats: cannot add event");
+		rs->event_added = 0;
+		rs->in_zonestats = 0;
+		return;
+	}
+	rs->event_added = 1;
+	(void)ssl;
+#else
+	(void)peek; (void)rs;
+	(void)ssl_printf(ssl, "error no zone stats enabled at compile time\n");
+#endif /* USE_ZONE_STATS */
+}
+
 /** see if we have more zonestatistics entries and it has to be incremented */
 static void
 zonestat_inc_ifneeded(xfrd_state_type* xfrd)
@@ -1452,50 +1633,252 @@ do_changezone(RES* ssl, xfrd_state_type* xfrd, char* arg)
 	send_ok(ssl);
 }
 
-/** do the addzones command */
+/** the lines of an addzones or delzones command */
+struct zone_batch {
+	/* the lines, without the newline */
+	char** lines;
+	/* number of lines, and allocated size of the array */
+	size_t num, max;
+};
+
+/** add a line to the zone batch */
+static void
+zone_batch_add(region_type* region, struct zone_batch* b, const char* line,
+	size_t len)
+{
+	if(b->num == b->max) {
+		char** a;
+		b->max = (b->max ? b->max*2 : 1024);
+		a = (char**)region_alloc_array(region, b->max, sizeof(char*));
+		if(b->num)
+			memcpy(a, b->lines, b->num*sizeof(char*));
+		b->lines = a;
+	}
+	b->lines[b->num] = (char*)region_alloc_init(region, line, len+1);
+	b->lines[b->num][len] = 0;
+	b->num++;
+}
+
+/** read the lines until the end of transmission, in blocks, and not
+ * per byte like ssl_read_line; false on failure */
+static int
+read_zone_batch(RES* ssl, region_type* region, struct zone_batch* b)
+{
+	char buf[16384], line[2048];
+	size_t linelen = 0;
+	ssize_t i, r;
+	memset(b, 0, sizeof(*b));
+	while((r = ssl_read_buf(ssl, buf, sizeof(buf))) > 0) {
+		for(i=0; i<r; i++) {
+			if(buf[i] != '\n') {
+				/* overlong lines are cut off */
+				if(linelen < sizeof(line)-1)
+					line[linelen++] = buf[i];
+				continue;
+			}
+			if(linelen == 1 && line[0] == 0x04)
+				return 1; /* end of transmission */
+			/* skip empty lines */
+			if(linelen != 0)
+				zone_batch_add(region, b, line, linelen);
+			linelen = 0;
+		}
+	}
+	if(r == -1)
+		return 0;
+	/* end of file, the last line without newline */
+	if(linelen != 0 && !(linelen == 1 && line[0] == 0x04))
+		zone_batch_add(region, b, line, linelen);
+	return 1;
+}
+
+/** print the number of zones and the rate for the bulk command */
+static void
+print_zone_batch_rate(RES* ssl, const char* what, size_t num,
+	struct timeval* start)
+{
+	struct timeval now;
+	unsigned long long usec;
+	if(gettimeofday(&now, NULL) == -1)
+		log_msg(LOG_ERR, "gettimeofday: %s", strerror(errno));
+	usec = (unsigned long long)(now.tv_sec - start->tv_sec)*1000000 +
+		now.tv_usec - start->tv_usec;
+	if(usec == 0)
+		usec = 1;
+	(void)ssl_printf(ssl, "%s %d zones in %llu.%3.3u seconds, "
+		"%llu zones/sec\n", what, (int)num, usec/1000000,
+		(unsigned)((usec%1000000)/1000),
+		(unsigned long long)num*1000000/usec);
+	VERBOSITY(1, (LOG_INFO, "%s %d zones in %llu.%3.3u seconds", what,
+		(int)num, usec/1000000, (unsigned)((usec%1000000)/1000)));
+}
+
+/** do the addzones command, the zones are checked first, and if there is
+ * an error nothing is added, then all are added with one sync of the
+ * zonelist and one reload */
 static void
 do_addzones(RES* ssl, xfrd_state_type* xfrd)
 {
-	char buf[2048];
-	int num = 0;
-	while(ssl_read_line(ssl, buf, sizeof(buf))) {
-		if(buf[0] == 0x04 && buf[1] == 0)
-			break; /* end of transmission */
-		if(!perform_addzone(ssl, xfrd, buf)) {
-			if(!ssl_printf(ssl, "error for input line '%s'\n", 
-				buf))
-				return;
-		} else {
-			if(!ssl_printf(ssl, "added: %s\n", buf))
-				return;
-			num++;
+	struct nsd_options* opt = xfrd->nsd->options;
+	region_type* region = region_create(xalloc, free);
+	rbtree_type* seen = rbtree_create(region,
+		(int (*)(const void *, const void *)) dname_compare);
+	struct zone_batch b;
+	char** pnames;
+	struct zone_options* zopt;
+	struct timeval start;
+	size_t i, num = 0, errors = 0;
+
+	if(gettimeofday(&start, NULL) == -1)
+		log_msg(LOG_ERR, "gettimeofday: %s", strerror(errno));
+	if(!read_zone_batch(ssl, region, &b)) {
+		region_destroy(region);
+		return;
+	}
+	/* check the lines, the pattern name is NULL for duplicates */
+	pnames = (char**)region_alloc_array(region, b.num+1, sizeof(char*));
+	for(i=0; i<b.num; i++) {
+		const dname_type* dname;
+		rbnode_type* n;
+		char* arg2 = NULL;
+		pnames[i] = NULL;
+		if(!find_arg2(ssl, b.lines[i], &arg2)) {
+			errors++;
+			continue;
 		}
+		if(!rbtree_search(opt->patterns, arg2)) {
+			(void)ssl_printf(ssl, "error pattern %s does not exist\n",
+				arg2);
+			errors++;
+			continue;
+		}
+		dname = dname_parse(region, b.lines[i]);
+		if(!dname) {
+			(void)ssl_printf(ssl, "error cannot parse zone name %s\n",
+				b.lines[i]);
+			errors++;
+			continue;
+		}
+		if(zone_options_find(opt, dname) || rbtree_search(seen, dname))
+			continue;
+		n = (rbnode_type*)region_alloc_zero(region, sizeof(*n));
+		n->key = dname;
+		(void)rbtree_insert(seen, n);
+		pnames[i] = arg2;
+	}
+	if(errors) {
+		(void)ssl_printf(ssl, "error in %d lines, no zones added\n",
+			(int)errors);
+		region_destroy(region);
+		return;
 	}
-	(void)ssl_printf(ssl, "added %d zones\n", num);
+
+	/* add them, with one write of the zonelist and one reload */
+	opt->zonelist_batch = 1;
+	for(i=0; i<b.num; i++) {
+		if(!pnames[i]) {
+			(void)ssl_printf(ssl, "zone %s already exists\n",
+				b.lines[i]);
+			continue;
+		}
+		zopt = zone_list_add(opt, b.lines[i], pnames[i]);
+		if(!zopt) {
+			(void)ssl_printf(ssl, "error could not add zonelist "
+				"entry for %s\n", b.lines[i]);
+			continue;
+		}
+		task_new_add_zone(xfrd->nsd->task[xfrd->nsd->mytask],
+			xfrd->last_task, b.lines[i], pnames[i],
+			getzonestatid(opt, zopt));
+		/* add to xfrd - notify (for master and slaves) */
+		init_notify_send(xfrd->notify_zones, xfrd->region, zopt);
+		/* add to xfrd - slave */
+		if(zone_is_slave(zopt)) {
+			xfrd_init_slave_zone(xfrd, zopt);
+		}
+		num++;
+	}
+	zone_list_sync(opt);
+	if(num) {
+		zonestat_inc_ifneeded(xfrd);
+		xfrd_set_reload_now(xfrd);
+	}
+	print_zone_batch_rate(ssl, "added", num, &start);
+	region_destroy(region);
 }
 
-/** do the delzones command */
+/** do the delzones command, like addzones all the lines are checked
+ * first */
 static void
 do_delzones(RES* ssl, xfrd_state_type* xfrd)
 {
-	char buf[2048];
-	int num = 0;
-	while(ssl_read_line(ssl, buf, sizeof(buf))) {
-		if(buf[0] == 0x04 && buf[1] == 0)
-			break; /* end of transmission */
-		if(!perform_delzone(ssl, xfrd, buf)) {
-			if(!ssl_printf(ssl, "error for input line '%s'\n", 
-				buf))
-				return;
-		} else {
-			if(!ssl_printf(ssl, "removed: %s\n", buf))
-				return;
-			num++;
+	struct nsd_options* opt = xfrd->nsd->options;
+	region_type* region = region_create(xalloc, free);
+	struct zone_batch b;
+	const dname_type** dnames;
+	struct zone_options* zopt;
+	struct timeval start;
+	size_t i, num = 0, errors = 0;
+
+	if(gettimeofday(&start, NULL) == -1)
+		log_msg(LOG_ERR, "gettimeofday: %s", strerror(errno));
+	if(!read_zone_batch(ssl, region, &b)) {
+		region_destroy(region);
+		return;
+	}
+	/* check the lines */
+	dnames = (const dname_type**)region_alloc_array(region, b.num+1,
+		sizeof(dname_type*));
+	for(i=0; i<b.num; i++) {
+		dnames[i] = dname_parse(region, b.lines[i]);
+		if(!dnames[i]) {
+			(void)ssl_printf(ssl, "error cannot parse zone name %s\n",
+				b.lines[i]);
+			errors++;
+			continue;
+		}
+		zopt = zone_options_find(opt, dnames[i]);
+		if(zopt && zopt->part_of_config) {
+			(void)ssl_printf(ssl, "error zone %s defined in "
+				"nsd.conf, cannot delete it in this manner: "
+				"remove it from nsd.conf yourself and "
+				"repattern\n", b.lines[i]);
+			errors++;
 		}
 	}
-	(void)ssl_printf(ssl, "deleted %d zones\n", num);
-}
+	if(errors) {
+		(void)ssl_printf(ssl, "error in %d lines, no zones deleted\n",
+			(int)errors);
+		region_destroy(region);
+		return;
+	}
 
+	/* delete them, with one write of the zonelist and one reload */
+	opt->zonelist_batch = 1;
+	for(i=0; i<b.num; i++) {
+		zopt = zone_options_find(opt, dnames[i]);
+		if(!zopt) {
+			(void)ssl_printf(ssl, "warning zone %s not present\n",
+				b.lines[i]);
+			continue;
+		}
+		task_new_del_zone(xfrd->nsd->task[xfrd->nsd->mytask],
+			xfrd->last_task, dnames[i]);
+		/* delete it in xfrd */
+		if(zone_is_slave(zopt)) {
+			xfrd_del_slave_zone(xfrd, dnames[i]);
+		}
+		xfrd_del_notify(xfrd, dnames[i]);
+		/* delete from config */
+		zone_list_del(opt, zopt);
+		num++;
+	}
+	zone_list_sync(opt);
+	if(num)
+		xfrd_set_reload_now(xfrd);
+	print_zone_batch_rate(ssl, "deleted", num, &start);
+	region_destroy(region);
+}
 
 /** remove TSIG key from config and add task so that reload does too */
 static void remove_key(xfrd_state_type* xfrd, const char* kname)
@@ -1665,7 +2048,7 @@ repat_interrupt_zones(xfrd_state_type* xfrd, struct nsd_options* newopt)
 			if(xz->tcp_conn != -1) {
 				xfrd_tcp_release(xfrd->tcp_set, xz);
 				xfrd_set_refresh_now(xz);
-			} else if(xz->zone_handler.ev_fd != -1) {
+			} else if(xz->udp_sock) {
 				xfrd_udp_release(xz);
 				xfrd_set_refresh_now(xz);
 			}
@@ -2182,6 +2565,14 @@ execute_cmd(struct daemon_remote* rc, RES* ssl, char* cmd, struct rc_state* rs)
 		do_stats(rc, 1, rs);
 	} else if(cmdcmp(p, "stats", 5)) {
 		do_stats(rc, 0, rs);
+	} else if(cmdcmp(p, "zonestats_noreset", 17)) {
+		do_zonestats(ssl, 1, rs);
+	} else if(cmdcmp(p, "zonestats", 9)) {
+		do_zonestats(ssl, 0, rs);
+	} else if(cmdcmp(p, "top_noreset", 11)) {
+		do_top(ssl, rc, skipwhite(p+11), 0);
+	} else if(cmdcmp(p, "top", 3)) {
+		do_top(ssl, rc, skipwhite(p+3), 1);
 	} else if(cmdcmp(p, "log_reopen", 10)) {
 		do_log_reopen(ssl, rc->xfrd);
 	} else if(cmdcmp(p, "addzone", 7)) {
@@ -2376,7 +2767,7 @@ remote_control_callback(int fd, short event, void* arg)
 	res.fd = fd;
 	handle_req(rc, s, &res);
 
-	if(!s->in_stats_list) {
+	if(!s->in_stats_list && !s->in_zonestats) {
 		VERBOSITY(3, (LOG_INFO, "remote control operation completed"));
 		clean_point(rc, s);
 	}
@@ -2512,70 +2903,146 @@ print_stat_block(RES* ssl, char* n, char* d, struct nsdst* st)
 	if(!ssl_printf(ssl, "%s%snum.dropped=%lu\n", n, d,
 		(unsigned long)st->dropped))
 		return;
+
+#ifdef USE_DNSTAP
+	/* dnstap messages dropped */
+	if(!ssl_printf(ssl, "%s%snum.dnstap_dropped=%lu\n", n, d,
+		(unsigned long)st->dnstap_dropped))
+		return;
+#endif
 }
 
 #ifdef USE_ZONE_STATS
+/** the zonestat values that were printed when the stats were cleared */
+struct zonestat_clear {
+	/* the values of the counters in struct nsdzst */
+	stc_type counter[ZONESTAT_COUNTER_NUM];
+	/* the rare counters that were not zero, the next field is unused */
+	uint32_t rare_num;
+	struct zonestat_rare_entry* rare;
+};
+
 static void
 resize_zonestat(xfrd_state_type* xfrd, size_t num)
 {
-	struct nsdst** a = xalloc_array_zero(num, sizeof(struct nsdst*));
+	struct zonestat_clear** a = xalloc_array_zero(num,
+		sizeof(struct zonestat_clear*));
 	if(xfrd->zonestat_clear_num != 0)
 		memcpy(a, xfrd->zonestat_clear, xfrd->zonestat_clear_num
-			* sizeof(struct nsdst*));
+			* sizeof(struct zonestat_clear*));
 	free(xfrd->zonestat_clear);
 	xfrd->zonestat_clear = a;
 	xfrd->zonestat_clear_num = num;
 }
 
+/** subtract the cleared values from the stats */
+static void
+zonestat_clear_subtract(struct nsdst* st, struct zonestat_clear* c)
+{
+	uint32_t i;
+	for(i=0; i<ZONESTAT_COUNTER_NUM; i++)
+		*zonestat_counter(st, i) -= c->counter[i];
+	for(i=0; i<c->rare_num; i++)
+		*zonestat_array_counter(st, c->rare[i].id) -= c->rare[i].count;
+}
+
+/** store the cumulative stats as the cleared values */
+static void
+zonestat_clear_store(struct zonestat_clear* c, struct nsdst* st)
+{
+	unsigned i;
+	uint32_t n = 0;
+	for(i=0; i<ZONESTAT_COUNTER_NUM; i++)
+		c->counter[i] = *zonestat_counter(st, i);
+	for(i=0; i<ZONESTAT_ARRAY_NUM; i++)
+		if(!zonestat_slot[i] && *zonestat_array_counter(st, i) != 0)
+			n++;
+	if(n > c->rare_num) {
+		free(c->rare);
+		c->rare = xalloc_array_zero(n, sizeof(*c->rare));
+	}
+	c->rare_num = 0;
+	for(i=0; i<ZONESTAT_ARRAY_NUM; i++) {
+		if(!zonestat_slot[i] && *zonestat_array_counter(st, i) != 0) {
+			c->rare[c->rare_num].id = i;
+			c->rare[c->rare_num].count = *zonestat_array_counter(st, i);
+			c->rare_num++;
+		}
+	}
+}
+
+/** print the statistics for one zonestat name, returns false on a write
+ * failure */
+static int
+zonestat_print_zone(RES* ssl, xfrd_state_type* xfrd, struct zonestatname* n,
+	int clear)
+{
+	char* name = (char*)n->node.key;
+	struct nsdst stat0, stat1;
+	if(n->id >= xfrd->zonestat_safe)
+		return 1; /* newly allocated and reload has not yet
+			done and replied with new size */
+	if(name == NULL || name[0]==0)
+		return 1; /* empty name, do not output */
+	/* the statistics are stored in two blocks, during reload
+	 * the newly forked processes get the other block to use,
+	 * these blocks are mmapped and are currently in use to
+	 * add statistics to */
+	memset(&stat0, 0, sizeof(stat0));
+	zonestat_add(&stat0, &xfrd->nsd->zonestat[0][n->id],
+		xfrd->nsd->zonestatrare[0]);
+	zonestat_add(&stat0, &xfrd->nsd->zonestat[1][n->id],
+		xfrd->nsd->zonestatrare[1]);
+
+	/* save a copy of current (cumulative) stats in stat1 */
+	if(clear)
+		memcpy(&stat1, &stat0, sizeof(stat1));
+	/* subtract last total of stats that was 'cleared' */
+	if(n->id < xfrd->zonestat_clear_num &&
+		xfrd->zonestat_clear[n->id])
+		zonestat_clear_subtract(&stat0, xfrd->zonestat_clear[n->id]);
+	if(clear) {
+		/* extend storage array if needed */
+		if(n->id >= xfrd->zonestat_clear_num) {
+			if(n->id+1 < xfrd->nsd->options->zonestatnames->count)
+				resize_zonestat(xfrd, xfrd->nsd->options->zonestatnames->count);
+			else
+				resize_zonestat(xfrd, n->id+1);
+		}
+		if(!xfrd->zonestat_clear[n->id])
+			xfrd->zonestat_clear[n->id] = xalloc_zero(
+				sizeof(struct zonestat_clear));
+		/* store last total of stats */
+		zonestat_clear_store(xfrd->zonestat_clear[n->id], &stat1);
+	}
+
+	/* stat0 contains the details that we want to print */
+	if(!ssl_printf(ssl, "%s%snum.queries=%lu\n", name, ".",
+		(unsigned long)(stat0.qudp + stat0.qudp6 + stat0.ctcp +
+			stat0.ctcp6 + stat0.ctls + stat0.ctls6)))
+		return 0;
+	print_stat_block(ssl, name, ".", &stat0);
+	return 1;
+}
+
+/** print the counts that did not fit in the rare tables, they are not
+ * zeroed, they count since the start */
+static void
+zonestat_print_lost(RES* ssl, xfrd_state_type* xfrd)
+{
+	(void)ssl_printf(ssl, "zonestats.lost=%lu\n",
+		(unsigned long)zonestat_lost(xfrd->nsd));
+}
+
 static void
 zonestat_print(RES* ssl, xfrd_state_type* xfrd, int clear)
 {
 	struct zonestatname* n;
-	struct nsdst stat0, stat1;
 	RBTREE_FOR(n, struct zonestatname*, xfrd->nsd->options->zonestatnames){
-		char* name = (char*)n->node.key;
-		if(n->id >= xfrd->zonestat_safe)
-			continue; /* newly allocated and reload has not yet
-				done and replied with new size */
-		if(name == NULL || name[0]==0)
-			continue; /* empty name, do not output */
-		/* the statistics are stored in two blocks, during reload
-		 * the newly forked processes get the other block to use,
-		 * these blocks are mmapped and are currently in use to
-		 * add statistics to */
-		memcpy(&stat0, &xfrd->nsd->zonestat[0][n->id], sizeof(stat0));
-		memcpy(&stat1, &xfrd->nsd->zonestat[1][n->id], sizeof(stat1));
-		stats_add(&stat0, &stat1);
-		
-		/* save a copy of current (cumulative) stats in stat1 */
-		memcpy(&stat1, &stat0, sizeof(stat1));
-		/* subtract last total of stats that was 'cleared' */
-		if(n->id < xfrd->zonestat_clear_num &&
-			xfrd->zonestat_clear[n->id])
-			stats_subtract(&stat0, xfrd->zonestat_clear[n->id]);
-		if(clear) {
-			/* extend storage array if needed */
-			if(n->id >= xfrd->zonestat_clear_num) {
-				if(n->id+1 < xfrd->nsd->options->zonestatnames->count)
-					resize_zonestat(xfrd, xfrd->nsd->options->zonestatnames->count);
-				else
-					resize_zonestat(xfrd, n->id+1);
-			}
-			if(!xfrd->zonestat_clear[n->id])
-				xfrd->zonestat_clear[n->id] = xalloc(
-					sizeof(struct nsdst));
-			/* store last total of stats */
-			memcpy(xfrd->zonestat_clear[n->id], &stat1,
-				sizeof(struct nsdst));
-		}
-
-		/* stat0 contains the details that we want to print */
-		if(!ssl_printf(ssl, "%s%snum.queries=%lu\n", name, ".",
-			(unsigned long)(stat0.qudp + stat0.qudp6 + stat0.ctcp +
-				stat0.ctcp6 + stat0.ctls + stat0.ctls6)))
+		if(!zonestat_print_zone(ssl, xfrd, n, clear))
 			return;
-		print_stat_block(ssl, name, ".", &stat0);
 	}
+	zonestat_print_lost(ssl, xfrd);
 }
 #endif /* USE_ZONE_STATS */
 
@@ -2611,6 +3078,13 @@ print_stats(RES* ssl, xfrd_state_type* xfrd, struct timeval* now, int clear)
 		return;
 	if(!print_longnum(ssl, "size.db.mem=", xfrd->nsd->st.db_mem))
 		return;
+	if(!print_longnum(ssl, "size.db.compact=",
+		xfrd->nsd->st.db_compact_moved))
+		return;
+	if(!ssl_printf(ssl, "time.db.compact=%lu.%6.6lu\n",
+		(unsigned long)(xfrd->nsd->st.db_compact_usec/1000000),
+		(unsigned long)(xfrd->nsd->st.db_compact_usec%1000000)))
+		return;
 	if(!print_longnum(ssl, "size.xfrd.mem=", region_get_mem(xfrd->region)))
 		return;
 	if(!print_longnum(ssl, "size.config.disk=", 
@@ -2640,6 +3114,8 @@ clear_stats(xfrd_state_type* xfrd)
 	size_t i;
 	uint64_t dbd = xfrd->nsd->st.db_disk;
 	uint64_t dbm = xfrd->nsd->st.db_mem;
+	uint64_t dbcu = xfrd->nsd->st.db_compact_usec;
+	uint64_t dbcm = xfrd->nsd->st.db_compact_moved;
 	for(i=0; i<xfrd->nsd->child_count; i++) {
 		xfrd->nsd->children[i].query_count = 0;
 	}
@@ -2649,6 +3125,8 @@ clear_stats(xfrd_state_type* xfrd)
 	 * that before the next stats printout */
 	xfrd->nsd->st.db_disk = dbd;
 	xfrd->nsd->st.db_mem = dbm;
+	xfrd->nsd->st.db_compact_usec = dbcu;
+	xfrd->nsd->st.db_compact_moved = dbcm;
 }
 
 void
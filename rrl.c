@@ -52,13 +52,14 @@ static uint8_t rrl_ipv4_prefixlen = RRL_IPV4_PREFIX_LENGTH;
 static uint8_t rrl_ipv6_prefixlen = RRL_IPV6_PREFIX_LENGTH;
 static uint64_t rrl_ipv6_mask; /* max prefixlen 64 */
 static uint32_t rrl_whitelist_ratelimit = RRL_WLIST_LIMIT; /* 2x qps */
+static uint32_t rrl_cookie_ratelimit = RRL_COOKIE_LIMIT; /* 2x qps */
 
 /* the array of mmaps for the children (saved between reloads) */
 static void** rrl_maps = NULL;
 static size_t rrl_maps_num = 0;
 
-void rrl_mmap_init(int numch, size_t numbuck, size_t lm, size_t wlm, size_t sm,
-	size_t plf, size_t pls)
+void rrl_mmap_init(int numch, size_t numbuck, size_t lm, size_t wlm,
+	size_t clm, size_t sm, size_t plf, size_t pls)
 {
 #ifdef HAVE_MMAP
 	size_t i;
@@ -76,6 +77,7 @@ void rrl_mmap_init(int numch, size_t numbuck, size_t lm, size_t wlm, size_t sm,
 			(((uint64_t)0xffffffff)<<32);
 	}
 	rrl_whitelist_ratelimit = wlm*2;
+	rrl_cookie_ratelimit = clm*2;
 #ifdef HAVE_MMAP
 	/* allocate the ratelimit hashtable in a memory map so it is
 	 * preserved across reforks (every child its own table) */
@@ -147,7 +149,7 @@ void rrl_deinit(size_t ch)
 
 /** return the source netblock of the query, this is the genuine source
  * for genuine queries and the target for reflected packets */
-static uint64_t rrl_get_source(query_type* query, uint16_t* c2)
+uint64_t rrl_get_source(query_type* query, uint16_t* c2)
 {
 	/* note there is an IPv6 subnet, that maps
 	 * to the same buckets as IPv4 space, but there is a flag in c2
@@ -318,6 +320,9 @@ static void examine_query(query_type* query, uint32_t* hash, uint64_t* source,
 	if(query->zone && query->zone->opts &&
 		(query->zone->opts->pattern->rrl_whitelist & c))
 		*lm = rrl_whitelist_ratelimit;
+	/* a valid server cookie means the source address is not spoofed */
+	if(query->edns.cookie_status == COOKIE_VALID)
+		*lm = rrl_cookie_ratelimit;
 	if(*lm == 0) return;
 	c |= c2;
 	*flags = c;
@@ -37,14 +37,18 @@ enum rrl_type {
 #define RRL_IPV6_PREFIX_LENGTH 64
 /** default whitelist rrl limit, in 2x qps, default is thus 2000 qps */
 #define RRL_WLIST_LIMIT 4000
+/** default rrl limit for queries with a valid server cookie, in 2x qps,
+ * the default 0 does not limit them, their source address is verified */
+#define RRL_COOKIE_LIMIT 0
 
 /**
  * Initialize for n children (optional, otherwise no mmaps used)
- * ratelimits lm and wlm are in qps (this routines x2s them for internal use).
+ * ratelimits lm, wlm and clm are in qps (this routines x2s them for
+ * internal use).  clm is for queries with a valid DNS cookie.
  * plf and pls are in prefix lengths.
  */
-void rrl_mmap_init(int numch, size_t numbuck, size_t lm, size_t wlm, size_t sm,
-	size_t plf, size_t pls);
+void rrl_mmap_init(int numch, size_t numbuck, size_t lm, size_t wlm,
+	size_t clm, size_t sm, size_t plf, size_t pls);
 
 /**
  * Initialize rate limiting (for this child server process)
@@ -77,6 +81,10 @@ const char* rrltype2str(enum rrl_type c);
 /** convert string to classification type */
 enum rrl_type rrlstr2type(const char* s);
 
+/** the source netblock of the query, masked with the prefix length, the
+ * c2 flag is rrl_ip6 for IPv6 */
+uint64_t rrl_get_source(query_type* query, uint16_t* c2);
+
 /** for unit test, update rrl bucket; return rate */
 uint32_t rrl_update(query_type* query, uint32_t hash, uint64_t source,
 	uint16_t flags, int32_t now, uint32_t lm);
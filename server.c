@@ -43,6 +43,9 @@
 #endif
 #ifdef HAVE_MMAP
 #include <sys/mman.h>
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS   MAP_ANON
+#endif
 #endif /* HAVE_MMAP */
 #ifdef HAVE_OPENSSL_RAND_H
 #include <openssl/rand.h>
@@ -79,8 +82,10 @@
 #include "ipc.h"
 #include "udb.h"
 #include "remote.h"
+#include "metrics.h"
 #include "lookup3.h"
 #include "rrl.h"
+#include "topn.h"
 #ifdef USE_DNSTAP
 #include "dnstap/dnstap_collector.h"
 #endif
@@ -220,6 +225,13 @@ struct tcp_handler_data
 	 */
 	enum { tls_hs_none, tls_hs_read, tls_hs_write,
 		tls_hs_read_event, tls_hs_write_event } shake_state;
+#endif
+#ifdef BIND8_STATS
+	/*
+	 * The time the query was read, for the latency statistics.
+	 * Zero when not measured.
+	 */
+	struct timeval query_start;
 #endif
 	/* list of connections, for service of remaining tcp channels */
 	struct tcp_handler_data *prev, *next;
@@ -475,12 +487,149 @@ zonestatid_tree_set(struct nsd* nsd)
 }
 
 #ifdef USE_ZONE_STATS
+/* the array elements that have a counter in struct nsdzst, after the
+ * plain counters.  The others are counted in the rare table. */
+static const uint16_t zonestat_common[ZONESTAT_COUNTER_NUM -
+	ZONESTAT_PLAIN_NUM] = {
+	ZST_qtype(TYPE_A), ZST_qtype(TYPE_NS), ZST_qtype(TYPE_CNAME),
+	ZST_qtype(TYPE_SOA), ZST_qtype(TYPE_PTR), ZST_qtype(TYPE_MX),
+	ZST_qtype(TYPE_TXT), ZST_qtype(TYPE_AAAA), ZST_qtype(TYPE_SRV),
+	ZST_qtype(TYPE_DS), ZST_qtype(TYPE_RRSIG), ZST_qtype(TYPE_DNSKEY),
+	ZST_qtype(64) /* SVCB */, ZST_qtype(65) /* HTTPS */,
+	ZST_qtype(TYPE_IXFR), ZST_qtype(TYPE_AXFR), ZST_qtype(TYPE_ANY),
+	ZST_qclass(CLASS_IN),
+	ZST_opcode(OPCODE_QUERY), ZST_opcode(OPCODE_NOTIFY),
+	ZST_rcode(RCODE_OK), ZST_rcode(RCODE_FORMAT), ZST_rcode(RCODE_SERVFAIL),
+	ZST_rcode(RCODE_NXDOMAIN), ZST_rcode(RCODE_IMPL),
+	ZST_rcode(RCODE_REFUSE), ZST_rcode(RCODE_NOTAUTH)
+};
+
+uint8_t zonestat_slot[ZONESTAT_ARRAY_NUM];
+
+void
+zonestat_slot_init(void)
+{
+	size_t i;
+	memset(zonestat_slot, 0, sizeof(zonestat_slot));
+	for(i=0; i<sizeof(zonestat_common)/sizeof(zonestat_common[0]); i++)
+		zonestat_slot[zonestat_common[i]] = ZONESTAT_PLAIN_NUM + i;
+}
+
+int
+zonestat_rare_inc(struct zonestat_rare* rare, struct nsdzst* z, unsigned id)
+{
+	uint32_t e, head;
+	for(e = z->rare; e != 0; e = rare->entry[e-1].next) {
+		if(rare->entry[e-1].id == id) {
+			rare->entry[e-1].count++;
+			return 0;
+		}
+	}
+	/* take a new entry, other processes may be adding at the same
+	 * time, if the same counter is added twice the reader sums them */
+	do {
+		e = rare->used;
+		if(e >= ZONESTAT_RARE_NUM) {
+			if(rare->lost++ == 0)
+				log_msg(LOG_WARNING, "zonestats: the table of "
+					"rare counters is full, their counts "
+					"are lost");
+			return 0;
+		}
+	} while(!__sync_bool_compare_and_swap(&rare->used, e, e+1));
+	rare->entry[e].count = 1;
+	rare->entry[e].id = id;
+	do {
+		head = z->rare;
+		rare->entry[e].next = head;
+	} while(!__sync_bool_compare_and_swap(&z->rare, head, e+1));
+	return 0;
+}
+
+stc_type*
+zonestat_counter(struct nsdst* st, unsigned c)
+{
+	switch(c) {
+	case zst_qudp: return &st->qudp;
+	case zst_qudp6: return &st->qudp6;
+	case zst_ctcp: return &st->ctcp;
+	case zst_ctcp6: return &st->ctcp6;
+	case zst_ctls: return &st->ctls;
+	case zst_ctls6: return &st->ctls6;
+	case zst_nona: return &st->nona;
+	case zst_dropped: return &st->dropped;
+	case zst_truncated: return &st->truncated;
+	case zst_edns: return &st->edns;
+	case zst_ednserr: return &st->ednserr;
+	case zst_raxfr: return &st->raxfr;
+	default:
+		break;
+	}
+	return zonestat_array_counter(st, zonestat_common[c -
+		ZONESTAT_PLAIN_NUM]);
+}
+
+stc_type*
+zonestat_array_counter(struct nsdst* st, unsigned id)
+{
+	if(id < ZST_qclass(0))
+		return &st->qtype[id];
+	if(id < ZST_rcode(0))
+		return &st->qclass[id - ZST_qclass(0)];
+	if(id < ZST_opcode(0))
+		return &st->rcode[id - ZST_rcode(0)];
+	return &st->opcode[id - ZST_opcode(0)];
+}
+
+/* The counters are read while the server processes increment them,
+ * without locks.  A rare entry is linked into the list after it is
+ * filled in, and the compare and swap orders the stores. */
+void
+zonestat_add(struct nsdst* st, struct nsdzst* z, struct zonestat_rare* rare)
+{
+	unsigned c;
+	uint32_t e;
+	for(c=0; c<ZONESTAT_COUNTER_NUM; c++)
+		*zonestat_counter(st, c) += z->counter[c];
+	for(e = z->rare; e != 0; e = rare->entry[e-1].next) {
+		if(e > ZONESTAT_RARE_NUM)
+			break;
+		*zonestat_array_counter(st, rare->entry[e-1].id) +=
+			rare->entry[e-1].count;
+	}
+}
+
+stc_type
+zonestat_lost(struct nsd* nsd)
+{
+	return nsd->zonestatrare[0]->lost + nsd->zonestatrare[1]->lost;
+}
+
+/* allocate the table of rare counters, shared with the children */
+static struct zonestat_rare*
+zonestat_rare_alloc(void)
+{
+	struct zonestat_rare* rare;
+#ifdef HAVE_MMAP
+	rare = (struct zonestat_rare*)mmap(NULL, sizeof(*rare),
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if(rare == MAP_FAILED) {
+		log_msg(LOG_ERR, "mmap failed: %s", strerror(errno));
+		exit(1);
+	}
+	/* the pages are zero filled, and used when they are touched */
+#else
+	rare = (struct zonestat_rare*)xalloc_zero(sizeof(*rare));
+#endif
+	return rare;
+}
+
 void
 server_zonestat_alloc(struct nsd* nsd)
 {
 	size_t num = (nsd->options->zonestatnames->count==0?1:
 			nsd->options->zonestatnames->count);
-	size_t sz = sizeof(struct nsdst)*num;
+	size_t sz = sizeof(struct nsdzst)*num;
 	char tmpfile[256];
 	uint8_t z = 0;
 
@@ -531,7 +680,7 @@ server_zonestat_alloc(struct nsd* nsd)
 			nsd->zonestatfname[1], strerror(errno));
 		exit(1);
 	}
-	nsd->zonestat[0] = (struct nsdst*)mmap(NULL, sz, PROT_READ|PROT_WRITE,
+	nsd->zonestat[0] = (struct nsdzst*)mmap(NULL, sz, PROT_READ|PROT_WRITE,
 		MAP_SHARED, nsd->zonestatfd[0], 0);
 	if(nsd->zonestat[0] == MAP_FAILED) {
 		log_msg(LOG_ERR, "mmap failed: %s", strerror(errno));
@@ -539,7 +688,7 @@ server_zonestat_alloc(struct nsd* nsd)
 		unlink(nsd->zonestatfname[1]);
 		exit(1);
 	}
-	nsd->zonestat[1] = (struct nsdst*)mmap(NULL, sz, PROT_READ|PROT_WRITE,
+	nsd->zonestat[1] = (struct nsdzst*)mmap(NULL, sz, PROT_READ|PROT_WRITE,
 		MAP_SHARED, nsd->zonestatfd[1], 0);
 	if(nsd->zonestat[1] == MAP_FAILED) {
 		log_msg(LOG_ERR, "mmap failed: %s", strerror(errno));
@@ -555,6 +704,10 @@ server_zonestat_alloc(struct nsd* nsd)
 	nsd->zonestatsizenow = num;
 	nsd->zonestatnow = nsd->zonestat[0];
 #endif /* HAVE_MMAP */
+	nsd->zonestatrare[0] = zonestat_rare_alloc();
+	nsd->zonestatrare[1] = zonestat_rare_alloc();
+	nsd->zonestatrarenow = nsd->zonestatrare[0];
+	zonestat_slot_init();
 }
 
 void
@@ -562,8 +715,8 @@ zonestat_remap(struct nsd* nsd, int idx, size_t sz)
 {
 #ifdef HAVE_MMAP
 #ifdef MREMAP_MAYMOVE
-	nsd->zonestat[idx] = (struct nsdst*)mremap(nsd->zonestat[idx],
-		sizeof(struct nsdst)*nsd->zonestatsize[idx], sz,
+	nsd->zonestat[idx] = (struct nsdzst*)mremap(nsd->zonestat[idx],
+		sizeof(struct nsdzst)*nsd->zonestatsize[idx], sz,
 		MREMAP_MAYMOVE);
 	if(nsd->zonestat[idx] == MAP_FAILED) {
 		log_msg(LOG_ERR, "mremap failed: %s", strerror(errno));
@@ -571,12 +724,12 @@ zonestat_remap(struct nsd* nsd, int idx, size_t sz)
 	}
 #else /* !HAVE MREMAP */
 	if(msync(nsd->zonestat[idx],
-		sizeof(struct nsdst)*nsd->zonestatsize[idx], MS_ASYNC) != 0)
+		sizeof(struct nsdzst)*nsd->zonestatsize[idx], MS_ASYNC) != 0)
 		log_msg(LOG_ERR, "msync failed: %s", strerror(errno));
 	if(munmap(nsd->zonestat[idx],
-		sizeof(struct nsdst)*nsd->zonestatsize[idx]) != 0)
+		sizeof(struct nsdzst)*nsd->zonestatsize[idx]) != 0)
 		log_msg(LOG_ERR, "munmap failed: %s", strerror(errno));
-	nsd->zonestat[idx] = (struct nsdst*)mmap(NULL, sz,
+	nsd->zonestat[idx] = (struct nsdzst*)mmap(NULL, sz,
 		PROT_READ|PROT_WRITE, MAP_SHARED, nsd->zonestatfd[idx], 0);
 	if(nsd->zonestat[idx] == MAP_FAILED) {
 		log_msg(LOG_ERR, "mmap failed: %s", strerror(errno));
@@ -599,7 +752,7 @@ server_zonestat_realloc(struct nsd* nsd)
 		idx = 1;
 	if(nsd->zonestatsize[idx] == nsd->zonestatdesired)
 		return;
-	sz = sizeof(struct nsdst)*nsd->zonestatdesired;
+	sz = sizeof(struct nsdzst)*nsd->zonestatdesired;
 	if(lseek(nsd->zonestatfd[idx], (off_t)sz-1, SEEK_SET) == -1) {
 		log_msg(LOG_ERR, "lseek %s: %s", nsd->zonestatfname[idx],
 			strerror(errno));
@@ -613,8 +766,8 @@ server_zonestat_realloc(struct nsd* nsd)
 	zonestat_remap(nsd, idx, sz);
 	/* zero the newly allocated region */
 	if(nsd->zonestatdesired > nsd->zonestatsize[idx]) {
-		memset(((char*)nsd->zonestat[idx])+sizeof(struct nsdst) *
-			nsd->zonestatsize[idx], 0, sizeof(struct nsdst) *
+		memset(((char*)nsd->zonestat[idx])+sizeof(struct nsdzst) *
+			nsd->zonestatsize[idx], 0, sizeof(struct nsdzst) *
 			(nsd->zonestatdesired - nsd->zonestatsize[idx]));
 	}
 	nsd->zonestatsize[idx] = nsd->zonestatdesired;
@@ -629,14 +782,88 @@ server_zonestat_switch(struct nsd* nsd)
 {
 	if(nsd->zonestatnow == nsd->zonestat[0]) {
 		nsd->zonestatnow = nsd->zonestat[1];
+		nsd->zonestatrarenow = nsd->zonestatrare[1];
 		nsd->zonestatsizenow = nsd->zonestatsize[1];
 	} else {
 		nsd->zonestatnow = nsd->zonestat[0];
+		nsd->zonestatrarenow = nsd->zonestatrare[0];
 		nsd->zonestatsizenow = nsd->zonestatsize[0];
 	}
 }
 #endif /* USE_ZONE_STATS */
 
+#ifdef BIND8_STATS
+const unsigned nsd_latency_bound[NSD_LATENCY_BUCKETS-1] = { 100, 250, 500,
+	1000, 2500, 5000, 10000, 25000, 100000, 1000000 };
+
+/* the timer that publishes the statistics of the child */
+static struct event stat_publish_event;
+
+void
+server_stat_map_alloc(struct nsd* nsd)
+{
+	size_t sz = sizeof(struct nsdst)*2*nsd->child_count;
+	nsd->stat_map = NULL;
+	nsd->stat_block = 0;
+	if(!nsd->options->metrics_enable || sz == 0)
+		return;
+#ifdef HAVE_MMAP
+	nsd->stat_map = (struct nsdst*)mmap(NULL, sz, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if(nsd->stat_map == MAP_FAILED) {
+		log_msg(LOG_ERR, "mmap failed: %s", strerror(errno));
+		exit(1);
+	}
+#else
+	log_msg(LOG_WARNING, "metrics: no mmap, the counters of the running "
+		"servers are not shown");
+#endif /* HAVE_MMAP */
+}
+
+/* copy the statistics of this child to the stat_map, a reader can see
+ * a mix of this and the previous copy, both have counts that are not
+ * more than the current counts */
+static void
+server_stat_publish(struct nsd* nsd)
+{
+	memcpy(&nsd->stat_map[nsd->stat_block*nsd->child_count +
+		nsd->this_child->child_num], &nsd->st, sizeof(nsd->st));
+}
+
+static void
+server_stat_publish_timer(int ATTR_UNUSED(fd), short ATTR_UNUSED(event),
+	void* arg)
+{
+	struct nsd* nsd = (struct nsd*)arg;
+	struct timeval tv;
+	server_stat_publish(nsd);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	if(event_add(&stat_publish_event, &tv) != 0)
+		log_msg(LOG_ERR, "stat publish: event_add failed");
+}
+
+/* account num answers that were received at start, and are sent now */
+static void
+server_stat_latency(struct nsd* nsd, struct timeval* start, unsigned num)
+{
+	struct timeval now;
+	unsigned long usec;
+	unsigned i = 0;
+	if(gettimeofday(&now, NULL) == -1)
+		return;
+	if(now.tv_sec < start->tv_sec || (now.tv_sec == start->tv_sec &&
+		now.tv_usec < start->tv_usec))
+		usec = 0; /* the clock went back */
+	else	usec = (unsigned long)(now.tv_sec - start->tv_sec)*1000000
+			+ now.tv_usec - start->tv_usec;
+	while(i < NSD_LATENCY_BUCKETS-1 && usec > nsd_latency_bound[i])
+		i++;
+	nsd->st.latency[i] += num;
+	nsd->st.latency_usec += usec*num;
+}
+#endif /* BIND8_STATS */
+
 static void
 cleanup_dname_compression_tables(void *ptr)
 {
@@ -1328,6 +1555,105 @@ server_init(struct nsd *nsd)
 	return 0;
 }
 
+/** read the cookie secrets from file, returns false on failure */
+static int
+cookie_secrets_read(struct nsd *nsd, const char *fname)
+{
+	uint8_t secrets[2][COOKIE_SECRET_SIZE];
+	size_t count = 0, len;
+	char line[256], *s;
+	int lineno = 0;
+	FILE *in = fopen(fname, "r");
+	if(!in) {
+		log_msg(LOG_ERR, "cannot open cookie-secret-file %s: %s",
+			fname, strerror(errno));
+		return 0;
+	}
+	while(fgets(line, (int)sizeof(line), in)) {
+		lineno++;
+		s = line;
+		while(isspace((unsigned char)*s))
+			s++;
+		len = strlen(s);
+		while(len > 0 && isspace((unsigned char)s[len-1]))
+			s[--len] = 0;
+		if(*s == 0 || *s == '#')
+			continue;
+		if(count == 2) {
+			log_msg(LOG_WARNING, "%s:%d: more than two cookie "
+				"secrets, the rest is ignored", fname, lineno);
+			break;
+		}
+		if(len != 2*COOKIE_SECRET_SIZE || hex_pton(s, secrets[count],
+			COOKIE_SECRET_SIZE) != COOKIE_SECRET_SIZE) {
+			log_msg(LOG_ERR, "%s:%d: a cookie secret must be %d "
+				"hex digits", fname, lineno,
+				2*COOKIE_SECRET_SIZE);
+			fclose(in);
+			return 0;
+		}
+		count++;
+	}
+	fclose(in);
+	if(count == 0) {
+		log_msg(LOG_ERR, "%s: no cookie secret in file", fname);
+		return 0;
+	}
+	memcpy(nsd->cookie_secrets, secrets, sizeof(secrets));
+	nsd->cookie_secrets_count = count;
+	return 1;
+}
+
+/** make a random cookie secret */
+static void
+cookie_secret_random(uint8_t secret[COOKIE_SECRET_SIZE])
+{
+	size_t i;
+#ifdef HAVE_GETRANDOM
+	if(getrandom(secret, COOKIE_SECRET_SIZE, 0) == COOKIE_SECRET_SIZE)
+		return;
+#endif
+#if defined(HAVE_SSL) && defined(HAVE_OPENSSL_RAND_H)
+	if(RAND_status() && RAND_bytes(secret, COOKIE_SECRET_SIZE) > 0)
+		return;
+#endif
+	for(i = 0; i < COOKIE_SECRET_SIZE; i++) {
+#ifdef HAVE_ARC4RANDOM
+		secret[i] = (uint8_t)arc4random();
+#else
+		secret[i] = (uint8_t)random();
+#endif
+	}
+}
+
+/*
+ * Set up the DNS cookie secrets, before the children are forked, so that
+ * they all use the same ones.  The cookie-secret-file is read at start and
+ * on every reload, its first secret creates server cookies and the second
+ * is accepted too, for a rollover.  Without the file, a random secret is
+ * made once and kept over reloads.
+ */
+static void
+server_cookie_secrets_setup(struct nsd *nsd)
+{
+	if(!nsd->options->answer_cookie)
+		return;
+	if(nsd->options->cookie_secret_file &&
+		nsd->options->cookie_secret_file[0]) {
+		if(cookie_secrets_read(nsd, nsd->options->cookie_secret_file))
+			return;
+		if(nsd->cookie_secrets_count != 0) {
+			log_msg(LOG_ERR, "keeping the previous cookie secrets");
+			return;
+		}
+		log_msg(LOG_ERR, "using a random cookie secret");
+	}
+	if(nsd->cookie_secrets_count == 0) {
+		cookie_secret_random(nsd->cookie_secrets[0]);
+		nsd->cookie_secrets_count = 1;
+	}
+}
+
 /*
  * Prepare the server for take off.
  *
@@ -1359,10 +1685,12 @@ server_prepare(struct nsd *nsd)
 	rrl_mmap_init(nsd->child_count, nsd->options->rrl_size,
 		nsd->options->rrl_ratelimit,
 		nsd->options->rrl_whitelist_ratelimit,
+		nsd->options->rrl_cookie_ratelimit,
 		nsd->options->rrl_slip,
 		nsd->options->rrl_ipv4_prefix_length,
 		nsd->options->rrl_ipv6_prefix_length);
 #endif /* RATELIMIT */
+	server_cookie_secrets_setup(nsd);
 
 	/* Open the database... */
 	if ((nsd->db = namedb_open(nsd->dbfile, nsd->options)) == NULL) {
@@ -1463,6 +1791,7 @@ server_shutdown(struct nsd *nsd)
 	}
 
 	tsig_finalize();
+	daemon_metrics_delete(nsd->metrics);
 #ifdef HAVE_SSL
 	daemon_remote_delete(nsd->rc); /* ssl-delete secret keys */
 	if (nsd->tls_ctx)
@@ -1642,6 +1971,7 @@ server_send_soa_xfrd(struct nsd* nsd, int shortsoa)
 #ifdef HAVE_SSL
 			daemon_remote_close(nsd->rc);
 #endif
+			daemon_metrics_close(nsd->metrics);
 			/* Unlink it if possible... */
 			unlinkpid(nsd->pidfile);
 			unlink(nsd->task[0]->fname);
@@ -2106,10 +2436,17 @@ reload_process_tasks(struct nsd* nsd, udb_ptr* last_task, int cmdsocket)
 	sig_atomic_t cmd = NSD_QUIT_SYNC;
 	udb_ptr t, next;
 	udb_base* u = nsd->task[nsd->mytask];
+	int num_xfr = 0;
+	struct timeval start, end;
 	udb_ptr_init(&next, u);
 	udb_ptr_new(&t, u, udb_base_get_userdata(u));
 	udb_base_set_userdata(u, 0);
+	if(gettimeofday(&start, NULL) != 0)
+		memset(&start, 0, sizeof(start));
 	while(!udb_ptr_is_null(&t)) {
+		if(TASKLIST(&t)->task_type == task_apply_xfr)
+			num_xfr++;
+
 		/* store next in list so this one can be deleted or reused */
 		udb_ptr_set_rptr(&next, u, &TASKLIST(&t)->next);
 		udb_rptr_zero(&TASKLIST(&t)->next, u);
@@ -2144,6 +2481,13 @@ reload_process_tasks(struct nsd* nsd, udb_ptr* last_task, int cmdsocket)
 	}
 	udb_ptr_unlink(&t, u);
 	udb_ptr_unlink(&next, u);
+	if(num_xfr != 0 && start.tv_sec != 0 &&
+		gettimeofday(&end, NULL) == 0) {
+		VERBOSITY(1, (LOG_INFO, "reload: applied %d zone transfers "
+			"in %g seconds", num_xfr, (double)(end.tv_sec -
+			start.tv_sec) + (double)(end.tv_usec - start.tv_usec)
+			/ 1000000.0));
+	}
 }
 
 #ifdef BIND8_STATS
@@ -2176,8 +2520,10 @@ reload_do_stats(int cmdfd, struct nsd* nsd, udb_ptr* last)
 	}
 	s.db_disk = (nsd->db->udb?nsd->db->udb->base_size:0);
 	s.db_mem = region_get_mem(nsd->db->region);
+	s.db_compact_usec = (nsd->db->udb?nsd->db->udb->compact_usec:0);
+	s.db_compact_moved = (nsd->db->udb?nsd->db->udb->compact_moved:0);
 	p = (stc_type*)task_new_stat_info(nsd->task[nsd->mytask], last, &s,
-		nsd->child_count);
+		nsd->child_count, nsd->stat_block);
 	if(!p) return;
 	for(i=0; i<nsd->child_count; i++) {
 		if(block_read(nsd, cmdfd, p++, sizeof(stc_type), 1)!=
@@ -2220,7 +2566,9 @@ server_reload(struct nsd *nsd, region_type* server_region, netio_type* netio,
 	udb_compact_inhibited(nsd->db->udb, 1);
 	reload_process_tasks(nsd, &last_task, cmdsocket);
 	udb_compact_inhibited(nsd->db->udb, 0);
-	udb_compact(nsd->db->udb);
+	/* compact a part now, the remainder is done in steps by the
+	 * server_main loop, so that the reload is not stalled by it */
+	udb_compact_step(nsd->db->udb, UDB_COMPACT_STEP_BUDGET);
 
 #ifndef NDEBUG
 	if(nsd_debug_level >= 1)
@@ -2240,6 +2588,14 @@ server_reload(struct nsd *nsd, region_type* server_region, netio_type* netio,
 	server_zonestat_realloc(nsd); /* realloc for new children */
 	server_zonestat_switch(nsd);
 #endif
+#ifdef BIND8_STATS
+	/* the new children publish in the other block of the stat_map,
+	 * xfrd zeroes this block when it has the final stats of the
+	 * old children */
+	nsd->stat_block = !nsd->stat_block;
+#endif
+	/* the new children use the cookie secrets from the file, if any */
+	server_cookie_secrets_setup(nsd);
 
 	/* listen for the signals of failed children again */
 	sigaction(SIGCHLD, &old_sigchld, NULL);
@@ -2372,6 +2728,7 @@ server_main(struct nsd *nsd)
 	pid_t child_pid;
 	pid_t reload_pid = -1;
 	sig_atomic_t mode;
+	int compacting;
 
 	/* Ensure we are the main process */
 	assert(nsd->server_kind == NSD_SERVER_MAIN);
@@ -2422,6 +2779,9 @@ server_main(struct nsd *nsd)
 					if(reload_listener.fd != -1) close(reload_listener.fd);
 					reload_listener.fd = -1;
 					reload_listener.event_types = NETIO_EVENT_NONE;
+					/* the failed reload has changed the db file,
+					 * do not compact it from the stale mapping */
+					udb_compact_inhibited(nsd->db->udb, 1);
 					task_process_sync(nsd->task[nsd->mytask]);
 					/* inform xfrd reload attempt ended */
 					if(!write_socket(nsd->xfrd_listener->fd,
@@ -2459,6 +2819,12 @@ server_main(struct nsd *nsd)
 			/* timeout to collect processes. In case no sigchild happens. */
 			timeout_spec.tv_sec = 60;
 			timeout_spec.tv_nsec = 0;
+			/* the database is compacted in steps in between the
+			 * events, but not while a reload process owns it */
+			compacting = (reload_pid == -1 &&
+				udb_compact_pending(nsd->db->udb));
+			if(compacting)
+				timeout_spec.tv_sec = 0;
 
 			/* listen on ports, timeout for collecting terminated children */
 			if(netio_dispatch(netio, &timeout_spec, 0) == -1) {
@@ -2466,6 +2832,17 @@ server_main(struct nsd *nsd)
 					log_msg(LOG_ERR, "netio_dispatch failed: %s", strerror(errno));
 				}
 			}
+			if(compacting && nsd->mode == NSD_RUN) {
+				if(!udb_compact_step(nsd->db->udb,
+					UDB_COMPACT_STEP_BUDGET))
+					log_msg(LOG_ERR, "could not compact the database");
+				else if(!udb_compact_pending(nsd->db->udb)) {
+					VERBOSITY(2, (LOG_INFO, "database compacted, "
+						"%llu bytes moved in %llu usec total",
+						(unsigned long long)nsd->db->udb->compact_moved,
+						(unsigned long long)nsd->db->udb->compact_usec));
+				}
+			}
 			if(nsd->restart_children) {
 				restart_child_servers(nsd, server_region, netio,
 					&nsd->xfrd_listener->fd);
@@ -2482,6 +2859,9 @@ server_main(struct nsd *nsd)
 				if(reload_listener.fd != -1) close(reload_listener.fd);
 				reload_listener.fd = -1;
 				reload_listener.event_types = NETIO_EVENT_NONE;
+				/* the failed reload has changed the db file,
+				 * do not compact it from the stale mapping */
+				udb_compact_inhibited(nsd->db->udb, 1);
 				task_process_sync(nsd->task[nsd->mytask]);
 				/* inform xfrd reload attempt ended */
 				if(!write_socket(nsd->xfrd_listener->fd,
@@ -2636,6 +3016,7 @@ server_main(struct nsd *nsd)
 #ifdef HAVE_SSL
 	daemon_remote_close(nsd->rc);
 #endif
+	daemon_metrics_close(nsd->metrics);
 	send_children_quit_and_wait(nsd);
 
 	/* Unlink it if possible... */
@@ -2705,9 +3086,12 @@ server_process_query_udp(struct nsd *nsd, struct query *query)
 {
 #ifdef RATELIMIT
 	if(query_process(query, nsd) != QUERY_DISCARDED) {
-		if(rrl_process_query(query))
+		if(rrl_process_query(query)) {
+#ifdef USE_DNSTAP
+			query->dnstap_rrl = 1;
+#endif
 			return rrl_slip(query);
-		else	return QUERY_PROCESSED;
+		} else	return QUERY_PROCESSED;
 	}
 	return QUERY_DISCARDED;
 #else
@@ -2860,6 +3244,18 @@ server_child(struct nsd *nsd)
 #ifdef RATELIMIT
 	rrl_init(nsd->this_child->child_num);
 #endif
+	topn_init(nsd->this_child->child_num);
+#ifdef BIND8_STATS
+	if(nsd->stat_map) {
+		server_stat_publish(nsd);
+		memset(&stat_publish_event, 0, sizeof(stat_publish_event));
+		event_set(&stat_publish_event, -1, EV_TIMEOUT,
+			server_stat_publish_timer, nsd);
+		if(event_base_set(event_base, &stat_publish_event) != 0)
+			log_msg(LOG_ERR, "stat publish: event_base_set failed");
+		server_stat_publish_timer(-1, EV_TIMEOUT, nsd);
+	}
+#endif
 
 	assert(nsd->server_kind != NSD_SERVER_MAIN);
 	DEBUG(DEBUG_IPC, 2, (LOG_INFO, "child process started"));
@@ -3244,6 +3640,9 @@ handle_udp(int fd, short event, void* arg)
 	struct udp_handler_data *data = (struct udp_handler_data *) arg;
 	int received, sent, recvcount, i;
 	struct query *q;
+#ifdef BIND8_STATS
+	struct timeval start;
+#endif
 
 	if (!(event & EV_READ)) {
 		return;
@@ -3260,6 +3659,11 @@ handle_udp(int fd, short event, void* arg)
 		/* Simply no data available */
 		return;
 	}
+#ifdef BIND8_STATS
+	/* the answers wait until the batch is sent */
+	if(data->nsd->stat_map && gettimeofday(&start, NULL) == -1)
+		start.tv_sec = 0;
+#endif
 	for (i = 0; i < recvcount; i++) {
 	loopstart:
 		received = msgs[i].msg_len;
@@ -3293,12 +3697,14 @@ handle_udp(int fd, short event, void* arg)
 		buffer_skip(q->packet, received);
 		buffer_flip(q->packet);
 #ifdef USE_DNSTAP
-		dt_collector_submit_auth_query(data->nsd, &q->addr, q->addrlen,
-			q->tcp, q->packet);
+		if(dt_collector_select_query(data->nsd, q))
+			dt_collector_submit_auth_query(data->nsd, &q->addr,
+				q->addrlen, q->tcp, q->packet);
 #endif /* USE_DNSTAP */
 
 		/* Process and answer the query... */
 		if (server_process_query_udp(data->nsd, q) != QUERY_DISCARDED) {
+			topn_query(q);
 			if (RCODE(q->packet) == RCODE_OK && !AA(q->packet)) {
 				STATUP(data->nsd, nona);
 				ZTATUP(data->nsd, q->zone, nona);
@@ -3327,11 +3733,13 @@ handle_udp(int fd, short event, void* arg)
 			}
 #endif /* BIND8_STATS */
 #ifdef USE_DNSTAP
-			dt_collector_submit_auth_response(data->nsd,
-				&q->addr, q->addrlen, q->tcp, q->packet,
-				q->zone);
+			if(dt_collector_select_response(data->nsd, q))
+				dt_collector_submit_auth_response(data->nsd,
+					&q->addr, q->addrlen, q->tcp,
+					q->packet, q->zone);
 #endif /* USE_DNSTAP */
 		} else {
+			topn_query(q);
 			query_reset(queries[i], UDP_MAX_MESSAGE_LEN, 0);
 			iovecs[i].iov_len = buffer_remaining(q->packet);
 			msgs[i].msg_hdr.msg_namelen = queries[i]->addrlen;
@@ -3403,6 +3811,10 @@ handle_udp(int fd, short event, void* arg)
 		}
 		i += sent;
 	}
+#ifdef BIND8_STATS
+	if(data->nsd->stat_map && start.tv_sec != 0 && i > 0)
+		server_stat_latency(data->nsd, &start, (unsigned)i);
+#endif
 	for(i=0; i<recvcount; i++) {
 		query_reset(queries[i], UDP_MAX_MESSAGE_LEN, 0);
 		iovecs[i].iov_len = buffer_remaining(queries[i]->packet);
@@ -3620,16 +4032,24 @@ handle_tcp_reading(int fd, short event, void* arg)
 #endif /* BIND8_STATS */
 
 	/* We have a complete query, process it.  */
+#ifdef BIND8_STATS
+	if(data->nsd->stat_map &&
+		gettimeofday(&data->query_start, NULL) == -1)
+		data->query_start.tv_sec = 0;
+#endif
 
 	/* tcp-query-count: handle query counter ++ */
 	data->query_count++;
 
 	buffer_flip(data->query->packet);
 #ifdef USE_DNSTAP
-	dt_collector_submit_auth_query(data->nsd, &data->query->addr,
-		data->query->addrlen, data->query->tcp, data->query->packet);
+	if(dt_collector_select_query(data->nsd, data->query))
+		dt_collector_submit_auth_query(data->nsd, &data->query->addr,
+			data->query->addrlen, data->query->tcp,
+			data->query->packet);
 #endif /* USE_DNSTAP */
 	data->query_state = server_process_query(data->nsd, data->query);
+	topn_query(data->query);
 	if (data->query_state == QUERY_DISCARDED) {
 		/* Drop the packet and the entire connection... */
 		STATUP(data->nsd, dropped);
@@ -3674,9 +4094,11 @@ handle_tcp_reading(int fd, short event, void* arg)
 	}
 #endif /* BIND8_STATS */
 #ifdef USE_DNSTAP
-	dt_collector_submit_auth_response(data->nsd, &data->query->addr,
-		data->query->addrlen, data->query->tcp, data->query->packet,
-		data->query->zone);
+	if(dt_collector_select_response(data->nsd, data->query))
+		dt_collector_submit_auth_response(data->nsd,
+			&data->query->addr, data->query->addrlen,
+			data->query->tcp, data->query->packet,
+			data->query->zone);
 #endif /* USE_DNSTAP */
 	data->bytes_transmitted = 0;
 
@@ -3801,6 +4223,13 @@ handle_tcp_writing(int fd, short event, void* arg)
 	}
 
 	assert(data->bytes_transmitted == q->tcplen + sizeof(q->tcplen));
+#ifdef BIND8_STATS
+	/* the first answer is sent, for AXFR that is the first packet */
+	if(data->nsd->stat_map && data->query_start.tv_sec != 0) {
+		server_stat_latency(data->nsd, &data->query_start, 1);
+		data->query_start.tv_sec = 0;
+	}
+#endif
 
 	if (data->query_state == QUERY_IN_AXFR) {
 		/* Continue processing AXFR and writing back results.  */
@@ -4096,16 +4525,24 @@ handle_tls_reading(int fd, short event, void* arg)
 #endif
 
 	/* We have a complete query, process it.  */
+#ifdef BIND8_STATS
+	if(data->nsd->stat_map &&
+		gettimeofday(&data->query_start, NULL) == -1)
+		data->query_start.tv_sec = 0;
+#endif
 
 	/* tcp-query-count: handle query counter ++ */
 	data->query_count++;
 
 	buffer_flip(data->query->packet);
 #ifdef USE_DNSTAP
-	dt_collector_submit_auth_query(data->nsd, &data->query->addr,
-		data->query->addrlen, data->query->tcp, data->query->packet);
+	if(dt_collector_select_query(data->nsd, data->query))
+		dt_collector_submit_auth_query(data->nsd, &data->query->addr,
+			data->query->addrlen, data->query->tcp,
+			data->query->packet);
 #endif /* USE_DNSTAP */
 	data->query_state = server_process_query(data->nsd, data->query);
+	topn_query(data->query);
 	if (data->query_state == QUERY_DISCARDED) {
 		/* Drop the packet and the entire connection... */
 		STATUP(data->nsd, dropped);
@@ -4150,9 +4587,11 @@ handle_tls_reading(int fd, short event, void* arg)
 	}
 #endif /* BIND8_STATS */
 #ifdef USE_DNSTAP
-	dt_collector_submit_auth_response(data->nsd, &data->query->addr,
-		data->query->addrlen, data->query->tcp, data->query->packet,
-		data->query->zone);
+	if(dt_collector_select_response(data->nsd, data->query))
+		dt_collector_submit_auth_response(data->nsd,
+			&data->query->addr, data->query->addrlen,
+			data->query->tcp, data->query->packet,
+			data->query->zone);
 #endif /* USE_DNSTAP */
 	data->bytes_transmitted = 0;
 
@@ -4251,6 +4690,13 @@ handle_tls_writing(int fd, short event, void* arg)
 	}
 
 	assert(data->bytes_transmitted == q->tcplen + sizeof(q->tcplen));
+#ifdef BIND8_STATS
+	/* the first answer is sent, for AXFR that is the first packet */
+	if(data->nsd->stat_map && data->query_start.tv_sec != 0) {
+		server_stat_latency(data->nsd, &data->query_start, 1);
+		data->query_start.tv_sec = 0;
+	}
+#endif
 
 	if (data->query_state == QUERY_IN_AXFR) {
 		/* Continue processing AXFR and writing back results.  */
@@ -4418,6 +4864,9 @@ handle_tcp_accept(int fd, short event, void* arg)
 #endif
 	tcp_data->prev = NULL;
 	tcp_data->next = NULL;
+#ifdef BIND8_STATS
+	tcp_data->query_start.tv_sec = 0;
+#endif
 
 	tcp_data->query_state = QUERY_PROCESSED;
 	tcp_data->bytes_transmitted = 0;
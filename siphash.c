@@ -0,0 +1,85 @@
+/*
+ * siphash.c -- SipHash-2-4 keyed hash function.
+ *
+ * Copyright (c) 2019, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ * Written from the description in "SipHash: a fast short-input PRF" by
+ * Jean-Philippe Aumasson and Daniel J. Bernstein.  It is used for DNS
+ * cookies (RFC 7873, RFC 9018), where the input is short and the cost
+ * is dominated by the fixed number of rounds.
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include <stddef.h>
+#include "siphash.h"
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+/** read 64 bits little endian */
+static uint64_t
+read_u64_le(const uint8_t* p)
+{
+	return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) |
+		((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+		((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+#define SIPROUND do { \
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+	} while(0)
+
+void
+siphash24(const uint8_t key[SIPHASH_KEY_SIZE], const uint8_t* in,
+	size_t inlen, uint8_t out[SIPHASH_OUT_SIZE])
+{
+	uint64_t k0 = read_u64_le(key);
+	uint64_t k1 = read_u64_le(key + 8);
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t b = ((uint64_t)inlen) << 56;
+	const uint8_t* end = in + (inlen & ~(size_t)7);
+	uint64_t m;
+	int i;
+
+	for(; in != end; in += 8) {
+		m = read_u64_le(in);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	/* the last, partial, word; with the length in the top byte */
+	switch(inlen & 7) {
+	case 7: b |= ((uint64_t)in[6]) << 48; /* fallthrough */
+	case 6: b |= ((uint64_t)in[5]) << 40; /* fallthrough */
+	case 5: b |= ((uint64_t)in[4]) << 32; /* fallthrough */
+	case 4: b |= ((uint64_t)in[3]) << 24; /* fallthrough */
+	case 3: b |= ((uint64_t)in[2]) << 16; /* fallthrough */
+	case 2: b |= ((uint64_t)in[1]) << 8; /* fallthrough */
+	case 1: b |= ((uint64_t)in[0]); break;
+	case 0: break;
+	}
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	b = v0 ^ v1 ^ v2 ^ v3;
+	for(i=0; i<SIPHASH_OUT_SIZE; i++)
+		out[i] = (uint8_t)(b >> (8*i));
+}
@@ -0,0 +1,27 @@
+/*
+ * siphash.h -- SipHash-2-4 keyed hash function.
+ *
+ * Copyright (c) 2019, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#define SIPHASH_KEY_SIZE 16 /* bytes */
+#define SIPHASH_OUT_SIZE 8 /* bytes */
+
+/**
+ * SipHash-2-4 of the input data, keyed with a 16 byte secret.
+ * @param key: the 128 bit key.
+ * @param in: the data to hash.
+ * @param inlen: length of the data.
+ * @param out: the 64 bit result is stored here, in little endian byte
+ *	order, as in the reference implementation.
+ */
+void siphash24(const uint8_t key[SIPHASH_KEY_SIZE], const uint8_t* in,
+	size_t inlen, uint8_t out[SIPHASH_OUT_SIZE]);
+
+#endif /* SIPHASH_H */
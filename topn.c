@@ -0,0 +1,390 @@
+/*
+ * topn.c -- the most queried names, client netblocks and zones.
+ *
+ * Copyright (c) 2019, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ * Every server process counts its queries with the Space-Saving
+ * algorithm of Metwally, Agrawal and El Abbadi: a fixed number of
+ * counters, where a name that is not counted yet takes over the
+ * smallest counter.  The count is then at most the count of that
+ * smallest counter too high, and the names with a high count are
+ * always in the table.  The tables are in shared memory, and the
+ * remote control merges them on demand.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "topn.h"
+#include "util.h"
+#include "lookup3.h"
+#include "namedb.h"
+#include "rrl.h"
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS   MAP_ANON
+#endif
+#endif /* HAVE_MMAP */
+
+/** the initial value for the hash of the keys */
+#define TOPN_HASH_INIT 0x3e5a2c11
+
+/** a counted name, the counts are in a separate array, that is
+ * scanned for the smallest count */
+struct topn_entry {
+	/* the count of the name that was replaced by this one */
+	uint64_t error;
+	uint32_t hash;
+	/* index+1 of the next entry in the hash bucket, or 0 */
+	uint8_t next;
+	uint8_t len;
+	uint8_t key[TOPN_KEY_SIZE];
+};
+
+/** the counters for one type */
+struct topn_table {
+	/* number of entries in use */
+	uint32_t num;
+	/* where to look for the smallest count, and a count that is not
+	 * larger than the smallest count */
+	uint32_t rover;
+	uint64_t min;
+	/* index+1 of the first entry in the bucket, or 0 */
+	uint8_t bucket[TOPN_BUCKETS];
+	uint64_t count[TOPN_SIZE];
+	struct topn_entry entry[TOPN_SIZE];
+};
+
+/** the tables of one server process.  The reader increments clear to
+ * zero them, and the server process does so when it sees the change.
+ * During a reload the old and the new server process use the same
+ * tables for a short time, that is why the indexes are checked. */
+struct topn_map {
+	uint32_t clear, cleared;
+	struct topn_table table[TOPN_TYPES];
+};
+
+/* the tables of this server process */
+static struct topn_map* topn_map = NULL;
+/* the array of mmaps for the children (saved between reloads) */
+static struct topn_map** topn_maps = NULL;
+static size_t topn_maps_num = 0;
+static uint8_t topn_ipv4_prefixlen = RRL_IPV4_PREFIX_LENGTH;
+static uint8_t topn_ipv6_prefixlen = RRL_IPV6_PREFIX_LENGTH;
+#ifndef RATELIMIT
+static uint32_t topn_ipv4_mask;
+static uint64_t topn_ipv6_mask;
+#endif
+
+void
+topn_mmap_init(int numch, size_t plf, size_t pls)
+{
+#ifdef HAVE_MMAP
+	size_t i;
+#endif
+	topn_ipv4_prefixlen = (plf > 32 ? 32 : plf);
+	topn_ipv6_prefixlen = (pls > 64 ? 64 : pls);
+#ifndef RATELIMIT
+	topn_ipv4_mask = (topn_ipv4_prefixlen == 0 ? 0 :
+		htonl(0xffffffff << (32-topn_ipv4_prefixlen)));
+	if(topn_ipv6_prefixlen == 0) {
+		topn_ipv6_mask = 0;
+	} else if(topn_ipv6_prefixlen <= 32) {
+		topn_ipv6_mask = ((uint64_t) htonl(0xffffffff <<
+			(32-topn_ipv6_prefixlen))) << 32;
+	} else {
+		topn_ipv6_mask = ((uint64_t) htonl(0xffffffff <<
+			(64-topn_ipv6_prefixlen))) | (((uint64_t)0xffffffff)<<32);
+	}
+#endif /* RATELIMIT */
+#ifdef HAVE_MMAP
+	topn_maps_num = (size_t)numch;
+	topn_maps = (struct topn_map**)xmallocarray(topn_maps_num,
+		sizeof(struct topn_map*));
+	for(i=0; i<topn_maps_num; i++) {
+		topn_maps[i] = (struct topn_map*)mmap(NULL,
+			sizeof(struct topn_map), PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if(topn_maps[i] == MAP_FAILED) {
+			log_msg(LOG_ERR, "topn: mmap failed: %s",
+				strerror(errno));
+			exit(1);
+		}
+		memset(topn_maps[i], 0, sizeof(struct topn_map));
+	}
+#else
+	(void)numch;
+	topn_maps_num = 0;
+	topn_maps = NULL;
+#endif
+}
+
+void
+topn_init(size_t ch)
+{
+	if(!topn_maps || ch >= topn_maps_num)
+		topn_map = (struct topn_map*)xalloc_zero(sizeof(*topn_map));
+	else	topn_map = topn_maps[ch];
+}
+
+/** remove the entry from its hash bucket */
+static void
+topn_unlink(struct topn_table* t, unsigned n)
+{
+	uint8_t* p = &t->bucket[t->entry[n].hash & (TOPN_BUCKETS-1)];
+	unsigned steps = 0;
+	while(*p != 0 && *p <= TOPN_SIZE && steps++ < TOPN_SIZE) {
+		if(*p == n+1) {
+			*p = t->entry[n].next;
+			return;
+		}
+		p = &t->entry[*p-1].next;
+	}
+}
+
+/** find a counter with the smallest count.  Counts only go up, so an
+ * entry that is not larger than the remembered minimum is the smallest,
+ * and the scan continues after the previous one. */
+static unsigned
+topn_smallest(struct topn_table* t)
+{
+	unsigned i, n = t->rover % TOPN_SIZE, m = n;
+	for(i=0; i<TOPN_SIZE; i++) {
+		if(t->count[n] <= t->min) {
+			t->rover = (n+1) % TOPN_SIZE;
+			return n;
+		}
+		if(t->count[n] < t->count[m])
+			m = n;
+		n = (n+1) % TOPN_SIZE;
+	}
+	t->min = t->count[m];
+	t->rover = (m+1) % TOPN_SIZE;
+	return m;
+}
+
+/** count the key in the table */
+static void
+topn_add(struct topn_table* t, const uint8_t* key, size_t len)
+{
+	uint32_t h = hashlittle(key, len, TOPN_HASH_INIT);
+	uint8_t* b = &t->bucket[h & (TOPN_BUCKETS-1)];
+	struct topn_entry* e;
+	unsigned i, n, steps = 0;
+
+	for(i = *b; i != 0 && i <= TOPN_SIZE && steps++ < TOPN_SIZE;
+		i = t->entry[i-1].next) {
+		e = &t->entry[i-1];
+		if(e->hash == h && e->len == len &&
+			memcmp(e->key, key, len) == 0) {
+			t->count[i-1]++;
+			return;
+		}
+	}
+	if(t->num < TOPN_SIZE) {
+		n = t->num++;
+		t->entry[n].error = 0;
+	} else {
+		/* take over the smallest counter */
+		n = topn_smallest(t);
+		topn_unlink(t, n);
+		t->entry[n].error = t->count[n];
+	}
+	e = &t->entry[n];
+	e->hash = h;
+	e->len = (uint8_t)len;
+	memcpy(e->key, key, len);
+	t->count[n]++;
+	e->next = *b;
+	*b = (uint8_t)(n+1);
+}
+
+/** the key for the netblock of the client, the address family, the
+ * prefix length and the masked address */
+static size_t
+topn_client_key(query_type* q, uint8_t* key)
+{
+	uint64_t s;
+	uint16_t c2;
+#ifdef RATELIMIT
+	s = rrl_get_source(q, &c2);
+#else
+#ifdef INET6
+	if(((struct sockaddr_in*)&q->addr)->sin_family != AF_INET) {
+		c2 = 1;
+		memmove(&s, &((struct sockaddr_in6*)&q->addr)->sin6_addr,
+			sizeof(s));
+		s &= topn_ipv6_mask;
+	} else
+#endif
+	{
+		c2 = 0;
+		s = ((struct sockaddr_in*)&q->addr)->sin_addr.s_addr &
+			topn_ipv4_mask;
+	}
+#endif /* RATELIMIT */
+	if(c2) {
+		key[0] = 6;
+		key[1] = topn_ipv6_prefixlen;
+		memmove(key+2, &s, sizeof(s));
+		return 2+sizeof(s);
+	} else {
+		uint32_t a = (uint32_t)s;
+		key[0] = 4;
+		key[1] = topn_ipv4_prefixlen;
+		memmove(key+2, &a, sizeof(a));
+		return 2+sizeof(a);
+	}
+}
+
+void
+topn_query(query_type* q)
+{
+	uint8_t key[2+sizeof(uint64_t)];
+	size_t len;
+	if(!topn_map)
+		return;
+	if(topn_map->clear != topn_map->cleared) {
+		memset(topn_map->table, 0, sizeof(topn_map->table));
+		topn_map->cleared = topn_map->clear;
+	}
+	if(q->qname)
+		topn_add(&topn_map->table[topn_qname], dname_name(q->qname),
+			q->qname->name_size);
+	len = topn_client_key(q, key);
+	topn_add(&topn_map->table[topn_client], key, len);
+	if(q->zone && q->zone->apex) {
+		const dname_type* d = domain_dname(q->zone->apex);
+		topn_add(&topn_map->table[topn_zone], dname_name(d),
+			d->name_size);
+	}
+}
+
+/** check that the key is well formed, it is read while it changes */
+static int
+topn_key_valid(enum topn_type type, const uint8_t* key, size_t len)
+{
+	size_t i = 0;
+	if(type == topn_client)
+		return (len == 6 && key[0] == 4) || (len == 10 && key[0] == 6);
+	if(len == 0)
+		return 0;
+	while(key[i] != 0) {
+		if((key[i] & 0xc0))
+			return 0;
+		i += key[i] + 1;
+		if(i >= len)
+			return 0;
+	}
+	return i+1 == len;
+}
+
+/** sort the results on count, highest first */
+static int
+topn_result_cmp(const void* a, const void* b)
+{
+	const struct topn_result* x = (const struct topn_result*)a;
+	const struct topn_result* y = (const struct topn_result*)b;
+	if(x->count != y->count)
+		return (x->count > y->count) ? -1 : 1;
+	if(x->len != y->len)
+		return (x->len < y->len) ? -1 : 1;
+	return memcmp(x->key, y->key, x->len);
+}
+
+size_t
+topn_report(enum topn_type type, struct topn_result* result, size_t max)
+{
+	size_t total = topn_maps_num * TOPN_SIZE, num = 0, hsize = 1;
+	size_t ch, i, h;
+	struct topn_table* t;
+	struct topn_result* all;
+	size_t* index;
+
+	if(total == 0 || max == 0)
+		return 0;
+	while(hsize < total*2)
+		hsize *= 2;
+	all = (struct topn_result*)xmallocarray(total, sizeof(*all));
+	index = (size_t*)xalloc_array_zero(hsize, sizeof(size_t));
+	t = (struct topn_table*)xalloc(sizeof(*t));
+	for(ch=0; ch<topn_maps_num; ch++) {
+		if(topn_maps[ch]->clear != topn_maps[ch]->cleared)
+			continue; /* not cleared yet */
+		/* the server process changes the table, work on a copy */
+		memcpy(t, &topn_maps[ch]->table[type], sizeof(*t));
+		for(i=0; i<TOPN_SIZE && i<t->num; i++) {
+			struct topn_entry* e = &t->entry[i];
+			if(t->count[i] == 0 ||
+				!topn_key_valid(type, e->key, e->len))
+				continue;
+			h = hashlittle(e->key, e->len, TOPN_HASH_INIT) &
+				(hsize-1);
+			while(index[h] != 0 && (all[index[h]-1].len != e->len ||
+				memcmp(all[index[h]-1].key, e->key, e->len) != 0))
+				h = (h+1) & (hsize-1);
+			if(index[h] == 0) {
+				all[num].count = 0;
+				all[num].error = 0;
+				all[num].len = e->len;
+				memcpy(all[num].key, e->key, e->len);
+				index[h] = ++num;
+			}
+			all[index[h]-1].count += t->count[i];
+			all[index[h]-1].error += e->error;
+		}
+	}
+	qsort(all, num, sizeof(*all), topn_result_cmp);
+	if(num > max)
+		num = max;
+	memcpy(result, all, num*sizeof(*all));
+	free(t);
+	free(index);
+	free(all);
+	return num;
+}
+
+void
+topn_clear(void)
+{
+	size_t i;
+	for(i=0; i<topn_maps_num; i++)
+		topn_maps[i]->clear++;
+}
+
+int
+topn_key2str(enum topn_type type, struct topn_result* r, char* buf,
+	size_t len)
+{
+	if(type == topn_client) {
+		uint8_t a[16];
+		char s[64];
+		int af = (r->key[0] == 6) ? AF_INET6 : AF_INET;
+		memset(a, 0, sizeof(a));
+		memmove(a, r->key+2, r->len-2);
+		if(!inet_ntop(af, a, s, (socklen_t)sizeof(s)))
+			return 0;
+		return snprintf(buf, len, "%s/%d", s, (int)r->key[1]) <
+			(int)len;
+	}
+	return strlcpy(buf, wiredname2str(r->key), len) < len;
+}
+
+const char*
+topn_type2str(enum topn_type type)
+{
+	switch(type) {
+	case topn_qname: return "qname";
+	case topn_client: return "client";
+	case topn_zone: return "zone";
+	default:
+		break;
+	}
+	return "unknown";
+}
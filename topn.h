@@ -0,0 +1,72 @@
+/*
+ * topn.h -- the most queried names, client netblocks and zones.
+ *
+ * Copyright (c) 2019, NLnet Labs. All rights reserved.
+ *
+ * See LICENSE for the license.
+ *
+ */
+
+#ifndef TOPN_H
+#define TOPN_H
+#include "query.h"
+
+/** the things that are counted */
+enum topn_type {
+	topn_qname = 0,
+	topn_client,
+	topn_zone,
+	TOPN_TYPES
+};
+
+/** number of counters per type, for every server process */
+#define TOPN_SIZE 128
+/** number of hash buckets per type */
+#define TOPN_BUCKETS 256
+/** size of the key, a domain name in wireformat or a client netblock */
+#define TOPN_KEY_SIZE MAXDOMAINLEN
+
+/** an entry in the merged report */
+struct topn_result {
+	/* the count, this can overestimate by up to error */
+	uint64_t count;
+	uint64_t error;
+	uint8_t len;
+	uint8_t key[TOPN_KEY_SIZE];
+};
+
+/**
+ * Initialize the shared memory tables for n children, the tables are
+ * kept across reforks, like the rrl tables.
+ * plf and pls are the prefix lengths for the client netblocks.
+ */
+void topn_mmap_init(int numch, size_t plf, size_t pls);
+
+/** use the table for this child server process */
+void topn_init(size_t ch);
+
+/** count the query name, client netblock and zone of the query */
+void topn_query(query_type* query);
+
+/**
+ * Merge the tables of the children into a ranked list, for the remote
+ * control.  The counts are read while the children update them.
+ * @param type: the type of counter.
+ * @param result: array of max entries, filled with the highest counts.
+ * @param max: size of the result array.
+ * @return the number of entries in the result.
+ */
+size_t topn_report(enum topn_type type, struct topn_result* result,
+	size_t max);
+
+/** ask the children to zero their tables, the report is empty until then */
+void topn_clear(void);
+
+/** print the key of the entry, returns false if it does not fit */
+int topn_key2str(enum topn_type type, struct topn_result* r, char* buf,
+	size_t len);
+
+/** name of the type, for the report */
+const char* topn_type2str(enum topn_type type);
+
+#endif /* TOPN_H */
@@ -0,0 +1,145 @@
+/*
+	test siphash.h and the DNS cookies in edns.h
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "tpkg/cutest/cutest.h"
+#include "nsd.h"
+#include "query.h"
+#include "edns.h"
+#include "siphash.h"
+#include "util.h"
+
+static void siphash_1(CuTest *tc);
+static void cookie_1(CuTest *tc);
+static void cookie_2(CuTest *tc);
+
+CuSuite* reg_cutest_cookie(void)
+{
+	CuSuite* suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, siphash_1);
+	SUITE_ADD_TEST(suite, cookie_1);
+	SUITE_ADD_TEST(suite, cookie_2);
+	return suite;
+}
+
+/* test vector from the appendix of the SipHash paper */
+static void siphash_1(CuTest *tc)
+{
+	uint8_t key[SIPHASH_KEY_SIZE], in[15], out[SIPHASH_OUT_SIZE];
+	uint8_t expect[SIPHASH_OUT_SIZE] = { 0xe5, 0x45, 0xbe, 0x49,
+		0x61, 0xca, 0x29, 0xa1 };
+	size_t i;
+	for(i=0; i<sizeof(key); i++)
+		key[i] = (uint8_t)i;
+	for(i=0; i<sizeof(in); i++)
+		in[i] = (uint8_t)i;
+	siphash24(key, in, sizeof(in), out);
+	CuAssert(tc, "siphash24 test vector", memcmp(out, expect,
+		sizeof(out)) == 0);
+}
+
+/** setup query for the cookie tests, from an IPv4 address */
+static void cookie_setup(query_type* q, const char* ip, const char* cookie)
+{
+	struct sockaddr_in* sa = (struct sockaddr_in*)&q->addr;
+	memset(q, 0, sizeof(*q));
+	sa->sin_family = AF_INET;
+	(void)inet_pton(AF_INET, ip, &sa->sin_addr);
+	q->edns.cookie_len = strlen(cookie)/2;
+	(void)hex_pton(cookie, q->edns.cookie, q->edns.cookie_len);
+}
+
+/* the examples from RFC 9018 appendix A, create and verify */
+static void cookie_1(CuTest *tc)
+{
+	query_type q;
+	struct nsd n;
+	uint8_t expect[COOKIE_CLIENT_LEN + COOKIE_SERVER_LEN];
+
+	memset(&n, 0, sizeof(n));
+	(void)hex_pton("e5e973e5a6b2a43f48e7dc849e37bfcf",
+		n.cookie_secrets[0], COOKIE_SECRET_SIZE);
+	n.cookie_secrets_count = 1;
+
+	/* A.1, learning a new server cookie */
+	cookie_setup(&q, "198.51.100.100", "2464c4abcf10c957");
+	cookie_create(&q, &n, 1559731985);
+	(void)hex_pton("2464c4abcf10c957010000005cf79f111f8130c3eee29480",
+		expect, sizeof(expect));
+	CuAssert(tc, "cookie A.1 length", q.edns.cookie_len ==
+		COOKIE_CLIENT_LEN + COOKIE_SERVER_LEN);
+	CuAssert(tc, "cookie A.1", memcmp(q.edns.cookie, expect,
+		sizeof(expect)) == 0);
+	cookie_verify(&q, &n, 1559731985);
+	CuAssert(tc, "cookie A.1 verify", q.edns.cookie_status == COOKIE_VALID);
+
+	/* A.2, the same client after 40 minutes gets a new cookie */
+	cookie_setup(&q, "198.51.100.100",
+		"2464c4abcf10c957010000005cf79f111f8130c3eee29480");
+	cookie_verify(&q, &n, 1559734385);
+	CuAssert(tc, "cookie A.2 verify", q.edns.cookie_status == COOKIE_VALID);
+	cookie_create(&q, &n, 1559734385);
+	(void)hex_pton("2464c4abcf10c957010000005cf7a871d4a564a1442aca77",
+		expect, sizeof(expect));
+	CuAssert(tc, "cookie A.2", memcmp(q.edns.cookie, expect,
+		sizeof(expect)) == 0);
+}
+
+/* cookies that do not verify, and the staging secret */
+static void cookie_2(CuTest *tc)
+{
+	query_type q;
+	struct nsd n;
+	const char* c = "2464c4abcf10c957010000005cf79f111f8130c3eee29480";
+	uint32_t t = 1559731985;
+
+	memset(&n, 0, sizeof(n));
+	(void)hex_pton("e5e973e5a6b2a43f48e7dc849e37bfcf",
+		n.cookie_secrets[0], COOKIE_SECRET_SIZE);
+	n.cookie_secrets_count = 1;
+
+	cookie_setup(&q, "198.51.100.101", c);
+	cookie_verify(&q, &n, t);
+	CuAssert(tc, "other address", q.edns.cookie_status == COOKIE_INVALID);
+
+	cookie_setup(&q, "198.51.100.100", c);
+	q.edns.cookie[0] ^= 1;
+	cookie_verify(&q, &n, t);
+	CuAssert(tc, "other client cookie",
+		q.edns.cookie_status == COOKIE_INVALID);
+
+	cookie_setup(&q, "198.51.100.100", c);
+	q.edns.cookie[23] ^= 1;
+	cookie_verify(&q, &n, t);
+	CuAssert(tc, "other hash", q.edns.cookie_status == COOKIE_INVALID);
+
+	cookie_setup(&q, "198.51.100.100", c);
+	cookie_verify(&q, &n, t + 3601);
+	CuAssert(tc, "expired", q.edns.cookie_status == COOKIE_INVALID);
+	cookie_verify(&q, &n, t - 301);
+	CuAssert(tc, "from the future", q.edns.cookie_status == COOKIE_INVALID);
+	cookie_verify(&q, &n, t + 3600);
+	CuAssert(tc, "just in time", q.edns.cookie_status == COOKIE_VALID);
+
+	/* a new secret, and the old one as staging secret */
+	memmove(n.cookie_secrets[1], n.cookie_secrets[0], COOKIE_SECRET_SIZE);
+	(void)hex_pton("dd3bdf9344b678b185a6f5cb60fca715",
+		n.cookie_secrets[0], COOKIE_SECRET_SIZE);
+	cookie_verify(&q, &n, t);
+	CuAssert(tc, "staging not used", q.edns.cookie_status == COOKIE_INVALID);
+	n.cookie_secrets_count = 2;
+	cookie_verify(&q, &n, t);
+	CuAssert(tc, "staging secret", q.edns.cookie_status == COOKIE_VALID);
+	cookie_create(&q, &n, t);
+	CuAssert(tc, "new secret", memcmp(q.edns.cookie+16, "\x1f\x81\x30\xc3"
+		"\xee\xe2\x94\x80", 8) != 0);
+	cookie_verify(&q, &n, t);
+	CuAssert(tc, "new secret verify", q.edns.cookie_status == COOKIE_VALID);
+}
@@ -0,0 +1,693 @@
+/*
+	test dnstap.c, the encoded frames are decoded with the field numbers
+	and wire types of dnstap.proto
+*/
+
+#include "config.h"
+#include "dnstap/dnstap_config.h"
+
+#ifdef USE_DNSTAP
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS   MAP_ANON
+#endif
+#endif /* HAVE_MMAP */
+#include <arpa/inet.h>
+#include "tpkg/cutest/cutest.h"
+#include "dnstap/dnstap.h"
+#include "dnstap/dnstap_collector.h"
+#include "options.h"
+#include "util.h"
+#include "nsd.h"
+#include "namedb.h"
+#include "query.h"
+#include "packet.h"
+
+static void dnstap_query(CuTest *tc);
+static void dnstap_response6(CuTest *tc);
+static void dnstap_file(CuTest *tc);
+static void dnstap_filter(CuTest *tc);
+static void dnstap_sample(CuTest *tc);
+#ifdef HAVE_MMAP
+static void dnstap_rings(CuTest *tc);
+#endif
+
+CuSuite* reg_cutest_dnstap(void)
+{
+	CuSuite* suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, dnstap_query);
+	SUITE_ADD_TEST(suite, dnstap_response6);
+	SUITE_ADD_TEST(suite, dnstap_file);
+	SUITE_ADD_TEST(suite, dnstap_filter);
+	SUITE_ADD_TEST(suite, dnstap_sample);
+#ifdef HAVE_MMAP
+	SUITE_ADD_TEST(suite, dnstap_rings);
+#endif
+	return suite;
+}
+
+/* the numbers from dnstap.proto, not the defines in dnstap.c, so that a
+ * wrong number in the encoder shows up */
+#define PROTO_DNSTAP_IDENTITY		1
+#define PROTO_DNSTAP_VERSION		2
+#define PROTO_DNSTAP_MESSAGE		14
+#define PROTO_DNSTAP_TYPE		15
+#define PROTO_DNSTAP_TYPE_MESSAGE	1
+#define PROTO_MSG_TYPE			1
+#define PROTO_MSG_SOCKET_FAMILY		2
+#define PROTO_MSG_SOCKET_PROTOCOL	3
+#define PROTO_MSG_QUERY_ADDRESS		4
+#define PROTO_MSG_QUERY_PORT		6
+#define PROTO_MSG_QUERY_TIME_SEC	8
+#define PROTO_MSG_QUERY_TIME_NSEC	9
+#define PROTO_MSG_QUERY_MESSAGE		10
+#define PROTO_MSG_QUERY_ZONE		11
+#define PROTO_MSG_RESPONSE_TIME_SEC	12
+#define PROTO_MSG_RESPONSE_TIME_NSEC	13
+#define PROTO_MSG_RESPONSE_MESSAGE	14
+#define PROTO_MSG_AUTH_QUERY		1
+#define PROTO_MSG_AUTH_RESPONSE		2
+#define PROTO_FAMILY_INET		1
+#define PROTO_FAMILY_INET6		2
+#define PROTO_PROTOCOL_UDP		1
+#define PROTO_PROTOCOL_TCP		2
+#define PROTO_WIRE_VARINT		0
+#define PROTO_WIRE_FIXED64		1
+#define PROTO_WIRE_LENGTH		2
+#define PROTO_WIRE_FIXED32		5
+
+/** a decoded protobuf field */
+struct pb_field {
+	unsigned num;
+	unsigned wire;
+	/** value of varint and fixed32 */
+	uint64_t val;
+	/** data of length delimited field */
+	const uint8_t* data;
+	size_t len;
+};
+
+/** decode a varint, returns false if it runs past the end */
+static int
+pb_get_varint(const uint8_t** p, const uint8_t* end, uint64_t* v)
+{
+	int shift = 0;
+	*v = 0;
+	while(*p < end && shift < 64) {
+		uint8_t b = *(*p)++;
+		*v |= ((uint64_t)(b&0x7f)) << shift;
+		if(!(b&0x80))
+			return 1;
+		shift += 7;
+	}
+	return 0;
+}
+
+/** decode the fields of a message, returns the number of fields or -1
+ * if the message is malformed. */
+static int
+pb_decode(const uint8_t* p, size_t len, struct pb_field* f, int max)
+{
+	const uint8_t* end = p+len;
+	uint64_t key;
+	int n = 0;
+	while(p < end) {
+		if(n == max || !pb_get_varint(&p, end, &key))
+			return -1;
+		f[n].num = (unsigned)(key>>3);
+		f[n].wire = (unsigned)(key&7);
+		f[n].data = NULL;
+		f[n].len = 0;
+		f[n].val = 0;
+		switch(f[n].wire) {
+		case PROTO_WIRE_VARINT:
+			if(!pb_get_varint(&p, end, &f[n].val))
+				return -1;
+			break;
+		case PROTO_WIRE_LENGTH:
+			if(!pb_get_varint(&p, end, &key) ||
+				key > (uint64_t)(end-p))
+				return -1;
+			f[n].data = p;
+			f[n].len = (size_t)key;
+			p += key;
+			break;
+		case PROTO_WIRE_FIXED32:
+			if(end-p < 4)
+				return -1;
+			f[n].val = (uint64_t)p[0] | ((uint64_t)p[1]<<8) |
+				((uint64_t)p[2]<<16) | ((uint64_t)p[3]<<24);
+			p += 4;
+			break;
+		case PROTO_WIRE_FIXED64:
+		default:
+			/* dnstap.proto has no such fields */
+			return -1;
+		}
+		n++;
+	}
+	return n;
+}
+
+/** find the field with the number, checks that it occurs once and has
+ * the wire type. */
+static struct pb_field*
+pb_find(CuTest* tc, struct pb_field* f, int n, unsigned num, unsigned wire)
+{
+	struct pb_field* r = NULL;
+	int i;
+	for(i=0; i<n; i++) {
+		if(f[i].num == num) {
+			CuAssertTrue(tc, r == NULL);
+			r = &f[i];
+		}
+	}
+	CuAssertPtrNotNull(tc, r);
+	CuAssertIntEquals(tc, (int)wire, (int)r->wire);
+	return r;
+}
+
+/** check that the field numbers ascend, like protobuf encoders write them */
+static void
+pb_check_order(CuTest* tc, struct pb_field* f, int n)
+{
+	int i;
+	for(i=1; i<n; i++)
+		CuAssertTrue(tc, f[i-1].num < f[i].num);
+}
+
+/** create the env for a file that is not opened, the frames stay in the
+ * output buffer */
+static struct dt_env*
+dnstap_test_env(const char* identity, const char* version)
+{
+	struct nsd_options opt;
+	struct dt_env* env = dt_create(NULL, "/nonexistent/dnstap.test", 0);
+	memset(&opt, 0, sizeof(opt));
+	opt.dnstap_enable = 1;
+	opt.dnstap_send_identity = (identity != NULL);
+	opt.dnstap_identity = (char*)identity;
+	opt.dnstap_send_version = (version != NULL);
+	opt.dnstap_version = (char*)version;
+	opt.dnstap_log_auth_query_messages = 1;
+	opt.dnstap_log_auth_response_messages = 1;
+	dt_apply_cfg(env, &opt);
+	return env;
+}
+
+/** decode the frame at the start of buf, returns the fields of the
+ * Dnstap message in top, and of the Message in msg, and the frame length */
+static size_t
+dnstap_test_frame(CuTest* tc, const uint8_t* buf, size_t len,
+	struct pb_field* top, int* ntop, struct pb_field* msg, int* nmsg)
+{
+	struct pb_field* m;
+	size_t flen;
+	CuAssertTrue(tc, len >= 4);
+	flen = read_uint32(buf);
+	CuAssertTrue(tc, flen != 0); /* a data frame, not a control frame */
+	CuAssertTrue(tc, 4 + flen <= len);
+	*ntop = pb_decode(buf+4, flen, top, 16);
+	CuAssertTrue(tc, *ntop > 0);
+	pb_check_order(tc, top, *ntop);
+	m = pb_find(tc, top, *ntop, PROTO_DNSTAP_TYPE, PROTO_WIRE_VARINT);
+	CuAssertIntEquals(tc, PROTO_DNSTAP_TYPE_MESSAGE, (int)m->val);
+	m = pb_find(tc, top, *ntop, PROTO_DNSTAP_MESSAGE, PROTO_WIRE_LENGTH);
+	*nmsg = pb_decode(m->data, m->len, msg, 32);
+	CuAssertTrue(tc, *nmsg > 0);
+	pb_check_order(tc, msg, *nmsg);
+	return 4 + flen;
+}
+
+/* an IPv4 UDP query, with identity and version */
+static void dnstap_query(CuTest *tc)
+{
+	struct dt_env* env = dnstap_test_env("ns1.example", "nsd-test");
+	struct pb_field top[16], msg[32], *f;
+	int ntop, nmsg;
+	struct sockaddr_storage ss;
+	struct sockaddr_in* s4 = (struct sockaddr_in*)&ss;
+	uint8_t pkt[40];
+	uint8_t zone[] = {7,'e','x','a','m','p','l','e',3,'c','o','m',0};
+	size_t i, flen;
+	time_t now = time(NULL);
+
+	memset(&ss, 0, sizeof(ss));
+	s4->sin_family = AF_INET;
+	s4->sin_port = htons(5353);
+	(void)inet_pton(AF_INET, "192.0.2.1", &s4->sin_addr);
+	for(i=0; i<sizeof(pkt); i++)
+		pkt[i] = (uint8_t)i;
+	dt_msg_send_auth_query(env, &ss, 0, zone, sizeof(zone), pkt,
+		sizeof(pkt));
+
+	flen = dnstap_test_frame(tc, env->buf, env->len_buf, top, &ntop,
+		msg, &nmsg);
+	CuAssertTrue(tc, flen == env->len_buf);
+	CuAssertIntEquals(tc, 4, ntop);
+	f = pb_find(tc, top, ntop, PROTO_DNSTAP_IDENTITY, PROTO_WIRE_LENGTH);
+	CuAssertTrue(tc, f->len == 11 && memcmp(f->data, "ns1.example",
+		11) == 0);
+	f = pb_find(tc, top, ntop, PROTO_DNSTAP_VERSION, PROTO_WIRE_LENGTH);
+	CuAssertTrue(tc, f->len == 8 && memcmp(f->data, "nsd-test", 8) == 0);
+
+	CuAssertIntEquals(tc, 9, nmsg);
+	f = pb_find(tc, msg, nmsg, PROTO_MSG_TYPE, PROTO_WIRE_VARINT);
+	CuAssertIntEquals(tc, PROTO_MSG_AUTH_QUERY, (int)f->val);
+	f = pb_find(tc, msg, nmsg, PROTO_MSG_SOCKET_FAMILY, PROTO_WIRE_VARINT);
+	CuAssertIntEquals(tc, PROTO_FAMILY_INET, (int)f->val);
+	f = pb_find(tc, msg, nmsg, PROTO_MSG_SOCKET_PROTOCOL,
+		PROTO_WIRE_VARINT);
+	CuAssertIntEquals(tc, PROTO_PROTOCOL_UDP, (int)f->val);
+	f = pb_find(tc, msg, nmsg, PROTO_MSG_QUERY_ADDRESS, PROTO_WIRE_LENGTH);
+	CuAssertTrue(tc, f->len == 4 && memcmp(f->data, &s4->sin_addr, 4)
+		== 0);
+	f = pb_find(tc, msg, nmsg, PROTO_MSG_QUERY_PORT, PROTO_WIRE_VARINT);
+	CuAssertIntEquals(tc, 5353, (int)f->val);
+	f = pb_find(tc, msg, nmsg, PROTO_MSG_QUERY_TIME_SEC,
+		PROTO_WIRE_VARINT);
+	CuAssertTrue(tc, f->val + 5 >= (uint64_t)now &&
+		f->val <= (uint64_t)now + 5);
+	f = pb_find(tc, msg, nmsg, PROTO_MSG_QUERY_TIME_NSEC,
+		PROTO_WIRE_FIXED32);
+	CuAssertTrue(tc, f->val < 1000000000);
+	f = pb_find(tc, msg, nmsg, PROTO_MSG_QUERY_MESSAGE, PROTO_WIRE_LENGTH);
+	CuAssertTrue(tc, f->len == sizeof(pkt) && memcmp(f->data, pkt,
+		sizeof(pkt)) == 0);
+	f = pb_find(tc, msg, nmsg, PROTO_MSG_QUERY_ZONE, PROTO_WIRE_LENGTH);
+	CuAssertTrue(tc, f->len == sizeof(zone) && memcmp(f->data, zone,
+		sizeof(zone)) == 0);
+	dt_delete(env);
+}
+
+/* IPv6 TCP responses, without identity and version, of sizes around
+ * the boundaries of the varint length of the message */
+static void dnstap_response6(CuTest *tc)
+{
+	struct dt_env* env = dnstap_test_env(NULL, NULL);
+	struct pb_field top[16], msg[32], *f;
+	int ntop, nmsg;
+	struct sockaddr_storage ss;
+	struct sockaddr_in6* s6 = (struct sockaddr_in6*)&ss;
+	static uint8_t pkt[20000];
+	size_t sizes[] = {0, 12, 60, 100, 127, 128, 16000, 16383, 16384,
+		20000};
+	size_t i, pos = 0;
+
+	memset(&ss, 0, sizeof(ss));
+	s6->sin6_family = AF_INET6;
+	s6->sin6_port = htons(53000);
+	(void)inet_pton(AF_INET6, "2001:db8::53", &s6->sin6_addr);
+	for(i=0; i<sizeof(pkt); i++)
+		pkt[i] = (uint8_t)(i*7);
+	for(i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++)
+		dt_msg_send_auth_response(env, &ss, 1, NULL, 0, pkt, sizes[i]);
+
+	for(i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		pos += dnstap_test_frame(tc, env->buf+pos, env->len_buf-pos,
+			top, &ntop, msg, &nmsg);
+		CuAssertIntEquals(tc, 2, ntop);
+		/* no query zone, no query time */
+		CuAssertIntEquals(tc, 8, nmsg);
+		f = pb_find(tc, msg, nmsg, PROTO_MSG_TYPE, PROTO_WIRE_VARINT);
+		CuAssertIntEquals(tc, PROTO_MSG_AUTH_RESPONSE, (int)f->val);
+		f = pb_find(tc, msg, nmsg, PROTO_MSG_SOCKET_FAMILY,
+			PROTO_WIRE_VARINT);
+		CuAssertIntEquals(tc, PROTO_FAMILY_INET6, (int)f->val);
+		f = pb_find(tc, msg, nmsg, PROTO_MSG_SOCKET_PROTOCOL,
+			PROTO_WIRE_VARINT);
+		CuAssertIntEquals(tc, PROTO_PROTOCOL_TCP, (int)f->val);
+		f = pb_find(tc, msg, nmsg, PROTO_MSG_QUERY_ADDRESS,
+			PROTO_WIRE_LENGTH);
+		CuAssertTrue(tc, f->len == 16 && memcmp(f->data,
+			&s6->sin6_addr, 16) == 0);
+		f = pb_find(tc, msg, nmsg, PROTO_MSG_QUERY_PORT,
+			PROTO_WIRE_VARINT);
+		CuAssertIntEquals(tc, 53000, (int)f->val);
+		(void)pb_find(tc, msg, nmsg, PROTO_MSG_RESPONSE_TIME_SEC,
+			PROTO_WIRE_VARINT);
+		(void)pb_find(tc, msg, nmsg, PROTO_MSG_RESPONSE_TIME_NSEC,
+			PROTO_WIRE_FIXED32);
+		f = pb_find(tc, msg, nmsg, PROTO_MSG_RESPONSE_MESSAGE,
+			PROTO_WIRE_LENGTH);
+		CuAssertTrue(tc, f->len == sizes[i] && memcmp(f->data, pkt,
+			sizes[i]) == 0);
+	}
+	CuAssertTrue(tc, pos == env->len_buf);
+	dt_delete(env);
+}
+
+/** check the control frame at buf, returns its length */
+static size_t
+dnstap_test_control(CuTest* tc, const uint8_t* buf, size_t len,
+	uint32_t type, int content_type)
+{
+	const char* ct = "protobuf:dnstap.Dnstap";
+	size_t flen;
+	CuAssertTrue(tc, len >= 12);
+	CuAssertIntEquals(tc, 0, (int)read_uint32(buf));
+	flen = read_uint32(buf+4);
+	CuAssertTrue(tc, 8 + flen <= len);
+	CuAssertIntEquals(tc, (int)type, (int)read_uint32(buf+8));
+	if(content_type) {
+		CuAssertTrue(tc, flen == 12 + strlen(ct));
+		CuAssertIntEquals(tc, 1, (int)read_uint32(buf+12));
+		CuAssertTrue(tc, read_uint32(buf+16) == strlen(ct));
+		CuAssertTrue(tc, memcmp(buf+20, ct, strlen(ct)) == 0);
+	} else	CuAssertTrue(tc, flen == 4);
+	return 8 + flen;
+}
+
+/* the file is a frame stream, a start frame, the data frames and a stop
+ * frame */
+static void dnstap_file(CuTest *tc)
+{
+	char path[64];
+	struct dt_env* env;
+	struct nsd_options opt;
+	struct pb_field top[16], msg[32];
+	int ntop, nmsg, i;
+	struct sockaddr_storage ss;
+	uint8_t pkt[12] = {0x12, 0x34, 0x01, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+	static uint8_t buf[4096];
+	size_t len, pos;
+	FILE* in;
+
+	snprintf(path, sizeof(path), "/tmp/cutest.dnstap.%u",
+		(unsigned)getpid());
+	unlink(path);
+	env = dt_create(NULL, path, 0);
+	memset(&opt, 0, sizeof(opt));
+	opt.dnstap_enable = 1;
+	opt.dnstap_log_auth_query_messages = 1;
+	dt_apply_cfg(env, &opt);
+	CuAssertTrue(tc, dt_init(env));
+	memset(&ss, 0, sizeof(ss));
+	((struct sockaddr_in*)&ss)->sin_family = AF_INET;
+	for(i=0; i<3; i++) {
+		dt_msg_send_auth_query(env, &ss, 0, NULL, 0, pkt, sizeof(pkt));
+		if(i == 1)
+			dt_flush(env);
+	}
+	dt_delete(env);
+
+	in = fopen(path, "r");
+	CuAssertPtrNotNull(tc, in);
+	len = fread(buf, 1, sizeof(buf), in);
+	fclose(in);
+	unlink(path);
+	pos = dnstap_test_control(tc, buf, len, 2 /* START */, 1);
+	for(i=0; i<3; i++) {
+		pos += dnstap_test_frame(tc, buf+pos, len-pos, top, &ntop,
+			msg, &nmsg);
+		CuAssertIntEquals(tc, 2, ntop);
+	}
+	pos += dnstap_test_control(tc, buf+pos, len-pos, 3 /* STOP */, 0);
+	CuAssertTrue(tc, pos == len);
+}
+
+/** create the collector with the filter options, in nsd */
+static void
+dnstap_test_collector(struct nsd* nsd, region_type* region,
+	const char* qtypes, const char* rcodes, int sample_rate)
+{
+	memset(nsd, 0, sizeof(*nsd));
+	nsd->child_count = 1;
+	nsd->options = nsd_options_create(region);
+	nsd->options->dnstap_log_qtypes = (char*)qtypes;
+	nsd->options->dnstap_log_rcodes = (char*)rcodes;
+	nsd->options->dnstap_sample_rate = sample_rate;
+	nsd->options->dnstap_log_rrl_only = 0;
+	nsd->dt_collector = dt_collector_create(nsd);
+}
+
+/** delete the collector in nsd */
+static void
+dnstap_test_collector_delete(struct nsd* nsd)
+{
+	dt_collector_close(nsd->dt_collector, nsd);
+	dt_collector_destroy(nsd->dt_collector, nsd);
+	nsd->dt_collector = NULL;
+}
+
+/** put a query for example.com with the qtype in the packet, as it is
+ * received, before it is parsed */
+static void
+dnstap_test_query(struct query* q, uint16_t qtype)
+{
+	static const uint8_t qname[] = {7, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+		3, 'c', 'o', 'm', 0};
+	buffer_clear(q->packet);
+	buffer_write_u16(q->packet, 0x1234);
+	buffer_write_u16(q->packet, 0);
+	buffer_write_u16(q->packet, 1);
+	buffer_write_u16(q->packet, 0);
+	buffer_write_u16(q->packet, 0);
+	buffer_write_u16(q->packet, 0);
+	buffer_write(q->packet, qname, sizeof(qname));
+	buffer_write_u16(q->packet, qtype);
+	buffer_write_u16(q->packet, CLASS_IN);
+	buffer_flip(q->packet);
+}
+
+/* the qtype, rcode, zone and ratelimit filters */
+static void dnstap_filter(CuTest *tc)
+{
+	region_type* region = region_create(xalloc, free);
+	struct nsd nsd;
+	struct query q;
+	struct zone zone;
+	struct zone_options zopt;
+	struct pattern_options popt;
+
+	memset(&q, 0, sizeof(q));
+	q.packet = buffer_create(region, 512);
+	/* the unknown qtype, rcode 16 and "6x" are not used */
+	dnstap_test_collector(&nsd, region, "A TXT BOGUS",
+		"NXDOMAIN 5 16 6x", 0);
+	CuAssertTrue(tc, nsd.dt_collector->rcodes ==
+		((1<<RCODE_NXDOMAIN)|(1<<RCODE_REFUSE)));
+
+	/* the qtypes */
+	dnstap_test_query(&q, TYPE_A);
+	CuAssertTrue(tc, dt_collector_select_query(&nsd, &q) == 1);
+	CuAssertTrue(tc, q.dnstap_log == 1);
+	dnstap_test_query(&q, TYPE_TXT);
+	CuAssertTrue(tc, dt_collector_select_query(&nsd, &q) == 1);
+	dnstap_test_query(&q, TYPE_AAAA);
+	CuAssertTrue(tc, dt_collector_select_query(&nsd, &q) == 0);
+	CuAssertTrue(tc, q.dnstap_log == 0);
+	/* the response to a query that is not logged is not logged */
+	RCODE_SET(q.packet, RCODE_NXDOMAIN);
+	CuAssertTrue(tc, dt_collector_select_response(&nsd, &q) == 0);
+	/* a question that cannot be read is not logged */
+	dnstap_test_query(&q, TYPE_A);
+	buffer_set_limit(q.packet, QHEADERSZ+4);
+	CuAssertTrue(tc, dt_collector_select_query(&nsd, &q) == 0);
+
+	/* the rcodes */
+	dnstap_test_query(&q, TYPE_A);
+	CuAssertTrue(tc, dt_collector_select_query(&nsd, &q) == 1);
+	RCODE_SET(q.packet, RCODE_OK);
+	CuAssertTrue(tc, dt_collector_select_response(&nsd, &q) == 0);
+	RCODE_SET(q.packet, RCODE_NXDOMAIN);
+	CuAssertTrue(tc, dt_collector_select_response(&nsd, &q) == 1);
+	RCODE_SET(q.packet, RCODE_REFUSE);
+	CuAssertTrue(tc, dt_collector_select_response(&nsd, &q) == 1);
+
+	/* the zone with dnstap-log: no */
+	memset(&zone, 0, sizeof(zone));
+	memset(&zopt, 0, sizeof(zopt));
+	memset(&popt, 0, sizeof(popt));
+	zopt.pattern = &popt;
+	zone.opts = &zopt;
+	q.zone = &zone;
+	popt.dnstap_log = 1;
+	CuAssertTrue(tc, dt_collector_select_response(&nsd, &q) == 1);
+	popt.dnstap_log = 0;
+	CuAssertTrue(tc, dt_collector_select_response(&nsd, &q) == 0);
+	q.zone = NULL;
+
+	/* only the responses that the ratelimit acted on */
+	nsd.dt_collector->rrl_only = 1;
+	CuAssertTrue(tc, dt_collector_select_query(&nsd, &q) == 1);
+	CuAssertTrue(tc, q.dnstap_rrl == 0);
+	CuAssertTrue(tc, dt_collector_select_response(&nsd, &q) == 0);
+	q.dnstap_rrl = 1;
+	CuAssertTrue(tc, dt_collector_select_response(&nsd, &q) == 1);
+	dnstap_test_collector_delete(&nsd);
+
+	/* without filters, everything is logged */
+	dnstap_test_collector(&nsd, region, NULL, "", 1);
+	CuAssertTrue(tc, nsd.dt_collector->qtypes == NULL);
+	CuAssertTrue(tc, nsd.dt_collector->rcodes == 0);
+	CuAssertTrue(tc, nsd.dt_collector->sample_rate == 0);
+	dnstap_test_query(&q, TYPE_AAAA);
+	CuAssertTrue(tc, dt_collector_select_query(&nsd, &q) == 1);
+	RCODE_SET(q.packet, RCODE_SERVFAIL);
+	CuAssertTrue(tc, dt_collector_select_response(&nsd, &q) == 1);
+	dnstap_test_collector_delete(&nsd);
+	region_destroy(region);
+}
+
+/* one in sample-rate queries is logged, of those that pass the qtype
+ * filter */
+static void dnstap_sample(CuTest *tc)
+{
+	region_type* region = region_create(xalloc, free);
+	struct nsd nsd;
+	struct query q;
+	int i, n;
+
+	memset(&q, 0, sizeof(q));
+	q.packet = buffer_create(region, 512);
+	dnstap_test_collector(&nsd, region, NULL, NULL, 3);
+	/* the first query is logged, and then every third */
+	for(i=0, n=0; i<30; i++) {
+		dnstap_test_query(&q, TYPE_A);
+		if(dt_collector_select_query(&nsd, &q)) {
+			CuAssertTrue(tc, i%3 == 0);
+			n++;
+		}
+	}
+	CuAssertIntEquals(tc, 10, n);
+	dnstap_test_collector_delete(&nsd);
+
+	/* the queries that the qtype filter drops are not counted */
+	dnstap_test_collector(&nsd, region, "A", NULL, 2);
+	for(i=0, n=0; i<40; i++) {
+		dnstap_test_query(&q, (i%2)?TYPE_AAAA:TYPE_A);
+		if(dt_collector_select_query(&nsd, &q)) {
+			CuAssertTrue(tc, i%4 == 0);
+			n++;
+		}
+	}
+	CuAssertIntEquals(tc, 10, n);
+	dnstap_test_collector_delete(&nsd);
+	region_destroy(region);
+}
+
+#ifdef HAVE_MMAP
+/** a worker process for the ring test, it claims a ring */
+struct dnstap_worker {
+	pid_t pid;
+	/* commands to the worker, and the ring numbers from it */
+	int cmd, result;
+};
+
+/** the number of the ring that the worker claimed, -1 for none */
+static int
+dnstap_worker_ring(CuTest* tc, struct dnstap_worker* w)
+{
+	int r;
+	CuAssertTrue(tc, read(w->result, &r, sizeof(r)) == (ssize_t)sizeof(r));
+	return r;
+}
+
+/** start a worker, it claims a ring of worker number num.  It tries again
+ * on command 'r', and it exits on command 'q' */
+static int
+dnstap_worker_start(CuTest* tc, struct dt_collector* dt_col, int num,
+	struct dnstap_worker* w)
+{
+	int cmd[2], result[2];
+	CuAssertTrue(tc, pipe(cmd) == 0 && pipe(result) == 0);
+	w->pid = fork();
+	CuAssertTrue(tc, w->pid != -1);
+	if(w->pid == 0) {
+		char c = 'r';
+		close(cmd[1]);
+		close(result[0]);
+		while(c == 'r') {
+			struct dt_ring* ring = dt_collector_claim_ring(dt_col,
+				num);
+			int i, r = -1;
+			for(i=0; i<dt_col->count*DT_RINGS_PER_WORKER; i++)
+				if(dt_col->rings[i] == ring)
+					r = i;
+			if(write(result[1], &r, sizeof(r)) != (ssize_t)sizeof(r)
+				|| read(cmd[0], &c, 1) != 1)
+				break;
+		}
+		_exit(0);
+	}
+	close(cmd[0]);
+	close(result[1]);
+	w->cmd = cmd[1];
+	w->result = result[0];
+	return dnstap_worker_ring(tc, w);
+}
+
+/** stop the worker, and wait until it has exited */
+static void
+dnstap_worker_stop(CuTest* tc, struct dnstap_worker* w)
+{
+	int status;
+	CuAssertTrue(tc, write(w->cmd, "q", 1) == 1);
+	CuAssertTrue(tc, waitpid(w->pid, &status, 0) == w->pid);
+	close(w->cmd);
+	close(w->result);
+}
+
+/* the workers of the reloads in a row never write to the same ring */
+static void dnstap_rings(CuTest *tc)
+{
+	struct dt_collector dt_col;
+	struct dnstap_worker a, b, c, d, e;
+	int i, ra, rb, rc;
+
+	memset(&dt_col, 0, sizeof(dt_col));
+	dt_col.count = 2;
+	dt_col.rings = (struct dt_ring**)xalloc_array_zero(
+		dt_col.count*DT_RINGS_PER_WORKER, sizeof(struct dt_ring*));
+	for(i=0; i<dt_col.count*DT_RINGS_PER_WORKER; i++) {
+		void* p = mmap(NULL, sizeof(struct dt_ring),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		CuAssertTrue(tc, p != MAP_FAILED);
+		dt_col.rings[i] = (struct dt_ring*)p;
+	}
+
+	/* the first worker 0, and the ones of two reloads in a row, while
+	 * the old ones have not exited yet */
+	ra = dnstap_worker_start(tc, &dt_col, 0, &a);
+	rb = dnstap_worker_start(tc, &dt_col, 0, &b);
+	rc = dnstap_worker_start(tc, &dt_col, 0, &c);
+	CuAssertTrue(tc, ra != -1 && rb != -1 && rc != -1);
+	CuAssertTrue(tc, ra != rb && rb != rc && ra != rc);
+	CuAssertTrue(tc, ra%dt_col.count == 0 && rb%dt_col.count == 0 &&
+		rc%dt_col.count == 0);
+	/* worker 1 has rings of its own */
+	CuAssertTrue(tc, dnstap_worker_start(tc, &dt_col, 1, &e)%dt_col.count
+		== 1);
+
+	/* after another reload, all rings of worker 0 are in use */
+	CuAssertTrue(tc, dnstap_worker_start(tc, &dt_col, 0, &d) == -1);
+	CuAssertTrue(tc, write(d.cmd, "r", 1) == 1);
+	CuAssertTrue(tc, dnstap_worker_ring(tc, &d) == -1);
+	/* the ring of the oldest worker is free when it has exited */
+	dnstap_worker_stop(tc, &a);
+	CuAssertTrue(tc, write(d.cmd, "r", 1) == 1);
+	CuAssertTrue(tc, dnstap_worker_ring(tc, &d) == ra);
+	/* the next ones get the rings of the workers that exited */
+	dnstap_worker_stop(tc, &b);
+	dnstap_worker_stop(tc, &c);
+	i = dnstap_worker_start(tc, &dt_col, 0, &a);
+	CuAssertTrue(tc, i == rb || i == rc);
+
+	dnstap_worker_stop(tc, &a);
+	dnstap_worker_stop(tc, &d);
+	dnstap_worker_stop(tc, &e);
+	for(i=0; i<dt_col.count*DT_RINGS_PER_WORKER; i++)
+		munmap(dt_col.rings[i], sizeof(struct dt_ring));
+	free(dt_col.rings);
+}
+#endif /* HAVE_MMAP */
+#endif /* USE_DNSTAP */
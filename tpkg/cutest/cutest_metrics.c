@@ -0,0 +1,108 @@
+/*
+	test the http request check and the OpenMetrics output, metrics.c
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tpkg/cutest/cutest.h"
+#include "metrics.h"
+#include "buffer.h"
+#include "region-allocator.h"
+#include "nsd.h"
+
+#ifdef BIND8_STATS
+static void metrics_1(CuTest *tc);
+static void metrics_2(CuTest *tc);
+
+CuSuite* reg_cutest_metrics(void)
+{
+	CuSuite* suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, metrics_1);
+	SUITE_ADD_TEST(suite, metrics_2);
+	return suite;
+}
+
+/* the http request */
+static void metrics_1(CuTest *tc)
+{
+	int head;
+	CuAssert(tc, "get", metrics_http_status("GET /metrics HTTP/1.1\r\n"
+		"Host: localhost\r\n\r\n", "/metrics", &head) == 200 && !head);
+	CuAssert(tc, "head", metrics_http_status("HEAD /metrics HTTP/1.0\r\n"
+		"\r\n", "/metrics", &head) == 200 && head);
+	CuAssert(tc, "query string", metrics_http_status(
+		"GET /metrics?x=1 HTTP/1.1\r\n\r\n", "/metrics", &head) == 200);
+	CuAssert(tc, "other path", metrics_http_status(
+		"GET /metricsx HTTP/1.1\r\n\r\n", "/metrics", &head) == 404);
+	CuAssert(tc, "root", metrics_http_status("GET / HTTP/1.1\r\n\r\n",
+		"/metrics", &head) == 404);
+	CuAssert(tc, "method", metrics_http_status(
+		"POST /metrics HTTP/1.1\r\n\r\n", "/metrics", &head) == 405);
+	CuAssert(tc, "no version", metrics_http_status("GET /metrics\r\n\r\n",
+		"/metrics", &head) == 400);
+	CuAssert(tc, "garbage", metrics_http_status("\r\n\r\n", "/metrics",
+		&head) == 400);
+}
+
+/* the output of the statistics */
+static void metrics_2(CuTest *tc)
+{
+	region_type* region = region_create(xalloc, free);
+	buffer_type* buf = buffer_create(region, 16);
+	struct nsdst st[2];
+	struct nsdst* sts[2];
+	char* labels[2];
+	char* out;
+
+	memset(st, 0, sizeof(st));
+	st[0].qudp = 5;
+	st[0].qtype[TYPE_A] = 3;
+	st[0].rcode[RCODE_NXDOMAIN] = 2;
+	st[0].latency[0] = 4;
+	st[0].latency[NSD_LATENCY_BUCKETS-1] = 1;
+	st[0].latency_usec = 1500000;
+	st[1].ctcp6 = 7;
+	sts[0] = &st[0];
+	sts[1] = &st[1];
+	labels[0] = "";
+	metrics_print_blocks(buf, "nsd", 1, labels, sts, 0);
+	buffer_write_u8(buf, 0);
+	out = (char*)buffer_begin(buf);
+	CuAssert(tc, "udp", strstr(out,
+		"\nnsd_queries_total{transport=\"udp\"} 5\n") != NULL);
+	CuAssert(tc, "type", strstr(out,
+		"\nnsd_queries_by_type_total{type=\"A\"} 3\n") != NULL);
+	CuAssert(tc, "unused type", strstr(out, "TYPE65") == NULL);
+	CuAssert(tc, "rcode", strstr(out,
+		"\nnsd_answers_by_rcode_total{rcode=\"NXDOMAIN\"} 2\n") != NULL);
+	CuAssert(tc, "bucket", strstr(out,
+		"\nnsd_answer_latency_seconds_bucket{le=\"0.000100\"} 4\n") != NULL);
+	CuAssert(tc, "inf", strstr(out,
+		"\nnsd_answer_latency_seconds_bucket{le=\"+Inf\"} 5\n") != NULL);
+	CuAssert(tc, "count", strstr(out,
+		"\nnsd_answer_latency_seconds_count 5\n") != NULL);
+	CuAssert(tc, "sum", strstr(out,
+		"\nnsd_answer_latency_seconds_sum 1.500000\n") != NULL);
+	CuAssert(tc, "type line", strstr(out,
+		"# TYPE nsd_queries counter\n") != NULL);
+
+	buffer_clear(buf);
+	labels[0] = "zone=\"example.com\",";
+	labels[1] = "zone=\"a\\\"b\",";
+	metrics_print_blocks(buf, "nsd_zone", 2, labels, sts, 1);
+	buffer_write_u8(buf, 0);
+	out = (char*)buffer_begin(buf);
+	CuAssert(tc, "zone udp", strstr(out, "\nnsd_zone_queries_total{"
+		"zone=\"example.com\",transport=\"udp\"} 5\n") != NULL);
+	CuAssert(tc, "zone tcp6", strstr(out, "\nnsd_zone_queries_total{"
+		"zone=\"a\\\"b\",transport=\"tcp6\"} 7\n") != NULL);
+	CuAssert(tc, "zone dropped", strstr(out, "\nnsd_zone_dropped_total{"
+		"zone=\"a\\\"b\"} 0\n") != NULL);
+	CuAssert(tc, "zone no rxerr", strstr(out, "receive_errors") == NULL);
+	region_destroy(region);
+}
+#endif /* BIND8_STATS */
@@ -25,9 +25,11 @@
 
 static void namedb_1(CuTest *tc);
 static void namedb_2(CuTest *tc);
+static void namedb_count(CuTest *tc);
 #ifdef NSEC3
 static void namedb_3(CuTest *tc);
 static void namedb_4(CuTest *tc);
+static void namedb_5(CuTest *tc);
 #endif /* NSEC3 */
 static int v = 0; /* verbosity */
 
@@ -40,9 +42,11 @@ CuSuite* reg_cutest_namedb(void)
 
 	SUITE_ADD_TEST(suite, namedb_1);
 	SUITE_ADD_TEST(suite, namedb_2);
+	SUITE_ADD_TEST(suite, namedb_count);
 #ifdef NSEC3
 	SUITE_ADD_TEST(suite, namedb_3);
 	SUITE_ADD_TEST(suite, namedb_4);
+	SUITE_ADD_TEST(suite, namedb_5);
 #endif /* NSEC3 */
 	return suite;
 }
@@ -243,6 +247,171 @@ check_rrsets(CuTest* tc, domain_type* domain)
 	}
 }
 
+/** the RRs that zonec_count passed to the callback */
+struct count_result {
+	size_t num, names, owners;
+	char text[4096];
+};
+
+/** zonec_count callback, prints the names of the RR, so that a released
+ * name that is still in use shows up as wrong text */
+static void
+count_rr_cb(void* arg, rr_type* rr, size_t new_domains, int new_owner)
+{
+	struct count_result* res = (struct count_result*)arg;
+	char line[1024];
+	size_t i;
+	res->num++;
+	res->names += new_domains;
+	res->owners += new_owner;
+	snprintf(line, sizeof(line), "%s %s", domain_to_string(rr->owner),
+		rrtype_to_string(rr->type));
+	for(i=0; i<rr->rdata_count; i++) {
+		if(rdata_atom_is_domain(rr->type, i)) {
+			(void)strlcat(line, " ", sizeof(line));
+			(void)strlcat(line, domain_to_string(rdata_atom_domain(
+				rr->rdatas[i])), sizeof(line));
+		}
+	}
+	(void)strlcat(line, "\n", sizeof(line));
+	(void)strlcat(res->text, line, sizeof(res->text));
+}
+
+/** count a zone, check the RRs, names and owners seen and that the names
+ * below the apex are released. outside is the number of names kept
+ * outside the zone */
+static void
+check_count_zone(CuTest* tc, const char* zonename, const char* ztxt,
+	const char* expect, size_t num, size_t names, size_t owners,
+	size_t outside)
+{
+	region_type* region = region_create(xalloc, free);
+	struct nsd_options* opt;
+	struct zone_options* zo;
+	namedb_type* db;
+	zone_type* zone;
+	domain_type* d;
+	struct count_result res;
+	size_t before;
+	unsigned int errors;
+	char* zonefile = udbtest_get_temp_file("count.zone");
+	FILE* out = fopen(zonefile, "w");
+	if(!out) {
+		printf("failed to write %s: %s\n", zonefile, strerror(errno));
+		exit(1);
+	}
+	fprintf(out, "%s", ztxt);
+	fclose(out);
+
+	opt = nsd_options_create(region);
+	zo = zone_options_create(region);
+	memset(zo, 0, sizeof(*zo));
+	zo->name = region_strdup(region, zonename);
+	zo->pattern = pattern_options_create(region);
+	zo->pattern->pname = zo->name;
+	zo->pattern->zonefile = region_strdup(region, zonefile);
+	CuAssertTrue(tc, nsd_options_insert_zone(opt, zo));
+
+	/* like nsd-mem -s, only the domain table */
+	db = namedb_open("", opt);
+	CuAssertTrue(tc, db != NULL);
+	zone = namedb_zone_create(db, (const dname_type*)zo->node.key, zo);
+	before = domain_table_count(db->domains);
+	memset(&res, 0, sizeof(res));
+	errors = zonec_count(zo->name, zonefile, zone, &count_rr_cb, &res);
+	if(v) printf("%s", res.text);
+	CuAssertTrue(tc, errors == 0);
+	CuAssertTrue(tc, res.num == num);
+	CuAssertStrEquals(tc, expect, res.text);
+	/* every name is counted once, also when it is used again after
+	 * it was released */
+	CuAssertTrue(tc, res.names == names);
+	CuAssertTrue(tc, res.owners == owners);
+
+	/* the zone is back to the apex and the names above it */
+	CuAssertTrue(tc, domain_table_count(db->domains) == before + outside);
+	for(d = db->domains->root; d; d = domain_next(d)) {
+		CuAssertTrue(tc, d == zone->apex ||
+			!domain_is_subdomain(d, zone->apex));
+	}
+	CuAssertTrue(tc, zone->soa_rrset == NULL);
+
+	namedb_close(db);
+	unlink(zonefile);
+	free(zonefile);
+	region_destroy(region);
+}
+
+/* test zonec_count: names that recur as owners and in rdata */
+static void namedb_count(CuTest *tc)
+{
+	if(v) printf("test namedb count start\n");
+	/* rdata names that are earlier owners, later owners, the current
+	 * owner itself, and names below and above other names */
+	check_count_zone(tc, "example.org.",
+		"$ORIGIN example.org.\n"
+		"$TTL 3600\n"
+		"@	IN	SOA	ns hostmaster 1 28800 7200 604800 3600\n"
+		"	IN	NS	ns\n"
+		"	IN	MX	10 mail\n"
+		"ns	IN	A	192.0.2.1\n"
+		"mail	IN	A	192.0.2.2\n"
+		"www	IN	CNAME	mail\n"
+		"ftp	IN	CNAME	www\n"
+		"self	IN	CNAME	self\n"
+		"loop	IN	NS	loop\n"
+		"	IN	A	192.0.2.3\n"
+		"mx	IN	MX	10 mx\n"
+		"	IN	MX	20 self\n"
+		"	IN	MX	30 @\n"
+		"a.b.c	IN	A	192.0.2.4\n"
+		"c	IN	MX	10 a.b.c\n"
+		"b.c	IN	CNAME	c\n"
+		"up	IN	MX	10 down\n"
+		"down	IN	MX	10 up\n",
+		"example.org. SOA ns.example.org. hostmaster.example.org.\n"
+		"example.org. NS ns.example.org.\n"
+		"example.org. MX mail.example.org.\n"
+		"ns.example.org. A\n"
+		"mail.example.org. A\n"
+		"www.example.org. CNAME mail.example.org.\n"
+		"ftp.example.org. CNAME www.example.org.\n"
+		"self.example.org. CNAME self.example.org.\n"
+		"loop.example.org. NS loop.example.org.\n"
+		"loop.example.org. A\n"
+		"mx.example.org. MX mx.example.org.\n"
+		"mx.example.org. MX self.example.org.\n"
+		"mx.example.org. MX example.org.\n"
+		"a.b.c.example.org. A\n"
+		"c.example.org. MX a.b.c.example.org.\n"
+		"b.c.example.org. CNAME c.example.org.\n"
+		"up.example.org. MX down.example.org.\n"
+		"down.example.org. MX up.example.org.\n",
+		18, 13, 13, 0);
+	/* the names outside the zone are kept, the apex points at itself */
+	check_count_zone(tc, "example.net.",
+		"example.net. 3600 IN SOA example.net. example.net. 1 2 3 4 5\n"
+		"example.net. 3600 IN NS ns.example.com.\n"
+		"example.net. 3600 IN NS example.net.\n"
+		"example.net. 3600 IN A 192.0.2.1\n"
+		"sub.example.net. 3600 IN NS ns.example.com.\n"
+		"sub.example.net. 3600 IN NS ns.sub.example.net.\n"
+		"ns.sub.example.net. 3600 IN A 192.0.2.2\n"
+		"www.example.net. 3600 IN CNAME sub.example.net.\n"
+		"www.example.net. 3600 IN MX 10 www.example.net.\n",
+		"example.net. SOA example.net. example.net.\n"
+		"example.net. NS ns.example.com.\n"
+		"example.net. NS example.net.\n"
+		"example.net. A\n"
+		"sub.example.net. NS ns.example.com.\n"
+		"sub.example.net. NS ns.sub.example.net.\n"
+		"ns.sub.example.net. A\n"
+		"www.example.net. CNAME sub.example.net.\n"
+		"www.example.net. MX www.example.net.\n",
+		9, 6, 4, 3);
+	if(v) printf("test namedb count end\n");
+}
+
 #ifdef NSEC3
 /* get NSEC3 for given nsec3-domain-name, b32.zone */
 static domain_type*
@@ -1761,4 +1930,129 @@ static void namedb_4(CuTest *tc)
 	namedb_close(db);
 	region_destroy(region);
 }
+
+/** NSEC3PARAM rdata for the hash, iterations and salt */
+struct nsec3_test_param {
+	rr_type rr;
+	rdata_atom_type rdatas[4];
+	uint16_t iter[2];
+	uint16_t salt[1+(1+8)/2+1];
+};
+
+/** set the NSEC3PARAM for the zone, the salt is 8 octets */
+static void
+nsec3_test_param_set(zone_type* zone, struct nsec3_test_param* p,
+	uint16_t iterations, const char* salt)
+{
+	memset(p, 0, sizeof(*p));
+	p->iter[0] = 2;
+	write_uint16(&p->iter[1], iterations);
+	p->salt[0] = 1+8;
+	((uint8_t*)&p->salt[1])[0] = 8;
+	memcpy(((uint8_t*)&p->salt[1])+1, salt, 8);
+	p->rdatas[2].data = p->iter;
+	p->rdatas[3].data = p->salt;
+	p->rr.rdatas = p->rdatas;
+	p->rr.rdata_count = 4;
+	p->rr.type = TYPE_NSEC3PARAM;
+	zone->nsec3_param = &p->rr;
+}
+
+/** the cached hash is the same as the hash of the name */
+static void
+nsec3_test_cached(CuTest* tc, zone_type* zone, const dname_type* dname)
+{
+	uint8_t h1[NSEC3_HASH_LEN], h2[NSEC3_HASH_LEN];
+	nsec3_hash_and_store(zone, dname, h1);
+	nsec3_hash_and_store_cached(zone, dname, h2);
+	CuAssertTrue(tc, memcmp(h1, h2, NSEC3_HASH_LEN) == 0);
+}
+
+/** true if the name is in the cache for the zone.  The zone gets other
+ * parameters for a moment, an entry in the cache has the hash with the
+ * old ones.  A name that is not in the cache is then put in it. */
+static int
+nsec3_test_in_cache(zone_type* zone, const dname_type* dname)
+{
+	struct nsec3_test_param other;
+	rr_type* param = zone->nsec3_param;
+	uint8_t h1[NSEC3_HASH_LEN], h2[NSEC3_HASH_LEN];
+	nsec3_test_param_set(zone, &other, 3, "otherslt");
+	nsec3_hash_and_store(zone, dname, h1);
+	nsec3_hash_and_store_cached(zone, dname, h2);
+	zone->nsec3_param = param;
+	return memcmp(h1, h2, NSEC3_HASH_LEN) != 0;
+}
+
+static void namedb_5(CuTest *tc)
+{
+	/* test _5 : the query name NSEC3 hash cache */
+	region_type* region = region_create(xalloc, free);
+	struct nsec3_test_param pa, pb;
+	zone_type za, zb;
+	const dname_type* names[20], *way[NSEC3_CACHE_WAYS+1];
+	char buf[64];
+	int i, n, set;
+
+	memset(&za, 0, sizeof(za));
+	memset(&zb, 0, sizeof(zb));
+	nsec3_test_param_set(&za, &pa, 1, "saltsalt");
+	nsec3_test_param_set(&zb, &pb, 10, "pepper12");
+	nsec3_hash_cache_clear();
+	for(i=0; i<20; i++) {
+		snprintf(buf, sizeof(buf), "n%d.example.org.", i);
+		names[i] = dname_parse(region, buf);
+	}
+
+	/* the same names in two zones, not in the cache, and then from
+	 * the cache */
+	for(n=0; n<2; n++) {
+		for(i=0; i<20; i++) {
+			nsec3_test_cached(tc, &za, names[i]);
+			nsec3_test_cached(tc, &zb, names[i]);
+		}
+	}
+	CuAssertTrue(tc, nsec3_test_in_cache(&za, names[0]));
+	CuAssertTrue(tc, nsec3_test_in_cache(&zb, names[19]));
+	snprintf(buf, sizeof(buf), "other.example.org.");
+	CuAssertTrue(tc, !nsec3_test_in_cache(&za, dname_parse(region, buf)));
+	/* a name that is in the same set for both zones */
+	for(i=0; ; i++) {
+		const dname_type* d;
+		snprintf(buf, sizeof(buf), "s%d.example.org.", i);
+		d = dname_parse(region, buf);
+		if(nsec3_hash_cache_set(&za, d) == nsec3_hash_cache_set(&zb,
+			d)) {
+			nsec3_test_cached(tc, &za, d);
+			nsec3_test_cached(tc, &zb, d);
+			nsec3_test_cached(tc, &za, d);
+			break;
+		}
+	}
+
+	/* names in the same set, the least recently used is replaced */
+	nsec3_hash_cache_clear();
+	way[0] = dname_parse(region, "w0.example.org.");
+	set = nsec3_hash_cache_set(&za, way[0]);
+	for(i=1, n=1; n<NSEC3_CACHE_WAYS+1; i++) {
+		const dname_type* d;
+		snprintf(buf, sizeof(buf), "w%d.example.org.", i);
+		d = dname_parse(region, buf);
+		if(nsec3_hash_cache_set(&za, d) == set)
+			way[n++] = d;
+	}
+	for(i=0; i<NSEC3_CACHE_WAYS; i++)
+		nsec3_test_cached(tc, &za, way[i]);
+	/* way[0] is used again, way[1] is then the least recently used */
+	nsec3_test_cached(tc, &za, way[0]);
+	nsec3_test_cached(tc, &za, way[NSEC3_CACHE_WAYS]);
+	for(i=0; i<NSEC3_CACHE_WAYS+1; i++) {
+		if(i != 1)
+			CuAssertTrue(tc, nsec3_test_in_cache(&za, way[i]));
+	}
+	CuAssertTrue(tc, !nsec3_test_in_cache(&za, way[1]));
+
+	nsec3_hash_cache_clear();
+	region_destroy(region);
+}
 #endif /* NSEC3 */
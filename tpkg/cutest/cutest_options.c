@@ -11,12 +11,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include "tpkg/cutest/cutest.h"
 #include "region-allocator.h"
 #include "options.h"
 #include "util.h"
 #include "dname.h"
 #include "nsd.h"
+#include "query.h"
 
 static void acl_1(CuTest *tc);
 static void acl_2(CuTest *tc);
@@ -24,6 +26,8 @@ static void acl_3(CuTest *tc);
 static void acl_4(CuTest *tc);
 static void acl_5(CuTest *tc);
 static void acl_6(CuTest *tc);
+static void acl_7(CuTest *tc);
+static void acl_8(CuTest *tc);
 static void replace_1(CuTest *tc);
 static void replace_2(CuTest *tc);
 static void zonelist_1(CuTest *tc);
@@ -38,6 +42,8 @@ CuSuite* reg_cutest_options(void)
 	SUITE_ADD_TEST(suite, acl_4); /* parse_acl_range_type */
 	SUITE_ADD_TEST(suite, acl_5); /* parse_acl_range_subnet */
 	SUITE_ADD_TEST(suite, acl_6); /* acl_same_host */
+	SUITE_ADD_TEST(suite, acl_7); /* acl_trie_check_incoming */
+	SUITE_ADD_TEST(suite, acl_8); /* acl_trie_check_incoming, random */
 	SUITE_ADD_TEST(suite, replace_1); /* replace_str */
 	SUITE_ADD_TEST(suite, replace_2); /* make_zonefile */
 	SUITE_ADD_TEST(suite, zonelist_1); /* zonelist */
@@ -265,6 +271,147 @@ static void acl_6(CuTest *tc)
 	region_destroy(region);
 }
 
+/* append acl element to the list */
+static void acl_append(region_type* region, acl_options_type** list,
+	const char* ip, const char* key)
+{
+	acl_options_type* acl = parse_acl_info(region,
+		region_strdup(region, ip), key);
+	while(*list)
+		list = &(*list)->next;
+	*list = acl;
+}
+
+/* set the address of the query */
+static void acl_query_addr(struct query* q, const char* ip, int port)
+{
+	memset(&q->addr, 0, sizeof(q->addr));
+#ifdef INET6
+	if(parse_acl_is_ipv6(ip)) {
+		struct sockaddr_in6* sa = (struct sockaddr_in6*)&q->addr;
+		sa->sin6_family = AF_INET6;
+		sa->sin6_port = htons(port);
+		(void)inet_pton(AF_INET6, ip, &sa->sin6_addr);
+		return;
+	}
+#endif
+	((struct sockaddr_in*)&q->addr)->sin_family = AF_INET;
+	((struct sockaddr_in*)&q->addr)->sin_port = htons(port);
+	(void)inet_pton(AF_INET, ip, &((struct sockaddr_in*)&q->addr)->sin_addr);
+}
+
+/* check the trie result for the address, and compare with the list */
+static void acl_trie_check(CuTest* tc, struct acl_trie* trie,
+	acl_options_type* list, struct query* q, const char* ip, int port,
+	int expect, int expect_reason, int cmp_list)
+{
+	acl_options_type* reason = NULL, *reason2 = NULL;
+	int res;
+	acl_query_addr(q, ip, port);
+	res = acl_trie_check_incoming(trie, q, &reason);
+	CuAssert(tc, ip, res == expect);
+	CuAssert(tc, ip, reason == acl_find_num(list, expect_reason));
+	if(cmp_list) {
+		CuAssert(tc, ip, res == acl_check_incoming(list, q, &reason2));
+		CuAssert(tc, ip, reason == reason2);
+	}
+}
+
+static void acl_7(CuTest *tc)
+{
+	/* acl_trie_check_incoming */
+	region_type* region = region_create(xalloc, free);
+	acl_options_type* list = NULL;
+	struct acl_trie* trie;
+	struct query q;
+
+	memset(&q, 0, sizeof(q));
+	q.tsig.status = TSIG_NOT_PRESENT;
+	acl_append(region, &list, "10.0.0.0/8", "NOKEY"); /* 0 */
+	acl_append(region, &list, "10.1.2.3", "BLOCKED");
+	acl_append(region, &list, "192.168.1.0&255.255.0.255", "NOKEY");
+	acl_append(region, &list, "11.0.0.250-11.0.1.5", "NOKEY");
+	acl_append(region, &list, "172.16.0.1@53", "NOKEY");
+	acl_append(region, &list, "0.0.0.0/0", "keyname"); /* 5 */
+	acl_append(region, &list, "10.1.2.0/24", "NOKEY");
+	acl_append(region, &list, "12.0.0.0/8", "NOKEY");
+	acl_append(region, &list, "12.3.0.0/16", "BLOCKED");
+#ifdef INET6
+	acl_append(region, &list, "2001:db8::/32", "NOKEY"); /* 9 */
+	acl_append(region, &list, "2001:db8:1::-2001:db8:1::ff", "BLOCKED");
+	acl_append(region, &list, "::/0", "NOKEY");
+#endif
+	trie = acl_trie_create(region, list);
+	CuAssert(tc, "no trie", acl_trie_create(region, NULL) == NULL);
+	CuAssert(tc, "no trie", acl_trie_check_incoming(NULL, &q, NULL) == -1);
+
+	acl_trie_check(tc, trie, list, &q, "10.9.9.9", 53, 0, 0, 1);
+	acl_trie_check(tc, trie, list, &q, "10.1.2.3", 53, -1, 1, 1);
+	acl_trie_check(tc, trie, list, &q, "10.1.2.4", 53, 0, 0, 1);
+	acl_trie_check(tc, trie, list, &q, "192.168.77.0", 53, 2, 2, 1);
+	acl_trie_check(tc, trie, list, &q, "192.168.77.1", 53, -1, -1, 1);
+	/* the trie has the range as numbers in network byte order */
+	acl_trie_check(tc, trie, list, &q, "11.0.0.250", 53, 3, 3, 0);
+	acl_trie_check(tc, trie, list, &q, "11.0.0.255", 53, 3, 3, 0);
+	acl_trie_check(tc, trie, list, &q, "11.0.1.0", 53, 3, 3, 0);
+	acl_trie_check(tc, trie, list, &q, "11.0.1.5", 53, 3, 3, 0);
+	acl_trie_check(tc, trie, list, &q, "11.0.0.249", 53, -1, -1, 0);
+	acl_trie_check(tc, trie, list, &q, "11.0.1.6", 53, -1, -1, 0);
+	acl_trie_check(tc, trie, list, &q, "172.16.0.1", 53, 4, 4, 1);
+	acl_trie_check(tc, trie, list, &q, "172.16.0.1", 54, -1, -1, 1);
+	acl_trie_check(tc, trie, list, &q, "12.1.0.1", 54, 7, 7, 1);
+	acl_trie_check(tc, trie, list, &q, "12.3.0.1", 54, -1, 8, 1);
+#ifdef INET6
+	acl_trie_check(tc, trie, list, &q, "2001:db8::5", 53, 9, 9, 1);
+	acl_trie_check(tc, trie, list, &q, "2001:db8:1::10", 53, -1, 10, 1);
+	acl_trie_check(tc, trie, list, &q, "2001:db8:1::100", 53, 9, 9, 0);
+	acl_trie_check(tc, trie, list, &q, "2002::1", 53, 11, 11, 1);
+#endif
+
+	acl_trie_delete(region, trie);
+	region_destroy(region);
+}
+
+static void acl_8(CuTest *tc)
+{
+	/* acl_trie_check_incoming, random subnets compared with the list */
+	region_type* region = region_create(xalloc, free);
+	acl_options_type* list = NULL;
+	struct acl_trie* trie;
+	struct query q;
+	uint32_t r = 12345;
+	char ip[64];
+	int i, res, res2;
+
+	memset(&q, 0, sizeof(q));
+	q.tsig.status = TSIG_NOT_PRESENT;
+#define ACL_RAND() (r = r*1103515245 + 12345, (r>>8))
+	for(i=0; i<2000; i++) {
+		uint32_t a = ACL_RAND();
+		snprintf(ip, sizeof(ip), "10.%u.%u.%u/%u", (a>>16)&7,
+			(a>>8)&0xff, a&0xff, 8+(unsigned)(ACL_RAND()%25));
+		acl_append(region, &list, ip, (ACL_RAND()%8)==0?"BLOCKED":
+			"NOKEY");
+	}
+	trie = acl_trie_create(region, list);
+	for(i=0; i<20000; i++) {
+		acl_options_type* reason = NULL, *reason2 = NULL;
+		uint32_t a = ACL_RAND();
+		snprintf(ip, sizeof(ip), "10.%u.%u.%u", (a>>16)&7,
+			(a>>8)&0xff, a&0xff);
+		acl_query_addr(&q, ip, 53);
+		res = acl_trie_check_incoming(trie, &q, &reason);
+		res2 = acl_check_incoming(list, &q, &reason2);
+		if(res != res2 || reason != reason2) {
+			CuAssert(tc, ip, 0);
+			break;
+		}
+	}
+#undef ACL_RAND
+	acl_trie_delete(region, trie);
+	region_destroy(region);
+}
+
 static void replace_1(CuTest *tc)
 {
 	char buf[32];
@@ -13,6 +13,7 @@
 #include "tpkg/cutest/cutest.h"
 #include "tpkg/cutest/qtest.h"
 #include "nsd.h"
+#include "dnstap/dnstap_config.h"
 
 CuSuite * reg_cutest_radtree(void);
 CuSuite * reg_cutest_rbtree(void);
@@ -32,6 +33,20 @@ CuSuite * reg_cutest_rrl(void);
 CuSuite * reg_cutest_popen3(void);
 CuSuite * reg_cutest_iter(void);
 CuSuite * reg_cutest_event(void);
+CuSuite * reg_cutest_cookie(void);
+CuSuite * reg_cutest_tsig(void);
+CuSuite * reg_cutest_topn(void);
+CuSuite * reg_cutest_xfrd_disk(void);
+CuSuite * reg_cutest_xfrd_udp(void);
+#ifdef BIND8_STATS
+CuSuite * reg_cutest_metrics(void);
+#endif
+#ifdef USE_ZONE_STATS
+CuSuite * reg_cutest_zonestat(void);
+#endif
+#ifdef USE_DNSTAP
+CuSuite * reg_cutest_dnstap(void);
+#endif
 
 /* dummy functions to link */
 struct nsd nsd;
@@ -85,6 +100,20 @@ int runalltests(const char *regex)
 	CuSuiteAddSuite(suite, reg_cutest_popen3());
 	CuSuiteAddSuite(suite, reg_cutest_iter());
 	CuSuiteAddSuite(suite, reg_cutest_event());
+	CuSuiteAddSuite(suite, reg_cutest_cookie());
+	CuSuiteAddSuite(suite, reg_cutest_tsig());
+	CuSuiteAddSuite(suite, reg_cutest_topn());
+	CuSuiteAddSuite(suite, reg_cutest_xfrd_disk());
+	CuSuiteAddSuite(suite, reg_cutest_xfrd_udp());
+#ifdef BIND8_STATS
+	CuSuiteAddSuite(suite, reg_cutest_metrics());
+#endif
+#ifdef USE_ZONE_STATS
+	CuSuiteAddSuite(suite, reg_cutest_zonestat());
+#endif
+#ifdef USE_DNSTAP
+	CuSuiteAddSuite(suite, reg_cutest_dnstap());
+#endif
 
 	if(CuSuiteRunRegexDisplay(suite, regex, disp_callback) == -1) {
 		fprintf(stderr, "invalid regular expression");
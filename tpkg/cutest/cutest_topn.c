@@ -0,0 +1,95 @@
+/*
+	test topn.h, the most queried names, clients and zones
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "tpkg/cutest/cutest.h"
+#include "topn.h"
+#include "dname.h"
+#include "region-allocator.h"
+#include "util.h"
+
+static void topn_1(CuTest *tc);
+
+CuSuite* reg_cutest_topn(void)
+{
+	CuSuite* suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, topn_1);
+	return suite;
+}
+
+/** count a query for the name from the IPv4 address */
+static void
+topn_test_query(region_type* region, const char* name, const char* ip)
+{
+	query_type q;
+	struct sockaddr_in* sa = (struct sockaddr_in*)&q.addr;
+	memset(&q, 0, sizeof(q));
+	sa->sin_family = AF_INET;
+	(void)inet_pton(AF_INET, ip, &sa->sin_addr);
+	q.qname = dname_parse(region, name);
+	topn_query(&q);
+}
+
+/* a few names with many queries, among many names with one query */
+static void topn_1(CuTest *tc)
+{
+	region_type* region = region_create(xalloc, free);
+	struct topn_result r[10];
+	char name[64], buf[1024];
+	size_t num;
+	int i;
+
+	topn_mmap_init(2, 24, 64);
+	topn_init(1);
+	for(i=0; i<20000; i++) {
+		if(i%4 == 0)
+			topn_test_query(region, "www.example.com.", "192.0.2.1");
+		else if(i%8 == 1)
+			topn_test_query(region, "mail.example.com.", "192.0.2.200");
+		else if(i%16 == 3)
+			topn_test_query(region, "ftp.example.com.", "198.51.100.1");
+		else {
+			snprintf(name, sizeof(name), "r%d.example.com.", i);
+			topn_test_query(region, name, "203.0.113.7");
+		}
+		if(i%1000 == 0)
+			region_free_all(region);
+	}
+
+	num = topn_report(topn_qname, r, 3);
+	CuAssert(tc, "qname num", num == 3);
+	CuAssert(tc, "qname 1", topn_key2str(topn_qname, &r[0], buf,
+		sizeof(buf)) && strcmp(buf, "www.example.com.") == 0);
+	CuAssert(tc, "qname 1 count", r[0].count >= 5000 &&
+		r[0].count - r[0].error <= 5000);
+	CuAssert(tc, "qname 2", topn_key2str(topn_qname, &r[1], buf,
+		sizeof(buf)) && strcmp(buf, "mail.example.com.") == 0);
+	CuAssert(tc, "qname 2 count", r[1].count >= 2500 &&
+		r[1].count - r[1].error <= 2500);
+	CuAssert(tc, "qname 3", topn_key2str(topn_qname, &r[2], buf,
+		sizeof(buf)) && strcmp(buf, "ftp.example.com.") == 0);
+
+	num = topn_report(topn_client, r, 10);
+	CuAssert(tc, "client num", num == 3);
+	CuAssert(tc, "client 1", topn_key2str(topn_client, &r[0], buf,
+		sizeof(buf)) && strcmp(buf, "203.0.113.0/24") == 0);
+	CuAssert(tc, "client 2", topn_key2str(topn_client, &r[1], buf,
+		sizeof(buf)) && strcmp(buf, "192.0.2.0/24") == 0 &&
+		r[1].count == 7500 && r[1].error == 0);
+	CuAssert(tc, "no zone", topn_report(topn_zone, r, 10) == 0);
+
+	/* cleared, the table is empty until the next query */
+	topn_clear();
+	CuAssert(tc, "cleared", topn_report(topn_client, r, 10) == 0);
+	topn_test_query(region, "www.example.com.", "192.0.2.1");
+	num = topn_report(topn_qname, r, 10);
+	CuAssert(tc, "after clear", num == 1 && r[0].count == 1);
+	region_destroy(region);
+}
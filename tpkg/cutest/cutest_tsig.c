@@ -0,0 +1,239 @@
+/*
+	test tsig.h HMAC contexts, with and without the precomputed key state,
+	the key table and the parse of the TSIG RR
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tpkg/cutest/cutest.h"
+#include "region-allocator.h"
+#include "util.h"
+#include "buffer.h"
+#include "dname.h"
+#include "tsig.h"
+
+static void tsig_state_1(CuTest *tc);
+static void tsig_table_1(CuTest *tc);
+static void tsig_parse_1(CuTest *tc);
+
+CuSuite* reg_cutest_tsig(void)
+{
+	CuSuite* suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, tsig_state_1);
+	SUITE_ADD_TEST(suite, tsig_table_1);
+	SUITE_ADD_TEST(suite, tsig_parse_1);
+	return suite;
+}
+
+#if defined(HAVE_SSL)
+/** hmac the message with the key, compare with the expected hex digest */
+static int
+hmac_check(tsig_algorithm_type* algo, void* ctx, tsig_key_type* key,
+	const char* msg, const char* expect)
+{
+	uint8_t digest[64], want[64];
+	size_t size = algo->maximum_digest_size;
+	algo->hmac_init_context(ctx, algo, key);
+	algo->hmac_update(ctx, msg, strlen(msg));
+	algo->hmac_final(ctx, digest, &size);
+	if(hex_pton(expect, want, sizeof(want)) != (ssize_t)size)
+		return 0;
+	return memcmp(digest, want, size) == 0;
+}
+#endif /* HAVE_SSL */
+
+/* RFC 4231 test cases 1 and 2 with hmac-sha256, the same context is
+ * used for both keys, keyed from scratch, from the key state, and reused */
+static void tsig_state_1(CuTest *tc)
+{
+#if defined(HAVE_SSL)
+	region_type* region = region_create(xalloc, free);
+	tsig_algorithm_type* algo;
+	tsig_key_type k1, k2;
+	uint8_t d1[20];
+	const char* h1 = "b0344c61d8db38535ca8afceaf0bf12b"
+		"881dc200c9833da726e9376c2e32cff7";
+	const char* h2 = "5bdcc146bf60754e6a042426089575c7"
+		"5a003f089d2739839dec58b964ec3843";
+	void* ctx;
+
+	(void)tsig_init(region);
+	algo = tsig_get_algorithm_by_name("hmac-sha256");
+	CuAssert(tc, "hmac-sha256 algorithm", algo != NULL);
+	if(!algo) {
+		region_destroy(region);
+		return;
+	}
+	memset(&k1, 0, sizeof(k1));
+	memset(&k2, 0, sizeof(k2));
+	memset(d1, 0x0b, sizeof(d1));
+	k1.data = d1;
+	k1.size = sizeof(d1);
+	k2.data = (uint8_t*)"Jefe";
+	k2.size = 4;
+	ctx = algo->hmac_create_context(region);
+
+	CuAssert(tc, "no state 1", hmac_check(algo, ctx, &k1, "Hi There", h1));
+	CuAssert(tc, "no state 2", hmac_check(algo, ctx, &k2,
+		"what do ya want for nothing?", h2));
+
+	tsig_key_create_state(&k1, algo);
+	tsig_key_create_state(&k2, algo);
+	CuAssert(tc, "states made", k1.state && k2.state &&
+		k1.state_serial != k2.state_serial);
+	CuAssert(tc, "state 1", hmac_check(algo, ctx, &k1, "Hi There", h1));
+	CuAssert(tc, "reuse 1", hmac_check(algo, ctx, &k1, "Hi There", h1));
+	CuAssert(tc, "state 2", hmac_check(algo, ctx, &k2,
+		"what do ya want for nothing?", h2));
+	CuAssert(tc, "reuse 2", hmac_check(algo, ctx, &k2,
+		"what do ya want for nothing?", h2));
+	CuAssert(tc, "state 1 again", hmac_check(algo, ctx, &k1, "Hi There",
+		h1));
+
+	/* the key changes, its state is deleted and made again */
+	tsig_key_delete_state(&k1);
+	CuAssert(tc, "deleted", k1.state == NULL && k1.state_serial == 0);
+	k1.data = (uint8_t*)"Jefe";
+	k1.size = 4;
+	CuAssert(tc, "changed no state", hmac_check(algo, ctx, &k1,
+		"what do ya want for nothing?", h2));
+	tsig_key_create_state(&k1, algo);
+	CuAssert(tc, "changed state", hmac_check(algo, ctx, &k1,
+		"what do ya want for nothing?", h2));
+
+	tsig_key_delete_state(&k1);
+	tsig_key_delete_state(&k2);
+	region_destroy(region);
+#else
+	(void)tc;
+#endif /* HAVE_SSL */
+}
+
+#define TABLE_KEYS 5000
+/* add, find and delete many keys, so that the table grows */
+static void tsig_table_1(CuTest *tc)
+{
+	region_type* region = region_create(xalloc, free);
+	tsig_key_type* keys = (tsig_key_type*)region_alloc_array_zero(region,
+		TABLE_KEYS, sizeof(tsig_key_type));
+	tsig_key_type dup;
+	char buf[64];
+	int i, ok;
+
+	(void)tsig_init(region);
+	for(i=0; i<TABLE_KEYS; i++) {
+		snprintf(buf, sizeof(buf), "key%d.example.com.", i);
+		keys[i].name = dname_parse(region, buf);
+		tsig_add_key(&keys[i]);
+	}
+	ok = 1;
+	for(i=0; i<TABLE_KEYS; i++) {
+		if(tsig_find_key(keys[i].name) != &keys[i])
+			ok = 0;
+	}
+	CuAssert(tc, "find all", ok);
+	CuAssert(tc, "find upper", tsig_find_key(dname_parse(region,
+		"KEY17.Example.COM.")) == &keys[17]);
+	CuAssert(tc, "not found", tsig_find_key(dname_parse(region,
+		"key17.example.net.")) == NULL);
+	CuAssert(tc, "not found prefix", tsig_find_key(dname_parse(region,
+		"key17.example.")) == NULL);
+
+	/* the first key with the name stays */
+	memset(&dup, 0, sizeof(dup));
+	dup.name = dname_parse(region, "key3.example.com.");
+	tsig_add_key(&dup);
+	CuAssert(tc, "dup", tsig_find_key(dup.name) == &keys[3]);
+
+	for(i=0; i<TABLE_KEYS; i+=2)
+		tsig_del_key(&keys[i]);
+	ok = 1;
+	for(i=0; i<TABLE_KEYS; i++) {
+		if(tsig_find_key(keys[i].name) != ((i&1)?&keys[i]:NULL))
+			ok = 0;
+	}
+	CuAssert(tc, "find after del", ok);
+	tsig_del_key(&keys[0]);
+	tsig_add_key(&keys[0]);
+	CuAssert(tc, "add again", tsig_find_key(keys[0].name) == &keys[0]);
+	region_destroy(region);
+}
+
+/* parse a TSIG RR, with compressed, uppercase names */
+static void tsig_parse_1(CuTest *tc)
+{
+	region_type* region = region_create(xalloc, free);
+	buffer_type* packet = buffer_create(region, 512);
+	tsig_record_type tsig;
+	uint8_t mac[32];
+	size_t rdlen_pos, mac_pos;
+
+	memset(mac, 0x3c, sizeof(mac));
+	tsig_create_record(&tsig, region);
+	/* the owner name that the key name points to */
+	buffer_write(packet, "\007Example\003COM\000", 13);
+	buffer_write(packet, "\003Key\300\000", 6);
+	buffer_write_u16(packet, TYPE_TSIG);
+	buffer_write_u16(packet, CLASS_ANY);
+	buffer_write_u32(packet, 0);
+	rdlen_pos = buffer_position(packet);
+	buffer_skip(packet, 2);
+	buffer_write(packet, "\013HMAC-SHA256\000", 13);
+	buffer_write_u16(packet, 0);
+	buffer_write_u32(packet, 1559731985);
+	buffer_write_u16(packet, 300);
+	buffer_write_u16(packet, sizeof(mac));
+	mac_pos = buffer_position(packet);
+	buffer_write(packet, mac, sizeof(mac));
+	buffer_write_u16(packet, 0x1234);
+	buffer_write_u16(packet, TSIG_ERROR_BADTIME);
+	buffer_write_u16(packet, 6);
+	buffer_write(packet, "\000\000\134\367\237\021", 6);
+	buffer_write_u16_at(packet, rdlen_pos, buffer_position(packet) -
+		rdlen_pos - 2);
+	buffer_flip(packet);
+
+	buffer_set_position(packet, 13);
+	CuAssert(tc, "parse", tsig_parse_rr(&tsig, packet));
+	CuAssert(tc, "status", tsig.status == TSIG_OK);
+	CuAssert(tc, "at end", buffer_remaining(packet) == 0);
+	CuAssert(tc, "position", tsig.position == 13);
+	CuAssert(tc, "key name", dname_compare(tsig.key_name,
+		dname_parse(region, "key.example.com.")) == 0 &&
+		memcmp(dname_name(tsig.key_name), "\003key\007example\003com",
+		17) == 0);
+	CuAssert(tc, "algorithm name", dname_compare(tsig.algorithm_name,
+		dname_parse(region, "hmac-sha256.")) == 0 &&
+		memcmp(dname_name(tsig.algorithm_name), "\013hmac-sha256", 12)
+		== 0);
+	CuAssert(tc, "time", tsig.signed_time_high == 0 &&
+		tsig.signed_time_low == 1559731985 &&
+		tsig.signed_time_fudge == 300);
+	CuAssert(tc, "mac", tsig.mac_size == sizeof(mac) &&
+		tsig.mac_data == buffer_at(packet, mac_pos));
+	CuAssert(tc, "fields", tsig.original_query_id == 0x1234 &&
+		tsig.error_code == TSIG_ERROR_BADTIME);
+	CuAssert(tc, "other", tsig.other_size == 6 && memcmp(tsig.other_data,
+		"\000\000\134\367\237\021", 6) == 0);
+
+	tsig_error_reply(&tsig);
+	CuAssert(tc, "error reply", tsig.mac_size == 0 &&
+		memcmp(buffer_at(packet, mac_pos), mac, sizeof(mac)) == 0);
+
+	/* other data that is too long */
+	buffer_write_u16_at(packet, buffer_limit(packet) - 8, 17);
+	buffer_set_position(packet, 13);
+	CuAssert(tc, "other too long", !tsig_parse_rr(&tsig, packet) &&
+		tsig.status == TSIG_ERROR);
+
+	/* not a TSIG RR */
+	buffer_write_u16_at(packet, 19, TYPE_A);
+	buffer_set_position(packet, 13);
+	CuAssert(tc, "not tsig", tsig_parse_rr(&tsig, packet) &&
+		tsig.status == TSIG_NOT_PRESENT && buffer_position(packet) == 13);
+	region_destroy(region);
+}
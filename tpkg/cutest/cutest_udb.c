@@ -15,6 +15,7 @@ static void udb_1(CuTest* tc);
 static void udb_2(CuTest* tc);
 static void udb_3(CuTest* tc);
 static void udb_4(CuTest* tc);
+static void udb_5(CuTest* tc);
 
 CuSuite* reg_cutest_udb(void)
 {
@@ -23,6 +24,7 @@ CuSuite* reg_cutest_udb(void)
 	SUITE_ADD_TEST(suite, udb_2);
 	SUITE_ADD_TEST(suite, udb_3);
 	SUITE_ADD_TEST(suite, udb_4);
+	SUITE_ADD_TEST(suite, udb_5);
 	return suite;
 }
 
@@ -361,6 +363,74 @@ static void test_A(void)
 
 /*** end test A for create and delete chunks ***/
 
+/*** test B for compaction in budgeted steps ***/
+static void test_B(void)
+{
+	char* fname = udbtest_get_temp_file(".udb");
+	struct info_A inf[MAX_NUM_A];
+	size_t i, num_a = 0;
+	uint64_t ng;
+	int steps = 0;
+	udb_base* udb = udb_base_create_new(fname, testAwalk, NULL);
+	CuAssertTrue(tc, udb != NULL);
+
+	/* fill with chunks, and free every other one, like a reload does */
+	udb_compact_inhibited(udb, 1);
+	for(i=0; i<MAX_NUM_A; i++) {
+		inf[i].sz = 100 + random() % 900;
+		inf[i].fill = (uint8_t)(i%255);
+		inf[i].a = udb_alloc_space(udb->alloc, inf[i].sz);
+		CuAssertTrue(tc, inf[i].a != 0);
+		memset(UDB_REL(udb->base, inf[i].a), (int)inf[i].fill,
+			inf[i].sz);
+		udb_ptr_init(&inf[i].ptr, udb);
+		udb_ptr_set(&inf[i].ptr, udb, inf[i].a);
+	}
+	for(i=0; i<MAX_NUM_A; i++) {
+		if(i%2 == 0) {
+			udb_void d = inf[i].ptr.data;
+			udb_ptr_set(&inf[i].ptr, udb, 0);
+			CuAssertTrue(tc, udb_alloc_free(udb->alloc, d,
+				inf[i].sz));
+		} else {
+			inf[num_a] = inf[i];
+			udb_ptr_init(&inf[num_a].ptr, udb);
+			udb_ptr_set(&inf[num_a].ptr, udb, inf[i].ptr.data);
+			udb_ptr_set(&inf[i].ptr, udb, 0);
+			num_a++;
+		}
+	}
+	CuAssertTrue(tc, !udb_compact_pending(udb));
+	udb_compact_inhibited(udb, 0);
+	CuAssertTrue(tc, udb_compact_pending(udb));
+	ng = udb->alloc->disk->nextgrow;
+
+	/* compact in small steps, the data stays intact in between */
+	while(udb_compact_pending(udb)) {
+		uint64_t moved = udb->compact_moved;
+		CuAssertTrue(tc, udb_compact_step(udb, 4096));
+		CuAssertTrue(tc, udb->compact_moved > moved ||
+			!udb_compact_pending(udb));
+		assert_udb_invariant(udb);
+		assert_info_A(udb, inf, num_a);
+		assert_free_structure(udb);
+		assert_relptr_structure(udb);
+		steps++;
+		CuAssertTrue(tc, steps < MAX_NUM_A);
+	}
+	CuAssertTrue(tc, steps > 1);
+	CuAssertTrue(tc, udb->compact_moved != 0);
+	CuAssertTrue(tc, udb->alloc->disk->nextgrow < ng);
+
+	for(i=0; i<num_a; i++)
+		udb_ptr_set(&inf[i].ptr, udb, 0);
+	udb_base_close(udb);
+	udb_base_free(udb);
+	if(unlink(fname) != 0)
+		perror("unlink");
+	free(fname);
+}
+
 /** test structure sizes for compiler padding */
 static void
 test_struct_sizes(void)
@@ -454,3 +524,9 @@ static void udb_4(CuTest* t)
 	tc = t;
 	test_A();
 }
+
+static void udb_5(CuTest* t)
+{
+	tc = t;
+	test_B();
+}
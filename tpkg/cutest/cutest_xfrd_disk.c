@@ -0,0 +1,557 @@
+/*
+	test xfrd-disk.c, the xfrd state file
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tpkg/cutest/cutest.h"
+#include "xfrd-disk.h"
+#include "xfrd.h"
+#include "nsd.h"
+#include "options.h"
+#include "dname.h"
+#include "region-allocator.h"
+#include "util.h"
+#include "tsig.h"
+#include "lookup3.h"
+
+static void xfrd_disk_roundtrip(CuTest *tc);
+static void xfrd_disk_append(CuTest *tc);
+static void xfrd_disk_truncated(CuTest *tc);
+static void xfrd_disk_garbled(CuTest *tc);
+static void xfrd_disk_noapex(CuTest *tc);
+static void xfrd_disk_text(CuTest *tc);
+
+CuSuite* reg_cutest_xfrd_disk(void)
+{
+	CuSuite* suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, xfrd_disk_roundtrip);
+	SUITE_ADD_TEST(suite, xfrd_disk_append);
+	SUITE_ADD_TEST(suite, xfrd_disk_truncated);
+	SUITE_ADD_TEST(suite, xfrd_disk_garbled);
+	SUITE_ADD_TEST(suite, xfrd_disk_noapex);
+	SUITE_ADD_TEST(suite, xfrd_disk_text);
+	return suite;
+}
+
+/* the zones, the names have the same length, so that the records in the
+ * state file are the same size */
+static const char* xfrd_disk_zones[] = {"zone1.example.", "zone2.example.",
+	"zone3.example."};
+#define XFRD_DISK_NUMZONES 3
+/* size of the header of the state file */
+#define XFRD_DISK_HDRSIZE 16
+/* size of the fixed part of a record, before the apex */
+#define XFRD_DISK_RECFIXED 72
+/* the part of a record after the filetime is in its check */
+#define XFRD_DISK_CHECKOFF 16
+
+/** the path of the state file for the test */
+static char xfrd_disk_file[64];
+
+/** create an xfrd with the zones, it is the global xfrd */
+static xfrd_state_type*
+xfrd_disk_create(void)
+{
+	region_type* region = region_create(xalloc, free);
+	struct nsd* n = (struct nsd*)region_alloc_zero(region,
+		sizeof(struct nsd));
+	struct pattern_options* pat = pattern_options_create(region);
+	struct acl_options* acl;
+	xfrd_state_type* x;
+	int i;
+
+	n->options = nsd_options_create(region);
+	n->options->xfrdfile = xfrd_disk_file;
+	/* two masters, so that the master number is kept */
+	acl = (struct acl_options*)region_alloc_zero(region, sizeof(*acl));
+	acl->next = (struct acl_options*)region_alloc_zero(region,
+		sizeof(*acl));
+	pat->request_xfr = acl;
+
+	x = (xfrd_state_type*)region_alloc_zero(region, sizeof(*x));
+	x->region = region;
+	x->nsd = n;
+	x->event_base = nsd_child_event_base();
+	x->got_time = 1;
+	x->current_time = time(NULL);
+	x->zones = rbtree_create(region,
+		(int (*)(const void *, const void *)) dname_compare);
+	xfrd = x;
+	for(i=0; i<XFRD_DISK_NUMZONES; i++) {
+		struct zone_options* zo = zone_options_create(region);
+		zo->name = region_strdup(region, xfrd_disk_zones[i]);
+		zo->node.key = dname_parse(region, xfrd_disk_zones[i]);
+		zo->pattern = pat;
+		xfrd_init_slave_zone(x, zo);
+	}
+	return x;
+}
+
+/** delete the xfrd */
+static void
+xfrd_disk_delete(xfrd_state_type* x)
+{
+	xfrd_zone_type* zone;
+	RBTREE_FOR(zone, xfrd_zone_type*, x->zones) {
+		tsig_delete_record(&zone->tsig, NULL);
+	}
+	if(x->timer_added)
+		event_del(&x->timer_handler);
+	event_base_free(x->event_base);
+	region_destroy(x->region);
+	xfrd = NULL;
+}
+
+/** find the zone by number */
+static xfrd_zone_type*
+xfrd_disk_zone(xfrd_state_type* x, int i)
+{
+	uint8_t buf[MAXDOMAINLEN+1];
+	struct dname_buffer dbuf;
+	const dname_type* d;
+	(void)dname_parse_wire(buf, xfrd_disk_zones[i]);
+	d = dname_make_buffered(&dbuf, buf, 1);
+	return (xfrd_zone_type*)rbtree_search(x->zones, d);
+}
+
+/** make a soa */
+static void
+xfrd_disk_soa(xfrd_soa_type* soa, uint32_t serial)
+{
+	memset(soa, 0, sizeof(*soa));
+	soa->type = htons(TYPE_SOA);
+	soa->klass = htons(CLASS_IN);
+	soa->ttl = htonl(3600);
+	soa->rdata_count = htons(7);
+	soa->prim_ns[0] = dname_parse_wire(soa->prim_ns+1, "ns.example.");
+	soa->email[0] = dname_parse_wire(soa->email+1,
+		"hostmaster.example.");
+	soa->serial = htonl(serial);
+	soa->refresh = htonl(3600);
+	soa->retry = htonl(600);
+	soa->expire = htonl(604800);
+	soa->minimum = htonl(300);
+}
+
+/** set the state of the zone, it has been transferred and is ok */
+static void
+xfrd_disk_set(xfrd_state_type* x, int i, uint32_t serial)
+{
+	xfrd_zone_type* zone = xfrd_disk_zone(x, i);
+	/* the timer is added to the event base of the global xfrd */
+	xfrd = x;
+	zone->state = xfrd_zone_ok;
+	zone->master_num = 1;
+	zone->master = zone->zone_options->pattern->request_xfr->next;
+	zone->next_master = 1;
+	zone->round_num = 2;
+	zone->last_xfr_size = 1000 + i;
+	zone->fresh_xfr_timeout = 3*XFRD_TRANSFER_TIMEOUT_START;
+	xfrd_disk_soa(&zone->soa_nsd, serial);
+	xfrd_disk_soa(&zone->soa_disk, serial);
+	zone->soa_nsd_acquired = xfrd_time() - 100;
+	zone->soa_disk_acquired = xfrd_time() - 100;
+	xfrd_deactivate_zone(zone);
+	xfrd_set_timer(zone, 3000);
+}
+
+/** check that the zone in y has the state of the zone in x */
+static void
+xfrd_disk_check(CuTest* tc, xfrd_state_type* x, xfrd_state_type* y)
+{
+	int i;
+	for(i=0; i<XFRD_DISK_NUMZONES; i++) {
+		xfrd_zone_type* a = xfrd_disk_zone(x, i);
+		xfrd_zone_type* b = xfrd_disk_zone(y, i);
+		CuAssertPtrNotNull(tc, a);
+		CuAssertPtrNotNull(tc, b);
+		CuAssertIntEquals(tc, (int)a->state, (int)b->state);
+		CuAssertIntEquals(tc, a->master_num, b->master_num);
+		CuAssertTrue(tc, b->master == acl_find_num(
+			b->zone_options->pattern->request_xfr, b->master_num));
+		CuAssertIntEquals(tc, a->next_master, b->next_master);
+		CuAssertIntEquals(tc, a->round_num, b->round_num);
+		CuAssertTrue(tc, a->last_xfr_size == b->last_xfr_size);
+		CuAssertTrue(tc, a->fresh_xfr_timeout == b->fresh_xfr_timeout);
+		/* a notified zone is checked after the retry time */
+		if(!a->soa_notified_acquired)
+			CuAssertTrue(tc, a->timeout.tv_sec == b->timeout.tv_sec);
+		CuAssertTrue(tc, a->soa_nsd_acquired == b->soa_nsd_acquired);
+		CuAssertTrue(tc, a->soa_notified_acquired ==
+			b->soa_notified_acquired);
+		/* the soa is only stored when it is acquired */
+		if(a->soa_nsd_acquired)
+			CuAssertTrue(tc, memcmp(&a->soa_nsd, &b->soa_nsd,
+				sizeof(a->soa_nsd)) == 0);
+		if(a->soa_disk_acquired)
+			CuAssertTrue(tc, memcmp(&a->soa_disk, &b->soa_disk,
+				sizeof(a->soa_disk)) == 0);
+		if(a->soa_notified_acquired)
+			CuAssertTrue(tc, memcmp(&a->soa_notified,
+				&b->soa_notified, sizeof(a->soa_notified)) == 0);
+	}
+}
+
+/** read the state file into a new xfrd */
+static xfrd_state_type*
+xfrd_disk_read(void)
+{
+	xfrd_state_type* x = xfrd_disk_create();
+	xfrd_read_state(x);
+	return x;
+}
+
+/** write the state of the xfrd, it is the global xfrd while it writes */
+static void
+xfrd_disk_write(xfrd_state_type* x)
+{
+	xfrd = x;
+	xfrd_write_state(x);
+}
+
+/** set the timers of the zones, like xfrd does when it runs, the
+ * timeout is stored in the state file */
+static void
+xfrd_disk_timers(xfrd_state_type* x)
+{
+	int i;
+	xfrd = x;
+	for(i=0; i<XFRD_DISK_NUMZONES; i++)
+		xfrd_set_timer(xfrd_disk_zone(x, i), 3000);
+}
+
+/** stat the state file */
+static void
+xfrd_disk_stat(CuTest* tc, struct stat* st)
+{
+	CuAssertTrue(tc, stat(xfrd_disk_file, st) == 0);
+}
+
+/** start with a new file, and an xfrd with zones that are ok */
+static xfrd_state_type*
+xfrd_disk_start(void)
+{
+	xfrd_state_type* x;
+	int i;
+	snprintf(xfrd_disk_file, sizeof(xfrd_disk_file),
+		"/tmp/cutest.xfrd.state.%u", (unsigned)getpid());
+	unlink(xfrd_disk_file);
+	x = xfrd_disk_create();
+	for(i=0; i<XFRD_DISK_NUMZONES; i++)
+		xfrd_disk_set(x, i, 1);
+	return x;
+}
+
+/* write the state, and read it back */
+static void xfrd_disk_roundtrip(CuTest *tc)
+{
+	xfrd_state_type* x = xfrd_disk_start(), *y;
+	xfrd_zone_type* zone;
+	struct stat st;
+	char magic[8];
+	FILE* in;
+
+	/* one zone with a notify */
+	zone = xfrd_disk_zone(x, 2);
+	xfrd_disk_soa(&zone->soa_notified, 2);
+	zone->soa_notified_acquired = xfrd_time() - 10;
+	xfrd_disk_write(x);
+	xfrd_disk_stat(tc, &st);
+	in = fopen(xfrd_disk_file, "r");
+	CuAssertPtrNotNull(tc, in);
+	CuAssertTrue(tc, fread(magic, 1, sizeof(magic), in) == sizeof(magic));
+	fclose(in);
+	CuAssertTrue(tc, memcmp(magic, XFRD_FILE_MAGIC_BIN, 8) == 0);
+	CuAssertTrue(tc, st.st_size % 8 == 0);
+
+	y = xfrd_disk_read();
+	xfrd_disk_check(tc, x, y);
+	xfrd_disk_delete(y);
+	xfrd_disk_delete(x);
+	unlink(xfrd_disk_file);
+}
+
+/* the zones that changed are appended, the last record is used */
+static void xfrd_disk_append(CuTest *tc)
+{
+	xfrd_state_type* x = xfrd_disk_start(), *y;
+	struct stat st, st2;
+	off_t reclen;
+	int i;
+
+	xfrd_disk_write(x);
+	xfrd_disk_stat(tc, &st);
+	reclen = (st.st_size - XFRD_DISK_HDRSIZE) / XFRD_DISK_NUMZONES;
+
+	/* nothing changed, nothing is written */
+	xfrd_disk_write(x);
+	xfrd_disk_stat(tc, &st2);
+	CuAssertTrue(tc, st2.st_ino == st.st_ino);
+	CuAssertTrue(tc, st2.st_size == st.st_size);
+
+	/* one zone changed, its record is appended */
+	xfrd_disk_set(x, 1, 2);
+	xfrd_disk_write(x);
+	xfrd_disk_stat(tc, &st2);
+	CuAssertTrue(tc, st2.st_ino == st.st_ino);
+	CuAssertTrue(tc, st2.st_size == st.st_size + reclen);
+	xfrd_disk_set(x, 1, 3);
+	xfrd_disk_write(x);
+	xfrd_disk_stat(tc, &st2);
+	CuAssertTrue(tc, st2.st_ino == st.st_ino);
+	CuAssertTrue(tc, st2.st_size == st.st_size + 2*reclen);
+
+	y = xfrd_disk_read();
+	CuAssertTrue(tc, ntohl(xfrd_disk_zone(y, 1)->soa_disk.serial) == 3);
+	xfrd_disk_check(tc, x, y);
+	xfrd_disk_delete(y);
+
+	/* when the old records take up more space than the current ones,
+	 * the file is written again */
+	for(i=4; i<20; i++) {
+		xfrd_disk_set(x, 0, i);
+		xfrd_disk_write(x);
+		xfrd_disk_stat(tc, &st2);
+		if(st2.st_ino != st.st_ino)
+			break;
+		CuAssertTrue(tc, st2.st_size <= XFRD_DISK_HDRSIZE +
+			2*XFRD_DISK_NUMZONES*reclen);
+	}
+	CuAssertTrue(tc, st2.st_ino != st.st_ino);
+	CuAssertTrue(tc, st2.st_size == st.st_size);
+	y = xfrd_disk_read();
+	CuAssertTrue(tc, ntohl(xfrd_disk_zone(y, 0)->soa_disk.serial) ==
+		(uint32_t)i);
+	xfrd_disk_check(tc, x, y);
+	xfrd_disk_delete(y);
+	xfrd_disk_delete(x);
+	unlink(xfrd_disk_file);
+}
+
+/* a truncated record at the end is not used, and the file is rewritten */
+static void xfrd_disk_truncated(CuTest *tc)
+{
+	xfrd_state_type* x = xfrd_disk_start(), *y, *z;
+	xfrd_zone_type* zone = xfrd_disk_zone(x, 1);
+	struct stat st, st2;
+	time_t timeout;
+
+	xfrd_disk_write(x);
+	xfrd_disk_set(x, 1, 2);
+	xfrd_disk_write(x);
+	timeout = zone->timeout.tv_sec;
+	xfrd_disk_set(x, 1, 3);
+	xfrd_disk_write(x);
+	xfrd_disk_stat(tc, &st);
+	CuAssertTrue(tc, truncate(xfrd_disk_file, st.st_size - 4) == 0);
+	xfrd_disk_stat(tc, &st);
+
+	y = xfrd_disk_read();
+	CuAssertTrue(tc, ntohl(xfrd_disk_zone(y, 1)->soa_disk.serial) == 2);
+	/* the state of the record before the truncated one */
+	xfrd_disk_soa(&zone->soa_nsd, 2);
+	xfrd_disk_soa(&zone->soa_disk, 2);
+	zone->timeout.tv_sec = timeout;
+	xfrd_disk_check(tc, x, y);
+
+	/* the next write does not append to the broken file */
+	xfrd_disk_timers(y);
+	xfrd_disk_write(y);
+	xfrd_disk_stat(tc, &st2);
+	CuAssertTrue(tc, st2.st_ino != st.st_ino);
+	CuAssertTrue(tc, (st2.st_size - XFRD_DISK_HDRSIZE) %
+		XFRD_DISK_NUMZONES == 0);
+	z = xfrd_disk_read();
+	xfrd_disk_check(tc, y, z);
+	xfrd_disk_delete(z);
+	xfrd_disk_delete(y);
+	xfrd_disk_delete(x);
+	unlink(xfrd_disk_file);
+}
+
+/* a garbled record, it and the records after it are not used, and the
+ * file is rewritten */
+static void xfrd_disk_garbled(CuTest *tc)
+{
+	xfrd_state_type* x = xfrd_disk_start(), *y;
+	struct stat st, st2;
+	off_t reclen;
+	FILE* f;
+	int i;
+
+	xfrd_disk_write(x);
+	xfrd_disk_stat(tc, &st);
+	reclen = (st.st_size - XFRD_DISK_HDRSIZE) / XFRD_DISK_NUMZONES;
+	xfrd_disk_set(x, 0, 2);
+	xfrd_disk_write(x);
+
+	/* change the serial in the soa of the third record */
+	f = fopen(xfrd_disk_file, "r+");
+	CuAssertPtrNotNull(tc, f);
+	CuAssertTrue(tc, fseek(f, (long)(XFRD_DISK_HDRSIZE + 2*reclen +
+		reclen - 16), SEEK_SET) == 0);
+	CuAssertTrue(tc, fputc(0x55, f) != EOF);
+	fclose(f);
+	xfrd_disk_stat(tc, &st);
+
+	y = xfrd_disk_read();
+	/* the first two zones are read, before the appended record */
+	for(i=0; i<2; i++) {
+		CuAssertTrue(tc, xfrd_disk_zone(y, i)->soa_nsd_acquired != 0);
+		CuAssertTrue(tc, ntohl(xfrd_disk_zone(y, i)->soa_disk.serial)
+			== 1);
+	}
+	CuAssertTrue(tc, xfrd_disk_zone(y, 2)->soa_nsd_acquired == 0);
+	CuAssertTrue(tc, xfrd_disk_zone(y, 2)->soa_notified_acquired == 0);
+
+	xfrd_disk_write(y);
+	xfrd_disk_stat(tc, &st2);
+	CuAssertTrue(tc, st2.st_ino != st.st_ino);
+	xfrd_disk_delete(y);
+	xfrd_disk_delete(x);
+	unlink(xfrd_disk_file);
+}
+
+/** append a record with a correct check, and without soas, to the
+ * state file, apex is the wire name, or NULL for none */
+static void
+xfrd_disk_append_rec(CuTest* tc, size_t len, const uint8_t* apex,
+	size_t apexlen)
+{
+	uint8_t* rec = (uint8_t*)xalloc_zero(len);
+	uint32_t len32 = (uint32_t)len, check;
+	FILE* f;
+	if(apex) {
+		rec[XFRD_DISK_RECFIXED] = (uint8_t)apexlen;
+		memcpy(rec+XFRD_DISK_RECFIXED+1, apex, apexlen);
+	}
+	check = hashlittle(rec + XFRD_DISK_CHECKOFF,
+		len - XFRD_DISK_CHECKOFF, 0);
+	memcpy(rec, &len32, sizeof(len32));
+	memcpy(rec+4, &check, sizeof(check));
+	f = fopen(xfrd_disk_file, "a");
+	CuAssertPtrNotNull(tc, f);
+	CuAssertTrue(tc, fwrite(rec, len, 1, f) == 1);
+	fclose(f);
+	free(rec);
+}
+
+/* a record with a correct check that ends before its apex, at the end
+ * of the file, it is not used, and the file is rewritten */
+static void xfrd_disk_noapex(CuTest *tc)
+{
+	xfrd_state_type* x = xfrd_disk_start(), *y;
+	/* the name of a zone that is not configured */
+	const uint8_t other[] = {5, 'o', 't', 'h', 'e', 'r', 0};
+	size_t page = (size_t)getpagesize(), fill;
+	struct stat st, st2;
+
+	xfrd_disk_write(x);
+	xfrd_disk_stat(tc, &st);
+	/* the record without apex ends at a page boundary, so that the
+	 * file ends at the end of the mapped memory */
+	fill = page - ((size_t)st.st_size + XFRD_DISK_RECFIXED) % page;
+	if(fill < XFRD_DISK_RECFIXED + 8)
+		fill += page;
+	xfrd_disk_append_rec(tc, fill, other, sizeof(other));
+	xfrd_disk_append_rec(tc, XFRD_DISK_RECFIXED, NULL, 0);
+	xfrd_disk_stat(tc, &st);
+	CuAssertTrue(tc, (size_t)st.st_size % page == 0);
+
+	y = xfrd_disk_read();
+	xfrd_disk_check(tc, x, y);
+	xfrd_disk_write(y);
+	xfrd_disk_stat(tc, &st2);
+	CuAssertTrue(tc, st2.st_ino != st.st_ino);
+	xfrd_disk_delete(y);
+	xfrd_disk_delete(x);
+	unlink(xfrd_disk_file);
+}
+
+/** write a soa in the text of the old state file */
+static void
+xfrd_disk_text_soa(FILE* out, const char* id, uint32_t serial)
+{
+	fprintf(out, "\t%s_acquired: %d\n", id, (int)xfrd_time()-100);
+	fprintf(out, "\t%s: %u %u %u %u ns.example. hostmaster.example. "
+		"%u 3600 600 604800 300\n", id, (unsigned)TYPE_SOA,
+		(unsigned)CLASS_IN, 3600, 7, (unsigned)serial);
+}
+
+/** write the old text state file */
+static void
+xfrd_disk_text_file(const char* magic)
+{
+	FILE* out = fopen(xfrd_disk_file, "w");
+	int i;
+	if(!out)
+		return;
+	fprintf(out, "%s\n", magic);
+	fprintf(out, "# NSD state file, a comment\n");
+	fprintf(out, "filetime: %d\n", (int)xfrd_time()-10);
+	fprintf(out, "numzones: %d\n", XFRD_DISK_NUMZONES+1);
+	for(i=0; i<XFRD_DISK_NUMZONES+1; i++) {
+		fprintf(out, "zone:\tname: %s\n", i<XFRD_DISK_NUMZONES?
+			xfrd_disk_zones[i]:"notconfigured.example.");
+		fprintf(out, "\tstate: 0\n\tmaster: 1\n\tnext_master: 1\n"
+			"\tround_num: 2\n\tnext_timeout: 3000\n"
+			"\tbackoff: 3\n");
+		if(strcmp(magic, XFRD_FILE_MAGIC) == 0)
+			fprintf(out, "\tlast_xfr_size: %d\n", 1000+i);
+		xfrd_disk_text_soa(out, "soa_nsd", 10+i);
+		xfrd_disk_text_soa(out, "soa_disk", 10+i);
+		fprintf(out, "\tsoa_notify_acquired: 0\n");
+	}
+	fprintf(out, "%s\n", magic);
+	fclose(out);
+}
+
+/* the text files of the previous versions are read, and the next write
+ * is the binary file */
+static void xfrd_disk_text(CuTest *tc)
+{
+	const char* magics[] = {XFRD_FILE_MAGIC_V2, XFRD_FILE_MAGIC};
+	xfrd_state_type* x, *y;
+	char magic[8];
+	FILE* in;
+	int i, m;
+
+	for(m=0; m<2; m++) {
+		x = xfrd_disk_start();
+		for(i=0; i<XFRD_DISK_NUMZONES; i++) {
+			xfrd_zone_type* zone = xfrd_disk_zone(x, i);
+			xfrd_disk_set(x, i, 10+i);
+			zone->soa_nsd_acquired = xfrd_time()-100;
+			zone->timeout.tv_sec = 3000;
+			if(m == 0)
+				zone->last_xfr_size = 0;
+		}
+		xfrd_disk_text_file(magics[m]);
+
+		y = xfrd_disk_read();
+		xfrd_disk_check(tc, x, y);
+		xfrd_disk_delete(x);
+
+		/* it is written as a binary file */
+		xfrd_disk_timers(y);
+		xfrd_disk_write(y);
+		in = fopen(xfrd_disk_file, "r");
+		CuAssertPtrNotNull(tc, in);
+		CuAssertTrue(tc, fread(magic, 1, sizeof(magic), in) ==
+			sizeof(magic));
+		fclose(in);
+		CuAssertTrue(tc, memcmp(magic, XFRD_FILE_MAGIC_BIN, 8) == 0);
+		x = xfrd_disk_read();
+		xfrd_disk_check(tc, y, x);
+		xfrd_disk_delete(x);
+		xfrd_disk_delete(y);
+		unlink(xfrd_disk_file);
+	}
+}
@@ -0,0 +1,401 @@
+/*
+	test xfrd.c, the udp sockets for the IXFR queries and the zone timers
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tpkg/cutest/cutest.h"
+#include "xfrd.h"
+#include "nsd.h"
+#include "options.h"
+#include "dname.h"
+#include "region-allocator.h"
+#include "buffer.h"
+#include "packet.h"
+#include "util.h"
+#include "tsig.h"
+
+static void xfrd_udp_one(CuTest *tc);
+static void xfrd_udp_share(CuTest *tc);
+static void xfrd_udp_age(CuTest *tc);
+static void xfrd_udp_timers(CuTest *tc);
+static void xfrd_udp_timer_jump(CuTest *tc);
+
+CuSuite* reg_cutest_xfrd_udp(void)
+{
+	CuSuite* suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, xfrd_udp_one);
+	SUITE_ADD_TEST(suite, xfrd_udp_share);
+	SUITE_ADD_TEST(suite, xfrd_udp_age);
+	SUITE_ADD_TEST(suite, xfrd_udp_timers);
+	SUITE_ADD_TEST(suite, xfrd_udp_timer_jump);
+	return suite;
+}
+
+#define XFRD_UDP_NUMZONES 6
+
+/** the socket of the master, that receives the queries */
+static int xfrd_udp_master = -1;
+
+/** create the master socket, on a free port of localhost */
+static int
+xfrd_udp_master_open(CuTest* tc)
+{
+	struct sockaddr_in sa;
+	socklen_t len = (socklen_t)sizeof(sa);
+	struct timeval tv;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	xfrd_udp_master = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	CuAssertTrue(tc, xfrd_udp_master != -1);
+	CuAssertTrue(tc, bind(xfrd_udp_master, (struct sockaddr*)&sa,
+		(socklen_t)sizeof(sa)) == 0);
+	CuAssertTrue(tc, getsockname(xfrd_udp_master, (struct sockaddr*)&sa,
+		&len) == 0);
+	/* a lost query fails the test, it does not hang it */
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	CuAssertTrue(tc, setsockopt(xfrd_udp_master, SOL_SOCKET, SO_RCVTIMEO,
+		&tv, (socklen_t)sizeof(tv)) == 0);
+	return (int)ntohs(sa.sin_port);
+}
+
+/** create an xfrd with the zones, that have the master on localhost */
+static xfrd_state_type*
+xfrd_udp_create(CuTest* tc, int share)
+{
+	region_type* region = region_create(xalloc, free);
+	struct nsd* n = (struct nsd*)region_alloc_zero(region,
+		sizeof(struct nsd));
+	struct pattern_options* pat = pattern_options_create(region);
+	struct acl_options* acl;
+	xfrd_state_type* x;
+	int i;
+
+	n->options = nsd_options_create(region);
+	n->options->xfrd_udp_share = share;
+	acl = (struct acl_options*)region_alloc_zero(region, sizeof(*acl));
+	acl->ip_address_spec = region_strdup(region, "127.0.0.1");
+	acl->addr.addr.s_addr = htonl(INADDR_LOOPBACK);
+	acl->port = xfrd_udp_master_open(tc);
+	acl->allow_udp = 1;
+	pat->request_xfr = acl;
+
+	x = (xfrd_state_type*)region_alloc_zero(region, sizeof(*x));
+	x->region = region;
+	x->nsd = n;
+	x->event_base = nsd_child_event_base();
+	x->packet = buffer_create(region, QIOBUFSZ);
+	x->got_time = 1;
+	x->current_time = time(NULL);
+	x->zones = rbtree_create(region,
+		(int (*)(const void *, const void *)) dname_compare);
+	xfrd = x;
+	for(i=0; i<XFRD_UDP_NUMZONES; i++) {
+		struct zone_options* zo = zone_options_create(region);
+		xfrd_zone_type* zone;
+		char name[32];
+		snprintf(name, sizeof(name), "zone%d.example.", i);
+		zo->name = region_strdup(region, name);
+		zo->node.key = dname_parse(region, name);
+		zo->pattern = pat;
+		xfrd_init_slave_zone(x, zo);
+		zone = (xfrd_zone_type*)rbtree_search(x->zones, zo->node.key);
+		/* it has the zone, so it asks for an IXFR over UDP */
+		zone->soa_disk.serial = htonl(1);
+		zone->soa_disk.refresh = htonl(86400);
+		zone->soa_disk.retry = htonl(3600);
+		zone->soa_disk.expire = htonl(2419200);
+		zone->soa_disk_acquired = x->current_time;
+		xfrd_deactivate_zone(zone);
+	}
+	return x;
+}
+
+/** delete the xfrd */
+static void
+xfrd_udp_delete(xfrd_state_type* x)
+{
+	xfrd_zone_type* zone;
+	struct xfrd_udp_sock* sock;
+	RBTREE_FOR(zone, xfrd_zone_type*, x->zones) {
+		tsig_delete_record(&zone->tsig, NULL);
+	}
+	for(sock = x->udp_socks; sock; sock = sock->next) {
+		event_del(&sock->handler);
+		close(sock->handler.ev_fd);
+	}
+	if(x->timer_added)
+		event_del(&x->timer_handler);
+	event_base_free(x->event_base);
+	region_destroy(x->region);
+	xfrd = NULL;
+	close(xfrd_udp_master);
+	xfrd_udp_master = -1;
+}
+
+/** the zone with the number */
+static xfrd_zone_type*
+xfrd_udp_zone(xfrd_state_type* x, int i)
+{
+	xfrd_zone_type* zone;
+	int n = 0;
+	RBTREE_FOR(zone, xfrd_zone_type*, x->zones) {
+		if(n++ == i)
+			return zone;
+	}
+	return NULL;
+}
+
+/** the number of open udp sockets */
+static int
+xfrd_udp_socks(xfrd_state_type* x)
+{
+	struct xfrd_udp_sock* sock;
+	int n = 0;
+	for(sock = x->udp_socks; sock; sock = sock->next)
+		n++;
+	return n;
+}
+
+/** receive the query of the zone at the master, return the source port */
+static int
+xfrd_udp_recv(CuTest* tc, xfrd_zone_type* zone)
+{
+	uint8_t buf[512];
+	struct sockaddr_in src;
+	socklen_t srclen = (socklen_t)sizeof(src);
+	ssize_t r = recvfrom(xfrd_udp_master, buf, sizeof(buf), 0,
+		(struct sockaddr*)&src, &srclen);
+	CuAssertTrue(tc, r >= QHEADERSZ);
+	CuAssertTrue(tc, zone->udp_sock != NULL);
+	CuAssertTrue(tc, ((buf[0]<<8)|buf[1]) == zone->query_id);
+	CuAssertTrue(tc, src.sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+	return (int)ntohs(src.sin_port);
+}
+
+/** query for all the zones, store the source ports */
+static void
+xfrd_udp_query_all(CuTest* tc, xfrd_state_type* x, int* port)
+{
+	int i;
+	for(i=0; i<XFRD_UDP_NUMZONES; i++) {
+		xfrd_zone_type* zone = xfrd_udp_zone(x, i);
+		xfrd_make_request(zone);
+		port[i] = xfrd_udp_recv(tc, zone);
+	}
+}
+
+/* by default every query has its own socket, and source port */
+static void
+xfrd_udp_one(CuTest *tc)
+{
+	xfrd_state_type* x = xfrd_udp_create(tc, 1);
+	int port[XFRD_UDP_NUMZONES];
+	int i, j;
+
+	xfrd_udp_query_all(tc, x, port);
+	CuAssertIntEquals(tc, XFRD_UDP_NUMZONES, xfrd_udp_socks(x));
+	CuAssertTrue(tc, x->udp_use_num == XFRD_UDP_NUMZONES);
+	for(i=0; i<XFRD_UDP_NUMZONES; i++) {
+		CuAssertTrue(tc, xfrd_udp_sock_retired(
+			xfrd_udp_zone(x, i)->udp_sock));
+		for(j=0; j<i; j++)
+			CuAssertTrue(tc, port[i] != port[j]);
+	}
+	/* the socket is closed with the end of its query */
+	for(i=0; i<XFRD_UDP_NUMZONES; i++) {
+		xfrd_udp_release(xfrd_udp_zone(x, i));
+		CuAssertIntEquals(tc, XFRD_UDP_NUMZONES-1-i,
+			xfrd_udp_socks(x));
+	}
+	CuAssertTrue(tc, x->udp_use_num == 0);
+	xfrd_udp_delete(x);
+}
+
+/* with xfrd-udp-share a socket takes that many queries */
+static void
+xfrd_udp_share(CuTest *tc)
+{
+	xfrd_state_type* x = xfrd_udp_create(tc, 3);
+	int port[XFRD_UDP_NUMZONES];
+	int i;
+
+	xfrd_udp_query_all(tc, x, port);
+	CuAssertIntEquals(tc, 2, xfrd_udp_socks(x));
+	CuAssertTrue(tc, port[0] == port[1] && port[1] == port[2]);
+	CuAssertTrue(tc, port[3] == port[4] && port[4] == port[5]);
+	CuAssertTrue(tc, port[0] != port[3]);
+	/* the queries on a socket have different IDs */
+	CuAssertTrue(tc, xfrd_udp_zone(x, 0)->query_id !=
+		xfrd_udp_zone(x, 1)->query_id);
+	CuAssertTrue(tc, xfrd_udp_zone(x, 0)->query_id !=
+		xfrd_udp_zone(x, 2)->query_id);
+	CuAssertTrue(tc, xfrd_udp_zone(x, 1)->query_id !=
+		xfrd_udp_zone(x, 2)->query_id);
+	CuAssertTrue(tc, xfrd_udp_sock_retired(xfrd_udp_zone(x, 0)->udp_sock));
+
+	/* a socket is closed when the last of its queries is done */
+	for(i=0; i<XFRD_UDP_NUMZONES; i++) {
+		xfrd_udp_release(xfrd_udp_zone(x, i));
+		CuAssertIntEquals(tc, (i<2?2:(i<5?1:0)), xfrd_udp_socks(x));
+	}
+	xfrd_udp_delete(x);
+}
+
+/* a socket takes no new queries after XFRD_UDP_SOCK_TIME seconds */
+static void
+xfrd_udp_age(CuTest *tc)
+{
+	xfrd_state_type* x = xfrd_udp_create(tc, 3);
+	xfrd_zone_type* z0 = xfrd_udp_zone(x, 0);
+	xfrd_zone_type* z1 = xfrd_udp_zone(x, 1);
+	xfrd_zone_type* z2 = xfrd_udp_zone(x, 2);
+	int p0, p1;
+
+	xfrd_make_request(z0);
+	p0 = xfrd_udp_recv(tc, z0);
+	CuAssertTrue(tc, !xfrd_udp_sock_retired(z0->udp_sock));
+	x->current_time += XFRD_UDP_SOCK_TIME - 1;
+	CuAssertTrue(tc, !xfrd_udp_sock_retired(z0->udp_sock));
+	x->current_time += 1;
+	CuAssertTrue(tc, xfrd_udp_sock_retired(z0->udp_sock));
+
+	/* the old socket is kept for the outstanding query */
+	xfrd_make_request(z1);
+	p1 = xfrd_udp_recv(tc, z1);
+	CuAssertTrue(tc, p0 != p1);
+	CuAssertTrue(tc, z0->udp_sock != z1->udp_sock);
+	CuAssertIntEquals(tc, 2, xfrd_udp_socks(x));
+	xfrd_udp_release(z0);
+	CuAssertIntEquals(tc, 1, xfrd_udp_socks(x));
+
+	/* the idle socket stays until it is too old, then it is closed
+	 * when the next socket is obtained */
+	xfrd_udp_release(z1);
+	CuAssertIntEquals(tc, 1, xfrd_udp_socks(x));
+	x->current_time += XFRD_UDP_SOCK_TIME;
+	xfrd_make_request(z2);
+	(void)xfrd_udp_recv(tc, z2);
+	CuAssertTrue(tc, z2->udp_sock->opened == x->current_time);
+	CuAssertIntEquals(tc, 1, xfrd_udp_socks(x));
+	xfrd_udp_release(z2);
+	xfrd_udp_delete(x);
+}
+
+/** advance the time to now, and run the tick of the timer wheel. The
+ * zones that fired have sent a query, that is received and released,
+ * and the time is stored in fired[] */
+static void
+xfrd_udp_tick(CuTest* tc, xfrd_state_type* x, time_t now, time_t* fired)
+{
+	int i, j, num = 0;
+	/* the tick is called here, and not from the event base */
+	if(x->timer_added)
+		event_del(&x->timer_handler);
+	x->current_time = now;
+	xfrd_handle_timer_wheel(-1, EV_TIMEOUT, NULL);
+	for(i=0; i<XFRD_UDP_NUMZONES; i++) {
+		if(!xfrd_udp_zone(x, i)->udp_sock)
+			continue;
+		CuAssertTrue(tc, fired[i] == 0);
+		fired[i] = now;
+		num++;
+	}
+	/* the queries arrive in the order the timers fired */
+	for(j=0; j<num; j++) {
+		uint8_t buf[512];
+		xfrd_zone_type* zone = NULL;
+		ssize_t r = recv(xfrd_udp_master, buf, sizeof(buf), 0);
+		CuAssertTrue(tc, r >= QHEADERSZ);
+		for(i=0; i<XFRD_UDP_NUMZONES; i++) {
+			xfrd_zone_type* z = xfrd_udp_zone(x, i);
+			if(z->udp_sock && z->query_id == ((buf[0]<<8)|buf[1]))
+				zone = z;
+		}
+		CuAssertPtrNotNull(tc, zone);
+		xfrd_udp_release(zone);
+	}
+	CuAssertTrue(tc, x->timer_added == (x->timer_num > 0));
+}
+
+/* the zone timers fire in the second they expire */
+static void
+xfrd_udp_timers(CuTest *tc)
+{
+	xfrd_state_type* x = xfrd_udp_create(tc, 1);
+	time_t fired[XFRD_UDP_NUMZONES];
+	time_t start = x->current_time, t;
+	time_t big = XFRD_TIMER_SLOTS*2 + 7;
+
+	memset(fired, 0, sizeof(fired));
+	xfrd_set_timer(xfrd_udp_zone(x, 0), 0);
+	xfrd_set_timer(xfrd_udp_zone(x, 1), 1);
+	xfrd_set_timer(xfrd_udp_zone(x, 2), 5);
+	xfrd_set_timer(xfrd_udp_zone(x, 3), 10);
+	/* later than the slots of the wheel, and randomized */
+	xfrd_set_timer(xfrd_udp_zone(x, 4), big);
+	/* set and unset, it does not fire */
+	xfrd_set_timer(xfrd_udp_zone(x, 5), 3);
+	CuAssertTrue(tc, x->timer_num == 6 && x->timer_added);
+	xfrd_unset_timer(xfrd_udp_zone(x, 5));
+	CuAssertTrue(tc, x->timer_num == 5);
+	/* set again, it replaces the time */
+	xfrd_set_timer(xfrd_udp_zone(x, 3), 4);
+	xfrd_set_timer(xfrd_udp_zone(x, 3), 10);
+	CuAssertTrue(tc, x->timer_num == 5);
+
+	for(t = start+1; t <= start+big; t++)
+		xfrd_udp_tick(tc, x, t, fired);
+	CuAssertTrue(tc, fired[0] == start+1);
+	CuAssertTrue(tc, fired[1] == start+1);
+	CuAssertTrue(tc, fired[2] == start+5);
+	CuAssertTrue(tc, fired[3] == start+10);
+	CuAssertTrue(tc, fired[4] >= start+big*9/10 && fired[4] <= start+big);
+	CuAssertTrue(tc, fired[5] == 0);
+	CuAssertTrue(tc, x->timer_num == 0 && !x->timer_added);
+	xfrd_udp_delete(x);
+}
+
+/* the timers fire after the clock jumps, or the ticks were late */
+static void
+xfrd_udp_timer_jump(CuTest *tc)
+{
+	xfrd_state_type* x = xfrd_udp_create(tc, 1);
+	time_t fired[XFRD_UDP_NUMZONES];
+	time_t start = x->current_time;
+
+	memset(fired, 0, sizeof(fired));
+	xfrd_set_timer(xfrd_udp_zone(x, 0), 3);
+	xfrd_set_timer(xfrd_udp_zone(x, 1), 7);
+	xfrd_set_timer(xfrd_udp_zone(x, 2), XFRD_TIMER_SLOTS+100);
+	xfrd_set_timer(xfrd_udp_zone(x, 3), XFRD_TIMER_SLOTS*3);
+	/* a late tick, the timers of the seconds in between fire */
+	xfrd_udp_tick(tc, x, start+5, fired);
+	CuAssertTrue(tc, fired[0] == start+5);
+	CuAssertTrue(tc, fired[1] == 0);
+	/* the clock is set back, nothing fires before its time */
+	xfrd_udp_tick(tc, x, start-100, fired);
+	CuAssertTrue(tc, fired[1] == 0);
+	xfrd_udp_tick(tc, x, start+7, fired);
+	CuAssertTrue(tc, fired[1] == start+7);
+	CuAssertTrue(tc, fired[2] == 0);
+	/* a jump over the whole wheel */
+	xfrd_udp_tick(tc, x, start+XFRD_TIMER_SLOTS*4, fired);
+	CuAssertTrue(tc, fired[2] == start+XFRD_TIMER_SLOTS*4);
+	CuAssertTrue(tc, fired[3] == start+XFRD_TIMER_SLOTS*4);
+	CuAssertTrue(tc, x->timer_num == 0 && !x->timer_added);
+	xfrd_udp_delete(x);
+}
@@ -0,0 +1,140 @@
+/*
+	test the compact per zone statistics, struct nsdzst in nsd.h
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tpkg/cutest/cutest.h"
+#include "nsd.h"
+#include "namedb.h"
+#include "util.h"
+
+#ifdef USE_ZONE_STATS
+static void zonestat_1(CuTest *tc);
+static void zonestat_2(CuTest *tc);
+
+CuSuite* reg_cutest_zonestat(void)
+{
+	CuSuite* suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, zonestat_1);
+	SUITE_ADD_TEST(suite, zonestat_2);
+	return suite;
+}
+
+/** setup a server with zonestat arrays of num entries, not mmapped */
+static void
+zonestat_setup(struct nsd* n, size_t num)
+{
+	memset(n, 0, sizeof(*n));
+	n->zonestat[0] = xalloc_array_zero(num, sizeof(struct nsdzst));
+	n->zonestatrare[0] = xalloc_zero(sizeof(struct zonestat_rare));
+	n->zonestatrare[1] = xalloc_zero(sizeof(struct zonestat_rare));
+	n->zonestatnow = n->zonestat[0];
+	n->zonestatrarenow = n->zonestatrare[0];
+	n->zonestatsizenow = num;
+	zonestat_slot_init();
+}
+
+static void
+zonestat_delete(struct nsd* n)
+{
+	free(n->zonestat[0]);
+	free(n->zonestatrare[0]);
+	free(n->zonestatrare[1]);
+}
+
+/* count the same queries in the zonestats and in a struct nsdst, the
+ * expanded zonestats are the same */
+static void zonestat_1(CuTest *tc)
+{
+	struct nsd nsdv, *n = &nsdv;
+	zone_type zones[4];
+	zone_type* z;
+	struct nsdst want[4], got;
+	int i, ok = 1;
+	unsigned r = 12345;
+
+	zonestat_setup(n, 4);
+	memset(zones, 0, sizeof(zones));
+	memset(want, 0, sizeof(want));
+	for(i=0; i<4; i++)
+		zones[i].zonestatid = i;
+	for(i=0; i<100000; i++) {
+		int qtype, qclass, rcode, opcode, zi;
+		r = r*1103515245 + 12345;
+		zi = (r>>8)%4;
+		z = &zones[zi];
+		/* mostly common values, and some rare and out of range */
+		qtype = ((r>>12)%8 == 0)? (int)((r>>16)%300) : 1+(int)((r>>16)%2);
+		qclass = ((r>>14)%16 == 0)? 3 : 1;
+		rcode = (int)((r>>20)%20);
+		opcode = ((r>>24)%8 == 0)? (int)((r>>25)%8) : 0;
+		ZTATUP(n, z, qudp);
+		ZTATUP2(n, z, qtype, qtype);
+		ZTATUP2(n, z, qclass, qclass);
+		ZTATUP2(n, z, rcode, rcode);
+		ZTATUP2(n, z, opcode, opcode);
+		want[zi].qudp++;
+		want[zi].qtype[qtype < 256 ? qtype : 256]++;
+		want[zi].qclass[qclass < 3 ? qclass : 3]++;
+		want[zi].rcode[rcode < 16 ? rcode : 16]++;
+		want[zi].opcode[opcode < 5 ? opcode : 5]++;
+		if(zi == 2) {
+			ZTATUP(n, z, raxfr);
+			ZTATUP(n, z, truncated);
+			want[zi].raxfr++;
+			want[zi].truncated++;
+		}
+	}
+	/* a zone without stats, and out of bounds */
+	z = NULL;
+	ZTATUP(n, z, qudp);
+	z = &zones[0];
+	z->zonestatid = 10;
+	ZTATUP2(n, z, qtype, 1);
+
+	for(i=0; i<4; i++) {
+		memset(&got, 0, sizeof(got));
+		zonestat_add(&got, &n->zonestat[0][i], n->zonestatrare[0]);
+		if(memcmp(&got, &want[i], sizeof(got)) != 0)
+			ok = 0;
+	}
+	CuAssert(tc, "zonestat counts", ok);
+	CuAssert(tc, "zonestat size", sizeof(struct nsdzst) <
+		sizeof(struct nsdst)/4);
+	CuAssert(tc, "rare entries", n->zonestatrare[0]->used > 0 &&
+		n->zonestatrare[0]->used < 4*ZONESTAT_ARRAY_NUM &&
+		n->zonestatrare[0]->lost == 0);
+	zonestat_delete(n);
+}
+
+/* the rare table fills up */
+static void zonestat_2(CuTest *tc)
+{
+	struct nsd nsdv, *n = &nsdv;
+	zone_type zv, *z = &zv;
+	struct nsdst got;
+
+	zonestat_setup(n, 1);
+	memset(z, 0, sizeof(*z));
+	n->zonestatrare[0]->used = ZONESTAT_RARE_NUM - 1;
+	ZTATUP2(n, z, qtype, TYPE_NSEC);
+	ZTATUP2(n, z, qtype, TYPE_NSEC);
+	ZTATUP2(n, z, qtype, TYPE_NAPTR);
+	ZTATUP2(n, z, qtype, TYPE_A);
+	memset(&got, 0, sizeof(got));
+	zonestat_add(&got, &n->zonestat[0][0], n->zonestatrare[0]);
+	CuAssert(tc, "rare added", got.qtype[TYPE_NSEC] == 2);
+	CuAssert(tc, "rare lost", got.qtype[TYPE_NAPTR] == 0 &&
+		n->zonestatrare[0]->lost == 1);
+	CuAssert(tc, "common", got.qtype[TYPE_A] == 1);
+	/* the lost counts of both tables are reported */
+	n->zonestatrare[1]->lost = 2;
+	CuAssert(tc, "lost total", zonestat_lost(n) == 3);
+	zonestat_delete(n);
+}
+#endif /* USE_ZONE_STATS */
@@ -24,6 +24,9 @@ static void init_context(void *context,
 			 tsig_key_type *key);
 static void update(void *context, const void *data, size_t size);
 static void final(void *context, uint8_t *digest, size_t *size);
+static void *create_key_state(tsig_algorithm_type *algorithm,
+			      tsig_key_type *key);
+static void delete_key_state(void *state);
 
 #ifdef HAVE_EVP_MAC_CTX_NEW
 struct tsig_openssl_data {
@@ -33,13 +36,6 @@ struct tsig_openssl_data {
 	const char* digest;
 };
 
-struct tsig_openssl_context {
-	/* the evp mac context, if notNULL it has algo and key set. */
-	EVP_MAC_CTX* hmac_ctx;
-	/* the size of destination buffers */
-	size_t outsize;
-};
-
 static void
 cleanup_tsig_openssl_data(void *data)
 {
@@ -49,6 +45,20 @@ cleanup_tsig_openssl_data(void *data)
 }
 #endif
 
+struct tsig_openssl_context {
+#ifndef HAVE_EVP_MAC_CTX_NEW
+	/* the hmac context */
+	HMAC_CTX* hmac_ctx;
+#else
+	/* the evp mac context, if notNULL it has algo and key set. */
+	EVP_MAC_CTX* hmac_ctx;
+	/* the size of destination buffers */
+	size_t outsize;
+#endif
+	/* the serial of the key state that hmac_ctx is keyed with, or 0 */
+	uint32_t state_serial;
+};
+
 static int
 tsig_openssl_init_algorithm(region_type* region,
 	const char* digest, const char* name, const char* wireformat)
@@ -131,6 +141,8 @@ tsig_openssl_init_algorithm(region_type* region,
 	algorithm->hmac_init_context = init_context;
 	algorithm->hmac_update = update;
 	algorithm->hmac_final = final;
+	algorithm->hmac_create_key_state = create_key_state;
+	algorithm->hmac_delete_key_state = delete_key_state;
 	tsig_add_algorithm(algorithm);
 
 #ifdef HAVE_EVP_MAC_CTX_NEW
@@ -165,46 +177,129 @@ tsig_openssl_init(region_type *region)
 	return count;
 }
 
+#ifndef HAVE_EVP_MAC_CTX_NEW
+static HMAC_CTX*
+hmac_ctx_new(void)
+{
+#ifdef HAVE_HMAC_CTX_NEW
+	HMAC_CTX *ctx = HMAC_CTX_new();
+#else
+	HMAC_CTX *ctx = (HMAC_CTX *) malloc(sizeof(HMAC_CTX));
+#endif
+	if(!ctx)
+		return NULL;
+#ifdef HAVE_HMAC_CTX_RESET
+	HMAC_CTX_reset(ctx);
+#else
+	HMAC_CTX_init(ctx);
+#endif
+	return ctx;
+}
+
 static void
-cleanup_context(void *data)
+hmac_ctx_free(HMAC_CTX *ctx)
 {
-#ifndef HAVE_EVP_MAC_CTX_NEW
-	HMAC_CTX *context = (HMAC_CTX *) data;
 #ifdef HAVE_HMAC_CTX_NEW
-	HMAC_CTX_free(context);
+	HMAC_CTX_free(ctx);
 #else
-	HMAC_CTX_cleanup(context);
-	free(context);
+	HMAC_CTX_cleanup(ctx);
+	free(ctx);
 #endif
+}
 #else
+/** new EVP_MAC_CTX with the digest and key set */
+static EVP_MAC_CTX*
+hmac_ctx_new_keyed(struct tsig_openssl_data* algo_data, tsig_key_type *key)
+{
+	OSSL_PARAM params[3];
+	EVP_MAC_CTX* ctx = EVP_MAC_CTX_new(algo_data->mac);
+	if(!ctx) {
+		log_msg(LOG_ERR, "could not EVP_MAC_CTX_new");
+		return NULL;
+	}
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+		(char*)algo_data->digest, 0);
+	params[1] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+		key->data, key->size);
+	params[2] = OSSL_PARAM_construct_end();
+#ifdef HAVE_EVP_MAC_CTX_SET_PARAMS
+	if(EVP_MAC_CTX_set_params(ctx, params) <= 0) {
+		log_msg(LOG_ERR, "could not EVP_MAC_CTX_set_params");
+		EVP_MAC_CTX_free(ctx);
+		return NULL;
+	}
+#else
+	if(EVP_MAC_set_ctx_params(ctx, params) <= 0) {
+		log_msg(LOG_ERR, "could not EVP_MAC_set_ctx_params");
+		EVP_MAC_CTX_free(ctx);
+		return NULL;
+	}
+#endif
+	return ctx;
+}
+#endif
+
+static void
+cleanup_context(void *data)
+{
 	struct tsig_openssl_context* c = (struct tsig_openssl_context*)data;
+#ifndef HAVE_EVP_MAC_CTX_NEW
+	if(c->hmac_ctx)
+		hmac_ctx_free(c->hmac_ctx);
+#else
 	EVP_MAC_CTX_free(c->hmac_ctx);
-	c->hmac_ctx = NULL;
 #endif
+	c->hmac_ctx = NULL;
 }
 
 static void *
 create_context(region_type *region)
 {
+	struct tsig_openssl_context* context = region_alloc(region,
+		sizeof(*context));
+	memset(context, 0, sizeof(*context));
 #ifndef HAVE_EVP_MAC_CTX_NEW
-#ifdef HAVE_HMAC_CTX_NEW
-	HMAC_CTX *context = HMAC_CTX_new();
-#else
-	HMAC_CTX *context = (HMAC_CTX *) malloc(sizeof(HMAC_CTX));
+	context->hmac_ctx = hmac_ctx_new();
+	if(!context->hmac_ctx)
+		log_msg(LOG_ERR, "could not create HMAC context");
 #endif
 	region_add_cleanup(region, cleanup_context, context);
-#ifdef HAVE_HMAC_CTX_RESET
-	HMAC_CTX_reset(context);
+	return context;
+}
+
+/*
+ * The key state is an HMAC context that has the key set, and nothing
+ * hashed after that.  Key setup hashes the key (if it is longer than the
+ * block) and the inner and outer pads, that work is done once per key,
+ * instead of for every message.
+ */
+static void *
+create_key_state(tsig_algorithm_type *algorithm, tsig_key_type *key)
+{
+#ifndef HAVE_EVP_MAC_CTX_NEW
+	const EVP_MD *md = (const EVP_MD *) algorithm->data;
+	HMAC_CTX *state = hmac_ctx_new();
+	if(!state)
+		return NULL;
+	if(!HMAC_Init_ex(state, key->data, key->size, md, NULL)) {
+		hmac_ctx_free(state);
+		return NULL;
+	}
+	return state;
 #else
-	HMAC_CTX_init(context);
+	return hmac_ctx_new_keyed((struct tsig_openssl_data*)algorithm->data,
+		key);
 #endif
+}
+
+static void
+delete_key_state(void *state)
+{
+#ifndef HAVE_EVP_MAC_CTX_NEW
+	hmac_ctx_free((HMAC_CTX*)state);
 #else
-	struct tsig_openssl_context* context = region_alloc(region,
-		sizeof(*context));
-	memset(context, 0, sizeof(*context));
-	region_add_cleanup(region, cleanup_context, context);
+	EVP_MAC_CTX_free((EVP_MAC_CTX*)state);
 #endif
-	return context;
 }
 
 static void
@@ -212,43 +307,46 @@ init_context(void *context,
 			  tsig_algorithm_type *algorithm,
 			  tsig_key_type *key)
 {
+	struct tsig_openssl_context* c = (struct tsig_openssl_context*)context;
 #ifndef HAVE_EVP_MAC_CTX_NEW
-	HMAC_CTX *ctx = (HMAC_CTX *) context;
 	const EVP_MD *md = (const EVP_MD *) algorithm->data;
-	HMAC_Init_ex(ctx, key->data, key->size, md, NULL);
-#else
-	OSSL_PARAM params[3];
-	struct tsig_openssl_data* algo_data = (struct tsig_openssl_data*)
-		algorithm->data;
-	struct tsig_openssl_context* c = (struct tsig_openssl_context*)context;
-	if(c->hmac_ctx) {
-		EVP_MAC_CTX_free(c->hmac_ctx);
-	}
-	c->hmac_ctx = EVP_MAC_CTX_new(algo_data->mac);
-	if(!c->hmac_ctx) {
-		log_msg(LOG_ERR, "could not EVP_MAC_CTX_new");
-		return;
-	}
-	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
-		(char*)algo_data->digest, 0);
-	params[1] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
-		key->data, key->size);
-	params[2] = OSSL_PARAM_construct_end();
-#ifdef HAVE_EVP_MAC_CTX_SET_PARAMS
-	if(EVP_MAC_CTX_set_params(c->hmac_ctx, params) <= 0) {
-		log_msg(LOG_ERR, "could not EVP_MAC_CTX_set_params");
-		EVP_MAC_CTX_free(c->hmac_ctx);
-		c->hmac_ctx = NULL;
+	if(!c->hmac_ctx)
 		return;
+	if(key->state && key->state_algorithm == algorithm) {
+		/* restart from the inner pad state, or copy the key state
+		 * if the context had another key */
+		if(c->state_serial == key->state_serial) {
+			if(HMAC_Init_ex(c->hmac_ctx, NULL, 0, NULL, NULL))
+				return;
+		} else if(HMAC_CTX_copy(c->hmac_ctx, (HMAC_CTX*)key->state)) {
+			c->state_serial = key->state_serial;
+			return;
+		}
 	}
+	c->state_serial = 0;
+	HMAC_Init_ex(c->hmac_ctx, key->data, key->size, md, NULL);
 #else
-	if(EVP_MAC_set_ctx_params(hmac_ctx, params) <= 0) {
-		log_msg(LOG_ERR, "could not EVP_MAC_set_ctx_params");
+	if(key->state && key->state_algorithm == algorithm) {
+		/* restart from the inner pad state, or copy the key state
+		 * if the context had another key */
+		if(c->hmac_ctx && c->state_serial == key->state_serial) {
+			if(EVP_MAC_init(c->hmac_ctx, NULL, 0, NULL) > 0)
+				return;
+			log_msg(LOG_ERR, "could not EVP_MAC_init");
+		}
 		EVP_MAC_CTX_free(c->hmac_ctx);
-		c->hmac_ctx = NULL;
-		return;
+		c->hmac_ctx = EVP_MAC_CTX_dup((EVP_MAC_CTX*)key->state);
+		if(c->hmac_ctx) {
+			c->state_serial = key->state_serial;
+			c->outsize = algorithm->maximum_digest_size;
+			return;
+		}
+		log_msg(LOG_ERR, "could not EVP_MAC_CTX_dup");
 	}
-#endif
+	EVP_MAC_CTX_free(c->hmac_ctx);
+	c->state_serial = 0;
+	c->hmac_ctx = hmac_ctx_new_keyed((struct tsig_openssl_data*)
+		algorithm->data, key);
 	c->outsize = algorithm->maximum_digest_size;
 #endif
 }
@@ -256,11 +354,10 @@ init_context(void *context,
 static void
 update(void *context, const void *data, size_t size)
 {
+	struct tsig_openssl_context* c = (struct tsig_openssl_context*)context;
 #ifndef HAVE_EVP_MAC_CTX_NEW
-	HMAC_CTX *ctx = (HMAC_CTX *) context;
-	HMAC_Update(ctx, (unsigned char *) data, (int) size);
+	HMAC_Update(c->hmac_ctx, (unsigned char *) data, (int) size);
 #else
-	struct tsig_openssl_context* c = (struct tsig_openssl_context*)context;
 	if(EVP_MAC_update(c->hmac_ctx, data, size) <= 0) {
 		log_msg(LOG_ERR, "could not EVP_MAC_update");
 	}
@@ -270,13 +367,12 @@ update(void *context, const void *data, size_t size)
 static void
 final(void *context, uint8_t *digest, size_t *size)
 {
+	struct tsig_openssl_context* c = (struct tsig_openssl_context*)context;
 #ifndef HAVE_EVP_MAC_CTX_NEW
-	HMAC_CTX *ctx = (HMAC_CTX *) context;
 	unsigned len = (unsigned) *size;
-	HMAC_Final(ctx, digest, &len);
+	HMAC_Final(c->hmac_ctx, digest, &len);
 	*size = (size_t) len;
 #else
-	struct tsig_openssl_context* c = (struct tsig_openssl_context*)context;
 	if(EVP_MAC_final(c->hmac_ctx, digest, size, c->outsize) <= 0) {
 		log_msg(LOG_ERR, "could not EVP_MAC_final");
 	}
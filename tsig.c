@@ -17,7 +17,7 @@
 #include "dns.h"
 #include "packet.h"
 #include "query.h"
-#include "rbtree.h"
+#include "siphash.h"
 
 #if !defined(HAVE_SSL) || !defined(HAVE_CRYPTO_MEMCMP)
 /* we need fixed time compare */
@@ -76,13 +76,21 @@ int memcmp_fixedtime(const void *s1, const void *s2, size_t n)
 
 static region_type *tsig_region;
 
+/*
+ * The keys are in a hash table, by the wire format of the key name, that
+ * is lowercase for the key and for the TSIG RR that is looked up.
+ */
 struct tsig_key_table
 {
-	rbnode_type node; /* by dname */
+	struct tsig_key_table *next; /* in the bucket */
+	uint32_t hash;
 	tsig_key_type *key;
 };
 typedef struct tsig_key_table tsig_key_table_type;
-static rbtree_type *tsig_key_table;
+static tsig_key_table_type **tsig_key_table;
+static size_t tsig_key_table_size; /* number of buckets, power of 2 */
+static size_t tsig_key_table_count;
+#define TSIG_KEY_TABLE_INITIAL_SIZE 64
 
 struct tsig_algorithm_table
 {
@@ -140,17 +148,49 @@ tsig_digest_variables(tsig_record_type *tsig, int tsig_timers_only)
 	}
 }
 
-static int
-tree_dname_compare(const void* a, const void* b)
+/** hash of the key name.  The table only holds configured keys, so the
+ * SipHash key does not need to be secret, lookups of other names by an
+ * attacker cannot make the chains longer */
+static uint32_t
+tsig_key_hash(const dname_type *name)
 {
-	return dname_compare((const dname_type*)a, (const dname_type*)b);
+	static const uint8_t k[SIPHASH_KEY_SIZE] = { 0x74, 0x73, 0x69, 0x67,
+		0x6b, 0x65, 0x79, 0x73, 0x6e, 0x73, 0x64, 0x34, 0x31, 0x7a,
+		0x9e, 0x37 };
+	uint8_t h[SIPHASH_OUT_SIZE];
+	siphash24(k, dname_name(name), name->name_size, h);
+	return read_uint32(h);
+}
+
+static void
+tsig_key_table_grow(void)
+{
+	size_t newsize = tsig_key_table_size*2, i;
+	tsig_key_table_type **newtable = (tsig_key_table_type **)
+		region_alloc_array_zero(tsig_region, newsize,
+		sizeof(tsig_key_table_type*));
+	for(i = 0; i < tsig_key_table_size; i++) {
+		tsig_key_table_type *entry = tsig_key_table[i], *next;
+		for(; entry; entry = next) {
+			next = entry->next;
+			entry->next = newtable[entry->hash & (newsize-1)];
+			newtable[entry->hash & (newsize-1)] = entry;
+		}
+	}
+	region_recycle(tsig_region, tsig_key_table,
+		tsig_key_table_size*sizeof(tsig_key_table_type*));
+	tsig_key_table = newtable;
+	tsig_key_table_size = newsize;
 }
 
 int
 tsig_init(region_type *region)
 {
 	tsig_region = region;
-	tsig_key_table = rbtree_create(region, &tree_dname_compare);
+	tsig_key_table_size = TSIG_KEY_TABLE_INITIAL_SIZE;
+	tsig_key_table_count = 0;
+	tsig_key_table = (tsig_key_table_type **) region_alloc_array_zero(
+		region, tsig_key_table_size, sizeof(tsig_key_table_type*));
 	tsig_algorithm_table = NULL;
 
 #if defined(HAVE_SSL)
@@ -159,33 +199,86 @@ tsig_init(region_type *region)
 	return 1;
 }
 
+/** find the entry for the name, and the pointer to it in its bucket */
+static tsig_key_table_type**
+tsig_key_lookup(const dname_type *name, uint32_t hash)
+{
+	tsig_key_table_type **prev, *entry;
+	prev = &tsig_key_table[hash & (tsig_key_table_size-1)];
+	for(entry = *prev; entry; prev = &entry->next, entry = entry->next) {
+		if(entry->hash == hash &&
+			entry->key->name->name_size == name->name_size &&
+			memcmp(dname_name(entry->key->name), dname_name(name),
+			name->name_size) == 0)
+			return prev;
+	}
+	return NULL;
+}
+
 void
 tsig_add_key(tsig_key_type *key)
 {
-	tsig_key_table_type *entry = (tsig_key_table_type *) region_alloc_zero(
+	tsig_key_table_type *entry;
+	uint32_t hash = tsig_key_hash(key->name);
+	if(tsig_key_lookup(key->name, hash))
+		return; /* a key with that name is already in the table */
+	entry = (tsig_key_table_type *) region_alloc_zero(
 		tsig_region, sizeof(tsig_key_table_type));
 	entry->key = key;
-	entry->node.key = entry->key->name;
-	(void)rbtree_insert(tsig_key_table, &entry->node);
+	entry->hash = hash;
+	entry->next = tsig_key_table[hash & (tsig_key_table_size-1)];
+	tsig_key_table[hash & (tsig_key_table_size-1)] = entry;
+	if(++tsig_key_table_count > tsig_key_table_size)
+		tsig_key_table_grow();
+}
+
+void
+tsig_key_create_state(tsig_key_type *key, tsig_algorithm_type *algorithm)
+{
+	static uint32_t serial = 0;
+	tsig_key_delete_state(key);
+	if(!algorithm || !algorithm->hmac_create_key_state || !key->data)
+		return;
+	key->state = algorithm->hmac_create_key_state(algorithm, key);
+	if(!key->state)
+		return;
+	key->state_algorithm = algorithm;
+	/* zero is never used, that is the serial of unkeyed contexts */
+	if(++serial == 0)
+		serial = 1;
+	key->state_serial = serial;
+}
+
+void
+tsig_key_delete_state(tsig_key_type *key)
+{
+	if(key->state && key->state_algorithm)
+		key->state_algorithm->hmac_delete_key_state(key->state);
+	key->state = NULL;
+	key->state_algorithm = NULL;
+	key->state_serial = 0;
 }
 
 void
 tsig_del_key(tsig_key_type *key)
 {
-	tsig_key_table_type *entry;
+	tsig_key_table_type *entry, **prev;
 	if(!key) return;
-	entry = (tsig_key_table_type*)rbtree_delete(tsig_key_table, key->name);
-	if(!entry) return;
+	prev = tsig_key_lookup(key->name, tsig_key_hash(key->name));
+	if(!prev) return;
+	entry = *prev;
+	*prev = entry->next;
+	tsig_key_table_count--;
 	region_recycle(tsig_region, entry, sizeof(tsig_key_table_type));
 }
 
 tsig_key_type*
 tsig_find_key(const dname_type* name)
 {
-	tsig_key_table_type* entry;
-	entry = (tsig_key_table_type*)rbtree_search(tsig_key_table, name);
+	tsig_key_table_type** entry;
+	entry = tsig_key_lookup(name, tsig_key_hash(name));
 	if(entry)
-		return entry->key;
+		return (*entry)->key;
 	return NULL;
 }
 
@@ -310,6 +403,8 @@ tsig_create_record_custom(tsig_record_type *tsig, region_type *region,
 		large_object_size, initial_cleanup_size, 0);
 	if(region)
 		region_add_cleanup(region, tsig_cleanup, tsig);
+	tsig->context = NULL;
+	tsig->context_algorithm = NULL;
 	tsig_init_record(tsig, NULL, NULL);
 }
 
@@ -331,12 +426,11 @@ tsig_init_record(tsig_record_type *tsig,
 	tsig->error_code = TSIG_ERROR_NOERROR;
 	tsig->position = 0;
 	tsig->response_count = 0;
-	tsig->context = NULL;
 	tsig->algorithm = algorithm;
 	tsig->key = key;
 	tsig->prior_mac_size = 0;
-	tsig->prior_mac_data = NULL;
-	region_free_all(tsig->context_region);
+	/* the context is kept for the next messages, tsig_prepare makes
+	 * a new one if the algorithm is different */
 }
 
 int
@@ -419,8 +513,7 @@ tsig_from_query(tsig_record_type *tsig)
 		current_time_high = (uint16_t) (current_time >> 32);
 		current_time_low = (uint32_t) current_time;
 		tsig->other_size = 6;
-		tsig->other_data = (uint8_t *) region_alloc(
-			tsig->rr_region, sizeof(uint16_t) + sizeof(uint32_t));
+		tsig->other_data = tsig->other_data_buffer;
 		write_uint16(tsig->other_data, current_time_high);
 		write_uint32(tsig->other_data + 2, current_time_low);
 		return 0;
@@ -456,10 +549,12 @@ tsig_init_query(tsig_record_type *tsig, uint16_t original_query_id)
 void
 tsig_prepare(tsig_record_type *tsig)
 {
-	if (!tsig->context) {
+	if (!tsig->context || tsig->context_algorithm != tsig->algorithm) {
 		assert(tsig->algorithm);
+		region_free_all(tsig->context_region);
 		tsig->context = tsig->algorithm->hmac_create_context(
 			tsig->context_region);
+		tsig->context_algorithm = tsig->algorithm;
 		tsig->prior_mac_data = (uint8_t *) region_alloc(
 			tsig->context_region,
 			tsig->algorithm->maximum_digest_size);
@@ -592,9 +687,9 @@ tsig_parse_rr(tsig_record_type *tsig, buffer_type *packet)
 	tsig->algorithm_name = NULL;
 	tsig->mac_data = NULL;
 	tsig->other_data = NULL;
-	region_free_all(tsig->rr_region);
 
-	tsig->key_name = dname_make_from_packet(tsig->rr_region, packet, 1, 1);
+	tsig->key_name = dname_make_from_packet_buffered(
+		&tsig->key_name_buffer, packet, 1, 1);
 	if (!tsig->key_name) {
 		buffer_set_position(packet, tsig->position);
 		return 0;
@@ -624,8 +719,8 @@ tsig_parse_rr(tsig_record_type *tsig, buffer_type *packet)
 		return 0;
 	}
 
-	tsig->algorithm_name = dname_make_from_packet(
-		tsig->rr_region, packet, 1, 1);
+	tsig->algorithm_name = dname_make_from_packet_buffered(
+		&tsig->algorithm_name_buffer, packet, 1, 1);
 	if (!tsig->algorithm_name || !buffer_available(packet, 10)) {
 		buffer_set_position(packet, tsig->position);
 		return 0;
@@ -646,8 +741,9 @@ tsig_parse_rr(tsig_record_type *tsig, buffer_type *packet)
 		tsig->mac_size = 0;
 		return 0;
 	}
-	tsig->mac_data = (uint8_t *) region_alloc_init(
-		tsig->rr_region, buffer_current(packet), tsig->mac_size);
+	/* the mac is used in place, it is verified before the packet
+	 * is overwritten with the response */
+	tsig->mac_data = buffer_current(packet);
 	buffer_skip(packet, tsig->mac_size);
 	if (!buffer_available(packet, 6)) {
 		buffer_set_position(packet, tsig->position);
@@ -656,13 +752,15 @@ tsig_parse_rr(tsig_record_type *tsig, buffer_type *packet)
 	tsig->original_query_id = buffer_read_u16(packet);
 	tsig->error_code = buffer_read_u16(packet);
 	tsig->other_size = buffer_read_u16(packet);
-	if (!buffer_available(packet, tsig->other_size) || tsig->other_size > 16) {
+	if (!buffer_available(packet, tsig->other_size)
+		|| tsig->other_size > TSIG_OTHER_DATA_MAX) {
 		tsig->other_size = 0;
 		buffer_set_position(packet, tsig->position);
 		return 0;
 	}
-	tsig->other_data = (uint8_t *) region_alloc_init(
-		tsig->rr_region, buffer_current(packet), tsig->other_size);
+	memcpy(tsig->other_data_buffer, buffer_current(packet),
+		tsig->other_size);
+	tsig->other_data = tsig->other_data_buffer;
 	buffer_skip(packet, tsig->other_size);
 	tsig->status = TSIG_OK;
 	return 1;
@@ -729,8 +827,9 @@ tsig_reserved_space(tsig_record_type *tsig)
 void
 tsig_error_reply(tsig_record_type *tsig)
 {
-	if(tsig->mac_data)
-		memset(tsig->mac_data, 0, tsig->mac_size);
+	/* the mac_data can point into the packet, that now holds the
+	 * reply, so it is not cleared but left out */
+	tsig->mac_data = NULL;
 	tsig->mac_size = 0;
 }
 
@@ -22,6 +22,9 @@
 #define TSIG_ERROR_BADKEY   17
 #define TSIG_ERROR_BADTIME  18
 
+/* The maximum size of the TSIG other data that is parsed.  */
+#define TSIG_OTHER_DATA_MAX 16
+
 typedef struct tsig_algorithm tsig_algorithm_type;
 typedef struct tsig_key tsig_key_type;
 typedef struct tsig_record tsig_record_type;
@@ -90,6 +93,19 @@ struct tsig_algorithm
 	 * least maximum_digest_size bytes.
 	 */
 	void  (*hmac_final)(void *context, uint8_t *digest, size_t *size);
+
+	/*
+	 * Create the HMAC state for the key, with the key schedule done
+	 * (the inner and outer pads hashed), that contexts are initialized
+	 * from.  Returns NULL if that is not possible.
+	 */
+	void *(*hmac_create_key_state)(tsig_algorithm_type *algorithm,
+				       tsig_key_type *key);
+
+	/*
+	 * Delete the HMAC state for a key.
+	 */
+	void  (*hmac_delete_key_state)(void *state);
 };
 
 /*
@@ -100,6 +116,15 @@ struct tsig_key
 	const dname_type *name;
 	size_t            size;
 	uint8_t		 *data;
+
+	/*
+	 * The precomputed HMAC state for the key and its algorithm, or
+	 * NULL.  The serial is unique for every state that is made, so a
+	 * context can see that it has already been keyed with it.
+	 */
+	tsig_algorithm_type *state_algorithm;
+	void             *state;
+	uint32_t          state_serial;
 };
 
 struct tsig_record
@@ -109,12 +134,17 @@ struct tsig_record
 	size_t               response_count;
 	size_t               updates_since_last_prepare;
 	void                *context;
+	tsig_algorithm_type *context_algorithm;
 	tsig_algorithm_type *algorithm;
 	tsig_key_type       *key;
 	size_t               prior_mac_size;
 	uint8_t             *prior_mac_data;
 
-	/* TSIG RR data is allocated in the rr_region.  */
+	/*
+	 * The parsed TSIG RR names are stored in the name buffers, the
+	 * mac_data points into the packet that was parsed, it is valid
+	 * until the packet is overwritten by the response.
+	 */
 	region_type      *rr_region;
 	region_type	 *context_region;
 	const dname_type *key_name;
@@ -128,6 +158,9 @@ struct tsig_record
 	uint16_t          error_code;
 	uint16_t          other_size;
 	uint8_t          *other_data;
+	struct dname_buffer key_name_buffer;
+	struct dname_buffer algorithm_name_buffer;
+	uint8_t           other_data_buffer[TSIG_OTHER_DATA_MAX];
 };
 
 /*
@@ -142,6 +175,20 @@ int tsig_init(region_type *region);
 void tsig_add_key(tsig_key_type *key);
 void tsig_del_key(tsig_key_type *key);
 
+/*
+ * Find the key by its (normalized) name in the TSIG key table.
+ */
+tsig_key_type *tsig_find_key(const dname_type *name);
+
+/*
+ * Make the precomputed HMAC state for the key, for use with the
+ * algorithm.  Call it after the key data is set up, the state is
+ * deleted with tsig_key_delete_state before the key data changes.
+ */
+void tsig_key_create_state(tsig_key_type *key,
+			   tsig_algorithm_type *algorithm);
+void tsig_key_delete_state(tsig_key_type *key);
+
 /*
  * Add the specified algorithm to the TSIG algorithm table.
  */
@@ -31,7 +31,7 @@
 static void move_xl_segment(void* base, udb_base* udb, udb_void xl,
 	udb_void n, uint64_t sz, uint64_t startseg);
 /** attempt to compact the data and move free space to the end */
-static int udb_alloc_compact(void* base, udb_alloc* alloc);
+static int udb_alloc_compact(void* base, udb_alloc* alloc, uint64_t budget);
 
 /** convert pointer to the data part to a pointer to the base of the chunk */
 static udb_void
@@ -206,7 +206,7 @@ udb_base_create_fd(const char* fname, int fd, udb_walk_relptr_func walkfunc,
 	}
 	if(r) {
 		/* and compact now, or resume compacting */
-		udb_alloc_compact(udb, udb->alloc);
+		udb_alloc_compact(udb->base, udb->alloc, 0);
 		udb_base_sync(udb, 1);
 	}
 	udb->glob_data->clean_close = 0;
@@ -375,6 +375,20 @@ void udb_base_sync(udb_base* udb, int wait)
 #endif
 }
 
+void udb_base_release(udb_base* udb)
+{
+	if(!udb) return;
+#if defined(HAVE_MMAP) && defined(MADV_DONTNEED)
+	/* start the write of the dirty pages, the shared pages stay in the
+	 * page cache when they are dropped from the map */
+	udb_base_sync(udb, 0);
+	if(madvise(udb->base, udb->base_size, MADV_DONTNEED) != 0) {
+		VERBOSITY(3, (LOG_INFO, "madvise(%s) error %s",
+			udb->fname, strerror(errno)));
+	}
+#endif
+}
+
 /** hash a chunk pointer */
 static uint32_t
 chunk_hash_ptr(udb_void p)
@@ -405,6 +419,7 @@ grow_ram_hash(udb_base* udb, udb_ptr** newhash)
 	size_t i;
 	size_t osize= udb->ram_size;
 	udb_ptr* p, *np;
+	uint32_t ni;
 	udb_ptr** oldhash = udb->ram_hash;
 	udb->ram_size *= 2;
 	udb->ram_mask <<= 1;
@@ -416,9 +431,11 @@ grow_ram_hash(udb_base* udb, udb_ptr** newhash)
 		while(p) {
 			np = p->next;
 			/* link into newhash */
+			ni = chunk_hash_ptr(p->data)&udb->ram_mask;
 			p->prev=NULL;
-			p->next=newhash[chunk_hash_ptr(p->data)&udb->ram_mask];
+			p->next=newhash[ni];
 			if(p->next) p->next->prev = p;
+			newhash[ni] = p;
 			/* go to next element of oldhash */
 			p = np;
 		}
@@ -587,6 +604,26 @@ udb_base_grow_and_remap(udb_base* udb, uint64_t nsize)
 
 	assert(nsize > 0);
 	udb->glob_data->dirty_alloc = udb_dirty_fsize;
+#ifdef HAVE_POSIX_FALLOCATE
+	/* allocate the new extent in one go, so that the filesystem can
+	 * give it contiguous blocks, and later stores into the mmap do
+	 * not fail with SIGBUS because the disk is full */
+	if(nsize > udb->glob_data->fsize) {
+		int r = posix_fallocate(udb->fd, (off_t)udb->glob_data->fsize,
+			(off_t)(nsize - udb->glob_data->fsize));
+		if(r == 0) {
+			udb->glob_data->fsize = nsize;
+			udb->glob_data->dirty_alloc = udb_dirty_clean;
+			return udb_base_remap(udb, udb->alloc, nsize);
+		}
+		if(r != EINVAL && r != EOPNOTSUPP) {
+			log_msg(LOG_ERR, "grow(%s, size %u) error %s",
+				udb->fname, (unsigned)nsize, strerror(r));
+			return 0;
+		}
+		/* not supported by the filesystem, grow sparse file */
+	}
+#endif /* HAVE_POSIX_FALLOCATE */
 #ifdef HAVE_PWRITE
 	if((w=pwrite(udb->fd, &z, sizeof(z), (off_t)(nsize-1))) == -1) {
 #else
@@ -1288,6 +1325,16 @@ udb_alloc_exp_needed(size_t sz)
 	return udb_exp_size(asz);
 }
 
+uint64_t udb_alloc_space_needed(size_t sz)
+{
+	int exp = udb_alloc_exp_needed(sz);
+	if(exp == UDB_EXP_XL) {
+		uint64_t asz = sz + sizeof(udb_xl_chunk_d) + sizeof(uint64_t)*2;
+		return (asz+UDB_ALLOC_CHUNK_SIZE-1)&(~(UDB_ALLOC_CHUNK_SIZE-1));
+	}
+	return (uint64_t)1<<exp;
+}
+
 udb_void udb_alloc_space(udb_alloc* alloc, size_t sz)
 {
 	void* base = alloc->udb->base;
@@ -1553,9 +1600,20 @@ coagulate_and_push(void* base, udb_alloc* alloc, udb_void last, int exp,
 	return last;
 }
 
-/** attempt to compact the data and move free space to the end */
-int
-udb_alloc_compact(void* base, udb_alloc* alloc)
+/** see if the compaction step has moved its budget of chunk data */
+static int
+compact_budget_spent(uint64_t budget, uint64_t moved)
+{
+	/* always move at least one chunk (or XL list), so that every step
+	 * makes progress, even if that chunk is larger than the budget */
+	return budget != 0 && moved != 0 && moved >= budget;
+}
+
+/** compact data to the front, move at most budget bytes (0 is unlimited).
+ * returns false if it stopped because the budget was used up */
+static int
+udb_alloc_compact_work(void* base, udb_alloc* alloc, uint64_t budget,
+	uint64_t* moved)
 {
 	udb_void last;
 	int exp, e2;
@@ -1563,9 +1621,6 @@ udb_alloc_compact(void* base, udb_alloc* alloc)
 	uint64_t at = alloc->disk->nextgrow;
 	udb_void xl_start = 0;
 	uint64_t xl_sz = 0;
-	if(alloc->udb->inhibit_compact)
-		return 1;
-	alloc->udb->useful_compact = 0;
 	while(at > alloc->udb->glob_data->hsize) {
 		/* grab last entry */
 		exp = (int)*((uint8_t*)UDB_REL(base, at-1));
@@ -1589,10 +1644,13 @@ udb_alloc_compact(void* base, udb_alloc* alloc)
 				 * shift the later part(s) and continue */
 				uint64_t m = xl_start - (xl+xlsz);
 				assert(xl_start > xl+xlsz);
+				if(compact_budget_spent(budget, *moved))
+					return 0;
 				alloc->udb->glob_data->dirty_alloc = udb_dirty_compact;
 				free_xl_space(base, alloc, xl+xlsz, m);
 				move_xl_list(base, alloc, xl_start, xl_sz, m);
 				alloc->udb->glob_data->dirty_alloc = udb_dirty_clean;
+				*moved += xl_sz;
 			}
 			xl_start = xl;
 			xl_sz += xlsz;
@@ -1621,6 +1679,8 @@ udb_alloc_compact(void* base, udb_alloc* alloc)
 		} else if( (e2=have_free_for(alloc, exp)) ) {
 			/* last entry can be allocated in free chunks
 			 * move it to its new position, adjust rel_ptrs */
+			if(compact_budget_spent(budget, *moved))
+				return 0;
 			alloc->udb->glob_data->dirty_alloc = udb_dirty_compact;
 			move_chunk(base, alloc, last, exp, esz, e2);
 			if(xl_start) {
@@ -1635,6 +1695,7 @@ udb_alloc_compact(void* base, udb_alloc* alloc)
 			alloc->udb->glob_data->rb_new = 0;
 			alloc->udb->glob_data->rb_size = 0;
 			alloc->udb->glob_data->dirty_alloc = udb_dirty_clean;
+			*moved += esz;
 			/* and continue in front of it */
 			at = last;
 		} else {
@@ -1666,21 +1727,53 @@ udb_alloc_compact(void* base, udb_alloc* alloc)
 		}
 		if(m != 0) {
 			assert(at+m == xl_start);
+			if(compact_budget_spent(budget, *moved))
+				return 0;
 			alloc->udb->glob_data->dirty_alloc = udb_dirty_compact;
 			free_xl_space(base, alloc, at, m);
 			move_xl_list(base, alloc, xl_start, xl_sz, m);
 			alloc->udb->glob_data->dirty_alloc = udb_dirty_clean;
+			*moved += xl_sz;
 		}
 	}
+	return 1;
+}
+
+/** attempt to compact the data and move free space to the end,
+ * the budget is the max number of bytes to move, 0 for no limit */
+int
+udb_alloc_compact(void* base, udb_alloc* alloc, uint64_t budget)
+{
+	struct timeval start, end;
+	uint64_t moved = 0;
+	int ret = 1;
+	if(alloc->udb->inhibit_compact)
+		return 1;
+	if(gettimeofday(&start, NULL) != 0)
+		start.tv_sec = 0;
+	/* if the budget runs out, there is more work for the next step */
+	alloc->udb->useful_compact = !udb_alloc_compact_work(base, alloc,
+		budget, &moved);
 
 	/* if enough free, shrink the file; re-mmap */
 	if(enough_free(alloc)) {
 		uint64_t nsize = alloc->disk->nextgrow;
 		udb_base_shrink(alloc->udb, nsize);
 		if(!udb_base_remap(alloc->udb, alloc, nsize))
-			return 0;
+			ret = 0;
 	}
-	return 1;
+
+	if(moved != 0) {
+		alloc->udb->compact_moved += moved;
+		if(start.tv_sec != 0 && gettimeofday(&end, NULL) == 0) {
+			int64_t d = ((int64_t)end.tv_sec-(int64_t)start.tv_sec)
+				*1000000 + ((int64_t)end.tv_usec -
+				(int64_t)start.tv_usec);
+			if(d > 0)
+				alloc->udb->compact_usec += (uint64_t)d;
+		}
+	}
+	return ret;
 }
 
 int
@@ -1689,7 +1782,23 @@ udb_compact(udb_base* udb)
 	if(!udb) return 1;
 	if(!udb->useful_compact) return 1;
 	DEBUG(DEBUG_DBACCESS, 1, (LOG_INFO, "Compacting database..."));
-	return udb_alloc_compact(udb->base, udb->alloc);
+	return udb_alloc_compact(udb->base, udb->alloc, 0);
+}
+
+int
+udb_compact_step(udb_base* udb, uint64_t budget)
+{
+	if(!udb) return 1;
+	if(!udb->useful_compact) return 1;
+	DEBUG(DEBUG_DBACCESS, 2, (LOG_INFO, "Compacting database step..."));
+	return udb_alloc_compact(udb->base, udb->alloc, budget);
+}
+
+int
+udb_compact_pending(udb_base* udb)
+{
+	if(!udb) return 0;
+	return udb->useful_compact && !udb->inhibit_compact;
 }
 
 void udb_compact_inhibited(udb_base* udb, int inhibit)
@@ -1778,7 +1887,7 @@ int udb_alloc_free(udb_alloc* alloc, udb_void r, size_t sz)
 			alloc->udb->useful_compact = 1;
 			return 1;
 		}
-		return udb_alloc_compact(base, alloc);
+		return udb_alloc_compact(base, alloc, 0);
 	}
 	/* it is a regular chunk of 2**exp size */
 	exp = (int)fp->exp;
@@ -1825,7 +1934,7 @@ int udb_alloc_free(udb_alloc* alloc, udb_void r, size_t sz)
 		alloc->udb->useful_compact = 1;
 		return 1;
 	}
-	return udb_alloc_compact(base, alloc);
+	return udb_alloc_compact(base, alloc, 0);
 }
 
 udb_void udb_alloc_init(udb_alloc* alloc, void* d, size_t sz)
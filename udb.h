@@ -69,6 +69,8 @@ typedef uint64_t udb_void;
 #define UDB_EXP_HEADER 0
 /** exp size used to mark XL(extralarge) allocations (in whole mbs) */
 #define UDB_EXP_XL 1
+/** amount of data moved by one incremental compaction step, 4 Mb */
+#define UDB_COMPACT_STEP_BUDGET ((uint64_t)4*1024*1024)
 
 typedef struct udb_ptr udb_ptr;
 /**
@@ -209,8 +211,13 @@ struct udb_base {
 
 	/** compaction is inhibited */
 	int inhibit_compact;
-	/** compaction is useful; deletions performed. */
+	/** compaction is useful; deletions performed, or a compaction
+	 * step ran out of budget and there is more to do. */
 	int useful_compact;
+	/** stats: time spent compacting, in microseconds */
+	uint64_t compact_usec;
+	/** stats: number of bytes of chunk data moved by compaction */
+	uint64_t compact_moved;
 };
 
 typedef enum udb_chunk_type udb_chunk_type;
@@ -404,6 +411,15 @@ void udb_base_free_keep_mmap(udb_base* udb);
  */
 void udb_base_sync(udb_base* udb, int wait);
 
+/**
+ * Release the mmapped pages from the resident memory of the process.
+ * Written pages are kept in the file, they are paged in again when used.
+ * Used while a big zone is read or written, so that the zone is not
+ * in memory twice, in the namedb and in the mmap.
+ * @param udb: the udb.
+ */
+void udb_base_release(udb_base* udb);
+
 /**
  * The mmap size is updated to reflect changes by another process.
  * @param udb: the udb.
@@ -463,6 +479,14 @@ void udb_base_unlink_ptr(udb_base* udb, udb_ptr* ptr);
  */
 int udb_exp_size(uint64_t amount);
 
+/**
+ * The size of the space in the file that is used to allocate sz bytes,
+ * the chunk with its header, rounded up to the chunk size.
+ * @param sz: size of the allocation.
+ * @return the space used in the file.
+ */
+uint64_t udb_alloc_space_needed(size_t sz);
+
 /**
  * Utility for alloc, what is the size that the current offset supports
  * as a maximum 2**x chunk.
@@ -564,6 +588,26 @@ int udb_alloc_grow(udb_alloc* alloc, size_t sz, size_t num);
  */
 int udb_compact(udb_base* udb);
 
+/**
+ * Perform a step of the compaction, that moves at most budget bytes of
+ * chunk data.  It always moves at least one chunk, so that repeated calls
+ * make progress.  Call it again while udb_compact_pending() is true, for
+ * example once per event loop iteration, to compact incrementally.
+ * can shrink the db, which calls sync on the db (for portability).
+ * @param udb: the udb base.
+ * @param budget: max number of bytes to move in this step, 0 for no limit.
+ * @return 0 on failure (to remap the (possibly) changed udb base).
+ */
+int udb_compact_step(udb_base* udb, uint64_t budget);
+
+/**
+ * See if compaction (or the remainder of a budgeted compaction) is
+ * useful and not inhibited.
+ * @param udb: the udb base, can be NULL.
+ * @return true if udb_compact_step has work to do.
+ */
+int udb_compact_pending(udb_base* udb);
+
 /** 
  * set the udb to inhibit or uninhibit compaction.  Does not perform
  * the compaction itself if enabled, for that call udb_compact.
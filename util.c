@@ -1005,6 +1005,7 @@ create_pretty_rr(struct region* region)
 	state->previous_owner_region = region_create(xalloc, free);
 	state->previous_owner = NULL;
 	state->previous_owner_origin = NULL;
+	state->previous_owner_domain = NULL;
         region_add_cleanup(region, cleanup_region,
 		state->previous_owner_region);
 	return state;
@@ -1032,8 +1033,10 @@ print_rr(FILE *out,
         const dname_type *owner = domain_dname(record->owner);
 	buffer_clear(output);
         if (state) {
-		if (!state->previous_owner
-			|| dname_compare(state->previous_owner, owner) != 0) {
+		/* the RRs of a domain are printed after each other */
+		if (record->owner != state->previous_owner_domain && (
+			!state->previous_owner
+			|| dname_compare(state->previous_owner, owner) != 0)) {
 			const dname_type *owner_origin
 				= dname_origin(rr_region, owner);
 			int origin_changed = (!state->previous_owner_origin
@@ -1045,19 +1048,23 @@ print_rr(FILE *out,
 			}
 
 			set_previous_owner(state, owner);
-			buffer_printf(output, "%s",
+			buffer_print_string(output,
 				dname_to_string(owner,
 					state->previous_owner_origin));
 			region_free_all(rr_region);
 		}
+		state->previous_owner_domain = record->owner;
 	} else {
-		buffer_printf(output, "%s", dname_to_string(owner, NULL));
+		buffer_print_string(output, dname_to_string(owner, NULL));
 	}
 
-	buffer_printf(output, "\t%lu\t%s\t%s",
-		(unsigned long) record->ttl,
-		rrclass_to_string(record->klass),
-		rrtype_to_string(record->type));
+	buffer_print_string(output, "\t");
+	buffer_print_u32(output, record->ttl);
+	buffer_print_string(output, "\t");
+	buffer_print_string(output, record->klass == CLASS_IN ? "IN" :
+		rrclass_to_string(record->klass));
+	buffer_print_string(output, "\t");
+	buffer_print_string(output, rrtype_to_string(record->type));
 
 	result = print_rdata(output, descriptor, record);
 	if (!result) {
@@ -1070,7 +1077,7 @@ print_rr(FILE *out,
 	}
 
 	if (result) {
-		buffer_printf(output, "\n");
+		buffer_print_string(output, "\n");
 		buffer_flip(output);
 		result = write_data(out, buffer_current(output),
 		buffer_remaining(output));
@@ -17,6 +17,7 @@
 struct rr;
 struct buffer;
 struct region;
+struct domain;
 
 #ifdef HAVE_SYSLOG_H
 #  include <syslog.h>
@@ -397,6 +398,8 @@ struct state_pretty_rr {
 	struct region *previous_owner_region;
 	const struct dname *previous_owner;
 	const struct dname *previous_owner_origin;
+	/* the domain of the previous owner, to skip the name compare */
+	const struct domain *previous_owner_domain;
 };
 struct state_pretty_rr* create_pretty_rr(struct region* region);
 /* print rr to file, returns 0 on failure(nothing is written) */
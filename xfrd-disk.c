@@ -15,11 +15,50 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 #include "xfrd-disk.h"
 #include "xfrd.h"
 #include "buffer.h"
 #include "nsd.h"
 #include "options.h"
+#include "lookup3.h"
+
+/* start of the binary state file */
+struct xfrd_state_header {
+	/* XFRD_FILE_MAGIC_BIN, without the terminating zero */
+	char magic[8];
+	/* XFRD_FILE_ENDIAN, the file is in host byte order */
+	uint32_t endian;
+	/* size of this header */
+	uint32_t hdrsize;
+};
+
+/* the state of a zone in the binary state file, the header is followed
+ * by these records.  A record is appended when the state of the zone
+ * has changed, and the last record for the zone is used. */
+struct xfrd_state_record {
+	/* length of the record, a multiple of 8 */
+	uint32_t len;
+	/* hash of the record after the filetime, it detects a broken
+	 * record, and if the zone changed since it was written */
+	uint32_t check;
+	/* time the record was written, the timeout is relative to it */
+	uint64_t filetime;
+	uint64_t last_xfr_size;
+	/* acquired time of soa_nsd, soa_disk and soa_notified */
+	int64_t soa_acquired[3];
+	uint32_t state, master_num, next_master, round_num, timeout, backoff;
+	/* followed by the apex, with a length octet, and the acquired soas,
+	 * with their dnames stored with a length octet, padded with zeroes
+	 * to a multiple of 8. */
+};
+/* the check starts after the filetime */
+#define XFRD_STATE_CHECK_OFFSET 16
+/* maximum size of a record */
+#define XFRD_STATE_RECORD_MAX 2048
 
 /* quick tokenizer, reads words separated by whitespace.
    No quoted strings. Comments are skipped (#... eol). */
@@ -62,6 +101,17 @@ xfrd_read_i32(FILE *in, uint32_t* v)
 	return 1;
 }
 
+static int
+xfrd_read_i64(FILE *in, uint64_t* v)
+{
+	char* p = xfrd_read_token(in);
+	if(!p)
+		return 0;
+
+	*v=(uint64_t)strtoull(p, NULL, 10);
+	return 1;
+}
+
 static int
 xfrd_read_time_t(FILE *in, time_t* v)
 {
@@ -139,40 +189,145 @@ xfrd_read_state_soa(FILE* in, const char* id_acquired,
 	return 1;
 }
 
-void
-xfrd_read_state(struct xfrd_state* xfrd)
+/* the state of a zone, as read from the state file */
+struct xfrd_state_entry {
+	uint32_t state, masnum, nextmas, round_num, timeout, backoff;
+	uint64_t last_xfr_size;
+	xfrd_soa_type soa_nsd, soa_disk, soa_notified;
+	time_t soa_nsd_acquired, soa_disk_acquired, soa_notified_acquired;
+};
+
+/* size of the state file that was read or written, the records are
+ * appended to it if it has not changed since */
+static off_t xfrd_state_size = 0;
+
+/* set the zone state from the state file, that was written at filetime */
+static void
+xfrd_restore_zone(const char* statefile, uint32_t filetime,
+	xfrd_zone_type* zone, struct xfrd_state_entry* e)
+{
+	time_t soa_refresh;
+	uint32_t timeout = e->timeout;
+	xfrd_soa_type incoming_soa;
+	time_t incoming_acquired;
+
+	if(e->soa_nsd_acquired>xfrd_time()+15 ||
+		e->soa_disk_acquired>xfrd_time()+15 ||
+		e->soa_notified_acquired>xfrd_time()+15)
+	{
+		log_msg(LOG_ERR, "xfrd: statefile %s contains"
+			" times in the future for zone %s. Ignoring.",
+			statefile, zone->apex_str);
+		return;
+	}
+	zone->state = e->state;
+	zone->master_num = e->masnum;
+	zone->next_master = e->nextmas;
+	zone->round_num = e->round_num;
+	zone->last_xfr_size = e->last_xfr_size;
+	zone->timeout.tv_sec = timeout;
+	zone->timeout.tv_usec = 0;
+	zone->fresh_xfr_timeout = e->backoff*XFRD_TRANSFER_TIMEOUT_START;
+
+	/* read the zone OK, now set the master properly */
+	zone->master = acl_find_num(zone->zone_options->pattern->
+		request_xfr, zone->master_num);
+	if(!zone->master) {
+		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: masters changed for zone %s",
+			zone->apex_str));
+		zone->master = zone->zone_options->pattern->request_xfr;
+		zone->master_num = 0;
+		zone->round_num = 0;
+	}
+
+	/*
+	 * There is no timeout,
+	 * or there is a notification,
+	 * or there is a soa && current time is past refresh point
+	 */
+	soa_refresh = ntohl(e->soa_disk.refresh);
+	if (soa_refresh > (time_t)zone->zone_options->pattern->max_refresh_time)
+		soa_refresh = zone->zone_options->pattern->max_refresh_time;
+	else if (soa_refresh < (time_t)zone->zone_options->pattern->min_refresh_time)
+		soa_refresh = zone->zone_options->pattern->min_refresh_time;
+	if(timeout == 0 || e->soa_notified_acquired != 0 ||
+		(e->soa_disk_acquired != 0 &&
+		(uint32_t)xfrd_time() - e->soa_disk_acquired
+			> (uint32_t)soa_refresh))
+	{
+		zone->state = xfrd_zone_refreshing;
+		xfrd_set_refresh_now(zone);
+	}
+	if(timeout != 0 && filetime + timeout < (uint32_t)xfrd_time()) {
+		/* timeout is in the past, refresh the zone */
+		timeout = 0;
+		if(zone->state == xfrd_zone_ok)
+			zone->state = xfrd_zone_refreshing;
+		xfrd_set_refresh_now(zone);
+	}
+
+	/* There is a soa && current time is past expiry point */
+	if(e->soa_disk_acquired!=0 &&
+		(uint32_t)xfrd_time() - e->soa_disk_acquired
+			> ntohl(e->soa_disk.expire))
+	{
+		zone->state = xfrd_zone_expired;
+		xfrd_set_refresh_now(zone);
+	}
+
+	/* there is a zone read and it matches what we had before */
+	if(zone->soa_nsd_acquired && zone->state != xfrd_zone_expired
+		&& zone->soa_nsd.serial == e->soa_nsd.serial) {
+		xfrd_deactivate_zone(zone);
+		zone->state = e->state;
+		xfrd_set_timer(zone,
+			within_refresh_bounds(zone, timeout));
+	}
+	if((zone->soa_nsd_acquired == 0 && e->soa_nsd_acquired == 0 &&
+		e->soa_disk_acquired == 0) ||
+		(zone->state != xfrd_zone_ok && timeout != 0)) {
+		/* but don't check now, because that would mean a
+		 * storm of attempts on some master servers */
+		xfrd_deactivate_zone(zone);
+		zone->state = e->state;
+		xfrd_set_timer(zone,
+			within_retry_bounds(zone, timeout));
+	}
+
+	/* handle as an incoming SOA. */
+	incoming_soa = zone->soa_nsd;
+	incoming_acquired = zone->soa_nsd_acquired;
+	zone->soa_nsd = e->soa_nsd;
+	zone->soa_disk = e->soa_disk;
+	zone->soa_notified = e->soa_notified;
+	zone->soa_nsd_acquired = e->soa_nsd_acquired;
+	/* we had better use what we got from starting NSD, not
+	 * what we store in this file, because the actual zone
+	 * contents trumps the contents of this cache */
+	/* zone->soa_disk_acquired = e->soa_disk_acquired; */
+	zone->soa_notified_acquired = e->soa_notified_acquired;
+	if (zone->state == xfrd_zone_expired)
+	{
+		xfrd_send_expire_notification(zone);
+	}
+	if(incoming_acquired != 0)
+		xfrd_handle_incoming_soa(zone, &incoming_soa, incoming_acquired);
+}
+
+/* read the text state file of a previous version, after the magic */
+static void
+xfrd_read_state_text(struct xfrd_state* xfrd, FILE* in, const char* magic)
 {
 	const char* statefile = xfrd->nsd->options->xfrdfile;
-	FILE *in;
 	uint32_t filetime = 0;
 	uint32_t numzones, i;
 	region_type *tempregion;
-	time_t soa_refresh;
+	int has_xfr_size = (strcmp(magic, XFRD_FILE_MAGIC) == 0);
+	char* p;
 
 	tempregion = region_create(xalloc, free);
 	if(!tempregion)
 		return;
-
-	in = fopen(statefile, "r");
-	if(!in) {
-		if(errno != ENOENT) {
-			log_msg(LOG_ERR, "xfrd: Could not open file %s for reading: %s",
-				statefile, strerror(errno));
-		} else {
-			DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: no file %s. refreshing all zones.",
-				statefile));
-		}
-		region_destroy(tempregion);
-		return;
-	}
-	if(!xfrd_read_check_str(in, XFRD_FILE_MAGIC)) {
-		/* older file version; reset everything */
-		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: file %s is old version. refreshing all zones.",
-			statefile));
-		fclose(in);
-		region_destroy(tempregion);
-		return;
-	}
 	if(!xfrd_read_check_str(in, "filetime:") ||
 	   !xfrd_read_i32(in, &filetime) ||
 	   (time_t)filetime > xfrd_time()+15 ||
@@ -181,58 +336,50 @@ xfrd_read_state(struct xfrd_state* xfrd)
 	{
 		log_msg(LOG_ERR, "xfrd: corrupt state file %s dated %d (now=%lld)",
 			statefile, (int)filetime, (long long)xfrd_time());
-		fclose(in);
 		region_destroy(tempregion);
 		return;
 	}
 
 	for(i=0; i<numzones; i++) {
-		char *p;
 		xfrd_zone_type* zone;
 		const dname_type* dname;
-		uint32_t state, masnum, nextmas, round_num, timeout, backoff;
-		xfrd_soa_type soa_nsd_read, soa_disk_read, soa_notified_read;
-		time_t soa_nsd_acquired_read,
-			soa_disk_acquired_read, soa_notified_acquired_read;
-		xfrd_soa_type incoming_soa;
-		time_t incoming_acquired;
+		struct xfrd_state_entry e;
 
 		if(nsd.signal_hint_shutdown) {
-			fclose(in);
 			region_destroy(tempregion);
 			return;
 		}
 
-		memset(&soa_nsd_read, 0, sizeof(soa_nsd_read));
-		memset(&soa_disk_read, 0, sizeof(soa_disk_read));
-		memset(&soa_notified_read, 0, sizeof(soa_notified_read));
+		memset(&e, 0, sizeof(e));
 
 		if(!xfrd_read_check_str(in, "zone:") ||
 		   !xfrd_read_check_str(in, "name:")  ||
 		   !(p=xfrd_read_token(in)) ||
 		   !(dname = dname_parse(tempregion, p)) ||
 		   !xfrd_read_check_str(in, "state:") ||
-		   !xfrd_read_i32(in, &state) || (state>2) ||
+		   !xfrd_read_i32(in, &e.state) || (e.state>2) ||
 		   !xfrd_read_check_str(in, "master:") ||
-		   !xfrd_read_i32(in, &masnum) ||
+		   !xfrd_read_i32(in, &e.masnum) ||
 		   !xfrd_read_check_str(in, "next_master:") ||
-		   !xfrd_read_i32(in, &nextmas) ||
+		   !xfrd_read_i32(in, &e.nextmas) ||
 		   !xfrd_read_check_str(in, "round_num:") ||
-		   !xfrd_read_i32(in, &round_num) ||
+		   !xfrd_read_i32(in, &e.round_num) ||
 		   !xfrd_read_check_str(in, "next_timeout:") ||
-		   !xfrd_read_i32(in, &timeout) ||
+		   !xfrd_read_i32(in, &e.timeout) ||
 		   !xfrd_read_check_str(in, "backoff:") ||
-		   !xfrd_read_i32(in, &backoff) ||
+		   !xfrd_read_i32(in, &e.backoff) ||
+		   (has_xfr_size &&
+		   (!xfrd_read_check_str(in, "last_xfr_size:") ||
+		   !xfrd_read_i64(in, &e.last_xfr_size))) ||
 		   !xfrd_read_state_soa(in, "soa_nsd_acquired:", "soa_nsd:",
-			&soa_nsd_read, &soa_nsd_acquired_read) ||
+			&e.soa_nsd, &e.soa_nsd_acquired) ||
 		   !xfrd_read_state_soa(in, "soa_disk_acquired:", "soa_disk:",
-			&soa_disk_read, &soa_disk_acquired_read) ||
+			&e.soa_disk, &e.soa_disk_acquired) ||
 		   !xfrd_read_state_soa(in, "soa_notify_acquired:", "soa_notify:",
-			&soa_notified_read, &soa_notified_acquired_read))
+			&e.soa_notified, &e.soa_notified_acquired))
 		{
 			log_msg(LOG_ERR, "xfrd: corrupt state file %s dated %d (now=%lld)",
 				statefile, (int)filetime, (long long)xfrd_time());
-			fclose(in);
 			region_destroy(tempregion);
 			return;
 		}
@@ -242,208 +389,311 @@ xfrd_read_state(struct xfrd_state* xfrd)
 			DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: state file has info for not configured zone %s", p));
 			continue;
 		}
-
-		if(soa_nsd_acquired_read>xfrd_time()+15 ||
-			soa_disk_acquired_read>xfrd_time()+15 ||
-			soa_notified_acquired_read>xfrd_time()+15)
-		{
-			log_msg(LOG_ERR, "xfrd: statefile %s contains"
-				" times in the future for zone %s. Ignoring.",
-				statefile, zone->apex_str);
-			continue;
-		}
-		zone->state = state;
-		zone->master_num = masnum;
-		zone->next_master = nextmas;
-		zone->round_num = round_num;
-		zone->timeout.tv_sec = timeout;
-		zone->timeout.tv_usec = 0;
-		zone->fresh_xfr_timeout = backoff*XFRD_TRANSFER_TIMEOUT_START;
-
-		/* read the zone OK, now set the master properly */
-		zone->master = acl_find_num(zone->zone_options->pattern->
-			request_xfr, zone->master_num);
-		if(!zone->master) {
-			DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: masters changed for zone %s",
-				zone->apex_str));
-			zone->master = zone->zone_options->pattern->request_xfr;
-			zone->master_num = 0;
-			zone->round_num = 0;
-		}
-
-		/*
-		 * There is no timeout,
-		 * or there is a notification,
-		 * or there is a soa && current time is past refresh point
-		 */
-		soa_refresh = ntohl(soa_disk_read.refresh);
-		if (soa_refresh > (time_t)zone->zone_options->pattern->max_refresh_time)
-			soa_refresh = zone->zone_options->pattern->max_refresh_time;
-		else if (soa_refresh < (time_t)zone->zone_options->pattern->min_refresh_time)
-			soa_refresh = zone->zone_options->pattern->min_refresh_time;
-		if(timeout == 0 || soa_notified_acquired_read != 0 ||
-			(soa_disk_acquired_read != 0 &&
-			(uint32_t)xfrd_time() - soa_disk_acquired_read
-				> (uint32_t)soa_refresh))
-		{
-			zone->state = xfrd_zone_refreshing;
-			xfrd_set_refresh_now(zone);
-		}
-		if(timeout != 0 && filetime + timeout < (uint32_t)xfrd_time()) {
-			/* timeout is in the past, refresh the zone */
-			timeout = 0;
-			if(zone->state == xfrd_zone_ok)
-				zone->state = xfrd_zone_refreshing;
-			xfrd_set_refresh_now(zone);
-		}
-
-		/* There is a soa && current time is past expiry point */
-		if(soa_disk_acquired_read!=0 &&
-			(uint32_t)xfrd_time() - soa_disk_acquired_read
-				> ntohl(soa_disk_read.expire))
-		{
-			zone->state = xfrd_zone_expired;
-			xfrd_set_refresh_now(zone);
-		} 
-
-		/* there is a zone read and it matches what we had before */
-		if(zone->soa_nsd_acquired && zone->state != xfrd_zone_expired
-			&& zone->soa_nsd.serial == soa_nsd_read.serial) {
-			xfrd_deactivate_zone(zone);
-			zone->state = state;
-			xfrd_set_timer(zone,
-				within_refresh_bounds(zone, timeout));
-		}	
-		if((zone->soa_nsd_acquired == 0 && soa_nsd_acquired_read == 0 &&
-			soa_disk_acquired_read == 0) ||
-			(zone->state != xfrd_zone_ok && timeout != 0)) {
-			/* but don't check now, because that would mean a
-			 * storm of attempts on some master servers */
-			xfrd_deactivate_zone(zone);
-			zone->state = state;
-			xfrd_set_timer(zone,
-				within_retry_bounds(zone, timeout));
-		}
-
-		/* handle as an incoming SOA. */
-		incoming_soa = zone->soa_nsd;
-		incoming_acquired = zone->soa_nsd_acquired;
-		zone->soa_nsd = soa_nsd_read;
-		zone->soa_disk = soa_disk_read;
-		zone->soa_notified = soa_notified_read;
-		zone->soa_nsd_acquired = soa_nsd_acquired_read;
-		/* we had better use what we got from starting NSD, not
-		 * what we store in this file, because the actual zone
-		 * contents trumps the contents of this cache */
-		/* zone->soa_disk_acquired = soa_disk_acquired_read; */
-		zone->soa_notified_acquired = soa_notified_acquired_read;
-		if (zone->state == xfrd_zone_expired)
-		{
-			xfrd_send_expire_notification(zone);
-		}
-		if(incoming_acquired != 0)
-			xfrd_handle_incoming_soa(zone, &incoming_soa, incoming_acquired);
+		xfrd_restore_zone(statefile, filetime, zone, &e);
 	}
 
-	if(!xfrd_read_check_str(in, XFRD_FILE_MAGIC)) {
+	if(!xfrd_read_check_str(in, magic)) {
 		log_msg(LOG_ERR, "xfrd: corrupt state file %s dated %d (now=%lld)",
 			statefile, (int)filetime, (long long)xfrd_time());
 		region_destroy(tempregion);
-		fclose(in);
 		return;
 	}
 
 	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: read %d zones from state file", (int)numzones));
-	fclose(in);
 	region_destroy(tempregion);
 }
 
-/* prints neato days hours and minutes. */
+/* the check of a record, over the bytes after the filetime */
+static uint32_t
+xfrd_state_record_check(uint8_t* rec, size_t len)
+{
+	return hashlittle(rec + XFRD_STATE_CHECK_OFFSET,
+		len - XFRD_STATE_CHECK_OFFSET, 0);
+}
+
+/* append the soa to the record, the dnames are stored with their length */
+static uint8_t*
+xfrd_state_write_soa(uint8_t* p, xfrd_soa_type* soa)
+{
+	memcpy(p, &soa->type, 2+2+4+2);
+	p += 2+2+4+2;
+	memcpy(p, soa->prim_ns, soa->prim_ns[0]+1);
+	p += soa->prim_ns[0]+1;
+	memcpy(p, soa->email, soa->email[0]+1);
+	p += soa->email[0]+1;
+	memcpy(p, &soa->serial, 5*4);
+	return p + 5*4;
+}
+
+/* read the soa from the record, false if it is broken */
+static int
+xfrd_state_read_soa(uint8_t** p, uint8_t* end, xfrd_soa_type* soa)
+{
+	uint8_t* q = *p;
+	if(end - q < 2+2+4+2+1)
+		return 0;
+	memcpy(&soa->type, q, 2+2+4+2);
+	q += 2+2+4+2;
+	if(end - q < q[0]+1+1)
+		return 0;
+	memcpy(soa->prim_ns, q, q[0]+1);
+	q += q[0]+1;
+	if(end - q < q[0]+1+5*4)
+		return 0;
+	memcpy(soa->email, q, q[0]+1);
+	q += q[0]+1;
+	memcpy(&soa->serial, q, 5*4);
+	*p = q + 5*4;
+	return 1;
+}
+
+/* make the record for the zone in rec, returns the length, the check is
+ * filled in but not the filetime */
+static size_t
+xfrd_state_record_make(xfrd_zone_type* zone, uint8_t* rec)
+{
+	struct xfrd_state_record* r = (struct xfrd_state_record*)rec;
+	uint8_t* p = rec + sizeof(*r);
+	size_t len;
+	memset(r, 0, sizeof(*r));
+	r->last_xfr_size = zone->last_xfr_size;
+	r->soa_acquired[0] = (int64_t)zone->soa_nsd_acquired;
+	r->soa_acquired[1] = (int64_t)zone->soa_disk_acquired;
+	r->soa_acquired[2] = (int64_t)zone->soa_notified_acquired;
+	r->state = (uint32_t)zone->state;
+	r->master_num = (uint32_t)zone->master_num;
+	r->next_master = (uint32_t)zone->next_master;
+	r->round_num = (uint32_t)zone->round_num;
+	r->timeout = (zone->timer_slot != -1)?
+		(uint32_t)zone->timeout.tv_sec:0;
+	r->backoff = zone->fresh_xfr_timeout/XFRD_TRANSFER_TIMEOUT_START;
+	*p++ = (uint8_t)zone->apex->name_size;
+	memcpy(p, dname_name(zone->apex), zone->apex->name_size);
+	p += zone->apex->name_size;
+	if(zone->soa_nsd_acquired)
+		p = xfrd_state_write_soa(p, &zone->soa_nsd);
+	if(zone->soa_disk_acquired)
+		p = xfrd_state_write_soa(p, &zone->soa_disk);
+	if(zone->soa_notified_acquired)
+		p = xfrd_state_write_soa(p, &zone->soa_notified);
+	/* pad to a multiple of 8 */
+	len = (size_t)(p - rec);
+	while(len%8 != 0)
+		rec[len++] = 0;
+	r->len = (uint32_t)len;
+	r->check = xfrd_state_record_check(rec, len);
+	return len;
+}
+
+/* parse the record, returns false if it is broken */
+static int
+xfrd_state_record_parse(uint8_t* rec, size_t avail,
+	struct xfrd_state_entry* e, uint8_t* apex)
+{
+	struct xfrd_state_record r;
+	uint8_t* p, *end;
+	if(avail < sizeof(r))
+		return 0;
+	memcpy(&r, rec, sizeof(r));
+	if(r.len < sizeof(r) || r.len%8 != 0 || r.len > avail ||
+		r.check != xfrd_state_record_check(rec, r.len) || r.state > 2)
+		return 0;
+	memset(e, 0, sizeof(*e));
+	e->state = r.state;
+	e->masnum = r.master_num;
+	e->nextmas = r.next_master;
+	e->round_num = r.round_num;
+	e->timeout = r.timeout;
+	e->backoff = r.backoff;
+	e->last_xfr_size = r.last_xfr_size;
+	e->soa_nsd_acquired = (time_t)r.soa_acquired[0];
+	e->soa_disk_acquired = (time_t)r.soa_acquired[1];
+	e->soa_notified_acquired = (time_t)r.soa_acquired[2];
+	p = rec + sizeof(r);
+	end = rec + r.len;
+	/* a record of only the fixed part has no apex */
+	if(p >= end || p[0] == 0 || end - p < p[0]+1)
+		return 0;
+	memset(apex, 0, MAXDOMAINLEN+1);
+	memcpy(apex, p+1, p[0]);
+	p += p[0]+1;
+	if((e->soa_nsd_acquired && !xfrd_state_read_soa(&p, end, &e->soa_nsd))
+		|| (e->soa_disk_acquired && !xfrd_state_read_soa(&p, end,
+		&e->soa_disk)) || (e->soa_notified_acquired &&
+		!xfrd_state_read_soa(&p, end, &e->soa_notified)))
+		return 0;
+	return 1;
+}
+
+/* the last record for a zone in the state file, records that are
+ * appended later replace the earlier ones */
+struct xfrd_state_last {
+	rbnode_type node;
+	xfrd_zone_type* zone;
+	uint8_t* rec;
+};
+
+/* read the binary state file, from memory */
 static void
-neato_timeout(FILE* out, const char* str, time_t secs)
+xfrd_read_state_records(struct xfrd_state* xfrd, uint8_t* data, size_t size)
 {
-	fprintf(out, "%s", str);
-	if(secs <= 0) {
-		fprintf(out, " %llds", (long long)secs);
+	const char* statefile = xfrd->nsd->options->xfrdfile;
+	struct xfrd_state_header hdr;
+	region_type* tempregion;
+	rbtree_type* last;
+	struct xfrd_state_last* l;
+	struct xfrd_state_entry e;
+	struct dname_buffer apexbuf;
+	uint8_t apex[MAXDOMAINLEN+1];
+	size_t pos, numrec = 0;
+
+	memcpy(&hdr, data, sizeof(hdr));
+	if(hdr.endian != XFRD_FILE_ENDIAN || hdr.hdrsize != sizeof(hdr)) {
+		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: file %s is from another "
+			"platform. refreshing all zones.", statefile));
 		return;
 	}
-	if(secs >= 3600*24) {
-		fprintf(out, " %lldd", (long long)(secs/(3600*24)));
-		secs = secs % (3600*24);
-	}
-	if(secs >= 3600) {
-		fprintf(out, " %lldh", (long long)(secs/3600));
-		secs = secs%3600;
-	}
-	if(secs >= 60) {
-		fprintf(out, " %lldm", (long long)(secs/60));
-		secs = secs%60;
+	tempregion = region_create(xalloc, free);
+	if(!tempregion)
+		return;
+	last = rbtree_create(tempregion,
+		(int (*)(const void *, const void *)) dname_compare);
+	pos = sizeof(hdr);
+	while(pos < size) {
+		xfrd_zone_type* zone;
+		const dname_type* dname;
+		if(!xfrd_state_record_parse(data+pos, size-pos, &e, apex) ||
+			!(dname = dname_make_buffered(&apexbuf, apex, 1))) {
+			/* the rest of the file is not used, and the next
+			 * write does not append to it */
+			log_msg(LOG_ERR, "xfrd: corrupt state file %s at "
+				"offset %lu, of %lu bytes", statefile,
+				(unsigned long)pos, (unsigned long)size);
+			break;
+		}
+		numrec++;
+		zone = (xfrd_zone_type*)rbtree_search(xfrd->zones, dname);
+		if(!zone) {
+			DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: state file has info for not configured zone %s", dname_to_string(dname, NULL)));
+		} else if((l=(struct xfrd_state_last*)rbtree_search(last,
+			zone->apex)) != NULL) {
+			l->rec = data+pos;
+		} else {
+			l = (struct xfrd_state_last*)region_alloc(tempregion,
+				sizeof(*l));
+			l->node.key = zone->apex;
+			l->zone = zone;
+			l->rec = data+pos;
+			(void)rbtree_insert(last, &l->node);
+		}
+		pos += ((struct xfrd_state_record*)(data+pos))->len;
 	}
-	if(secs > 0) {
-		fprintf(out, " %llds", (long long)secs);
+	if(pos == size)
+		xfrd_state_size = (off_t)size;
+
+	RBTREE_FOR(l, struct xfrd_state_last*, last) {
+		struct xfrd_state_record* r = (struct xfrd_state_record*)l->rec;
+		if(nsd.signal_hint_shutdown)
+			break;
+		if(!xfrd_state_record_parse(l->rec, r->len, &e, apex))
+			continue;
+		if((time_t)r->filetime > xfrd_time()+15) {
+			log_msg(LOG_ERR, "xfrd: state file %s has a record for "
+				"zone %s dated %lld (now=%lld)", statefile,
+				l->zone->apex_str, (long long)r->filetime,
+				(long long)xfrd_time());
+			continue;
+		}
+		xfrd_restore_zone(statefile, (uint32_t)r->filetime, l->zone,
+			&e);
+		/* if it does not change, the record is not written again */
+		l->zone->state_check = r->check;
 	}
+	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: read %d zones from %d records "
+		"in state file", (int)last->count, (int)numrec));
+	region_destroy(tempregion);
 }
 
-static void xfrd_write_dname(FILE* out, uint8_t* dname)
+void
+xfrd_read_state(struct xfrd_state* xfrd)
 {
-	uint8_t* d= dname+1;
-	uint8_t len = *d++;
-	uint8_t i;
-
-	if(dname[0]<=1) {
-		fprintf(out, ".");
+	const char* statefile = xfrd->nsd->options->xfrdfile;
+	FILE *in;
+	char magic[sizeof(XFRD_FILE_MAGIC_BIN)];
+	struct stat st;
+	uint8_t* data;
+	ssize_t r;
+	int fd;
+	char* p;
+
+	xfrd_state_size = 0;
+	fd = open(statefile, O_RDONLY);
+	if(fd == -1) {
+		if(errno != ENOENT) {
+			log_msg(LOG_ERR, "xfrd: Could not open file %s for reading: %s",
+				statefile, strerror(errno));
+		} else {
+			DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: no file %s. refreshing all zones.",
+				statefile));
+		}
 		return;
 	}
-
-	while(len)
-	{
-		assert(d - (dname+1) <= dname[0]);
-		for(i=0; i<len; i++)
-		{
-			uint8_t ch = *d++;
-			if (isalnum((unsigned char)ch) || ch == '-' || ch == '_') {
-				fprintf(out, "%c", ch);
-			} else if (ch == '.' || ch == '\\') {
-				fprintf(out, "\\%c", ch);
-			} else {
-				fprintf(out, "\\%03u", (unsigned int)ch);
-			}
+	if(fstat(fd, &st) == -1) {
+		log_msg(LOG_ERR, "xfrd: could not fstat %s: %s", statefile,
+			strerror(errno));
+		close(fd);
+		return;
+	}
+	if(st.st_size >= (off_t)sizeof(struct xfrd_state_header) &&
+		(r=read(fd, magic, sizeof(magic)-1)) == (ssize_t)sizeof(magic)-1
+		&& memcmp(magic, XFRD_FILE_MAGIC_BIN, sizeof(magic)-1) == 0) {
+		/* the binary file is mapped, and not parsed */
+#ifdef HAVE_MMAP
+		data = (uint8_t*)mmap(NULL, (size_t)st.st_size, PROT_READ,
+			MAP_SHARED, fd, (off_t)0);
+		if(data == MAP_FAILED) {
+			log_msg(LOG_ERR, "xfrd: could not mmap %s: %s",
+				statefile, strerror(errno));
+			close(fd);
+			return;
 		}
-		fprintf(out, ".");
-		len = *d++;
+		xfrd_read_state_records(xfrd, data, (size_t)st.st_size);
+		munmap(data, (size_t)st.st_size);
+#else
+		data = (uint8_t*)xalloc((size_t)st.st_size);
+		if(lseek(fd, (off_t)0, SEEK_SET) == -1 ||
+			read(fd, data, (size_t)st.st_size) != (ssize_t)st.st_size) {
+			log_msg(LOG_ERR, "xfrd: could not read %s: %s",
+				statefile, strerror(errno));
+			free(data);
+			close(fd);
+			return;
+		}
+		xfrd_read_state_records(xfrd, data, (size_t)st.st_size);
+		free(data);
+#endif /* HAVE_MMAP */
+		close(fd);
+		return;
 	}
-}
+	close(fd);
 
-static void
-xfrd_write_state_soa(FILE* out, const char* id,
-	xfrd_soa_type* soa, time_t soatime, const dname_type* ATTR_UNUSED(apex))
-{
-	fprintf(out, "\t%s_acquired: %d", id, (int)soatime);
-	if(!soatime) {
-		fprintf(out, "\n");
+	/* the text file of the previous versions */
+	in = fopen(statefile, "r");
+	if(!in) {
+		log_msg(LOG_ERR, "xfrd: Could not open file %s for reading: %s",
+			statefile, strerror(errno));
 		return;
 	}
-	neato_timeout(out, "\t# was", xfrd_time()-soatime);
-	fprintf(out, " ago\n");
-
-	fprintf(out, "\t%s: %u %u %u %u", id,
-		(unsigned)ntohs(soa->type), (unsigned)ntohs(soa->klass),
-		(unsigned)ntohl(soa->ttl), (unsigned)ntohs(soa->rdata_count));
-	fprintf(out, " ");
-	xfrd_write_dname(out, soa->prim_ns);
-	fprintf(out, " ");
-	xfrd_write_dname(out, soa->email);
-	fprintf(out, " %u", (unsigned)ntohl(soa->serial));
-	fprintf(out, " %u", (unsigned)ntohl(soa->refresh));
-	fprintf(out, " %u", (unsigned)ntohl(soa->retry));
-	fprintf(out, " %u", (unsigned)ntohl(soa->expire));
-	fprintf(out, " %u\n", (unsigned)ntohl(soa->minimum));
-	fprintf(out, "\t#");
-	neato_timeout(out, " refresh =", ntohl(soa->refresh));
-	neato_timeout(out, " retry =", ntohl(soa->retry));
-	neato_timeout(out, " expire =", ntohl(soa->expire));
-	neato_timeout(out, " minimum =", ntohl(soa->minimum));
-	fprintf(out, "\n");
+	if((p=xfrd_read_token(in)) && (strcmp(p, XFRD_FILE_MAGIC) == 0 ||
+		strcmp(p, XFRD_FILE_MAGIC_V2) == 0)) {
+		xfrd_read_state_text(xfrd, in, (strcmp(p, XFRD_FILE_MAGIC) == 0?
+			XFRD_FILE_MAGIC:XFRD_FILE_MAGIC_V2));
+	} else {
+		/* older file version; reset everything */
+		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: file %s is old version. refreshing all zones.",
+			statefile));
+	}
+	fclose(in);
 }
 
 void
@@ -451,70 +701,92 @@ xfrd_write_state(struct xfrd_state* xfrd)
 {
 	rbnode_type* p;
 	const char* statefile = xfrd->nsd->options->xfrdfile;
+	char tmpfile[1024];
+	uint64_t recbuf[XFRD_STATE_RECORD_MAX/8];
+	uint8_t* rec = (uint8_t*)recbuf;
+	struct xfrd_state_record* r = (struct xfrd_state_record*)rec;
+	struct xfrd_state_header hdr;
+	size_t len, live = sizeof(hdr), changed = 0, num = 0;
+	off_t size = 0;
+	struct stat st;
+	int rewrite;
 	FILE *out;
 	time_t now = xfrd_time();
 
-	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: write file %s", statefile));
-	out = fopen(statefile, "w");
+	/* the records of the zones that changed since the file was read or
+	 * written are appended; the file is written again when the old
+	 * records take up more space than the current ones */
+	for(p = rbtree_first(xfrd->zones); p && p!=RBTREE_NULL; p=rbtree_next(p))
+	{
+		xfrd_zone_type* zone = (xfrd_zone_type*)p;
+		len = xfrd_state_record_make(zone, rec);
+		live += len;
+		if(r->check != zone->state_check)
+			changed += len;
+	}
+	rewrite = (xfrd_state_size == 0 || stat(statefile, &st) == -1 ||
+		st.st_size != xfrd_state_size ||
+		(size_t)xfrd_state_size + changed > 2*live);
+
+	if(rewrite) {
+		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: write file %s", statefile));
+		snprintf(tmpfile, sizeof(tmpfile), "%s~", statefile);
+		out = fopen(tmpfile, "w");
+	} else {
+		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: append to file %s",
+			statefile));
+		out = fopen(statefile, "a");
+		size = xfrd_state_size;
+	}
+	xfrd_state_size = 0;
 	if(!out) {
 		log_msg(LOG_ERR, "xfrd: Could not open file %s for writing: %s",
-				statefile, strerror(errno));
+			(rewrite?tmpfile:statefile), strerror(errno));
 		return;
 	}
-
-	fprintf(out, "%s\n", XFRD_FILE_MAGIC);
-	fprintf(out, "# This file is written on exit by nsd xfr daemon.\n");
-	fprintf(out, "# This file contains slave zone information:\n");
-	fprintf(out, "# 	* timeouts (when was zone data acquired)\n");
-	fprintf(out, "# 	* state (OK, refreshing, expired)\n");
-	fprintf(out, "# 	* which master transfer to attempt next\n");
-	fprintf(out, "# The file is read on start (but not on reload) by nsd xfr daemon.\n");
-	fprintf(out, "# You can edit; but do not change statement order\n");
-	fprintf(out, "# and no fancy stuff (like quoted \"strings\").\n");
-	fprintf(out, "#\n");
-	fprintf(out, "# If you remove a zone entry, it will be refreshed.\n");
-	fprintf(out, "# This can be useful for an expired zone; it revives\n");
-	fprintf(out, "# the zone temporarily, from refresh-expiry time.\n");
-	fprintf(out, "# If you delete the file all slave zones are updated.\n");
-	fprintf(out, "#\n");
-	fprintf(out, "# Note: if you edit this file while nsd is running,\n");
-	fprintf(out, "#       it will be overwritten on exit by nsd.\n");
-	fprintf(out, "\n");
-	fprintf(out, "filetime: %lld\t# %s\n", (long long)now, ctime(&now));
-	fprintf(out, "# The number of zone entries in this file\n");
-	fprintf(out, "numzones: %d\n", (int)xfrd->zones->count);
-	fprintf(out, "\n");
+	if(rewrite) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, XFRD_FILE_MAGIC_BIN, sizeof(hdr.magic));
+		hdr.endian = XFRD_FILE_ENDIAN;
+		hdr.hdrsize = sizeof(hdr);
+		if(!write_data(out, &hdr, sizeof(hdr))) {
+			log_msg(LOG_ERR, "xfrd: could not write %s: %s",
+				tmpfile, strerror(errno));
+			fclose(out);
+			return;
+		}
+		size = sizeof(hdr);
+	}
 	for(p = rbtree_first(xfrd->zones); p && p!=RBTREE_NULL; p=rbtree_next(p))
 	{
 		xfrd_zone_type* zone = (xfrd_zone_type*)p;
-		fprintf(out, "zone: \tname: %s\n", zone->apex_str);
-		fprintf(out, "\tstate: %d", (int)zone->state);
-		fprintf(out, " # %s", zone->state==xfrd_zone_ok?"OK":(
-			zone->state==xfrd_zone_refreshing?"refreshing":"expired"));
-		fprintf(out, "\n");
-		fprintf(out, "\tmaster: %d\n", zone->master_num);
-		fprintf(out, "\tnext_master: %d\n", zone->next_master);
-		fprintf(out, "\tround_num: %d\n", zone->round_num);
-		fprintf(out, "\tnext_timeout: %d",
-			(zone->zone_handler_flags&EV_TIMEOUT)?(int)zone->timeout.tv_sec:0);
-		if((zone->zone_handler_flags&EV_TIMEOUT)) {
-			neato_timeout(out, "\t# =", zone->timeout.tv_sec);
+		len = xfrd_state_record_make(zone, rec);
+		if(!rewrite && r->check == zone->state_check)
+			continue;
+		r->filetime = (uint64_t)now;
+		if(!write_data(out, rec, len)) {
+			log_msg(LOG_ERR, "xfrd: could not write %s: %s",
+				(rewrite?tmpfile:statefile), strerror(errno));
+			fclose(out);
+			return;
 		}
-		fprintf(out, "\n");
-		fprintf(out, "\tbackoff: %d\n", zone->fresh_xfr_timeout/XFRD_TRANSFER_TIMEOUT_START);
-		xfrd_write_state_soa(out, "soa_nsd", &zone->soa_nsd,
-			zone->soa_nsd_acquired, zone->apex);
-		xfrd_write_state_soa(out, "soa_disk", &zone->soa_disk,
-			zone->soa_disk_acquired, zone->apex);
-		xfrd_write_state_soa(out, "soa_notify", &zone->soa_notified,
-			zone->soa_notified_acquired, zone->apex);
-		fprintf(out, "\n");
-	}
-
-	fprintf(out, "%s\n", XFRD_FILE_MAGIC);
-	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: written %d zones to state file",
-		(int)xfrd->zones->count));
-	fclose(out);
+		zone->state_check = r->check;
+		size += len;
+		num++;
+	}
+	if(fclose(out) != 0) {
+		log_msg(LOG_ERR, "xfrd: could not write %s: %s",
+			(rewrite?tmpfile:statefile), strerror(errno));
+		return;
+	}
+	if(rewrite && rename(tmpfile, statefile) == -1) {
+		log_msg(LOG_ERR, "xfrd: could not rename %s to %s: %s",
+			tmpfile, statefile, strerror(errno));
+		return;
+	}
+	xfrd_state_size = size;
+	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: written %d of %d zones to state file",
+		(int)num, (int)xfrd->zones->count));
 }
 
 /* return tempdirname */
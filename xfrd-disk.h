@@ -13,12 +13,19 @@
 struct xfrd_state;
 struct nsd;
 
-/* magic string to identify xfrd state file */
-#define XFRD_FILE_MAGIC "NSDXFRD2"
+/* magic string to identify the binary xfrd state file */
+#define XFRD_FILE_MAGIC_BIN "NSDXFRDB"
+/* to detect a file written with another byte order */
+#define XFRD_FILE_ENDIAN 0x01020304
+/* the previous versions of the file, in text, that are read on upgrade */
+#define XFRD_FILE_MAGIC "NSDXFRD3"
+/* previous version of the file, without the last transfer sizes */
+#define XFRD_FILE_MAGIC_V2 "NSDXFRD2"
 
 /* read from state file as many zones as possible (until error/eof).*/
 void xfrd_read_state(struct xfrd_state* xfrd);
-/* write xfrd zone state if possible */
+/* write xfrd zone state if possible, the zones that changed since the
+ * file was read or written are appended to it */
 void xfrd_write_state(struct xfrd_state* xfrd);
 
 /* create temp directory */
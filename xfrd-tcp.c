@@ -48,6 +48,36 @@ xfrd_pipe_cmp(const void* a, const void* b)
 	return (uintptr_t)x < (uintptr_t)y ? -1 : 1;
 }
 
+/* sort masters on IP address */
+static int
+xfrd_master_cmp(const void* a, const void* b)
+{
+	const struct xfrd_tcp_master* x = (struct xfrd_tcp_master*)a;
+	const struct xfrd_tcp_master* y = (struct xfrd_tcp_master*)b;
+	if(y->ip_len != x->ip_len)
+		return (int)y->ip_len - (int)x->ip_len;
+	return memcmp(&x->ip, &y->ip, x->ip_len);
+}
+
+/* sort waiting zones, most urgent transfer first.  Zones that expire
+ * sooner go first, then IXFR before AXFR, then the smallest transfer
+ * (by the size of the previous transfer), and then in order of arrival */
+static int
+xfrd_waiting_cmp(const void* a, const void* b)
+{
+	const xfrd_zone_type* x = (xfrd_zone_type*)a;
+	const xfrd_zone_type* y = (xfrd_zone_type*)b;
+	if(x->tcp_waiting_expire != y->tcp_waiting_expire)
+		return x->tcp_waiting_expire < y->tcp_waiting_expire ? -1 : 1;
+	if(x->tcp_waiting_axfr != y->tcp_waiting_axfr)
+		return x->tcp_waiting_axfr < y->tcp_waiting_axfr ? -1 : 1;
+	if(x->last_xfr_size != y->last_xfr_size)
+		return x->last_xfr_size < y->last_xfr_size ? -1 : 1;
+	if(x->tcp_waiting_seq != y->tcp_waiting_seq)
+		return x->tcp_waiting_seq < y->tcp_waiting_seq ? -1 : 1;
+	return 0;
+}
+
 struct xfrd_tcp_set* xfrd_tcp_set_create(struct region* region)
 {
 	int i;
@@ -55,11 +85,12 @@ struct xfrd_tcp_set* xfrd_tcp_set_create(struct region* region)
 		sizeof(struct xfrd_tcp_set));
 	memset(tcp_set, 0, sizeof(struct xfrd_tcp_set));
 	tcp_set->tcp_count = 0;
-	tcp_set->tcp_waiting_first = 0;
-	tcp_set->tcp_waiting_last = 0;
+	tcp_set->tcp_waiting_count = 0;
+	tcp_set->tcp_waiting_seq = 0;
 	for(i=0; i<XFRD_MAX_TCP; i++)
 		tcp_set->tcp_state[i] = xfrd_tcp_pipeline_create(region);
 	tcp_set->pipetree = rbtree_create(region, &xfrd_pipe_cmp);
+	tcp_set->mastertree = rbtree_create(region, &xfrd_master_cmp);
 	return tcp_set;
 }
 
@@ -243,17 +274,146 @@ pipeline_find(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
 	return r;
 }
 
-/* remove zone from tcp waiting list */
+/* find the master entry for the master of the zone, or create it */
+static struct xfrd_tcp_master*
+tcp_master_obtain(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
+{
+	struct xfrd_tcp_master key, *m;
+	key.node.key = &key;
+	key.ip_len = xfrd_acl_sockaddr_to(zone->master, &key.ip);
+	m = (struct xfrd_tcp_master*)rbtree_search(set->mastertree, &key);
+	if(m)
+		return m;
+	m = (struct xfrd_tcp_master*)region_alloc_zero(xfrd->region,
+		sizeof(*m));
+	memcpy(&m->ip, &key.ip, sizeof(m->ip));
+	m->ip_len = key.ip_len;
+	m->node.key = m;
+	m->waiting = rbtree_create(xfrd->region, &xfrd_waiting_cmp);
+	(void)rbtree_insert(set->mastertree, &m->node);
+	return m;
+}
+
+/* delete the master entry if no zone is active or waiting for it */
+static void
+tcp_master_release(struct xfrd_tcp_set* set, struct xfrd_tcp_master* m)
+{
+	if(m->num_active > 0 || m->waiting->count > 0)
+		return;
+	(void)rbtree_delete(set->mastertree, m);
+	region_recycle(xfrd->region, m->waiting, sizeof(*m->waiting));
+	region_recycle(xfrd->region, m, sizeof(*m));
+}
+
+/* is the master at the limit of transfers at the same time */
+static int
+tcp_master_full(struct xfrd_tcp_set* set, struct xfrd_tcp_master* m)
+{
+	return set->max_per_master > 0 &&
+		m->num_active >= set->max_per_master;
+}
+
+/* the zone stops using a tcp connection to its master */
+static void
+tcp_zone_master_done(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
+{
+	struct xfrd_tcp_master* m = zone->tcp_master;
+	assert(m && m->num_active > 0);
+	zone->tcp_master = NULL;
+	m->num_active--;
+	tcp_master_release(set, m);
+}
+
+/* does the zone request a full zone transfer (AXFR) */
+static int
+tcp_zone_wants_axfr(xfrd_zone_type* zone)
+{
+	return zone->soa_disk_acquired == 0 || zone->master->use_axfr_only ||
+		zone->master->ixfr_disabled ||
+		/* if zone expired, after the first round, do not ask for
+		 * IXFR any more, but full AXFR (of any serial number) */
+		(zone->state == xfrd_zone_expired && zone->round_num != 0);
+}
+
+/* add zone to the tcp waiting list of its master */
+static void
+tcp_zone_waiting_list_insert(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
+{
+	assert(zone->tcp_master && !zone->tcp_waiting);
+	/* zones without data, or that are expired, are most urgent */
+	if(zone->soa_disk_acquired == 0 || zone->state == xfrd_zone_expired)
+		zone->tcp_waiting_expire = 0;
+	else	zone->tcp_waiting_expire = (zone->soa_disk_acquired +
+			(time_t)ntohl(zone->soa_disk.expire)) /
+			XFRD_TCP_EXPIRE_PERIOD;
+	zone->tcp_waiting_axfr = tcp_zone_wants_axfr(zone);
+	zone->tcp_waiting_seq = set->tcp_waiting_seq++;
+	zone->tcp_waiting_since = xfrd_time();
+	zone->tcp_waiting_node.key = zone;
+	(void)rbtree_insert(zone->tcp_master->waiting,
+		&zone->tcp_waiting_node);
+	zone->tcp_waiting = 1;
+	set->tcp_waiting_count++;
+}
+
+/* remove zone from tcp waiting list, it keeps its tcp_master */
 static void
-tcp_zone_waiting_list_popfirst(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
+tcp_zone_waiting_list_delete(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
 {
 	assert(zone->tcp_waiting);
-	set->tcp_waiting_first = zone->tcp_waiting_next;
-	if(zone->tcp_waiting_next)
-		zone->tcp_waiting_next->tcp_waiting_prev = NULL;
-	else	set->tcp_waiting_last = 0;
-	zone->tcp_waiting_next = 0;
+	(void)rbtree_delete(zone->tcp_master->waiting, zone);
 	zone->tcp_waiting = 0;
+	set->tcp_waiting_count--;
+}
+
+void
+xfrd_tcp_waiting_remove(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
+{
+	struct xfrd_tcp_master* m = zone->tcp_master;
+	tcp_zone_waiting_list_delete(set, zone);
+	zone->tcp_master = NULL;
+	tcp_master_release(set, m);
+}
+
+/* the most urgent waiting zone that can start now; its master is below
+ * the limit and there is a free connection or a pipeline to the master */
+static xfrd_zone_type*
+tcp_waiting_find_startable(struct xfrd_tcp_set* set)
+{
+	struct xfrd_tcp_master* m;
+	xfrd_zone_type* best = NULL;
+	if(set->tcp_waiting_count == 0)
+		return NULL;
+	RBTREE_FOR(m, struct xfrd_tcp_master*, set->mastertree) {
+		xfrd_zone_type* zone;
+		if(m->waiting->count == 0 || tcp_master_full(set, m))
+			continue;
+		zone = (xfrd_zone_type*)rbtree_first(m->waiting)->key;
+		if(set->tcp_count >= XFRD_MAX_TCP &&
+			pipeline_find(set, zone) == NULL)
+			continue;
+		if(!best || xfrd_waiting_cmp(zone, best) < 0)
+			best = zone;
+	}
+	return best;
+}
+
+/* start waiting zones for which a connection or ID has become free */
+static void
+tcp_start_waiting(struct xfrd_tcp_set* set)
+{
+	xfrd_zone_type* zone;
+	/* if a zone fails to set-up or connect, the next is tried */
+	while((zone = tcp_waiting_find_startable(set)) != NULL) {
+		struct xfrd_tcp_master* m = zone->tcp_master;
+		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: zone %s waited %d "
+			"seconds for tcp", zone->apex_str,
+			(int)(xfrd_time() - zone->tcp_waiting_since)));
+		tcp_zone_waiting_list_delete(set, zone);
+		zone->tcp_master = NULL;
+		xfrd_tcp_obtain(set, zone);
+		tcp_master_release(set, m);
+	}
 }
 
 /* remove zone from tcp pipe write-wait list */
@@ -311,6 +471,7 @@ xfrd_tcp_pipe_stop(struct xfrd_tcp_pipeline* tp)
 			conn = zone->tcp_conn;
 			zone->tcp_conn = -1;
 			zone->tcp_waiting = 0;
+			tcp_zone_master_done(xfrd->tcp_set, zone);
 			tcp_pipe_sendlist_remove(tp, zone);
 			tcp_pipe_id_remove(tp, zone);
 			xfrd_set_refresh_now(zone);
@@ -373,6 +534,7 @@ pipeline_setup_new_zone(struct xfrd_tcp_set* set, struct xfrd_tcp_pipeline* tp,
 	/* assign the ID */
 	int idx;
 	assert(tp->num_unused > 0);
+	zone->tcp_master->num_active++;
 	/* we pick a random ID, even though it is TCP anyway */
 	idx = random_generate(tp->num_unused);
 	zone->query_id = tp->unused[idx];
@@ -404,12 +566,20 @@ void
 xfrd_tcp_obtain(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
 {
 	struct xfrd_tcp_pipeline* tp;
+	struct xfrd_tcp_master* m;
 	assert(zone->tcp_conn == -1);
 	assert(zone->tcp_waiting == 0);
 
-	if(set->tcp_count < XFRD_MAX_TCP) {
+	/* if there is no next master, fallback to use the first one */
+	if(!zone->master) {
+		zone->master = zone->zone_options->pattern->request_xfr;
+		zone->master_num = 0;
+	}
+	m = tcp_master_obtain(set, zone);
+	zone->tcp_master = m;
+
+	if(!tcp_master_full(set, m) && set->tcp_count < XFRD_MAX_TCP) {
 		int i;
-		assert(!set->tcp_waiting_first);
 		set->tcp_count ++;
 		/* find a free tcp_buffer */
 		for(i=0; i<XFRD_MAX_TCP; i++) {
@@ -420,6 +590,8 @@ xfrd_tcp_obtain(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
 		}
 		/** What if there is no free tcp_buffer? return; */
 		if (zone->tcp_conn < 0) {
+			zone->tcp_master = NULL;
+			tcp_master_release(set, m);
 			return;
 		}
 
@@ -427,11 +599,13 @@ xfrd_tcp_obtain(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
 		zone->tcp_waiting = 0;
 
 		/* stop udp use (if any) */
-		if(zone->zone_handler.ev_fd != -1)
+		if(zone->udp_sock)
 			xfrd_udp_release(zone);
 
 		if(!xfrd_tcp_open(set, tp, zone)) {
 			zone->tcp_conn = -1;
+			zone->tcp_master = NULL;
+			tcp_master_release(set, m);
 			set->tcp_count --;
 			xfrd_set_refresh_now(zone);
 			return;
@@ -455,9 +629,9 @@ xfrd_tcp_obtain(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
 		return;
 	}
 	/* check for a pipeline to the same master with unused ID */
-	if((tp = pipeline_find(set, zone))!= NULL) {
+	if(!tcp_master_full(set, m) && (tp = pipeline_find(set, zone))!= NULL) {
 		int i;
-		if(zone->zone_handler.ev_fd != -1)
+		if(zone->udp_sock)
 			xfrd_udp_release(zone);
 		for(i=0; i<XFRD_MAX_TCP; i++) {
 			if(set->tcp_state[i] == tp)
@@ -469,19 +643,16 @@ xfrd_tcp_obtain(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
 		return;
 	}
 
-	/* wait, at end of line */
-	DEBUG(DEBUG_XFRD,2, (LOG_INFO, "xfrd: max number of tcp "
-		"connections (%d) reached.", XFRD_MAX_TCP));
-	zone->tcp_waiting_next = 0;
-	zone->tcp_waiting_prev = set->tcp_waiting_last;
-	zone->tcp_waiting = 1;
-	if(!set->tcp_waiting_last) {
-		set->tcp_waiting_first = zone;
-		set->tcp_waiting_last = zone;
+	/* wait, in order of urgency */
+	if(tcp_master_full(set, m)) {
+		DEBUG(DEBUG_XFRD,2, (LOG_INFO, "xfrd: max number of "
+			"transfers (%d) to %s reached.", set->max_per_master,
+			zone->master->ip_address_spec));
 	} else {
-		set->tcp_waiting_last->tcp_waiting_next = zone;
-		set->tcp_waiting_last = zone;
+		DEBUG(DEBUG_XFRD,2, (LOG_INFO, "xfrd: max number of tcp "
+			"connections (%d) reached.", XFRD_MAX_TCP));
 	}
+	tcp_zone_waiting_list_insert(set, zone);
 	xfrd_deactivate_zone(zone);
 	xfrd_unset_timer(zone);
 }
@@ -596,11 +767,7 @@ xfrd_tcp_setup_write_packet(struct xfrd_tcp_pipeline* tp, xfrd_zone_type* zone)
 	assert(zone->tcp_conn != -1);
 	assert(zone->tcp_waiting == 0);
 	/* start AXFR or IXFR for the zone */
-	if(zone->soa_disk_acquired == 0 || zone->master->use_axfr_only ||
-		zone->master->ixfr_disabled ||
-		/* if zone expired, after the first round, do not ask for
-		 * IXFR any more, but full AXFR (of any serial number) */
-		(zone->state == xfrd_zone_expired && zone->round_num != 0)) {
+	if(tcp_zone_wants_axfr(zone)) {
 		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "request full zone transfer "
 						"(AXFR) for %s to %s",
 			zone->apex_str, zone->master->ip_address_spec));
@@ -941,6 +1108,7 @@ xfrd_tcp_release(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
 	assert(zone->tcp_waiting == 0);
 	zone->tcp_conn = -1;
 	zone->tcp_waiting = 0;
+	tcp_zone_master_done(set, zone);
 
 	/* remove from tcp_send list */
 	tcp_pipe_sendlist_remove(tp, zone);
@@ -949,39 +1117,18 @@ xfrd_tcp_release(struct xfrd_tcp_set* set, xfrd_zone_type* zone)
 		tcp_pipe_id_remove(tp, zone);
 	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: released tcp pipe now %d unused",
 		tp->num_unused));
-	/* if pipe was full, but no more, then see if waiting element is
-	 * for the same master, and can fill the unused ID */
-	if(tp->num_unused == 1 && set->tcp_waiting_first) {
-#ifdef INET6
-		struct sockaddr_storage to;
-#else
-		struct sockaddr_in to;
-#endif
-		socklen_t to_len = xfrd_acl_sockaddr_to(
-			set->tcp_waiting_first->master, &to);
-		if(to_len == tp->ip_len && memcmp(&to, &tp->ip, to_len) == 0) {
-			/* use this connection for the waiting zone */
-			zone = set->tcp_waiting_first;
-			assert(zone->tcp_conn == -1);
-			zone->tcp_conn = conn;
-			tcp_zone_waiting_list_popfirst(set, zone);
-			if(zone->zone_handler.ev_fd != -1)
-				xfrd_udp_release(zone);
-			xfrd_unset_timer(zone);
-			pipeline_setup_new_zone(set, tp, zone);
-			return;
-		}
-		/* waiting zone did not go to same server */
-	}
 
 	/* if all unused, or only skipped leftover, close the pipeline */
 	if(tp->num_unused >= ID_PIPE_NUM || tp->num_skip >= ID_PIPE_NUM - tp->num_unused)
 		xfrd_tcp_pipe_release(set, tp, conn);
+	/* the free ID, or the master below its limit, may let a waiting
+	 * zone start */
+	else	tcp_start_waiting(set);
 }
 
 void
 xfrd_tcp_pipe_release(struct xfrd_tcp_set* set, struct xfrd_tcp_pipeline* tp,
-	int conn)
+	int ATTR_UNUSED(conn))
 {
 	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: tcp pipe released"));
 	/* one handler per tcp pipe */
@@ -998,51 +1145,9 @@ xfrd_tcp_pipe_release(struct xfrd_tcp_set* set, struct xfrd_tcp_pipeline* tp,
 	/* remove from pipetree */
 	(void)rbtree_delete(xfrd->tcp_set->pipetree, &tp->node);
 
-	/* a waiting zone can use the free tcp slot (to another server) */
-	/* if that zone fails to set-up or connect, we try to start the next
-	 * waiting zone in the list */
-	while(set->tcp_count == XFRD_MAX_TCP && set->tcp_waiting_first) {
-		int i;
-
-		/* pop first waiting process */
-		xfrd_zone_type* zone = set->tcp_waiting_first;
-		/* start it */
-		assert(zone->tcp_conn == -1);
-		zone->tcp_conn = conn;
-		tcp_zone_waiting_list_popfirst(set, zone);
-
-		/* stop udp (if any) */
-		if(zone->zone_handler.ev_fd != -1)
-			xfrd_udp_release(zone);
-		if(!xfrd_tcp_open(set, tp, zone)) {
-			zone->tcp_conn = -1;
-			xfrd_set_refresh_now(zone);
-			/* try to start the next zone (if any) */
-			continue;
-		}
-		/* re-init this tcppipe */
-		/* ip and ip_len set by tcp_open */
-		tp->node.key = tp;
-		tp->num_unused = ID_PIPE_NUM;
-		tp->num_skip = 0;
-		tp->tcp_send_first = NULL;
-		tp->tcp_send_last = NULL;
-		memset(tp->id, 0, sizeof(tp->id));
-		for(i=0; i<ID_PIPE_NUM; i++) {
-			tp->unused[i] = i;
-		}
-
-		/* insert into tree */
-		(void)rbtree_insert(set->pipetree, &tp->node);
-		/* setup write */
-		xfrd_unset_timer(zone);
-		pipeline_setup_new_zone(set, tp, zone);
-		/* started a task, no need for cleanups, so return */
-		return;
-	}
-	/* no task to start, cleanup */
-	assert(!set->tcp_waiting_first);
 	set->tcp_count --;
 	assert(set->tcp_count >= 0);
+	/* a waiting zone can use the free tcp slot (to another server) */
+	tcp_start_waiting(set);
 }
 
@@ -35,8 +35,39 @@ struct xfrd_tcp_set {
 	int tcp_timeout;
 	/* rbtree with pipelines sorted by master */
 	rbtree_type* pipetree;
-	/* double linked list of zones waiting for a TCP connection */
-	struct xfrd_zone *tcp_waiting_first, *tcp_waiting_last;
+	/* rbtree with xfrd_tcp_master, sorted by master address */
+	rbtree_type* mastertree;
+	/* number of zones waiting for a TCP connection, for all masters */
+	int tcp_waiting_count;
+	/* arrival counter for zones that start to wait */
+	uint64_t tcp_waiting_seq;
+	/* max number of transfers per master at the same time, 0 no limit */
+	int max_per_master;
+};
+
+/* zones that expire within the same period of seconds are ordered on
+ * transfer type and size, instead of the exact time of expiry */
+#define XFRD_TCP_EXPIRE_PERIOD 3600
+
+/*
+ * The transfers for one master address.  Zones that cannot get a TCP
+ * connection wait in the tree of the master, most urgent transfer first.
+ * The entry exists while zones are active or waiting for the master.
+ */
+struct xfrd_tcp_master {
+	/* the rbtree node, sorted by IP address */
+	rbnode_type node;
+	/* address of the master */
+#ifdef INET6
+	struct sockaddr_storage ip;
+#else
+	struct sockaddr_in ip;
+#endif /* INET6 */
+	socklen_t ip_len;
+	/* number of zones with a transfer in a TCP pipeline to the master */
+	int num_active;
+	/* zones waiting for a TCP connection to the master */
+	rbtree_type* waiting;
 };
 
 /*
@@ -133,6 +164,8 @@ struct xfrd_tcp* xfrd_tcp_create(struct region* region, size_t bufsize);
 void xfrd_tcp_obtain(struct xfrd_tcp_set* set, struct xfrd_zone* zone);
 /* release tcp connection for a zone (starts waiting) */
 void xfrd_tcp_release(struct xfrd_tcp_set* set, struct xfrd_zone* zone);
+/* remove a zone from the list of zones waiting for a tcp connection */
+void xfrd_tcp_waiting_remove(struct xfrd_tcp_set* set, struct xfrd_zone* zone);
 /* release tcp pipe entirely (does not stop the zones inside it) */
 void xfrd_tcp_pipe_release(struct xfrd_tcp_set* set,
 	struct xfrd_tcp_pipeline* tp, int conn);
@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include "xfrd.h"
@@ -29,6 +30,7 @@
 #include "difffile.h"
 #include "ipc.h"
 #include "remote.h"
+#include "metrics.h"
 #include "rrl.h"
 #ifdef USE_DNSTAP
 #include "dnstap/dnstap_collector.h"
@@ -82,13 +84,15 @@ static void xfrd_handle_reload(int fd, short event, void* arg);
 /* handle child timeout */
 static void xfrd_handle_child_timer(int fd, short event, void* arg);
 
-/* send ixfr request, returns fd of connection to read on */
+/* send ixfr request on a udp socket, returns false on failure */
 static int xfrd_send_ixfr_request_udp(xfrd_zone_type* zone);
 /* obtain udp socket slot */
 static void xfrd_udp_obtain(xfrd_zone_type* zone);
 
-/* read data via udp */
+/* handle the udp answer in the packet buffer */
 static void xfrd_udp_read(xfrd_zone_type* zone);
+/* handle read event on a udp socket */
+static void xfrd_handle_udp_sock(int fd, short event, void* arg);
 
 /* find master by notify number */
 static int find_same_master_notify(xfrd_zone_type* zone, int acl_num_nfy);
@@ -148,6 +152,7 @@ xfrd_init(int socket, struct nsd* nsd, int shortsoa, int reload_active,
 	xfrd->udp_waiting_first = NULL;
 	xfrd->udp_waiting_last = NULL;
 	xfrd->udp_use_num = 0;
+	xfrd->udp_socks = NULL;
 	xfrd->got_time = 0;
 	xfrd->xfrfilenumber = 0;
 #ifdef USE_ZONE_STATS
@@ -195,9 +200,11 @@ xfrd_init(int socket, struct nsd* nsd, int shortsoa, int reload_active,
 #ifdef HAVE_SSL
 	daemon_remote_attach(xfrd->nsd->rc, xfrd);
 #endif
+	daemon_metrics_attach(xfrd->nsd->metrics, xfrd);
 
 	xfrd->tcp_set = xfrd_tcp_set_create(xfrd->region);
 	xfrd->tcp_set->tcp_timeout = nsd->tcp_timeout;
+	xfrd->tcp_set->max_per_master = nsd->options->xfrd_tcp_max_per_master;
 #if !defined(HAVE_ARC4RANDOM) && !defined(HAVE_GETRANDOM)
 	srandom((unsigned long) getpid() * (unsigned long) time(NULL));
 #endif
@@ -248,7 +255,7 @@ xfrd_process_activated(void)
 		zone->is_activated = 0;
 		/* run it : no events, specifically not the TIMEOUT event,
 		 * so that running zone transfers are not interrupted */
-		xfrd_handle_zone(zone->zone_handler.ev_fd, 0, zone);
+		xfrd_handle_zone(-1, 0, zone);
 	}
 }
 
@@ -356,17 +363,17 @@ xfrd_shutdown()
 #ifdef HAVE_SSL
 	daemon_remote_close(xfrd->nsd->rc); /* close sockets of rc */
 #endif
+	daemon_metrics_close(xfrd->nsd->metrics);
 	/* close sockets */
-	RBTREE_FOR(zone, xfrd_zone_type*, xfrd->zones)
-	{
-		if(zone->event_added) {
-			event_del(&zone->zone_handler);
-			if(zone->zone_handler.ev_fd != -1) {
-				close(zone->zone_handler.ev_fd);
-				zone->zone_handler.ev_fd = -1;
-			}
-			zone->event_added = 0;
-		}
+	if(xfrd->timer_added) {
+		event_del(&xfrd->timer_handler);
+		xfrd->timer_added = 0;
+	}
+	while(xfrd->udp_socks) {
+		struct xfrd_udp_sock* sock = xfrd->udp_socks;
+		xfrd->udp_socks = sock->next;
+		event_del(&sock->handler);
+		close(sock->handler.ev_fd);
 	}
 	close_notify_fds(xfrd->notify_zones);
 
@@ -398,6 +405,7 @@ xfrd_shutdown()
 	/* unlink xfr files in not-yet-done task file */
 	xfrd_clean_pending_tasks(xfrd->nsd, xfrd->nsd->task[xfrd->nsd->mytask]);
 	xfrd_del_tempdir(xfrd->nsd);
+	daemon_metrics_delete(xfrd->nsd->metrics);
 #ifdef HAVE_SSL
 	daemon_remote_delete(xfrd->nsd->rc); /* ssl-delete secret keys */
 	if (xfrd->nsd->tls_ctx)
@@ -490,12 +498,15 @@ xfrd_init_slave_zone(xfrd_state_type* xfrd, struct zone_options* zone_opt)
 	xzone->soa_notified.prim_ns[0]=1;
 	xzone->soa_notified.email[0]=1;
 
-	xzone->zone_handler.ev_fd = -1;
-	xzone->zone_handler_flags = 0;
-	xzone->event_added = 0;
+	xzone->timer_slot = -1;
+	xzone->timer_next = NULL;
+	xzone->timer_prev = NULL;
 
 	xzone->tcp_conn = -1;
 	xzone->tcp_waiting = 0;
+	xzone->tcp_master = NULL;
+	xzone->last_xfr_size = 0;
+	xzone->udp_sock = NULL;
 	xzone->udp_waiting = 0;
 	xzone->is_activated = 0;
 
@@ -707,15 +718,7 @@ xfrd_del_slave_zone(xfrd_state_type* xfrd, const dname_type* dname)
 	/* io */
 	if(z->tcp_waiting) {
 		/* delete from tcp waiting list */
-		if(z->tcp_waiting_prev)
-			z->tcp_waiting_prev->tcp_waiting_next =
-				z->tcp_waiting_next;
-		else xfrd->tcp_set->tcp_waiting_first = z->tcp_waiting_next;
-		if(z->tcp_waiting_next)
-			z->tcp_waiting_next->tcp_waiting_prev =
-				z->tcp_waiting_prev;
-		else xfrd->tcp_set->tcp_waiting_last = z->tcp_waiting_prev;
-		z->tcp_waiting = 0;
+		xfrd_tcp_waiting_remove(xfrd->tcp_set, z);
 	}
 	if(z->udp_waiting) {
 		/* delete from udp waiting list */
@@ -732,10 +735,10 @@ xfrd_del_slave_zone(xfrd_state_type* xfrd, const dname_type* dname)
 	xfrd_deactivate_zone(z);
 	if(z->tcp_conn != -1) {
 		xfrd_tcp_release(xfrd->tcp_set, z);
-	} else if(z->zone_handler.ev_fd != -1 && z->event_added) {
+	} else if(z->udp_sock) {
 		xfrd_udp_release(z);
-	} else if(z->event_added)
-		event_del(&z->zone_handler);
+	}
+	xfrd_unset_timer(z);
 	if(z->msg_seq_nr)
 		xfrd_unlink_xfrfile(xfrd->nsd, z->xfrfilenumber);
 
@@ -845,17 +848,10 @@ xfrd_handle_zone(int ATTR_UNUSED(fd), short event, void* arg)
 		event = EV_TIMEOUT;
 	}
 
-	if((event & EV_READ)) {
-		/* busy in udp transaction */
-		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: zone %s event udp read", zone->apex_str));
-		xfrd_udp_read(zone);
-		return;
-	}
-
 	/* timeout */
 	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: zone %s timeout", zone->apex_str));
-	if(zone->zone_handler.ev_fd != -1 && zone->event_added &&
-		(event & EV_TIMEOUT)) {
+	if(zone->udp_sock && (event & EV_TIMEOUT)) {
+		/* the udp query was not answered in time */
 		assert(zone->tcp_conn == -1);
 		xfrd_udp_release(zone);
 	}
@@ -892,7 +888,7 @@ xfrd_handle_zone(int ATTR_UNUSED(fd), short event, void* arg)
 	}
 
 	/* only make a new request if no request is running (UDPorTCP) */
-	if(zone->zone_handler.ev_fd == -1 && zone->tcp_conn == -1) {
+	if(!zone->udp_sock && zone->tcp_conn == -1) {
 		/* make a new request */
 		xfrd_make_request(zone);
 	}
@@ -1006,6 +1002,14 @@ xfrd_make_request(xfrd_zone_type* zone)
 	}
 }
 
+/* max number of udp queries at a time */
+static size_t
+xfrd_udp_max(void)
+{
+	return (size_t)XFRD_MAX_UDP *
+		(size_t)xfrd->nsd->options->xfrd_udp_share;
+}
+
 static void
 xfrd_udp_obtain(xfrd_zone_type* zone)
 {
@@ -1014,27 +1018,12 @@ xfrd_udp_obtain(xfrd_zone_type* zone)
 		/* no tcp and udp at the same time */
 		xfrd_tcp_release(xfrd->tcp_set, zone);
 	}
-	if(xfrd->udp_use_num < XFRD_MAX_UDP) {
-		int fd;
+	if(xfrd->udp_use_num < xfrd_udp_max()) {
 		xfrd->udp_use_num++;
-		fd = xfrd_send_ixfr_request_udp(zone);
-		if(fd == -1)
+		/* the answer arrives on the udp socket, the zone timer
+		 * is the timeout for the query */
+		if(!xfrd_send_ixfr_request_udp(zone))
 			xfrd->udp_use_num--;
-		else {
-			if(zone->event_added)
-				event_del(&zone->zone_handler);
-			memset(&zone->zone_handler, 0,
-				sizeof(zone->zone_handler));
-			event_set(&zone->zone_handler, fd,
-				EV_PERSIST|EV_READ|EV_TIMEOUT,
-				xfrd_handle_zone, zone);
-			if(event_base_set(xfrd->event_base, &zone->zone_handler) != 0)
-				log_msg(LOG_ERR, "xfrd udp: event_base_set failed");
-			if(event_add(&zone->zone_handler, &zone->timeout) != 0)
-				log_msg(LOG_ERR, "xfrd udp: event_add failed");
-			zone->zone_handler_flags=EV_PERSIST|EV_READ|EV_TIMEOUT;
-			zone->event_added = 1;
-		}
 		return;
 	}
 	/* queue the zone as last */
@@ -1126,21 +1115,104 @@ xfrd_set_refresh_now(xfrd_zone_type* zone)
 	}
 }
 
+/* start the tick of the timer wheel, in a second */
+static void
+xfrd_timer_wheel_tick(void)
+{
+	struct timeval tv;
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	memset(&xfrd->timer_handler, 0, sizeof(xfrd->timer_handler));
+	event_set(&xfrd->timer_handler, -1, EV_TIMEOUT,
+		xfrd_handle_timer_wheel, xfrd);
+	if(event_base_set(xfrd->event_base, &xfrd->timer_handler) != 0)
+		log_msg(LOG_ERR, "xfrd timer wheel: event_base_set failed");
+	if(event_add(&xfrd->timer_handler, &tv) != 0)
+		log_msg(LOG_ERR, "xfrd timer wheel: event_add failed");
+	xfrd->timer_added = 1;
+}
+
+/* put the zone in the list of the slot of the timer wheel */
+static void
+xfrd_timer_link(xfrd_zone_type* zone, int slot)
+{
+	zone->timer_slot = slot;
+	zone->timer_prev = NULL;
+	zone->timer_next = xfrd->timer_wheel[slot];
+	if(zone->timer_next)
+		zone->timer_next->timer_prev = zone;
+	xfrd->timer_wheel[slot] = zone;
+}
+
+/* take the zone out of the list of its slot of the timer wheel */
+static void
+xfrd_timer_unlink(xfrd_zone_type* zone)
+{
+	if(zone->timer_prev)
+		zone->timer_prev->timer_next = zone->timer_next;
+	else	xfrd->timer_wheel[zone->timer_slot] = zone->timer_next;
+	if(zone->timer_next)
+		zone->timer_next->timer_prev = zone->timer_prev;
+	zone->timer_slot = -1;
+	zone->timer_next = NULL;
+	zone->timer_prev = NULL;
+}
+
+void
+xfrd_handle_timer_wheel(int ATTR_UNUSED(fd), short event,
+	void* ATTR_UNUSED(arg))
+{
+	xfrd_zone_type* zone, *next;
+	time_t now, t;
+	assert(event & EV_TIMEOUT);
+	(void)event;
+	xfrd->timer_added = 0;
+	now = xfrd_time();
+	if(now < xfrd->timer_time) /* the clock was set back */
+		xfrd->timer_time = now - 1;
+	/* move the expired timers of the slots that passed to the list of
+	 * expired timers, every slot is visited once if it was long ago */
+	t = xfrd->timer_time + 1;
+	if(now - t >= XFRD_TIMER_SLOTS)
+		t = now - XFRD_TIMER_SLOTS + 1;
+	for(; t <= now; t++) {
+		for(zone = xfrd->timer_wheel[t % XFRD_TIMER_SLOTS]; zone;
+			zone = next) {
+			next = zone->timer_next;
+			if(zone->timer_expire > now)
+				continue;
+			xfrd_timer_unlink(zone);
+			xfrd_timer_link(zone, XFRD_TIMER_SLOTS);
+		}
+	}
+	xfrd->timer_time = now;
+	/* the handler of a zone can set and unset the timers of others */
+	while((zone = xfrd->timer_wheel[XFRD_TIMER_SLOTS]) != NULL) {
+		xfrd_timer_unlink(zone);
+		xfrd->timer_num--;
+		xfrd_handle_zone(-1, EV_TIMEOUT, zone);
+	}
+	if(xfrd->timer_num > 0 && !xfrd->timer_added)
+		xfrd_timer_wheel_tick();
+}
+
 void
 xfrd_unset_timer(xfrd_zone_type* zone)
 {
-	assert(zone->zone_handler.ev_fd == -1);
-	if(zone->event_added)
-		event_del(&zone->zone_handler);
-	zone->zone_handler_flags = 0;
-	zone->event_added = 0;
+	if(zone->timer_slot == -1)
+		return;
+	xfrd_timer_unlink(zone);
+	xfrd->timer_num--;
+	if(xfrd->timer_num == 0 && xfrd->timer_added) {
+		event_del(&xfrd->timer_handler);
+		xfrd->timer_added = 0;
+	}
 }
 
 void
 xfrd_set_timer(xfrd_zone_type* zone, time_t t)
 {
-	int fd = zone->zone_handler.ev_fd;
-	int fl = ((fd == -1)?EV_TIMEOUT:zone->zone_handler_flags);
+	time_t expire;
 	if(t > XFRD_TRANSFER_TIMEOUT_MAX)
 		t = XFRD_TRANSFER_TIMEOUT_MAX;
 	/* randomize the time, within 90%-100% of original */
@@ -1151,20 +1223,24 @@ xfrd_set_timer(xfrd_zone_type* zone, time_t t)
 		t = base + random_generate(t-base);
 	}
 
-	/* keep existing flags and fd, but re-add with timeout */
-	if(zone->event_added)
-		event_del(&zone->zone_handler);
-	else	fd = -1;
 	zone->timeout.tv_sec = t;
 	zone->timeout.tv_usec = 0;
-	memset(&zone->zone_handler, 0, sizeof(zone->zone_handler));
-	event_set(&zone->zone_handler, fd, fl, xfrd_handle_zone, zone);
-	if(event_base_set(xfrd->event_base, &zone->zone_handler) != 0)
-		log_msg(LOG_ERR, "xfrd timer: event_base_set failed");
-	if(event_add(&zone->zone_handler, &zone->timeout) != 0)
-		log_msg(LOG_ERR, "xfrd timer: event_add failed");
-	zone->zone_handler_flags = fl;
-	zone->event_added = 1;
+	if(zone->timer_slot != -1) {
+		xfrd_timer_unlink(zone);
+		xfrd->timer_num--;
+	}
+	if(!xfrd->timer_added) {
+		/* the wheel starts to turn from now */
+		xfrd->timer_time = xfrd_time();
+		xfrd_timer_wheel_tick();
+	}
+	/* the slot of now is done, the soonest is the next tick */
+	expire = xfrd_time() + t;
+	if(expire <= xfrd->timer_time)
+		expire = xfrd->timer_time + 1;
+	zone->timer_expire = expire;
+	xfrd_timer_link(zone, (int)(expire % XFRD_TIMER_SLOTS));
+	xfrd->timer_num++;
 }
 
 void
@@ -1278,20 +1354,284 @@ xfrd_udp_read_packet(buffer_type* packet, int fd, struct sockaddr* src,
 	return 1;
 }
 
+/* sort udp queries on query ID */
+static int
+xfrd_udp_query_cmp(const void* a, const void* b)
+{
+	const struct xfrd_udp_query* x = (const struct xfrd_udp_query*)a;
+	const struct xfrd_udp_query* y = (const struct xfrd_udp_query*)b;
+	if(x->query_id != y->query_id)
+		return x->query_id < y->query_id ? -1 : 1;
+	return 0;
+}
+
+/* find the outstanding query with the ID on the socket */
+static struct xfrd_udp_query*
+xfrd_udp_sock_find(struct xfrd_udp_sock* sock, uint16_t query_id)
+{
+	struct xfrd_udp_query key;
+	key.node.key = &key;
+	key.query_id = query_id;
+	return (struct xfrd_udp_query*)rbtree_search(sock->pending, &key);
+}
+
+/* the outgoing address for the family, the one that
+ * xfrd_bind_local_interface binds to; 0 if there is none for the family */
+static socklen_t
+#ifdef INET6
+xfrd_udp_sock_frm(struct acl_options* ifc, struct acl_options* acl,
+	struct sockaddr_storage* frm)
+#else
+xfrd_udp_sock_frm(struct acl_options* ifc, struct acl_options* acl,
+	struct sockaddr_in* frm)
+#endif /* INET6 */
+{
+	memset(frm, 0, sizeof(*frm));
+	for(; ifc; ifc = ifc->next) {
+		if(ifc->is_ipv6 == acl->is_ipv6)
+			return xfrd_acl_sockaddr_frm(ifc, frm);
+	}
+	return 0;
+}
+
+int
+xfrd_udp_sock_retired(struct xfrd_udp_sock* sock)
+{
+	return sock->num_sent >= xfrd->nsd->options->xfrd_udp_share ||
+		xfrd_time() >= sock->opened + XFRD_UDP_SOCK_TIME;
+}
+
+static void xfrd_udp_sock_check_done(struct xfrd_udp_sock* sock);
+
+/* get a udp socket to send a query to the master, or NULL */
+static struct xfrd_udp_sock*
+xfrd_udp_sock_obtain(struct acl_options* acl, struct acl_options* ifc)
+{
+	struct xfrd_udp_sock* sock, *next;
+	int fd, family;
+#ifdef INET6
+	struct sockaddr_storage frm;
+#else
+	struct sockaddr_in frm;
+#endif /* INET6 */
+	socklen_t frm_len = xfrd_udp_sock_frm(ifc, acl, &frm);
+
+	if(acl->is_ipv6) {
+#ifdef INET6
+		family = PF_INET6;
+#else
+		return NULL;
+#endif /* INET6 */
+	} else {
+		family = PF_INET;
+	}
+	for(sock = xfrd->udp_socks; sock; sock = next) {
+		next = sock->next;
+		if(xfrd_udp_sock_retired(sock)) {
+			/* close it if it was idle when it got too old */
+			xfrd_udp_sock_check_done(sock);
+			continue;
+		}
+		if(sock->family == family && sock->frm_len == frm_len &&
+			memcmp(&sock->frm, &frm, frm_len) == 0)
+			return sock;
+	}
+
+	fd = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+	if(fd == -1) {
+		log_msg(LOG_ERR, "xfrd: cannot create udp socket to %s: %s",
+			acl->ip_address_spec, strerror(errno));
+		return NULL;
+	}
+	if(!xfrd_bind_local_interface(fd, ifc, acl, 0)) {
+		log_msg(LOG_ERR, "xfrd: cannot bind outgoing interface '%s' to "
+				 "udp socket: No matching ip addresses found",
+			ifc->ip_address_spec);
+		close(fd);
+		return NULL;
+	}
+	if(fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		log_msg(LOG_ERR, "xfrd: fcntl failed: %s", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	sock = (struct xfrd_udp_sock*)region_alloc_zero(xfrd->region,
+		sizeof(*sock));
+	sock->family = family;
+	memcpy(&sock->frm, &frm, sizeof(frm));
+	sock->frm_len = frm_len;
+	sock->opened = xfrd_time();
+	sock->pending = rbtree_create(xfrd->region, &xfrd_udp_query_cmp);
+	event_set(&sock->handler, fd, EV_PERSIST|EV_READ,
+		xfrd_handle_udp_sock, sock);
+	if(event_base_set(xfrd->event_base, &sock->handler) != 0)
+		log_msg(LOG_ERR, "xfrd udp: event_base_set failed");
+	if(event_add(&sock->handler, NULL) != 0)
+		log_msg(LOG_ERR, "xfrd udp: event_add failed");
+	sock->next = xfrd->udp_socks;
+	xfrd->udp_socks = sock;
+	return sock;
+}
+
+/* close the socket if it takes no new queries and has none outstanding */
+static void
+xfrd_udp_sock_check_done(struct xfrd_udp_sock* sock)
+{
+	struct xfrd_udp_sock** pp;
+	if(!xfrd_udp_sock_retired(sock) || sock->pending->count > 0)
+		return;
+	for(pp = &xfrd->udp_socks; *pp; pp = &(*pp)->next) {
+		if(*pp == sock) {
+			*pp = sock->next;
+			break;
+		}
+	}
+	event_del(&sock->handler);
+	close(sock->handler.ev_fd);
+	region_recycle(xfrd->region, sock->pending, sizeof(*sock->pending));
+	region_recycle(xfrd->region, sock, sizeof(*sock));
+}
+
+/* is the source of the answer the master that was queried */
+static int
+xfrd_udp_from_master(struct acl_options* acl, struct sockaddr* src,
+	socklen_t srclen)
+{
+#ifdef INET6
+	struct sockaddr_storage to;
+#else
+	struct sockaddr_in to;
+#endif /* INET6 */
+	(void)xfrd_acl_sockaddr_to(acl, &to);
+	if(acl->is_ipv6) {
+#ifdef INET6
+		struct sockaddr_in6* a = (struct sockaddr_in6*)&to;
+		struct sockaddr_in6* b = (struct sockaddr_in6*)src;
+		return srclen >= (socklen_t)sizeof(*b) &&
+			b->sin6_family == AF_INET6 &&
+			a->sin6_port == b->sin6_port &&
+			memcmp(&a->sin6_addr, &b->sin6_addr,
+				sizeof(a->sin6_addr)) == 0;
+#else
+		return 0;
+#endif /* INET6 */
+	} else {
+		struct sockaddr_in* a = (struct sockaddr_in*)&to;
+		struct sockaddr_in* b = (struct sockaddr_in*)src;
+		return srclen >= (socklen_t)sizeof(*b) &&
+			b->sin_family == AF_INET &&
+			a->sin_port == b->sin_port &&
+			a->sin_addr.s_addr == b->sin_addr.s_addr;
+	}
+}
+
+/* the answer to the zone was bad, or could not be read */
+static void
+xfrd_udp_read_bad(xfrd_zone_type* zone)
+{
+	zone->master->bad_xfr_count++;
+	if (zone->master->bad_xfr_count > 2) {
+		xfrd_disable_ixfr(zone);
+		zone->master->bad_xfr_count = 0;
+	}
+	/* drop packet */
+	xfrd_udp_release(zone);
+	/* query next server */
+	xfrd_make_request(zone);
+}
+
+/* the socket failed, its queries are failed and it is closed after them */
+static void
+xfrd_udp_sock_failed(struct xfrd_udp_sock* sock)
+{
+	size_t n = sock->pending->count;
+	sock->num_sent = XFRD_UDP_SHARE_MAX;
+	/* the release of the last query frees the socket */
+	while(n--) {
+		struct xfrd_udp_query* q = (struct xfrd_udp_query*)
+			rbtree_first(sock->pending);
+		xfrd_udp_read_bad(q->zone);
+	}
+}
+
+static void
+xfrd_handle_udp_sock(int fd, short event, void* arg)
+{
+	struct xfrd_udp_sock* sock = (struct xfrd_udp_sock*)arg;
+	struct xfrd_udp_query* q;
+#ifdef INET6
+	struct sockaddr_storage src;
+#else
+	struct sockaddr_in src;
+#endif /* INET6 */
+	socklen_t srclen = (socklen_t)sizeof(src);
+	ssize_t received;
+
+	if(!(event & EV_READ))
+		return;
+	/* one answer per event, the handling of the answer can close the
+	 * socket when it was the last query on it */
+	buffer_clear(xfrd->packet);
+	received = recvfrom(fd, buffer_begin(xfrd->packet),
+		buffer_remaining(xfrd->packet), 0, (struct sockaddr*)&src,
+		&srclen);
+	if(received == -1) {
+		if(errno != EAGAIN && errno != EINTR
+#ifdef EWOULDBLOCK
+			&& errno != EWOULDBLOCK
+#endif
+			)
+		{
+			log_msg(LOG_ERR, "xfrd: recvfrom failed: %s",
+				strerror(errno));
+			/* the answers can not be matched to a zone */
+			xfrd_udp_sock_failed(sock);
+		}
+		return;
+	}
+	buffer_set_limit(xfrd->packet, received);
+	if(received < 2) {
+		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: dropped udp answer "
+			"without ID"));
+		return;
+	}
+	q = xfrd_udp_sock_find(sock, ID(xfrd->packet));
+	if(!q || !xfrd_udp_from_master(q->zone->master,
+		(struct sockaddr*)&src, srclen)) {
+		DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: dropped udp answer "
+			"with unknown ID or source"));
+		return;
+	}
+	if(received < QHEADERSZ) {
+		log_msg(LOG_ERR, "xfrd: zone %s: short udp answer from %s",
+			q->zone->apex_str, q->zone->master->ip_address_spec);
+		xfrd_udp_read_bad(q->zone);
+		return;
+	}
+	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: zone %s event udp read",
+		q->zone->apex_str));
+	xfrd_udp_read(q->zone);
+}
+
+/* the zone no longer has a query on its udp socket */
+static void
+xfrd_udp_sock_remove(xfrd_zone_type* zone)
+{
+	struct xfrd_udp_sock* sock = zone->udp_sock;
+	(void)rbtree_delete(sock->pending, &zone->udp_query);
+	zone->udp_sock = NULL;
+	xfrd_udp_sock_check_done(sock);
+}
+
 void
 xfrd_udp_release(xfrd_zone_type* zone)
 {
 	assert(zone->udp_waiting == 0);
-	if(zone->event_added)
-		event_del(&zone->zone_handler);
-	if(zone->zone_handler.ev_fd != -1) {
-		close(zone->zone_handler.ev_fd);
-	}
-	zone->zone_handler.ev_fd = -1;
-	zone->zone_handler_flags = 0;
-	zone->event_added = 0;
+	xfrd_unset_timer(zone);
+	if(zone->udp_sock)
+		xfrd_udp_sock_remove(zone);
 	/* see if there are waiting zones */
-	if(xfrd->udp_use_num == XFRD_MAX_UDP)
+	if(xfrd->udp_use_num >= xfrd_udp_max())
 	{
 		while(xfrd->udp_waiting_first) {
 			/* snip off waiting list */
@@ -1305,28 +1645,11 @@ xfrd_udp_release(xfrd_zone_type* zone)
 				xfrd->udp_waiting_last = NULL;
 			/* see if this zone needs udp connection */
 			if(wz->tcp_conn == -1) {
-				int fd = xfrd_send_ixfr_request_udp(wz);
-				if(fd != -1) {
-					if(wz->event_added)
-						event_del(&wz->zone_handler);
-					memset(&wz->zone_handler, 0,
-						sizeof(wz->zone_handler));
-					event_set(&wz->zone_handler, fd,
-						EV_READ|EV_TIMEOUT|EV_PERSIST,
-						xfrd_handle_zone, wz);
-					if(event_base_set(xfrd->event_base,
-						&wz->zone_handler) != 0)
-						log_msg(LOG_ERR, "cannot set event_base for ixfr");
-					if(event_add(&wz->zone_handler, &wz->timeout) != 0)
-						log_msg(LOG_ERR, "cannot add event for ixfr");
-					wz->zone_handler_flags = EV_READ|EV_TIMEOUT|EV_PERSIST;
-					wz->event_added = 1;
+				if(xfrd_send_ixfr_request_udp(wz))
 					return;
-				} else {
-					/* make this zone do something with
-					 * this failure to act */
-					xfrd_set_refresh_now(wz);
-				}
+				/* make this zone do something with
+				 * this failure to act */
+				xfrd_set_refresh_now(wz);
 			}
 		}
 	}
@@ -1352,19 +1675,6 @@ static void
 xfrd_udp_read(xfrd_zone_type* zone)
 {
 	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "xfrd: zone %s read udp data", zone->apex_str));
-	if(!xfrd_udp_read_packet(xfrd->packet, zone->zone_handler.ev_fd,
-		NULL, NULL)) {
-		zone->master->bad_xfr_count++;
-		if (zone->master->bad_xfr_count > 2) {
-			xfrd_disable_ixfr(zone);
-			zone->master->bad_xfr_count = 0;
-		}
-		/* drop packet */
-		xfrd_udp_release(zone);
-		/* query next server */
-		xfrd_make_request(zone);
-		return;
-	}
 	switch(xfrd_handle_received_xfr_packet(zone, xfrd->packet)) {
 		case xfrd_packet_tcp:
 			xfrd_set_timer(zone, xfrd->tcp_set->tcp_timeout);
@@ -1399,15 +1709,7 @@ xfrd_udp_read(xfrd_zone_type* zone)
 			break;
 		case xfrd_packet_bad:
 		default:
-			zone->master->bad_xfr_count++;
-			if (zone->master->bad_xfr_count > 2) {
-				xfrd_disable_ixfr(zone);
-				zone->master->bad_xfr_count = 0;
-			}
-			/* drop packet */
-			xfrd_udp_release(zone);
-			/* query next server */
-			xfrd_make_request(zone);
+			xfrd_udp_read_bad(zone);
 			break;
 	}
 }
@@ -1572,19 +1874,32 @@ xfrd_tsig_sign_request(buffer_type* packet, tsig_record_type* tsig,
 static int
 xfrd_send_ixfr_request_udp(xfrd_zone_type* zone)
 {
-	int fd;
+#ifdef INET6
+	struct sockaddr_storage to;
+#else
+	struct sockaddr_in to;
+#endif /* INET6 */
+	socklen_t to_len;
+	struct xfrd_udp_sock* sock;
+	uint16_t qid;
 
 	/* make sure we have a master to query the ixfr request to */
 	assert(zone->master);
 
 	if(zone->tcp_conn != -1) {
-		/* tcp is using the zone_handler.fd */
+		/* the zone has a tcp transfer */
 		log_msg(LOG_ERR, "xfrd: %s tried to send udp whilst tcp engaged",
 			zone->apex_str);
-		return -1;
+		return 0;
 	}
-	xfrd_setup_packet(xfrd->packet, TYPE_IXFR, CLASS_IN, zone->apex,
-		qid_generate());
+	if(!(sock = xfrd_udp_sock_obtain(zone->master,
+		zone->zone_options->pattern->outgoing_interface)))
+		return 0;
+	/* the ID must be unique among the queries on the socket */
+	do {
+		qid = qid_generate();
+	} while(xfrd_udp_sock_find(sock, qid));
+	xfrd_setup_packet(xfrd->packet, TYPE_IXFR, CLASS_IN, zone->apex, qid);
 	zone->query_id = ID(xfrd->packet);
 	/* delete old xfr file? */
 	if(zone->msg_seq_nr)
@@ -1601,15 +1916,26 @@ xfrd_send_ixfr_request_udp(xfrd_zone_type* zone)
 	buffer_flip(xfrd->packet);
 	xfrd_set_timer(zone, XFRD_UDP_TIMEOUT);
 
-	if((fd = xfrd_send_udp(zone->master, xfrd->packet,
-		zone->zone_options->pattern->outgoing_interface)) == -1)
-		return -1;
+	to_len = xfrd_acl_sockaddr_to(zone->master, &to);
+	if(sendto(sock->handler.ev_fd, buffer_current(xfrd->packet),
+		buffer_remaining(xfrd->packet), 0, (struct sockaddr*)&to,
+		to_len) == -1) {
+		log_msg(LOG_ERR, "xfrd: sendto %s failed %s",
+			zone->master->ip_address_spec, strerror(errno));
+		return 0;
+	}
+	sock->num_sent++;
+	zone->udp_query.node.key = &zone->udp_query;
+	zone->udp_query.query_id = zone->query_id;
+	zone->udp_query.zone = zone;
+	(void)rbtree_insert(sock->pending, &zone->udp_query.node);
+	zone->udp_sock = sock;
 
 	DEBUG(DEBUG_XFRD,1, (LOG_INFO,
 		"xfrd sent udp request for ixfr=%u for zone %s to %s",
 		(unsigned)ntohl(zone->soa_disk.serial),
 		zone->apex_str, zone->master->ip_address_spec));
-	return fd;
+	return 1;
 }
 
 static int xfrd_parse_soa_info(buffer_type* packet, xfrd_soa_type* soa)
@@ -2116,9 +2442,10 @@ xfrd_handle_received_xfr_packet(xfrd_zone_type* zone, buffer_type* packet)
 		(int)zone->msg_new_serial));
 	zone->msg_seq_nr++;
 
-        xfrfile_size = xfrd_get_xfrfile_size(xfrd->nsd, zone->xfrfilenumber);
-	if( zone->zone_options->pattern->size_limit_xfr != 0 &&
-	    xfrfile_size > zone->zone_options->pattern->size_limit_xfr ) {
+	/* only stat the file when there is a limit to check against */
+	if(zone->zone_options->pattern->size_limit_xfr != 0 &&
+	    (xfrfile_size = xfrd_get_xfrfile_size(xfrd->nsd,
+	    zone->xfrfilenumber)) > zone->zone_options->pattern->size_limit_xfr) {
             /*	    xfrd_unlink_xfrfile(xfrd->nsd, zone->xfrfilenumber);
                     xfrd_set_reload_timeout(); */
             log_msg(LOG_INFO, "xfrd : transferred zone data was too large %llu", (long long unsigned)xfrfile_size);
@@ -2130,6 +2457,9 @@ xfrd_handle_received_xfr_packet(xfrd_zone_type* zone, buffer_type* packet)
 	}
 
 	/* done. we are completely sure of this */
+	/* the size is used to schedule the next transfer of the zone */
+	zone->last_xfr_size = xfrd_get_xfrfile_size(xfrd->nsd,
+		zone->xfrfilenumber);
 	buffer_clear(packet);
 	buffer_printf(packet, "received update to serial %u at %s from %s",
 		(unsigned)zone->msg_new_serial, xfrd_pretty_time(xfrd_time()),
@@ -2244,7 +2574,7 @@ void
 xfrd_handle_notify_and_start_xfr(xfrd_zone_type* zone, xfrd_soa_type* soa)
 {
 	if(xfrd_handle_incoming_notify(zone, soa)) {
-		if(zone->zone_handler.ev_fd == -1 && zone->tcp_conn == -1 &&
+		if(!zone->udp_sock && zone->tcp_conn == -1 &&
 			!zone->tcp_waiting && !zone->udp_waiting) {
 			xfrd_set_refresh_now(zone);
 		}
@@ -2461,6 +2791,8 @@ xfrd_process_stat_info_task(xfrd_state_type* xfrd, struct task_list_d* task)
 	for(i=0; i<xfrd->nsd->child_count; i++) {
 		xfrd->nsd->children[i].query_count += *p++;
 	}
+	daemon_metrics_stat_info(xfrd->nsd->metrics,
+		(struct nsdst*)task->zname, (int)task->yesno);
 	/* got total, now see if users are interested in these statistics */
 #ifdef HAVE_SSL
 	daemon_remote_process_stats(xfrd->nsd->rc);
@@ -2474,9 +2806,9 @@ static void
 xfrd_process_zonestat_inc_task(xfrd_state_type* xfrd, struct task_list_d* task)
 {
 	xfrd->zonestat_safe = (unsigned)task->oldserial;
-	zonestat_remap(xfrd->nsd, 0, xfrd->zonestat_safe*sizeof(struct nsdst));
+	zonestat_remap(xfrd->nsd, 0, xfrd->zonestat_safe*sizeof(struct nsdzst));
 	xfrd->nsd->zonestatsize[0] = xfrd->zonestat_safe;
-	zonestat_remap(xfrd->nsd, 1, xfrd->zonestat_safe*sizeof(struct nsdst));
+	zonestat_remap(xfrd->nsd, 1, xfrd->zonestat_safe*sizeof(struct nsdzst));
 	xfrd->nsd->zonestatsize[1] = xfrd->zonestat_safe;
 }
 #endif /* USE_ZONE_STATS */
@@ -2555,7 +2887,7 @@ xfrd_handle_write_timer(int ATTR_UNUSED(fd), short event, void* ATTR_UNUSED(arg)
 	}
 	DEBUG(DEBUG_XFRD,1, (LOG_INFO, "zonefiles write timer"));
 	task_new_write_zonefiles(xfrd->nsd->task[xfrd->nsd->mytask],
-		xfrd->last_task, NULL);
+		xfrd->last_task, NULL, 0);
 	xfrd_set_reload_now(xfrd);
 	xfrd->write_zonefile_needed = 0;
 	xfrd_write_timer_set();
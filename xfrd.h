@@ -32,11 +32,18 @@ struct region;
 struct buffer;
 struct xfrd_tcp;
 struct xfrd_tcp_set;
+struct zonestat_clear;
+struct xfrd_tcp_master;
+struct xfrd_udp_sock;
 struct notify_zone;
 struct udb_ptr;
 typedef struct xfrd_state xfrd_state_type;
 typedef struct xfrd_zone xfrd_zone_type;
 typedef struct xfrd_soa xfrd_soa_type;
+
+/* number of one second slots in the timer wheel for the zone timers */
+#define XFRD_TIMER_SLOTS 1024
+
 /*
  * The global state for the xfrd daemon process.
  * The time_t times are epochs in secs since 1970, absolute times.
@@ -53,8 +60,10 @@ struct xfrd_state {
 	struct buffer* packet;
 	/* udp waiting list, double linked list */
 	struct xfrd_zone *udp_waiting_first, *udp_waiting_last;
-	/* number of udp sockets (for sending queries) in use */
+	/* number of udp queries outstanding */
 	size_t udp_use_num;
+	/* list of udp sockets for the queries */
+	struct xfrd_udp_sock* udp_socks;
 	/* activated waiting list, double linked list */
 	struct xfrd_zone *activated_first;
 
@@ -62,6 +71,17 @@ struct xfrd_state {
 	uint8_t got_time;
 	time_t current_time;
 
+	/* the zone timers, in one second slots by expiry time modulo
+	 * XFRD_TIMER_SLOTS, and the last list is the expired timers */
+	struct xfrd_zone* timer_wheel[XFRD_TIMER_SLOTS+1];
+	/* number of zones with a timer */
+	size_t timer_num;
+	/* the slots up to this time are done */
+	time_t timer_time;
+	/* tick of the timer wheel, every second while there are timers */
+	struct event timer_handler;
+	int timer_added;
+
 	/* counter for xfr file numbers */
 	uint64_t xfrfilenumber;
 
@@ -70,7 +90,7 @@ struct xfrd_state {
 	/* size currently of the clear array */
 	size_t zonestat_clear_num;
 	/* array of malloced entries with cumulative cleared stat values */
-	struct nsdst** zonestat_clear;
+	struct zonestat_clear** zonestat_clear;
 
 	/* timer for NSD reload */
 	struct timeval reload_timeout;
@@ -116,6 +136,45 @@ struct xfrd_state {
 	struct notify_zone *notify_waiting_first, *notify_waiting_last;
 };
 
+/*
+ * Entry for a zone with a udp query outstanding on a shared socket.
+ */
+struct xfrd_udp_query {
+	/* the rbtree node, key is this structure, sorted by query ID */
+	rbnode_type node;
+	uint16_t query_id;
+	struct xfrd_zone* zone;
+};
+
+/*
+ * UDP socket for the IXFR queries to masters.  Answers are matched to
+ * the zone with the query ID and the address of the master.  A socket
+ * takes new queries until xfrd-udp-share of them have been sent, or it is
+ * XFRD_UDP_SOCK_TIME seconds old, then a new socket (with a new source
+ * port) is used, and the old one is closed when its last query is done.
+ * By default a socket takes one query.
+ */
+struct xfrd_udp_sock {
+	/* next in the list of sockets */
+	struct xfrd_udp_sock* next;
+	/* read event, with the fd of the socket */
+	struct event handler;
+	/* address family and the outgoing address, frm_len 0 if unbound */
+	int family;
+#ifdef INET6
+	struct sockaddr_storage frm;
+#else
+	struct sockaddr_in frm;
+#endif /* INET6 */
+	socklen_t frm_len;
+	/* number of queries sent with the socket */
+	int num_sent;
+	/* time the socket was opened */
+	time_t opened;
+	/* the outstanding queries, struct xfrd_udp_query */
+	rbtree_type* pending;
+};
+
 /*
  * XFR daemon SOA information kept in network format.
  * This is in packet order.
@@ -178,24 +237,41 @@ struct xfrd_zone {
 	struct zone_options* zone_options;
 	int fresh_xfr_timeout;
 
-	/* handler for timeouts */
+	/* the timer, the timeout is the period that it was set for */
 	struct timeval timeout;
-	struct event zone_handler;
-	int zone_handler_flags;
-	int event_added;
+	time_t timer_expire;
+	/* slot in the timer wheel, or -1 if no timer is set */
+	int timer_slot;
+	xfrd_zone_type* timer_next;
+	xfrd_zone_type* timer_prev;
 
 	/* tcp connection zone is using, or -1 */
 	int tcp_conn;
 	/* zone is waiting for a tcp connection */
 	uint8_t tcp_waiting;
-	/* next zone in waiting list */
-	xfrd_zone_type* tcp_waiting_next;
-	xfrd_zone_type* tcp_waiting_prev;
+	/* master that the tcp connection is for (or waited for), or NULL */
+	struct xfrd_tcp_master* tcp_master;
+	/* node in the waiting tree of the master, key is this zone */
+	rbnode_type tcp_waiting_node;
+	/* order in the waiting tree: expiry period, axfr after ixfr,
+	 * then size of the last transfer and the sequence of arrival */
+	time_t tcp_waiting_expire;
+	uint8_t tcp_waiting_axfr;
+	uint64_t tcp_waiting_seq;
+	/* time the zone started waiting for a tcp connection */
+	time_t tcp_waiting_since;
+	/* size of the last transfer that was stored, 0 if unknown */
+	uint64_t last_xfr_size;
+	/* check of the record in the state file, to see if it changed */
+	uint32_t state_check;
 	/* zone is in its tcp send queue */
 	uint8_t in_tcp_send;
 	/* next zone in tcp send queue */
 	xfrd_zone_type* tcp_send_next;
 	xfrd_zone_type* tcp_send_prev;
+	/* shared udp socket with the query of the zone, or NULL */
+	struct xfrd_udp_sock* udp_sock;
+	struct xfrd_udp_query udp_query;
 	/* zone is waiting for a udp connection (tcp is preferred) */
 	uint8_t udp_waiting;
 	/* next zone in waiting list for UDP */
@@ -241,7 +317,9 @@ enum xfrd_packet_result {
 */
 #define XFRD_MAX_TCP 128 /* max number of TCP AXFR/IXFR concurrent connections.*/
 			/* Each entry has 64Kb buffer preallocated.*/
-#define XFRD_MAX_UDP 128 /* max number of UDP sockets at a time for IXFR */
+#define XFRD_MAX_UDP 128 /* max number of UDP IXFR queries at a time,
+			times the xfrd-udp-share option */
+#define XFRD_UDP_SOCK_TIME 5 /* seconds a UDP socket takes new queries */
 #define XFRD_MAX_UDP_NOTIFY 128 /* max concurrent UDP sockets for NOTIFY */
 
 #define XFRD_TRANSFER_TIMEOUT_START 10 /* empty zone timeout is between x and 2*x seconds */
@@ -387,6 +465,10 @@ int xfrd_udp_read_packet(buffer_type* packet, int fd, struct sockaddr* src,
  */
 void xfrd_udp_release(xfrd_zone_type* zone);
 
+/* the socket takes no new queries, so its source port is changed.
+ * for unit test */
+int xfrd_udp_sock_retired(struct xfrd_udp_sock* sock);
+
 /*
  * Get a static buffer for temporary use (to build a packet).
  */
@@ -447,6 +529,9 @@ void xfrd_handle_notify_and_start_xfr(xfrd_zone_type* zone, xfrd_soa_type* soa);
 /* handle zone timeout, event */
 void xfrd_handle_zone(int fd, short event, void* arg);
 
+/* handle the tick of the timer wheel, the zone timers that expired */
+void xfrd_handle_timer_wheel(int fd, short event, void* arg);
+
 const char* xfrd_pretty_time(time_t v);
 
 #endif /* XFRD_H */
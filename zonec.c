@@ -43,6 +43,7 @@
 #include "zparser.h"
 #include "options.h"
 #include "nsec3.h"
+#include "lookup3.h"
 
 #define ILNP_MAXDIGITS 4
 #define ILNP_NUMGROUPS 4
@@ -1381,6 +1382,139 @@ has_soa(domain_type* domain)
 	return 0;
 }
 
+/* delete the domain if it is unused, the origin and the owners that are
+ * in use by the parser are kept */
+static void
+count_release_domain(domain_type* domain)
+{
+	/* protect them from deletion, because deldomain walks up */
+	if(parser->origin != error_domain)
+		parser->origin->usage ++;
+	if(parser->prev_dname && parser->prev_dname != error_domain)
+		parser->prev_dname->usage ++;
+	if(parser->count_owner)
+		parser->count_owner->usage ++;
+	domain_table_deldomain(parser->db, domain);
+	if(parser->origin != error_domain)
+		parser->origin->usage --;
+	if(parser->prev_dname && parser->prev_dname != error_domain)
+		parser->prev_dname->usage --;
+	if(parser->count_owner)
+		parser->count_owner->usage --;
+}
+
+/* the slot for the name in the table of names seen by zonec_count, the
+ * names are stored as a 64 bit hash, with the low bit set for owners */
+static uint64_t*
+count_names_slot(domain_type* domain, uint64_t* hash)
+{
+	const dname_type* dname = domain_dname(domain);
+	uint8_t buf[MAXDOMAINLEN];
+	size_t i;
+	/* the label lengths are not changed by tolower */
+	for(i = 0; i < dname->name_size; i++)
+		buf[i] = (uint8_t)tolower((unsigned char)dname_name(dname)[i]);
+	*hash = (((uint64_t)hashlittle(buf, dname->name_size, 0) << 32) |
+		(uint64_t)hashlittle(buf, dname->name_size, 0x9e3779b9)
+		| 2) & ~(uint64_t)1;
+	i = (size_t)(*hash % parser->count_names_size);
+	while(parser->count_names[i] &&
+		(parser->count_names[i] & ~(uint64_t)1) != *hash)
+		i = (i + 1) % parser->count_names_size;
+	return &parser->count_names[i];
+}
+
+/* add the hash to the names seen, and grow the table at half full */
+static void
+count_names_add(uint64_t* slot, uint64_t hash)
+{
+	uint64_t* old = parser->count_names;
+	size_t i, j, oldsize = parser->count_names_size;
+	*slot = hash;
+	if(++parser->count_names_num < parser->count_names_size/2)
+		return;
+	parser->count_names_size = oldsize*2;
+	parser->count_names = (uint64_t*)xalloc_array_zero(
+		parser->count_names_size, sizeof(uint64_t));
+	for(i = 0; i < oldsize; i++) {
+		if(!old[i])
+			continue;
+		j = (size_t)((old[i] & ~(uint64_t)1) %
+			parser->count_names_size);
+		while(parser->count_names[j])
+			j = (j + 1) % parser->count_names_size;
+		parser->count_names[j] = old[i];
+	}
+	free(old);
+}
+
+/* the number of names for the domain and its parents that the zone did
+ * not have before, names that are released and used again are seen */
+static size_t
+count_new_names(domain_type* domain)
+{
+	size_t num = 0;
+	uint64_t hash, *slot;
+	/* the apex and the names above it are in the table already */
+	while(domain && !(domain != parser->current_zone->apex &&
+		domain_is_subdomain(parser->current_zone->apex, domain))) {
+		slot = count_names_slot(domain, &hash);
+		if(*slot)
+			break;
+		count_names_add(slot, hash);
+		num++;
+		domain = domain->parent;
+	}
+	return num;
+}
+
+/* pass the RR to the count function, and release it */
+static void
+count_rr(rr_type* rr)
+{
+	size_t i, num = count_new_names(rr->owner);
+	uint64_t hash, *slot;
+	int new_owner = 0;
+	if(rr->type == TYPE_SOA)
+		parser->count_soa = 1;
+	for(i = 0; i < rr->rdata_count; i++) {
+		if(rdata_atom_is_domain(rr->type, i))
+			num += count_new_names(rdata_atom_domain(
+				rr->rdatas[i]));
+	}
+	if(parser->count_owner != rr->owner) {
+		slot = count_names_slot(rr->owner, &hash);
+		new_owner = !(*slot & 1);
+		*slot |= 1;
+	}
+	(*parser->count_rr)(parser->count_arg, rr, num, new_owner);
+	for(i = 0; i < rr->rdata_count; i++) {
+		if(rdata_atom_is_domain(rr->type, i)) {
+			domain_type* d = rdata_atom_domain(rr->rdatas[i]);
+			/* names outside of the zone are kept, they are shared
+			 * by many RRs, like the names of nameservers */
+			if(!domain_is_subdomain(d, parser->current_zone->apex))
+				continue;
+			d->usage --;
+			count_release_domain(d);
+		} else {
+			region_recycle(parser->region, rr->rdatas[i].data,
+				rdata_atom_size(rr->rdatas[i])
+				+ sizeof(uint16_t));
+		}
+	}
+	region_recycle(parser->region, rr->rdatas,
+		sizeof(rdata_atom_type)*rr->rdata_count);
+	/* the previous owner can be in the rdata, it is released when
+	 * the owner changes */
+	if(parser->count_owner != rr->owner) {
+		domain_type* prev = parser->count_owner;
+		parser->count_owner = rr->owner;
+		if(prev)
+			count_release_domain(prev);
+	}
+}
+
 int
 process_rr(void)
 {
@@ -1440,6 +1574,12 @@ process_rr(void)
 		return 0;
 	}
 
+	if(parser->count_rr) {
+		count_rr(rr);
+		++totalrrs;
+		return 1;
+	}
+
 	/* Do we have this type of rrset already? */
 	rrset = domain_find_rrset(rr->owner, zone, rr->type);
 	if (!rrset) {
@@ -1453,6 +1593,8 @@ process_rr(void)
 
 		/* Add it */
 		domain_add_rrset(rr->owner, rrset);
+		if(rr->type == TYPE_DNAME)
+			zone->has_dname = 1;
 	} else {
 		rr_type* o;
 		if (rr->type != TYPE_RRSIG && rrset->rrs[0].ttl != rr->ttl) {
@@ -1630,6 +1772,12 @@ zonec_read(const char* name, const char* zonefile, zone_type* zone)
 	/* Parse and process all RRs.  */
 	yyparse();
 
+	if(parser->count_rr && parser->count_owner) {
+		domain_type* owner = parser->count_owner;
+		parser->count_owner = NULL;
+		parser->prev_dname = NULL;
+		count_release_domain(owner);
+	}
 	/* remove origin if it was unused */
 	if(parser->origin != error_domain)
 		domain_table_deldomain(parser->db, parser->origin);
@@ -1639,6 +1787,10 @@ zonec_read(const char* name, const char* zonefile, zone_type* zone)
 	/* check if zone file contained a correct SOA record */
 	if (!parser->current_zone) {
 		zc_error("zone configured as '%s' has no content.", name);
+	} else if(parser->count_rr) {
+		if(!parser->count_soa)
+			zc_error("zone configured as '%s' has no SOA record.",
+				name);
 	} else if(!parser->current_zone->soa_rrset ||
 		parser->current_zone->soa_rrset->rr_count == 0) {
 		zc_error("zone configured as '%s' has no SOA record.", name);
@@ -1660,6 +1812,33 @@ zonec_read(const char* name, const char* zonefile, zone_type* zone)
 }
 
 
+unsigned int
+zonec_count(const char* name, const char* zonefile, zone_type* zone,
+	void (*count_rr)(void* arg, rr_type* rr, size_t new_domains,
+	int new_owner), void* arg)
+{
+	unsigned int errors;
+	uint64_t hash, *slot;
+	parser->count_rr = count_rr;
+	parser->count_arg = arg;
+	parser->count_owner = NULL;
+	parser->count_soa = 0;
+	parser->count_names_size = 1024;
+	parser->count_names_num = 0;
+	parser->count_names = (uint64_t*)xalloc_array_zero(
+		parser->count_names_size, sizeof(uint64_t));
+	/* the apex is in the table already */
+	parser->current_zone = zone;
+	slot = count_names_slot(zone->apex, &hash);
+	count_names_add(slot, hash);
+	errors = zonec_read(name, zonefile, zone);
+	free(parser->count_names);
+	parser->count_names = NULL;
+	parser->count_rr = NULL;
+	parser->count_arg = NULL;
+	return errors;
+}
+
 /*
  * setup parse
  */
@@ -54,6 +54,16 @@ struct zparser {
 
 	rr_type current_rr;
 	rdata_atom_type *temporary_rdatas;
+
+	/* if set, the RRs are passed to this and not stored, zonec_count */
+	void (*count_rr)(void* arg, rr_type* rr, size_t new_domains,
+		int new_owner);
+	void* count_arg;
+	domain_type* count_owner;
+	int count_soa;
+	/* hashes of the names seen, they are released from the table */
+	uint64_t* count_names;
+	size_t count_names_size, count_names_num;
 };
 
 extern zparser_type *parser;
@@ -136,6 +146,14 @@ void zonec_desetup_parser(void);
 /* parse a zone into memory. name is origin. zonefile is file to read.
  * returns number of errors; failure may have read a partial zone */
 unsigned int zonec_read(const char *name, const char *zonefile, zone_type* zone);
+/* parse a zone and pass every RR to count_rr, the RRs are not stored and
+ * the names are released after use, so memory use grows only with a hash
+ * per name. new_domains is the number of names that the RR adds to the
+ * zone, new_owner is true for the first RR of an owner name.
+ * returns number of errors */
+unsigned int zonec_count(const char *name, const char *zonefile,
+	zone_type* zone, void (*count_rr)(void* arg, rr_type* rr,
+	size_t new_domains, int new_owner), void* arg);
 /* parse a string into the region. and with given domaintable. global parser
  * is restored afterwards. zone needs apex set. returns last domain name
  * parsed and the number rrs parse. return number of errors, 0 is success.
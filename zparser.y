@@ -1162,6 +1162,10 @@ zparser_create(region_type *region, region_type *rr_region, namedb_type *db)
 	result->current_zone = NULL;
 	result->origin = NULL;
 	result->prev_dname = NULL;
+	result->count_rr = NULL;
+	result->count_arg = NULL;
+	result->count_owner = NULL;
+	result->count_names = NULL;
 
 	result->temporary_rdatas = (rdata_atom_type *) region_alloc_array(
 		result->region, MAXRDATALEN, sizeof(rdata_atom_type));